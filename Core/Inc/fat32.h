@@ -0,0 +1,125 @@
+#ifndef __FAT32_H__
+#define __FAT32_H__
+
+#include "sd_spi_driver.h"
+
+/*
+ * FAT32 over SD_SPI_Handle, static RAM only:
+ *  - a volume keeps one FAT sector in RAM (the FAT window), written back to
+ *    every FAT copy when another sector is needed or on sync
+ *  - a file keeps one data sector and the run of contiguous clusters around
+ *    its position, whole sectors inside the run move with multiple block
+ *    transfers straight from / to the caller buffer
+ *  - growing files reserve FAT32_APPEND_CLUSTERS contiguous clusters at a
+ *    time, the unused ones are given back on close
+ *
+ * Short (8.3) names only, long name entries are skipped. A sector must not be
+ * modified through two open files at the same time.
+ */
+
+/* Clusters reserved at once when a file grows */
+#ifndef FAT32_APPEND_CLUSTERS
+#define FAT32_APPEND_CLUSTERS 8
+#endif
+
+/* Longest cluster run kept by a file */
+#define FAT32_RUN_MAX 1024
+
+typedef enum _FAT32_Result
+{
+    FAT32_OK = 0,
+    FAT32_DISK_ERROR, /*!< SD read or write failed */
+    FAT32_NO_FILESYSTEM, /*!< no FAT32 volume on sector 0 or the first partition */
+    FAT32_NOT_FOUND,
+    FAT32_INVALID, /*!< bad name, directory in the way, broken cluster chain */
+    FAT32_FULL
+} FAT32_Result;
+
+/* Open modes */
+#define FAT32_READ     0x01
+#define FAT32_WRITE    0x02
+#define FAT32_CREATE   0x04 /*!< create the file if it does not exist */
+#define FAT32_APPEND   0x08 /*!< start at the end of the file */
+#define FAT32_TRUNCATE 0x10 /*!< drop the content of an existing file */
+
+typedef struct __FAT32_Volume
+{
+    SD_SPI_Handle *sd;
+
+    uint32_t fat_start; /*!< First sector of the first FAT */
+    uint32_t fat_size; /*!< Sectors per FAT */
+    uint8_t num_fats;
+    uint8_t cluster_shift; /*!< Sectors per cluster = 1 << cluster_shift */
+    uint32_t data_start; /*!< Sector of cluster 2 */
+    uint32_t cluster_count;
+    uint32_t root_cluster;
+
+    uint32_t fsinfo_sector; /*!< 0 if none */
+    uint32_t free_count; /*!< 0xFFFFFFFF if unknown */
+    uint32_t next_free;
+    uint8_t fsinfo_dirty;
+
+    uint32_t window_sector;
+    uint8_t window_dirty;
+    uint8_t window[SD_BLOCK_SIZE];
+} FAT32_Volume;
+
+typedef struct __FAT32_File
+{
+    FAT32_Volume *volume;
+    uint8_t mode;
+
+    uint32_t first_cluster; /*!< 0 while the file is empty */
+    uint32_t size;
+    uint32_t position;
+    uint32_t clusters; /*!< Clusters known to be in the chain, it may go on past them */
+    uint8_t entry_dirty; /*!< Size or first cluster changed */
+
+    /* Cluster run cache: file clusters [run_index, run_index + run_length)
+     * are the disk clusters [run_cluster, run_cluster + run_length) */
+    uint32_t run_cluster;
+    uint32_t run_index;
+    uint32_t run_length;
+
+    /* Directory entry */
+    uint32_t entry_sector;
+    uint16_t entry_offset;
+
+    uint32_t buffer_sector;
+    uint8_t buffer_valid;
+    uint8_t buffer_dirty;
+    uint8_t buffer[SD_BLOCK_SIZE];
+} FAT32_File;
+
+/**
+ * @brief  Find the FAT32 volume on sd (superfloppy or first MBR partition)
+ */
+FAT32_Result FAT32_Mount(FAT32_Volume *volume, SD_SPI_Handle *sd);
+
+/**
+ * @brief  Write the FAT window and the FSInfo sector back
+ */
+FAT32_Result FAT32_Sync(FAT32_Volume *volume);
+
+/**
+ * @brief  Open path ("DIR/FILE.TXT", from the root directory) with FAT32_* mode flags
+ */
+FAT32_Result FAT32_Open(FAT32_Volume *volume, FAT32_File *file, const char *path, uint8_t mode);
+
+/**
+ * @brief  done (optional) receives the number of bytes read / written
+ */
+FAT32_Result FAT32_Read(FAT32_File *file, void *data, uint32_t len, uint32_t *done);
+FAT32_Result FAT32_Write(FAT32_File *file, const void *data, uint32_t len, uint32_t *done);
+
+/**
+ * @brief  Move to position (clamped to the file size)
+ */
+FAT32_Result FAT32_Seek(FAT32_File *file, uint32_t position);
+
+/**
+ * @brief  Write buffered data and the directory entry, give back unused clusters
+ */
+FAT32_Result FAT32_Close(FAT32_File *file);
+
+#endif // __FAT32_H__
@@ -3,13 +3,87 @@
 
 #include "lcd_driver.h"
 
+/* Largest size accepted by ili9341_putchar */
+#define ILI9341_MAX_CHAR_SIZE 4
+
+/* Buffer used to print numbers, limits the padding width */
+#define ILI9341_NUMBER_BUFLEN 32
+
+/* Number of expanded glyphs kept in RAM (384 bytes each) */
+#define ILI9341_GLYPH_CACHE_SIZE 8
+
+/* Pixel lines on the hardware scroll axis (logical x) */
+#define ILI9341_SCROLL_LINES 320
+
+/*
+ * Terminal using the hardware vertical scrolling (VSCRDEF / VSCRSADD).
+ * Scrolling only exists along the 320 line axis, so the console is drawn in portrait:
+ * text lines are stacked along logical x and run along logical y.
+ * A new line costs one scroll command and the clear of one text row.
+ */
+typedef struct __ILI9341_Console
+{
+    LCD_Handle *lcd;
+
+    uint16_t fg;
+    uint16_t bg;
+
+    /* Fixed status rows, outside of the scrolling area */
+    uint8_t status_rows;
+    uint8_t status_at_bottom;
+
+    uint8_t rows; // Scrolling text rows
+    uint8_t cols;
+
+    uint8_t row; // Cursor, in screen rows from the top of the scrolling area
+    uint8_t col;
+    uint8_t first_row; // Frame memory row shown at the top of the scrolling area
+
+    /* Glyphs are built here while the previous one is on the bus */
+    uint16_t glyph[2][FONTWIDTH * FONTHEIGHT];
+    uint8_t glyph_buf;
+} ILI9341_Console;
+
 void ili9341_init(LCD_Handle* LcdHandle);
+/*
+ * Set the address window (inclusive bounds) and start a memory write:
+ * pixels then fill the window column by column, wrapping at x1/y1.
+ * Ranges already set on the panel are not sent again.
+ */
+void ili9341_set_window(LCD_Handle *LcdHandle, int x0, int y0, int x1, int y1);
 void ili9341_set_xy(LCD_Handle *LcdHandle, int x, int y);
 void ili9341_draw_pixel(LCD_Handle *LcdHandle, uint16_t color);
 void ili9341_draw_pixel_at(LCD_Handle *LcdHandle,int x, int y , uint16_t color);
 void ili9341_clear(LCD_Handle *LcdHandle);
 void ili9341_fill_screen(LCD_Handle *LcdHandle, uint16_t color);
 
+/*
+ * Fill a rectangle with one address window, clipped to the screen
+ */
+void ili9341_fill_rect(LCD_Handle *LcdHandle, int x, int y, int w, int h, uint16_t color);
+
+/*
+ * Copy a w * h block of pixels (bus order, h pixels per column) with one address window.
+ * Returns as soon as the transfer is started, see LCD_Handle.BlitRect.
+ */
+void ili9341_blit_rect(LCD_Handle *LcdHandle, int x, int y, int w, int h, const uint16_t *pixels);
+
+/*
+ * Stream pixels (bus order) from the current draw position through SPI DMA.
+ * Returns as soon as the transfer is started, see LCD_Handle.WritePixels.
+ */
+void ili9341_write_pixels(LCD_Handle *LcdHandle, const uint16_t *pixels, uint32_t count);
+
+/*
+ * Wait until every pending transfer is finished
+ */
+void ili9341_sync(LCD_Handle *LcdHandle);
+
+/*
+ * To be called from HAL_SPI_TxCpltCallback
+ */
+void ili9341_tx_complete(LCD_Handle *LcdHandle, SPI_HandleTypeDef *hspi);
+
 /*
  *  Write character from font set to destination on screen
  */
@@ -27,4 +101,39 @@ void ili9341_putstring(LCD_Handle *LcdHandle, int x, int y, char *text, int size
  */
 void ili9341_putnumber(LCD_Handle *LcdHandle, int x, int y, long num, int dec, int lsize, int fc, int bc);
 
+/*
+ * Same as ili9341_putnumber, padded with spaces to width characters so the previous
+ * value is overwritten without a clear. width > 0: right aligned, < 0: left aligned.
+ */
+void ili9341_putnumber_padded(LCD_Handle *LcdHandle, int x, int y, long num, int dec, int width, int lsize, int fc,
+        int bc);
+
+/*
+ * Start the console: clear the screen and define the scrolling area.
+ * status_rows text rows are kept fixed at the top (or bottom if status_at_bottom).
+ */
+void ili9341_console_init(ILI9341_Console *console, LCD_Handle *LcdHandle, uint8_t status_rows,
+        uint8_t status_at_bottom, uint16_t fc, uint16_t bc);
+
+/*
+ * Leave the console, the scroll offset is reset so other drawing functions work again
+ */
+void ili9341_console_end(ILI9341_Console *console);
+
+/*
+ * Write one character, handles '\n', '\r' and '\b'. Lines wrap at the right edge.
+ */
+void ili9341_console_putc(ILI9341_Console *console, char c);
+void ili9341_console_write(ILI9341_Console *console, const char *text, uint32_t len);
+
+/*
+ * Clear the scrolling area and move the cursor home
+ */
+void ili9341_console_clear(ILI9341_Console *console);
+
+/*
+ * Print text on a status row, padded with spaces to the full width
+ */
+void ili9341_console_status(ILI9341_Console *console, uint8_t row, const char *text);
+
 #endif // __ILI9341_DRIVER_H__
@@ -28,6 +28,17 @@ typedef struct __LCD_Init
     uint16_t bg_color;
 } LCD_Init;
 
+/*
+ * Bus traffic counters, updated by the panel driver on every transfer.
+ * Reset them before a frame and read them after to get the per-frame cost.
+ */
+typedef struct __LCD_BusStats
+{
+    uint32_t bytes; // Bytes clocked out on the SPI bus
+    uint32_t cs_asserts; // Number of times chip select was pulled low
+    uint32_t transfers; // Number of HAL transmit calls (blocking or DMA)
+} LCD_BusStats;
+
 typedef struct __LCD_Handle
 {
     LCD_Init Init;
@@ -35,25 +46,109 @@ typedef struct __LCD_Handle
     uint16_t width;
     uint16_t height;
 
+    /* Bus state (owned by the panel driver) */
+    volatile uint8_t dma_busy;
+    volatile uint8_t release_pending;
+    uint8_t cs_active;
+    uint8_t dc_state;
+    uint8_t window_valid;
+    uint16_t window_x[2]; // Address window on the panel, to skip unchanged ranges
+    uint16_t window_y[2];
+
+    LCD_BusStats stats;
+
     /* Functions */
 
     void (*Clear)(struct __LCD_Handle *LcdHandle);
     void (*DrawPixelAt)(struct __LCD_Handle *LcdHandle, int x, int y,
             uint16_t color);
     void (*SetDrawPos)(struct __LCD_Handle *LcdHandle, int x, int y);
+    void (*SetWindow)(struct __LCD_Handle *LcdHandle, int x0, int y0, int x1, int y1); // Pixels wrap inside the window
     void (*DrawPixel)(struct __LCD_Handle *LcdHandle, uint16_t color); // Go automaticaly to next pos
 
+    /*
+     * Stream pixels from the current draw pos, pixels are in bus order (see LCD_TO_BUS).
+     * The transfer may still be running when it returns: the buffer must not be
+     * modified until Sync() or the next call to the driver.
+     */
+    void (*WritePixels)(struct __LCD_Handle *LcdHandle, const uint16_t *pixels, uint32_t count);
+    void (*Sync)(struct __LCD_Handle *LcdHandle); // Wait for pending transfers
+
+    /*
+     * Rectangle primitives, a single address window is set for the whole rectangle.
+     * BlitRect pixels are in bus order and stored column by column (pixels[i * h + j]
+     * goes to x + i, y + j), the panel scan order. Same buffer rule as WritePixels.
+     */
+    void (*FillRect)(struct __LCD_Handle *LcdHandle, int x, int y, int w, int h, uint16_t color);
+    void (*BlitRect)(struct __LCD_Handle *LcdHandle, int x, int y, int w, int h, const uint16_t *pixels);
+
     void (*PrintChar)(struct __LCD_Handle *LcdHandle, int x, int y, int c,
             int size, int fcolor, int bcolor);
     void (*PrintString)(struct __LCD_Handle *LcdHandle, int x, int y, char *text,
             int size, int fc, int bc);
     void (*PrintNumber)(struct __LCD_Handle *LcdHandle, int x, int y, long num, int dec,
             int lsize, int fc, int bc);
+    void (*PrintNumberPadded)(struct __LCD_Handle *LcdHandle, int x, int y, long num, int dec,
+            int width, int lsize, int fc, int bc); // width > 0: right aligned, < 0: left aligned
+
+    /* Callbacks */
+
+    void (*TransferComplete)(struct __LCD_Handle *LcdHandle); // Optional, called from the DMA interrupt
 
 } LCD_Handle;
 
+// RGB565 color to SPI byte order (MSB first)
+#define LCD_TO_BUS(color) ((uint16_t) ((((color) >> 8) & 0xFF) | (((color) & 0xFF) << 8)))
+
+/*
+ * Dirty region tracker: draw calls record the rectangles they change,
+ * LCD_Dirty_Flush() repaints only those, merged when it saves window setups.
+ */
+#define LCD_DIRTY_MAX_RECTS 16
+/* A separate window is worth this many pixels, rectangles are merged when the union wastes less */
+#define LCD_DIRTY_MERGE_SLACK 32
+/* Pixels painted per chunk while flushing (two chunk buffers are shared by all trackers) */
+#define LCD_DIRTY_CHUNK_PIXELS 512
+
+typedef struct __LCD_Rect
+{
+    int16_t x;
+    int16_t y;
+    int16_t w;
+    int16_t h;
+} LCD_Rect;
+
+/*
+ * Fill the w * h pixels of the rectangle at x, y (bus order, column by column like BlitRect)
+ */
+typedef void (*LCD_PaintFunc)(void *context, int x, int y, int w, int h, uint16_t *pixels);
+
+typedef struct __LCD_DirtyRegions
+{
+    LCD_Handle *lcd;
+
+    LCD_PaintFunc Paint;
+    void *context;
+
+    LCD_Rect rects[LCD_DIRTY_MAX_RECTS];
+    uint8_t count;
+} LCD_DirtyRegions;
+
+void LCD_Dirty_Init(LCD_DirtyRegions *dirty, LCD_Handle *lcd, LCD_PaintFunc paint, void *context);
+
+/*
+ * Record a changed rectangle, clipped to the screen
+ */
+void LCD_Dirty_Add(LCD_DirtyRegions *dirty, int x, int y, int w, int h);
+
+/*
+ * Repaint and stream every recorded rectangle, then clear the list
+ */
+void LCD_Dirty_Flush(LCD_DirtyRegions *dirty);
+
 #define FONTWIDTH 12
 #define FONTHEIGHT 16
+#define FONTCHARS 129
 
 //Font 12x16 vert. MSB
 extern const char xchar[][24];
@@ -108,6 +203,17 @@ extern const char xchar[][24];
 //STRING FUNCTIONS
 int int2asc(long, int, char*, int);
 
+// Longest string produced by int2asc_padded without padding: sign, 10 digits, separator
+#define INT2ASC_MAX_LEN 12
+
+/*
+ * Allocation free int2asc with a digit pair table (one division per two digits).
+ * dec: position of the decimal separator, same output as int2asc.
+ * width: > 0 pads with spaces on the left (right aligned), < 0 pads on the right.
+ * Returns the string length, or -1 (empty string) if it does not fit in buflen.
+ */
+int int2asc_padded(long num, int dec, int width, char *buf, int buflen);
+
 #ifdef __cplusplus
 }
 #endif
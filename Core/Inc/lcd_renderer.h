@@ -0,0 +1,100 @@
+#ifndef __LCD_RENDERER_H__
+#define __LCD_RENDERER_H__
+
+#include "lcd_driver.h"
+
+/*
+ * Band renderer: draw calls are recorded in a display list, then each frame is
+ * rasterised band by band into two RAM buffers. One band is on the bus while
+ * the next one is rendered, so overlapping widgets are composed without tearing
+ * and without a full framebuffer.
+ */
+
+/* Rows per band, a band is LCD_RENDER_MAX_WIDTH * LCD_RENDER_BAND_HEIGHT pixels (10 KB at 16 rows) */
+#define LCD_RENDER_BAND_HEIGHT 16
+#define LCD_RENDER_MAX_WIDTH 320
+
+/* Display list capacity, commands past this are dropped */
+#define LCD_RENDER_MAX_COMMANDS 32
+
+typedef enum
+{
+    LCD_RENDER_FILL,
+    LCD_RENDER_BLIT,
+    LCD_RENDER_TEXT,
+    LCD_RENDER_PAINT
+} LCD_RenderCommandType;
+
+typedef struct __LCD_RenderCommand
+{
+    LCD_RenderCommandType type;
+    LCD_Rect rect;
+
+    union
+    {
+        uint16_t color; // FILL, bus order
+        const uint16_t *pixels; // BLIT
+        struct
+        {
+            const char *text;
+            uint16_t fg; // bus order
+            uint16_t bg; // bus order
+            uint8_t size;
+        } text; // TEXT
+        struct
+        {
+            LCD_PaintFunc Paint;
+            void *context;
+        } paint; // PAINT
+    };
+} LCD_RenderCommand;
+
+/*
+ * Called with each finished band (bus order, column by column), e.g. to dump frames on a host build
+ */
+typedef void (*LCD_BandSink)(void *context, int y, int width, int height, const uint16_t *pixels);
+
+typedef struct __LCD_Renderer
+{
+    /* Bands are streamed here when not NULL */
+    LCD_Handle *lcd;
+
+    /* Optional, also receives every band */
+    LCD_BandSink Sink;
+    void *sink_context;
+
+    uint16_t width;
+    uint16_t height;
+    uint16_t bg_color; // bus order
+
+    LCD_RenderCommand commands[LCD_RENDER_MAX_COMMANDS];
+    uint8_t count;
+} LCD_Renderer;
+
+/*
+ * Width, height and background are taken from lcd. Without a lcd (host build),
+ * set width and height after init.
+ */
+void LCD_Render_Init(LCD_Renderer *renderer, LCD_Handle *lcd);
+
+/*
+ * Start a new frame, drops the previous display list
+ */
+void LCD_Render_Begin(LCD_Renderer *renderer);
+
+/*
+ * Record draw commands, later commands are drawn on top.
+ * Pointers (pixels, text, context) must stay valid until LCD_Render_End().
+ * return -1 if the display list is full, 0 otherwise
+ */
+int LCD_Render_FillRect(LCD_Renderer *renderer, int x, int y, int w, int h, uint16_t color);
+int LCD_Render_BlitRect(LCD_Renderer *renderer, int x, int y, int w, int h, const uint16_t *pixels);
+int LCD_Render_String(LCD_Renderer *renderer, int x, int y, const char *text, int size, int fc, int bc);
+int LCD_Render_Paint(LCD_Renderer *renderer, int x, int y, int w, int h, LCD_PaintFunc paint, void *context);
+
+/*
+ * Rasterise the display list band by band and send the frame
+ */
+void LCD_Render_End(LCD_Renderer *renderer);
+
+#endif // __LCD_RENDERER_H__
@@ -16,4 +16,8 @@ void Loop(uint32_t delta_ms);
 
 void TimerInterupt(void);
 
+void SpiTxComplete(SPI_HandleTypeDef *hspi);
+
+void SpiTxRxComplete(SPI_HandleTypeDef *hspi);
+
 #endif // __PROJECT_H__
@@ -0,0 +1,129 @@
+#ifndef __SD_ASYNC_H__
+#define __SD_ASYNC_H__
+
+#include "sd_spi_driver.h"
+
+/*
+ * Non-blocking SD engine: read / write requests are queued in a fixed ring and
+ * advanced by SD_Async_Poll from the main loop. Data blocks move by SPI DMA, the
+ * card busy phases (token wait, programming) are sampled a few bytes per poll,
+ * so the caller keeps its frame cadence while the card works.
+ *
+ * While the engine is not idle it owns the card: do not call the blocking
+ * SD_Sector* functions on the same handle.
+ */
+
+/**
+ * @brief  Number of requests waiting in the ring (the active one excluded)
+ */
+#ifndef SD_ASYNC_QUEUE_SIZE
+#define SD_ASYNC_QUEUE_SIZE 8
+#endif
+
+/**
+ * @brief  Bytes sampled per poll while waiting on the card (token or busy)
+ */
+#define SD_ASYNC_POLL_BYTES 16
+
+/**
+ * @brief  Margin in us on top of the wire time of one DMA block (4096 bits at
+ *         the current clock) before it is aborted, the card waits use the read
+ *         and write timeouts of the handle
+ */
+#define SD_ASYNC_DMA_MARGIN_US 5000
+
+typedef enum _SD_RequestType
+{
+    SD_REQUEST_READ,
+    SD_REQUEST_WRITE
+} SD_RequestType;
+
+typedef enum _SD_RequestStatus
+{
+    SD_REQUEST_QUEUED,
+    SD_REQUEST_ACTIVE,
+    SD_REQUEST_DONE,
+    SD_REQUEST_FAILED
+} SD_RequestStatus;
+
+typedef struct __SD_Request SD_Request;
+
+/**
+ * @brief  Called from SD_Async_Poll once the request is done or failed
+ */
+typedef void (*SD_RequestCallback)(SD_Request *request);
+
+/**
+ * @brief  Caller owned request, it and its buffer must stay valid until completion
+ */
+struct __SD_Request
+{
+    SD_RequestType type;
+    uint32_t sector; /*!< First sector */
+    uint32_t count; /*!< Number of consecutive sectors */
+    uint8_t *buffer; /*!< count * SD_BLOCK_SIZE bytes */
+
+    SD_RequestCallback Complete; /*!< Optional */
+    void *context;
+
+    volatile SD_RequestStatus status;
+    SD_Error error; /*!< Valid once status is DONE or FAILED */
+};
+
+typedef enum _SD_AsyncState
+{
+    SD_ASYNC_IDLE,
+    SD_ASYNC_READ_TOKEN, /*!< waiting for the 0xFE start token */
+    SD_ASYNC_READ_DATA, /*!< block DMA in flight */
+    SD_ASYNC_WRITE_READY, /*!< waiting for the card to leave busy before the next block */
+    SD_ASYNC_WRITE_DATA, /*!< block DMA in flight */
+    SD_ASYNC_STOP_BUSY, /*!< waiting for the card to leave busy after the last block */
+    SD_ASYNC_RETRY /*!< waiting for the card to leave busy before sending the rest again */
+} SD_AsyncState;
+
+typedef struct __SD_Async
+{
+    SD_SPI_Handle *sd;
+
+    SD_Request *queue[SD_ASYNC_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t tail;
+    uint8_t count;
+
+    SD_Request *current;
+    uint32_t done; /*!< Sectors of the current request transferred */
+    uint8_t retries; /*!< Data errors retried for the current request */
+    SD_AsyncState state;
+    uint32_t deadline; /*!< HAL tick at which the current wait fails */
+
+    volatile uint8_t dma_busy;
+} SD_Async;
+
+/**
+ * @brief  sd must be initialised (SD_Init) and its SPI linked to RX and TX DMA streams
+ */
+void SD_Async_Init(SD_Async *engine, SD_SPI_Handle *sd);
+
+/**
+ * @brief  Queue a request
+ * @retval SD_RESPONSE_FAILURE if the ring is full, SD_RESPONSE_NO_ERROR otherwise
+ */
+SD_Error SD_Async_Read(SD_Async *engine, SD_Request *request, uint32_t sector, uint32_t count, uint8_t *buffer);
+SD_Error SD_Async_Write(SD_Async *engine, SD_Request *request, uint32_t sector, uint32_t count, const uint8_t *buffer);
+
+/**
+ * @brief  Advance the active request, call from the main loop. Bounded work per call.
+ */
+void SD_Async_Poll(SD_Async *engine);
+
+/**
+ * @brief  Nothing active and nothing queued
+ */
+uint8_t SD_Async_IsIdle(SD_Async *engine);
+
+/**
+ * @brief  Call from HAL_SPI_TxCpltCallback / HAL_SPI_TxRxCpltCallback (interrupt context)
+ */
+void SD_Async_TransferComplete(SD_Async *engine, SPI_HandleTypeDef *hspi);
+
+#endif // __SD_ASYNC_H__
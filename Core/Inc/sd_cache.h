@@ -0,0 +1,86 @@
+#ifndef __SD_CACHE_H__
+#define __SD_CACHE_H__
+
+#include "sd_spi_driver.h"
+
+/*
+ * Set-associative write-back sector cache above SD_SectorRead / SD_SectorWrite.
+ * Sector s lives in set (s % SD_CACHE_SETS), one of SD_CACHE_WAYS lines, the
+ * least recently used line of the set is replaced. Dirty lines reach the card
+ * on eviction or SD_Cache_Flush, which merges consecutive sectors into
+ * multiple block writes.
+ *
+ * The cache uses the blocking driver calls, keep SD_Async idle while using it.
+ */
+
+/* Lines = SD_CACHE_SETS * SD_CACHE_WAYS, 512 bytes each (8 KB by default) */
+#ifndef SD_CACHE_SETS
+#define SD_CACHE_SETS 4
+#endif
+
+#ifndef SD_CACHE_WAYS
+#define SD_CACHE_WAYS 4
+#endif
+
+#define SD_CACHE_LINES (SD_CACHE_SETS * SD_CACHE_WAYS)
+
+typedef struct __SD_CacheLine
+{
+    uint32_t sector;
+    uint32_t used; /*!< Access stamp for LRU */
+    uint8_t valid;
+    uint8_t dirty;
+} SD_CacheLine;
+
+typedef struct __SD_CacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions; /*!< Valid lines replaced */
+    uint32_t writebacks; /*!< Sectors written to the card */
+    uint32_t write_runs; /*!< Write commands issued for them */
+} SD_CacheStats;
+
+typedef struct __SD_Cache
+{
+    SD_SPI_Handle *sd;
+
+    SD_CacheLine lines[SD_CACHE_LINES];
+    uint8_t data[SD_CACHE_LINES][SD_BLOCK_SIZE];
+    uint32_t stamp;
+
+    SD_CacheStats stats;
+} SD_Cache;
+
+void SD_Cache_Init(SD_Cache *cache, SD_SPI_Handle *sd);
+
+/**
+ * @brief  Copy a sector out of / into the cache. Writes only reach the card
+ *         on eviction or flush.
+ */
+SD_Error SD_Cache_Read(SD_Cache *cache, uint32_t sector, uint8_t *pBuffer);
+SD_Error SD_Cache_Write(SD_Cache *cache, uint32_t sector, const uint8_t *pBuffer);
+
+/**
+ * @brief  Zero copy access: *data points to the cached sector until the next
+ *         cache call. After modifying it, call SD_Cache_MarkDirty.
+ */
+SD_Error SD_Cache_Get(SD_Cache *cache, uint32_t sector, uint8_t **data);
+void SD_Cache_MarkDirty(SD_Cache *cache, uint32_t sector);
+
+/**
+ * @brief  Write every dirty line back, consecutive sectors in one CMD25
+ */
+SD_Error SD_Cache_Flush(SD_Cache *cache);
+
+/**
+ * @brief  Drop every line, dirty ones included (flush first to keep them)
+ */
+void SD_Cache_Invalidate(SD_Cache *cache);
+
+/**
+ * @brief  Copy the counters, reset them if reset is set
+ */
+void SD_Cache_GetStats(SD_Cache *cache, SD_CacheStats *stats, uint8_t reset);
+
+#endif // __SD_CACHE_H__
@@ -0,0 +1,33 @@
+#ifndef __SD_CRC_H__
+#define __SD_CRC_H__
+
+#include <stdint.h>
+
+/*
+ * Table-driven CRCs of the SD protocol, one lookup per byte:
+ *  - CRC7 (x^7 + x^3 + 1) of the command frames
+ *  - CRC16-CCITT (x^16 + x^12 + x^5 + 1) of the data blocks
+ */
+
+/**
+ * @brief  CRC7 of len bytes, the command CRC byte is (SD_CRC7(frame, 5) << 1) | 1
+ */
+uint8_t SD_CRC7(const uint8_t *data, uint32_t len);
+
+/**
+ * @brief  Continue a CRC16-CCITT over len bytes (data blocks start from 0)
+ */
+uint16_t SD_CRC16(uint16_t crc, const uint8_t *data, uint32_t len);
+
+/* CRC16-CCITT of each byte value */
+extern const uint16_t sd_crc16_table[256];
+
+/**
+ * @brief  Add one byte to a CRC16-CCITT (inlined in the receive loop)
+ */
+static inline uint16_t SD_CRC16_Byte(uint16_t crc, uint8_t data)
+{
+    return (crc << 8) ^ sd_crc16_table[(crc >> 8) ^ data];
+}
+
+#endif // __SD_CRC_H__
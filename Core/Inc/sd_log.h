@@ -0,0 +1,92 @@
+#ifndef __SD_LOG_H__
+#define __SD_LOG_H__
+
+#include "sd_spi_driver.h"
+
+/*
+ * Append-only record store on a range of raw sectors, used as a ring of
+ * fixed-size segments. Records (up to SD_LOG_MAX_RECORD bytes, each with its
+ * own CRC) are packed in RAM, SD_Log_Commit writes them as one segment with a
+ * single multiple block write. A segment is never rewritten: the segment with
+ * sequence number seq lives in slot seq % segments, so mounting finds the head
+ * with a binary search over the segment headers.
+ *
+ * A power loss can only tear the segment being written, its data CRC fails and
+ * the log ends at the previous one.
+ */
+
+/* Segment size in sectors, also the RAM buffer size (4 KB at 8) */
+#ifndef SD_LOG_SEGMENT_SECTORS
+#define SD_LOG_SEGMENT_SECTORS 8
+#endif
+
+#define SD_LOG_SEGMENT_SIZE (SD_LOG_SEGMENT_SECTORS * SD_BLOCK_SIZE)
+
+/* Segment header: magic, seq, used, count, data CRC, header CRC */
+#define SD_LOG_HEADER_SIZE 16
+
+/* Record header: length, CRC */
+#define SD_LOG_RECORD_HEADER_SIZE 4
+
+#define SD_LOG_MAX_RECORD (SD_LOG_SEGMENT_SIZE - SD_LOG_HEADER_SIZE - SD_LOG_RECORD_HEADER_SIZE)
+
+typedef enum _SD_LogResult
+{
+    SD_LOG_OK = 0,
+    SD_LOG_DISK_ERROR,
+    SD_LOG_TOO_LARGE, /*!< record larger than SD_LOG_MAX_RECORD or the read buffer */
+    SD_LOG_CORRUPT, /*!< record CRC mismatch, the cursor moved past it */
+    SD_LOG_END /*!< no more committed records */
+} SD_LogResult;
+
+typedef struct __SD_Log
+{
+    SD_SPI_Handle *sd;
+    uint32_t start; /*!< First sector of the log */
+    uint32_t segments; /*!< Ring size in segments */
+
+    uint32_t next_seq; /*!< Sequence number of the segment being filled */
+    uint32_t oldest_seq; /*!< Oldest segment still on the card */
+
+    uint16_t used; /*!< Record bytes in the segment buffer */
+    uint16_t count; /*!< Records in the segment buffer */
+    uint8_t segment[SD_LOG_SEGMENT_SIZE];
+} SD_Log;
+
+typedef struct __SD_LogCursor
+{
+    uint32_t seq;
+    uint16_t offset; /*!< Next record in the segment */
+    uint16_t end; /*!< End of the records of the segment, 0 if its header is not loaded yet */
+    uint32_t sector; /*!< Sector held in buffer */
+    uint8_t buffer[SD_BLOCK_SIZE];
+} SD_LogCursor;
+
+/**
+ * @brief  Invalidate every segment header of the range, needed once before the
+ *         first mount so stale sectors are not taken as records
+ */
+SD_LogResult SD_Log_Format(SD_Log *log, SD_SPI_Handle *sd, uint32_t start, uint32_t segments);
+
+/**
+ * @brief  Find the head of the log stored in [start, start + segments * SD_LOG_SEGMENT_SECTORS)
+ */
+SD_LogResult SD_Log_Mount(SD_Log *log, SD_SPI_Handle *sd, uint32_t start, uint32_t segments);
+
+/**
+ * @brief  Add a record to the segment buffer, commits first if it does not fit
+ */
+SD_LogResult SD_Log_Append(SD_Log *log, const void *data, uint16_t len);
+
+/**
+ * @brief  Write the buffered records as the next segment (group commit)
+ */
+SD_LogResult SD_Log_Commit(SD_Log *log);
+
+/**
+ * @brief  Read committed records from the oldest one
+ */
+void SD_Log_Rewind(SD_Log *log, SD_LogCursor *cursor);
+SD_LogResult SD_Log_Next(SD_Log *log, SD_LogCursor *cursor, void *data, uint16_t max, uint16_t *len);
+
+#endif // __SD_LOG_H__
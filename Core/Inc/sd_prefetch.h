@@ -0,0 +1,69 @@
+#ifndef __SD_PREFETCH_H__
+#define __SD_PREFETCH_H__
+
+#include "sd_async.h"
+
+/*
+ * Read-ahead for sequential streams. After two consecutive sector reads, the
+ * following sectors are requested in the background (SD_Async, CMD18 + DMA)
+ * into one of two buffers. While the consumer reads one buffer from RAM, the
+ * other one is filled.
+ *
+ * The depth (sectors per buffer) adapts to the consumer: it doubles when the
+ * consumer has to wait for a buffer still in flight, it halves when prefetched
+ * sectors are thrown away because the stream stopped.
+ *
+ * SD_Async_Poll must keep being called (main loop) for the background reads
+ * to progress.
+ */
+
+/* Sectors per buffer at most, two buffers are allocated (4 KB at 4) */
+#ifndef SD_PREFETCH_MAX_DEPTH
+#define SD_PREFETCH_MAX_DEPTH 4
+#endif
+
+typedef struct __SD_PrefetchStats
+{
+    uint32_t hits; /*!< Reads served from a prefetch buffer */
+    uint32_t misses; /*!< Reads sent to the card */
+    uint32_t stalls; /*!< Hits that waited for the buffer to arrive */
+    uint32_t wasted; /*!< Prefetched sectors never read */
+} SD_PrefetchStats;
+
+typedef struct __SD_PrefetchBuffer
+{
+    SD_Request request;
+    uint8_t in_use;
+    uint8_t consumed; /*!< Sectors read from the start of the buffer */
+    uint8_t data[SD_PREFETCH_MAX_DEPTH * SD_BLOCK_SIZE];
+} SD_PrefetchBuffer;
+
+typedef struct __SD_Prefetch
+{
+    SD_Async *engine;
+
+    SD_PrefetchBuffer buffers[2];
+
+    uint32_t last_sector; /*!< Sector of the previous read */
+    uint8_t sequential; /*!< The previous read followed the one before */
+    uint8_t depth;
+
+    SD_PrefetchStats stats;
+} SD_Prefetch;
+
+void SD_Prefetch_Init(SD_Prefetch *prefetch, SD_Async *engine);
+
+/**
+ * @brief  Read one sector, from a prefetch buffer when the stream is sequential
+ */
+SD_Error SD_Prefetch_Read(SD_Prefetch *prefetch, uint32_t sector, uint8_t *pBuffer);
+
+/**
+ * @brief  Drop the buffers, e.g. before writing sectors they may hold.
+ *         Waits for the background reads still in flight.
+ */
+void SD_Prefetch_Invalidate(SD_Prefetch *prefetch);
+
+void SD_Prefetch_GetStats(SD_Prefetch *prefetch, SD_PrefetchStats *stats, uint8_t reset);
+
+#endif // __SD_PREFETCH_H__
@@ -22,12 +22,156 @@ typedef enum _SDCardType
     SD_Card_SDHC /*!< High Capacity card (has CMD8+ACMD41, uses sector-addressing) */
 } SDCardType;
 
+/**
+ * @brief  Time the data phase of every block read with the DWT cycle counter
+ */
+#ifndef SD_SPI_BENCHMARK
+#define SD_SPI_BENCHMARK 0
+#endif
+
+/**
+ * @brief  Ask the card to check command and data CRCs (CMD59). Data blocks
+ *         read from the card are checked whenever the card accepted it.
+ */
+#ifndef SD_SPI_CRC
+#define SD_SPI_CRC 1
+#endif
+
+/**
+ * @brief  Retries at the same clock after a CRC error, before the clock is lowered
+ */
+#ifndef SD_CRC_RETRIES
+#define SD_CRC_RETRIES 2
+#endif
+
+/**
+ * @brief  Default interval between two samples of a busy card (SD_PollBusy)
+ */
+#ifndef SD_BUSY_POLL_US
+#define SD_BUSY_POLL_US 1000
+#endif
+
+typedef struct __SD_Benchmark
+{
+    uint32_t last_cycles; /*!< Data phase of the last block */
+    uint32_t data_cycles; /*!< Total of all data phases */
+    uint32_t data_bytes; /*!< Bytes received in those data phases */
+} SD_Benchmark;
+
+/**
+ * @brief  Init result error
+ */
+typedef enum _SD_InitResult
+{
+    SD_INIT_SUCESS = 0x00,
+    SD_INIT_NO_CARD = 0x01,
+    SD_INIT_VOLTAGE_ERROR = 0x2,
+    SD_INIT_APP_INIT_FAILED = 0x03,
+    SD_INIT_UNKNOW_CARD = 0x04,
+    SD_INIT_PENDING = 0x05, /*!< bring-up still in progress (SD_Init_Step) */
+
+} SD_InitResult;
+
+
+/**
+ * @brief  Card bring-up phases, each SD_Init_Step does a bounded amount of work
+ */
+typedef enum _SD_InitPhase
+{
+    SD_INIT_PHASE_DONE, /*!< finished (or never started), init_result holds the outcome */
+    SD_INIT_PHASE_POWER_UP, /*!< supply ramp-up, then 74+ clocks with CS high */
+    SD_INIT_PHASE_GO_IDLE, /*!< CMD0 until the card is in idle state */
+    SD_INIT_PHASE_IF_COND, /*!< CMD8: SDv1 or SDv2 */
+    SD_INIT_PHASE_APP_INIT, /*!< ACMD41 until the card leaves idle state */
+    SD_INIT_PHASE_MMC_INIT, /*!< CMD1 for cards without ACMD41 */
+    SD_INIT_PHASE_READ_OCR, /*!< CMD58: SDHC or not */
+    SD_INIT_PHASE_CONFIGURE /*!< CRC, block length, TRAN_SPEED */
+} SD_InitPhase;
+
+/**
+ * @brief  Card waits timed by the driver
+ */
+typedef enum _SD_Op
+{
+    SD_OP_READ, /*!< data token after a read command */
+    SD_OP_WRITE, /*!< busy while a block is programmed */
+    SD_OP_ERASE, /*!< busy while erasing */
+    SD_OP_READY, /*!< busy before a command or after an R1b response */
+    SD_OP_COUNT
+} SD_Op;
+
+typedef struct __SD_Latency
+{
+    uint32_t count; /*!< Waits measured */
+    uint32_t timeouts; /*!< Waits that ran out of time, counted in count too */
+    uint32_t last_us;
+    uint32_t max_us; /*!< Worst case */
+    uint32_t avg_us; /*!< Only filled by SD_GetLatency */
+    uint64_t total_us;
+} SD_Latency;
+
+/**
+ * @brief  Resume token of a card left busy (programming or erasing) by a
+ *         *Begin call, SD_PollBusy reports when it is done
+ */
+typedef struct __SD_BusyToken
+{
+    SD_Op op; /*!< What the card is busy with */
+    uint32_t timeout_us;
+    uint32_t last; /*!< DWT cycle count of the last SD_PollBusy */
+    uint64_t elapsed; /*!< Cycles since the card went busy */
+    uint64_t next_poll; /*!< Value of elapsed at which the card is sampled again */
+} SD_BusyToken;
+
+/**
+ * @brief  Whole allocation units of a sector range, in erase commands of
+ *         chunk sectors (SD_ErasePlan_Init / SD_ErasePlan_Next)
+ */
+typedef struct __SD_ErasePlan
+{
+    uint32_t next; /*!< First sector of the next erase */
+    uint32_t end; /*!< End of the aligned part of the range (excluded) */
+    uint32_t chunk; /*!< Sectors per erase: erase_size AUs when the card gives it, else one */
+} SD_ErasePlan;
+
 typedef struct __SD_SPI_Handle
 {
     SD_SPI_Init init;
 
     SDCardType card_type;
 
+    uint32_t max_clock; /*!< TRAN_SPEED from the CSD in Hz, 0 if unknown */
+    uint32_t clock; /*!< SPI clock in use in Hz */
+    uint8_t clock_step; /*!< SPI prescaler step: clock = PCLK / (2 << clock_step) */
+
+    uint8_t crc_on; /*!< CMD59 accepted: the card checks our CRCs and we check its data CRCs */
+    uint32_t crc_errors; /*!< Commands and data blocks rejected for their CRC */
+
+    /* Timeouts from the CSD access times, updated on every clock change */
+    uint32_t taac_ns; /*!< TAAC: fixed part of the read access time, 0 if unknown */
+    uint16_t nsac_clocks; /*!< NSAC * 100: part of the read access time counted in clocks */
+    uint8_t r2w_factor; /*!< Write time = read access time << r2w_factor */
+    uint32_t read_timeout_us;
+    uint32_t write_timeout_us;
+
+    SD_Latency latency[SD_OP_COUNT]; /*!< Timed with the DWT cycle counter */
+    uint32_t busy_poll_us; /*!< SD_PollBusy interval, SD_BUSY_POLL_US after SD_Init_Start */
+
+    /* Erase geometry and timing, the SD status part is read (ACMD13) on first use */
+    uint32_t erase_sectors; /*!< Smallest erasable unit from the CSD, 1 when ERASE_BLK_EN is set */
+    uint32_t au_sectors; /*!< Allocation unit, 0 until the SD status is read */
+    uint16_t erase_size; /*!< AUs erased within erase_timeout_s, 0 if the card gives no erase timeout */
+    uint8_t erase_timeout_s;
+    uint8_t erase_offset_s; /*!< Added once to every erase timeout */
+
+    SD_Benchmark benchmark; /*!< Only updated when SD_SPI_BENCHMARK is set */
+
+    /* Bring-up (SD_Init_Start / SD_Init_Step) */
+    SD_InitPhase init_phase;
+    SD_InitResult init_result;
+    uint32_t init_tick; /*!< HAL tick the current phase started */
+    uint8_t init_tries;
+
 } SD_SPI_Handle;
 
 typedef struct _SD_CSD
@@ -239,6 +383,8 @@ typedef enum _SD_Error
     SD_ADDRESS_ERROR = 0x20,
     SD_PARAMETER_ERROR = 0x40,
     SD_CHECK_BIT = 0x80, /*!< this bit must be set to 0 */
+    SD_RESPONSE_BUSY = 0xFD, /*!< the card is still busy, call SD_PollBusy again later */
+    SD_RESPONSE_DATA_ERROR = 0xFE, /*!< no data token or a data CRC mismatch, retried then at a lower clock */
     SD_RESPONSE_FAILURE = 0xFF
 } SD_Error;
 
@@ -252,18 +398,87 @@ typedef enum _SD_Error
 
 
 /**
- * @brief  Init result error
+ * @brief  Data response sent for CMD24
  */
-typedef enum _SD_InitResult
+typedef enum _SD_DataResponse
 {
-    SD_INIT_SUCESS = 0x00,
-    SD_INIT_NO_CARD = 0x01,
-    SD_INIT_VOLTAGE_ERROR = 0x2,
-    SD_INIT_APP_INIT_FAILED = 0x03,
-    SD_INIT_UNKNOW_CARD = 0x04,
+    SD_RESPONSE_MASK = 0x0E, /*!< any response value bits have to be masked by this */
+    SD_RESPONSE_ACCEPTED = 0x04, /*!< data accepted */
+    SD_RESPONSE_REJECTED_CRC = 0x0A, /*!< data rejected due to CRC error */
+    SD_RESPONSE_REJECTED_ERR = 0x0C /*!< data rejected due to write error */
+} SD_DataResponse;
 
-} SD_InitResult;
+/**
+ * @brief  Commands: CMDxx = CMD-number | 0x40
+ */
+/*
+ class 0 (basic):
+ CMD0        CMD2        CMD3        CMD4
+ CMD7        CMD8        CMD9        CMD10
+ CMD11       CMD12       CMD13       CMD15
+ class 2 (block read):
+ CMD16       CMD17       CMD18       CMD19       CMD20       CMD23
+ class 4 (block write):
+ CMD16       CMD20       CMD23       CMD24       CMD25       CMD27
+ class 5 (erase):
+ CMD32       CMD33       CMD38
+ class 6 (write protection):
+ CMD28       CMD29       CMD30
+ class 7 (lock card):
+ CMD16       CMD40       CMD42
+ class 8 (application-specific):
+ CMD55       CMD56
+ ACMD6       ACMD13  ACMD22  ACMD23  ACMD41  ACMD42  ACMD51
+ class 9 (I/O mode):
+ CMD5        CMD52       CMD53
+ class 10 (switch):
+ CMD6        CMD34       CMD35       CMD36       CMD37       CMD50       CMD57
+ all other classes are reserved
+ */
+typedef enum _SD_CMD
+{
+    SD_CMD_GO_IDLE_STATE = 0,     // CMD0  = 0x40, ARG=0x00000000, CRC=0x95
+    SD_CMD_SEND_OP_COND = 1,          // CMD1  = 0x41
+    SD_CMD_SEND_IF_COND = 8,          // CMD8  = 0x48, ARG=0x000001AA, CRC=0x87
+    SD_CMD_SEND_CSD = 9,          // CMD9  = 0x49
+    SD_CMD_SEND_CID = 10,     // CMD10 = 0x4A
+    SD_CMD_STOP_TRANSMISSION = 12,     // CMD12 = 0x4C
+    SD_CMD_SET_BLOCKLEN = 16,     // CMD16 = 0x50
+    SD_CMD_READ_SINGLE_BLOCK = 17,     // CMD17 = 0x51
+    SD_CMD_READ_MULT_BLOCK = 18,     // CMD18 = 0x52
+    SD_CMD_SET_BLOCK_COUNT = 23,     // CMD23 = 0x57
+    SD_CMD_WRITE_SINGLE_BLOCK = 24,     // CMD24 = 0x58
+    SD_CMD_WRITE_MULT_BLOCK = 25,     // CMD25 = 0x59
+    SD_CMD_ERASE_BLOCK_START = 32,     // CMD32 = 0x60
+    SD_CMD_ERASE_BLOCK_END = 33,     // CMD33 = 0x61
+    SD_CMD_ERASE = 38,     // CMD38 = 0x66
+    SD_CMD_SEND_APP = 55,     // CMD55 = 0x77, ARG=0x00000000, CRC=0x65
+    SD_CMD_READ_OCR = 58,     // CMD58 = 0x7A, ARG=0x00000000, CRC=0xFF
+    SD_CMD_CRC_ON_OFF = 59,     // CMD59 = 0x7B, ARG=0x00000001 to turn CRC checks on
+} SD_CMD;
+
+typedef enum _SD_ACMD
+{
+    SD_ACMD_STATUS = 13,     // ACMD13= 0x4D
+    SD_ACMD_SET_WR_BLK_ERASE_COUNT = 23,     // ACMD23= 0x57
+    SD_ACMD_ACTIVATE_INIT = 41,     // ACMD41= 0x69, ARG=0x40000000, CRC=0x77
+    SD_ACMD_SEND_SCR = 51,     // ACMD51= 0x73
+} SD_ACMD;
 
+/**
+ * @brief  Dummy byte
+ */
+#define SD_DUMMY_BYTE       0xFF
+
+/**
+ * @brief  Start Data tokens:
+ *         Tokens (necessary because at nop/idle (and CS active) only 0xff is
+ *         on the data/command line)
+ */
+#define SD_DATA_BLOCK_READ_START           0xFE  /*!< Data token start byte, Start Single/Multiple Block Read */
+#define SD_DATA_SINGLE_BLOCK_WRITE_START   0xFE  /*!< Data token start byte, Start Single Block Write */
+#define SD_DATA_MULTIPLE_BLOCK_WRITE_START 0xFC  /*!< Data token start byte, Start Multiple Block Write */
+#define SD_DATA_MULTIPLE_BLOCK_WRITE_STOP  0xFD  /*!< Data token stop byte, Stop Multiple Block Write */
 
 /**
  * @brief  Hold SPI bus for SD card
@@ -275,17 +490,124 @@ void SD_Bus_Hold(SD_SPI_Handle *sd);
  */
 void SD_Bus_Release(SD_SPI_Handle *sd);
 
+/**
+ * @brief  Single byte transfers and raw commands, for engines that drive the
+ *         card themselves (the bus must be held). SD_SendCmd appends the CRC7
+ *         and resends a command the card rejected for its CRC.
+ */
+void SD_WriteByte(SD_SPI_Handle *sd, uint8_t data);
+uint8_t SD_ReadByte(SD_SPI_Handle *sd);
+SD_Error SD_SendCmd(SD_SPI_Handle *sd, uint8_t cmd, uint32_t arg);
 
+
+/**
+ * @brief  Blocking card bring-up: SD_Init_Start then SD_Init_Step until done
+ */
 SD_InitResult SD_Init(SD_SPI_Handle *sd);
 
+/**
+ * @brief  Non-blocking card bring-up: SD_Init_Start once, then SD_Init_Step from
+ *         the main loop (or a timer tick) until it returns something else than
+ *         SD_INIT_PENDING. Each step sends at most a few commands at the 400 kHz
+ *         identification clock. The card must not be used before it is done.
+ */
+void SD_Init_Start(SD_SPI_Handle *sd);
+SD_InitResult SD_Init_Step(SD_SPI_Handle *sd);
+
 SD_Error SD_SectorRead(SD_SPI_Handle *sd, uint32_t readAddr, uint8_t *pBuffer);
 
+/**
+ * @brief  Read count consecutive sectors with one CMD18 / CMD12 pair
+ */
+SD_Error SD_SectorsRead(SD_SPI_Handle *sd, uint32_t readAddr, uint32_t count, uint8_t *pBuffer);
+
+/**
+ * @brief  Streaming read: start a multiple block read (CMD18) at readAddr,
+ *         then get each sector with SD_ReadStreamNext and end with SD_ReadStreamStop.
+ *         The SPI bus stays held from start to stop.
+ */
+SD_Error SD_ReadStreamStart(SD_SPI_Handle *sd, uint32_t readAddr);
+SD_Error SD_ReadStreamNext(SD_SPI_Handle *sd, uint8_t *pBuffer);
+SD_Error SD_ReadStreamStop(SD_SPI_Handle *sd);
+
 SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer);
 
+/**
+ * @brief  Cooperative write: send the sector and return SD_RESPONSE_BUSY with
+ *         token armed instead of waiting for the programming. The bus is
+ *         released, run other work and call SD_PollBusy until it stops
+ *         returning SD_RESPONSE_BUSY; the card must not be used meanwhile.
+ */
+SD_Error SD_SectorWriteBegin(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer, SD_BusyToken *token);
+
+/**
+ * @brief  Sample the card (a few bytes, CS held only meanwhile) once every
+ *         busy_poll_us, earlier calls return at once
+ * @retval SD_RESPONSE_BUSY, SD_RESPONSE_NO_ERROR once done, SD_RESPONSE_FAILURE on timeout
+ */
+SD_Error SD_PollBusy(SD_SPI_Handle *sd, SD_BusyToken *token);
+
+/**
+ * @brief  Write count consecutive sectors with one CMD25, the card is told
+ *         the run length first (ACMD23) so it can pre-erase
+ */
+SD_Error SD_SectorsWrite(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t count, const uint8_t *pBuffer);
+
+/**
+ * @brief  Streaming write: start a multiple block write (CMD25) at writeAddr,
+ *         send each sector with SD_WriteStreamNext and end with SD_WriteStreamStop.
+ *         preErase: number of sectors about to be written (ACMD23), 0 if unknown.
+ *         The SPI bus stays held from start to stop.
+ */
+SD_Error SD_WriteStreamStart(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t preErase);
+SD_Error SD_WriteStreamNext(SD_SPI_Handle *sd, const uint8_t *pBuffer);
+SD_Error SD_WriteStreamStop(SD_SPI_Handle *sd);
+
+/**
+ * @brief  Erase the sectors start to end (included) with CMD32 / CMD33 / CMD38
+ *         and wait for the card. The timeout comes from the SD status (erase
+ *         timeout per ERASE_SIZE AUs plus the offset), 250 ms per AU touched if
+ *         the card does not give it. The sectors then read as 0x00 or 0xFF
+ *         (SCR StateAfterErase). SD cards only.
+ */
+SD_Error SD_Erase(SD_SPI_Handle *sd, uint32_t start, uint32_t end);
+
+/**
+ * @brief  Cooperative erase: like SD_Erase but returns SD_RESPONSE_BUSY with
+ *         token armed, see SD_SectorWriteBegin
+ */
+SD_Error SD_EraseBegin(SD_SPI_Handle *sd, uint32_t start, uint32_t end, SD_BusyToken *token);
+
+/**
+ * @brief  Plan the erase of the whole allocation units inside [start, start + count),
+ *         the partial ones at both ends are left out. Reads the SD status the
+ *         first time. Then SD_ErasePlan_Next gives the range of each erase.
+ * @retval Sectors the plan erases
+ */
+uint32_t SD_ErasePlan_Init(SD_SPI_Handle *sd, SD_ErasePlan *plan, uint32_t start, uint32_t count);
+uint8_t SD_ErasePlan_Next(SD_ErasePlan *plan, uint32_t *start, uint32_t *end);
+
+/**
+ * @brief  The sectors of [start, start + count) are no longer used: erase the
+ *         allocation units they fully cover, later writes to them are faster.
+ *         The other sectors of the range keep their content.
+ */
+SD_Error SD_Discard(SD_SPI_Handle *sd, uint32_t start, uint32_t count);
+
+/**
+ * @brief  Latency of the op waits (worst case, average, timeouts)
+ */
+void SD_GetLatency(SD_SPI_Handle *sd, SD_Op op, SD_Latency *stats, uint8_t reset);
+
 SD_Error SD_GetCSDRegister(SD_SPI_Handle *sd, SD_CSD *SD_csd);
 
 SD_Error SD_GetCIDRegister(SD_SPI_Handle *sd, SD_CID *SD_cid);
 
 SD_Error SD_GetSCRRegister(SD_SPI_Handle *sd, SD_SCR *SD_scr);
 
+/**
+ * @brief  Read the SD status (ACMD13), SD cards only
+ */
+SD_Error SD_GetStatus(SD_SPI_Handle *sd, SD_Status *SD_status);
+
 #endif // __SD_DRIVER_H__
@@ -0,0 +1,68 @@
+#ifndef __SD_TRACE_H__
+#define __SD_TRACE_H__
+
+#include "stm32f4xx_hal.h"
+
+/*
+ * SD trace: binary events (id, value, tick) recorded in a RAM ring and
+ * drained later from the main loop. With SD_TRACE at 0 the SD_TRACE_EVENT
+ * calls compile to nothing.
+ */
+
+#ifndef SD_TRACE
+#define SD_TRACE 0
+#endif
+
+/* Ring capacity, a power of two. Events are dropped while the ring is full. */
+#ifndef SD_TRACE_SIZE
+#define SD_TRACE_SIZE 64
+#endif
+
+typedef enum _SD_TraceId
+{
+    SD_TRACE_READ_DELAY, /*!< value: us before the data token */
+    SD_TRACE_READ_TIMEOUT, /*!< no data token, value: timeout in us */
+    SD_TRACE_WRITE_DELAY, /*!< value: us busy while programming */
+    SD_TRACE_WRITE_TIMEOUT,
+    SD_TRACE_ERASE_DELAY, /*!< value: us busy while erasing */
+    SD_TRACE_ERASE_TIMEOUT,
+    SD_TRACE_SCR_MMC, /*!< SCR requested from a MMC card */
+    SD_TRACE_CRC_ERROR, /*!< value: command index, or the data token of a block */
+    SD_TRACE_ID_COUNT
+} SD_TraceId;
+
+typedef struct __SD_TraceEvent
+{
+    uint32_t tick; /*!< HAL tick when recorded */
+    uint32_t value;
+    uint8_t id; /*!< SD_TraceId */
+} SD_TraceEvent;
+
+#if SD_TRACE
+
+#define SD_TRACE_EVENT(id, value) SD_Trace_Record((id), (value))
+
+void SD_Trace_Record(SD_TraceId id, uint32_t value);
+
+/*
+ * Pop the oldest event, return 0 if the ring is empty
+ */
+uint8_t SD_Trace_Pop(SD_TraceEvent *event);
+
+/*
+ * Events lost because the ring was full, reset on read
+ */
+uint32_t SD_Trace_Dropped(void);
+
+/*
+ * Short name of an event id
+ */
+const char* SD_Trace_Name(uint8_t id);
+
+#else
+
+#define SD_TRACE_EVENT(id, value) ((void) 0)
+
+#endif // SD_TRACE
+
+#endif // __SD_TRACE_H__
@@ -15,11 +15,10 @@
 
 typedef struct _SnakeTile
 {
-    uint8_t dirty :1;
     uint8_t type :3;
     uint16_t next_snake_tile :10;
 
-    uint8_t reserved :3;
+    uint8_t reserved :4;
 } SnakeTile;
 
 typedef struct _SnakeInit
@@ -40,6 +39,8 @@ typedef struct _SnakeGameState
     uint16_t snake_tail :10;
 
     SnakeTile tiles[SNAKE_TILE_COUNT];
+
+    LCD_DirtyRegions dirty;
 } SnakeGameState;
 
 void InitSnake(SnakeGameState* gameState);
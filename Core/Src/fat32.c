@@ -0,0 +1,960 @@
+/*
+ * fat32.c
+ */
+
+#include "fat32.h"
+
+#include <string.h>
+
+#define FAT32_ENTRY_MASK 0x0FFFFFFF
+#define FAT32_EOC        0x0FFFFFFF
+#define FAT32_IS_EOC(c)  ((c) >= 0x0FFFFFF8)
+#define FAT32_NO_SECTOR  0xFFFFFFFF
+
+/* Directory entries */
+#define FAT32_DIR_ENTRY_SIZE 32
+#define FAT32_DIR_FREE       0xE5
+#define FAT32_ATTR_VOLUME    0x08 /*!< also set on long name entries */
+#define FAT32_ATTR_DIRECTORY 0x10
+#define FAT32_ATTR_ARCHIVE   0x20
+
+static uint16_t FAT32_Load16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t FAT32_Load32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void FAT32_Store16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void FAT32_Store32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint8_t FAT32_ValidCluster(FAT32_Volume *volume, uint32_t cluster)
+{
+    return cluster >= 2 && cluster < volume->cluster_count + 2;
+}
+
+static uint32_t FAT32_ClusterSector(FAT32_Volume *volume, uint32_t cluster)
+{
+    return volume->data_start + ((cluster - 2) << volume->cluster_shift);
+}
+
+/* ---------------------------------------------------------------------------
+ * FAT window
+ */
+
+static FAT32_Result FAT32_WindowFlush(FAT32_Volume *volume)
+{
+    uint32_t sector = volume->window_sector;
+    uint8_t copies = 1;
+
+    if (!volume->window_dirty)
+        return FAT32_OK;
+
+    /* a FAT sector is mirrored in every FAT */
+    if (sector >= volume->fat_start && sector < volume->fat_start + volume->fat_size)
+        copies = volume->num_fats;
+
+    for (uint8_t i = 0; i < copies; i++)
+    {
+        if (SD_SectorWrite(volume->sd, sector + i * volume->fat_size, volume->window) != SD_RESPONSE_NO_ERROR)
+            return FAT32_DISK_ERROR;
+    }
+
+    volume->window_dirty = 0;
+    return FAT32_OK;
+}
+
+static FAT32_Result FAT32_WindowLoad(FAT32_Volume *volume, uint32_t sector)
+{
+    FAT32_Result res;
+
+    if (sector == volume->window_sector)
+        return FAT32_OK;
+
+    res = FAT32_WindowFlush(volume);
+    if (res != FAT32_OK)
+        return res;
+
+    if (SD_SectorRead(volume->sd, sector, volume->window) != SD_RESPONSE_NO_ERROR)
+    {
+        volume->window_sector = FAT32_NO_SECTOR;
+        return FAT32_DISK_ERROR;
+    }
+
+    volume->window_sector = sector;
+    return FAT32_OK;
+}
+
+static FAT32_Result FAT32_GetEntry(FAT32_Volume *volume, uint32_t cluster, uint32_t *value)
+{
+    FAT32_Result res = FAT32_WindowLoad(volume, volume->fat_start + cluster / (SD_BLOCK_SIZE / 4));
+
+    if (res == FAT32_OK)
+        *value = FAT32_Load32(&volume->window[(cluster % (SD_BLOCK_SIZE / 4)) * 4]) & FAT32_ENTRY_MASK;
+
+    return res;
+}
+
+static FAT32_Result FAT32_SetEntry(FAT32_Volume *volume, uint32_t cluster, uint32_t value)
+{
+    FAT32_Result res = FAT32_WindowLoad(volume, volume->fat_start + cluster / (SD_BLOCK_SIZE / 4));
+    uint8_t *entry = &volume->window[(cluster % (SD_BLOCK_SIZE / 4)) * 4];
+
+    if (res != FAT32_OK)
+        return res;
+
+    /* the top 4 bits are reserved and kept */
+    FAT32_Store32(entry, (FAT32_Load32(entry) & ~FAT32_ENTRY_MASK) | (value & FAT32_ENTRY_MASK));
+    volume->window_dirty = 1;
+    return FAT32_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * Cluster allocation
+ */
+
+static FAT32_Result FAT32_FindFree(FAT32_Volume *volume, uint32_t *cluster)
+{
+    uint32_t c = FAT32_ValidCluster(volume, volume->next_free) ? volume->next_free : 2;
+    uint32_t value;
+    FAT32_Result res;
+
+    for (uint32_t n = 0; n < volume->cluster_count; n++)
+    {
+        res = FAT32_GetEntry(volume, c, &value);
+        if (res != FAT32_OK)
+            return res;
+
+        if (value == 0)
+        {
+            *cluster = c;
+            return FAT32_OK;
+        }
+
+        if (++c >= volume->cluster_count + 2)
+            c = 2;
+    }
+
+    return FAT32_FULL;
+}
+
+/**
+ * @brief  Allocate up to want contiguous clusters and link them after prev (0: new chain).
+ *         The run starts right after prev when that cluster is free.
+ */
+static FAT32_Result FAT32_Allocate(FAT32_Volume *volume, uint32_t prev, uint32_t want, uint32_t *start,
+        uint32_t *count)
+{
+    uint32_t value = 1;
+    uint32_t s, n;
+    FAT32_Result res;
+
+    if (prev != 0 && FAT32_ValidCluster(volume, prev + 1))
+    {
+        res = FAT32_GetEntry(volume, prev + 1, &value);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    if (value == 0)
+        s = prev + 1;
+    else
+    {
+        res = FAT32_FindFree(volume, &s);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    for (n = 1; n < want && FAT32_ValidCluster(volume, s + n); n++)
+    {
+        res = FAT32_GetEntry(volume, s + n, &value);
+        if (res != FAT32_OK)
+            return res;
+        if (value != 0)
+            break;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        res = FAT32_SetEntry(volume, s + i, (i + 1 < n) ? s + i + 1 : FAT32_EOC);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    if (prev != 0)
+    {
+        res = FAT32_SetEntry(volume, prev, s);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    if (volume->free_count != 0xFFFFFFFF)
+        volume->free_count -= n;
+    volume->next_free = s + n;
+    volume->fsinfo_dirty = 1;
+
+    *start = s;
+    *count = n;
+    return FAT32_OK;
+}
+
+static FAT32_Result FAT32_FreeChain(FAT32_Volume *volume, uint32_t cluster)
+{
+    uint32_t next;
+    FAT32_Result res;
+
+    while (FAT32_ValidCluster(volume, cluster))
+    {
+        res = FAT32_GetEntry(volume, cluster, &next);
+        if (res == FAT32_OK)
+            res = FAT32_SetEntry(volume, cluster, 0);
+        if (res != FAT32_OK)
+            return res;
+
+        if (volume->free_count != 0xFFFFFFFF)
+            volume->free_count++;
+        volume->fsinfo_dirty = 1;
+
+        cluster = next;
+    }
+
+    return FAT32_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * File sector buffer and cluster runs
+ */
+
+static FAT32_Result FAT32_BufferFlush(FAT32_File *file)
+{
+    if (!file->buffer_dirty)
+        return FAT32_OK;
+
+    if (SD_SectorWrite(file->volume->sd, file->buffer_sector, file->buffer) != SD_RESPONSE_NO_ERROR)
+        return FAT32_DISK_ERROR;
+
+    file->buffer_dirty = 0;
+    return FAT32_OK;
+}
+
+/**
+ * @param  read: 0 if the sector is new, it is zero filled instead of read
+ */
+static FAT32_Result FAT32_BufferLoad(FAT32_File *file, uint32_t sector, uint8_t read)
+{
+    FAT32_Result res;
+
+    if (file->buffer_valid && file->buffer_sector == sector)
+        return FAT32_OK;
+
+    res = FAT32_BufferFlush(file);
+    if (res != FAT32_OK)
+        return res;
+
+    file->buffer_valid = 0;
+    if (!read)
+        memset(file->buffer, 0, SD_BLOCK_SIZE);
+    else if (SD_SectorRead(file->volume->sd, sector, file->buffer) != SD_RESPONSE_NO_ERROR)
+        return FAT32_DISK_ERROR;
+
+    file->buffer_sector = sector;
+    file->buffer_valid = 1;
+    return FAT32_OK;
+}
+
+/**
+ * @brief  Disk cluster of the index-th cluster of the file. Walks the chain
+ *         from the cached run (or the start) and keeps the whole contiguous
+ *         run that holds it.
+ */
+static FAT32_Result FAT32_FindCluster(FAT32_File *file, uint32_t index, uint32_t *cluster)
+{
+    FAT32_Volume *volume = file->volume;
+    uint32_t next;
+    FAT32_Result res;
+
+    if (file->run_length > 0 && index >= file->run_index && index < file->run_index + file->run_length)
+    {
+        *cluster = file->run_cluster + index - file->run_index;
+        return FAT32_OK;
+    }
+
+    if (file->run_length > 0 && index >= file->run_index)
+    { /* continue from the last cluster of the cached run */
+        file->run_cluster += file->run_length - 1;
+        file->run_index += file->run_length - 1;
+    }
+    else
+    {
+        if (!FAT32_ValidCluster(volume, file->first_cluster))
+            return FAT32_INVALID;
+        file->run_cluster = file->first_cluster;
+        file->run_index = 0;
+    }
+    file->run_length = 1;
+
+    for (;;)
+    {
+        res = FAT32_GetEntry(volume, file->run_cluster + file->run_length - 1, &next);
+        if (res != FAT32_OK)
+        {
+            file->run_length = 0;
+            return res;
+        }
+
+        if (next == file->run_cluster + file->run_length && file->run_length < FAT32_RUN_MAX)
+        {
+            file->run_length++;
+            continue;
+        }
+
+        if (index < file->run_index + file->run_length)
+            break;
+
+        if (!FAT32_ValidCluster(volume, next))
+        { /* end of chain before index */
+            file->run_length = 0;
+            return FAT32_INVALID;
+        }
+
+        file->run_index += file->run_length;
+        file->run_cluster = next;
+        file->run_length = 1;
+    }
+
+    *cluster = file->run_cluster + index - file->run_index;
+    return FAT32_OK;
+}
+
+/**
+ * @brief  Sector holding position, and the number of sectors from it to the end of its run
+ */
+static FAT32_Result FAT32_Locate(FAT32_File *file, uint32_t position, uint32_t *sector, uint32_t *run_sectors)
+{
+    FAT32_Volume *volume = file->volume;
+    uint32_t index = position >> (9 + volume->cluster_shift);
+    uint32_t in_cluster = (position >> 9) & ((1 << volume->cluster_shift) - 1);
+    uint32_t cluster;
+    FAT32_Result res = FAT32_FindCluster(file, index, &cluster);
+
+    if (res != FAT32_OK)
+        return res;
+
+    *sector = FAT32_ClusterSector(volume, cluster) + in_cluster;
+    *run_sectors = ((file->run_index + file->run_length - index) << volume->cluster_shift) - in_cluster;
+    return FAT32_OK;
+}
+
+/**
+ * @brief  Make the file one cluster longer: the next cluster of the chain when
+ *         it goes on (the chain may be longer than the size, e.g. clusters
+ *         preallocated before a power loss), else FAT32_APPEND_CLUSTERS more
+ */
+static FAT32_Result FAT32_Extend(FAT32_File *file)
+{
+    FAT32_Volume *volume = file->volume;
+    uint32_t last = 0, next;
+    uint32_t start, count;
+    FAT32_Result res;
+
+    if (file->clusters > 0)
+    {
+        res = FAT32_FindCluster(file, file->clusters - 1, &last);
+        if (res == FAT32_OK)
+            res = FAT32_GetEntry(volume, last, &next);
+        if (res != FAT32_OK)
+            return res;
+
+        if (FAT32_ValidCluster(volume, next))
+        {
+            file->clusters++;
+            return FAT32_OK;
+        }
+    }
+    else if (FAT32_ValidCluster(volume, file->first_cluster))
+    { /* empty file that still has a chain */
+        file->clusters = 1;
+        return FAT32_OK;
+    }
+
+    res = FAT32_Allocate(volume, last, FAT32_APPEND_CLUSTERS, &start, &count);
+    if (res != FAT32_OK)
+        return res;
+
+    if (last == 0)
+    {
+        file->first_cluster = start;
+        file->entry_dirty = 1;
+        file->run_cluster = start;
+        file->run_index = 0;
+        file->run_length = count;
+    }
+    else if (start == last + 1 && file->run_length > 0 && file->run_index + file->run_length == file->clusters)
+        file->run_length += count;
+
+    file->clusters += count;
+    return FAT32_OK;
+}
+
+/* ---------------------------------------------------------------------------
+ * Directories
+ */
+
+/**
+ * @brief  Convert the next path component to a 8.3 directory name
+ * @retval Rest of the path, NULL if the component is not a valid short name
+ */
+static const char* FAT32_ParseName(const char *path, char name[11])
+{
+    uint8_t len = 0;
+    uint8_t limit = 8;
+
+    memset(name, ' ', 11);
+
+    while (*path != '\0' && *path != '/')
+    {
+        char c = *path++;
+
+        if (c == '.' && limit == 8 && len > 0)
+        {
+            len = 8;
+            limit = 11;
+            continue;
+        }
+
+        if (len >= limit || (unsigned char) c <= ' ' || strchr("\"*+,.:;<=>?[\\]|", c) != NULL)
+            return NULL;
+
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+        name[len++] = c;
+    }
+
+    if (name[0] == ' ')
+        return NULL;
+
+    if (*path == '/')
+        path++;
+    return path;
+}
+
+/**
+ * @brief  Look for name in the directory starting at cluster. On success the
+ *         entry is in file->buffer at entry_offset. Otherwise free_sector /
+ *         free_offset give the first free slot (free_sector 0 if the directory
+ *         is full) and last its last cluster.
+ */
+static FAT32_Result FAT32_FindEntry(FAT32_File *file, uint32_t cluster, const char name[11], uint32_t *free_sector,
+        uint16_t *free_offset, uint32_t *last)
+{
+    FAT32_Volume *volume = file->volume;
+    FAT32_Result res;
+
+    *free_sector = 0;
+
+    while (FAT32_ValidCluster(volume, cluster))
+    {
+        *last = cluster;
+
+        for (uint32_t s = 0; s < (1u << volume->cluster_shift); s++)
+        {
+            uint32_t sector = FAT32_ClusterSector(volume, cluster) + s;
+
+            res = FAT32_BufferLoad(file, sector, 1);
+            if (res != FAT32_OK)
+                return res;
+
+            for (uint16_t offset = 0; offset < SD_BLOCK_SIZE; offset += FAT32_DIR_ENTRY_SIZE)
+            {
+                const uint8_t *entry = &file->buffer[offset];
+
+                if (entry[0] == 0x00 || entry[0] == FAT32_DIR_FREE)
+                {
+                    if (*free_sector == 0)
+                    {
+                        *free_sector = sector;
+                        *free_offset = offset;
+                    }
+                    if (entry[0] == 0x00) /* end of directory */
+                        return FAT32_NOT_FOUND;
+                    continue;
+                }
+
+                if ((entry[11] & FAT32_ATTR_VOLUME) == 0 && memcmp(entry, name, 11) == 0)
+                {
+                    file->entry_sector = sector;
+                    file->entry_offset = offset;
+                    return FAT32_OK;
+                }
+            }
+        }
+
+        res = FAT32_GetEntry(volume, cluster, &cluster);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    return FAT32_NOT_FOUND;
+}
+
+static FAT32_Result FAT32_CreateEntry(FAT32_File *file, const char name[11], uint32_t free_sector,
+        uint16_t free_offset, uint32_t last)
+{
+    FAT32_Volume *volume = file->volume;
+    FAT32_Result res;
+    uint8_t *entry;
+
+    if (free_sector == 0)
+    { /* directory full: chain a cleared cluster */
+        uint32_t cluster, count;
+
+        res = FAT32_Allocate(volume, last, 1, &cluster, &count);
+        if (res != FAT32_OK)
+            return res;
+
+        for (uint32_t s = 0; s < (1u << volume->cluster_shift); s++)
+        {
+            res = FAT32_BufferLoad(file, FAT32_ClusterSector(volume, cluster) + s, 0);
+            if (res != FAT32_OK)
+                return res;
+            file->buffer_dirty = 1;
+        }
+
+        free_sector = FAT32_ClusterSector(volume, cluster);
+        free_offset = 0;
+    }
+
+    res = FAT32_BufferLoad(file, free_sector, 1);
+    if (res != FAT32_OK)
+        return res;
+
+    entry = &file->buffer[free_offset];
+    memset(entry, 0, FAT32_DIR_ENTRY_SIZE);
+    memcpy(entry, name, 11);
+    entry[11] = FAT32_ATTR_ARCHIVE;
+    file->buffer_dirty = 1;
+
+    file->entry_sector = free_sector;
+    file->entry_offset = free_offset;
+    return FAT32_OK;
+}
+
+/**
+ * @brief  Write the first cluster and the size to the directory entry on the card
+ */
+static FAT32_Result FAT32_WriteEntry(FAT32_File *file)
+{
+    FAT32_Result res = FAT32_BufferLoad(file, file->entry_sector, 1);
+    uint8_t *entry;
+
+    if (res != FAT32_OK)
+        return res;
+
+    entry = &file->buffer[file->entry_offset];
+    FAT32_Store16(&entry[20], file->first_cluster >> 16);
+    FAT32_Store16(&entry[26], file->first_cluster);
+    FAT32_Store32(&entry[28], file->size);
+    file->buffer_dirty = 1;
+
+    res = FAT32_BufferFlush(file);
+    if (res == FAT32_OK)
+        file->entry_dirty = 0;
+    return res;
+}
+
+/* ---------------------------------------------------------------------------
+ * API
+ */
+
+static uint8_t FAT32_IsBootSector(const uint8_t *sector)
+{
+    uint8_t spc = sector[13];
+
+    return (sector[0] == 0xEB || sector[0] == 0xE9) && sector[510] == 0x55 && sector[511] == 0xAA
+            && FAT32_Load16(&sector[11]) == SD_BLOCK_SIZE && spc != 0 && (spc & (spc - 1)) == 0
+            && FAT32_Load16(&sector[22]) == 0 && FAT32_Load32(&sector[36]) != 0 && sector[16] != 0;
+}
+
+FAT32_Result FAT32_Mount(FAT32_Volume *volume, SD_SPI_Handle *sd)
+{
+    const uint8_t *bs = volume->window;
+    uint32_t lba = 0;
+    uint32_t total;
+    uint16_t fsinfo;
+    FAT32_Result res;
+
+    memset(volume, 0, sizeof(*volume));
+    volume->sd = sd;
+    volume->window_sector = FAT32_NO_SECTOR;
+
+    res = FAT32_WindowLoad(volume, 0);
+    if (res != FAT32_OK)
+        return res;
+
+    if (!FAT32_IsBootSector(bs))
+    { /* MBR: first partition, FAT32 CHS (0x0B) or LBA (0x0C) */
+        if (bs[510] != 0x55 || bs[511] != 0xAA || (bs[0x1C2] != 0x0B && bs[0x1C2] != 0x0C))
+            return FAT32_NO_FILESYSTEM;
+
+        lba = FAT32_Load32(&bs[0x1C6]);
+        res = FAT32_WindowLoad(volume, lba);
+        if (res != FAT32_OK)
+            return res;
+        if (!FAT32_IsBootSector(bs))
+            return FAT32_NO_FILESYSTEM;
+    }
+
+    while ((1 << volume->cluster_shift) < bs[13])
+        volume->cluster_shift++;
+
+    volume->num_fats = bs[16];
+    volume->fat_size = FAT32_Load32(&bs[36]);
+    volume->fat_start = lba + FAT32_Load16(&bs[14]);
+    volume->data_start = volume->fat_start + volume->num_fats * volume->fat_size;
+    volume->root_cluster = FAT32_Load32(&bs[44]);
+
+    total = FAT32_Load16(&bs[19]);
+    if (total == 0)
+        total = FAT32_Load32(&bs[32]);
+    volume->cluster_count = (total - (volume->data_start - lba)) >> volume->cluster_shift;
+
+    volume->free_count = 0xFFFFFFFF;
+    volume->next_free = 2;
+
+    fsinfo = FAT32_Load16(&bs[48]);
+    if (fsinfo != 0 && fsinfo != 0xFFFF)
+    {
+        res = FAT32_WindowLoad(volume, lba + fsinfo);
+        if (res != FAT32_OK)
+            return res;
+
+        if (FAT32_Load32(&bs[0]) == 0x41615252 && FAT32_Load32(&bs[484]) == 0x61417272)
+        {
+            volume->fsinfo_sector = lba + fsinfo;
+            volume->free_count = FAT32_Load32(&bs[488]);
+            volume->next_free = FAT32_Load32(&bs[492]);
+        }
+    }
+
+    if (!FAT32_ValidCluster(volume, volume->next_free))
+        volume->next_free = 2;
+
+    return FAT32_OK;
+}
+
+FAT32_Result FAT32_Sync(FAT32_Volume *volume)
+{
+    FAT32_Result res = FAT32_WindowFlush(volume);
+
+    if (res != FAT32_OK || !volume->fsinfo_dirty || volume->fsinfo_sector == 0)
+        return res;
+
+    res = FAT32_WindowLoad(volume, volume->fsinfo_sector);
+    if (res != FAT32_OK)
+        return res;
+
+    FAT32_Store32(&volume->window[488], volume->free_count);
+    FAT32_Store32(&volume->window[492], volume->next_free);
+    volume->window_dirty = 1;
+    volume->fsinfo_dirty = 0;
+
+    return FAT32_WindowFlush(volume);
+}
+
+FAT32_Result FAT32_Open(FAT32_Volume *volume, FAT32_File *file, const char *path, uint8_t mode)
+{
+    uint32_t dir = volume->root_cluster;
+    uint32_t free_sector, last = 0;
+    uint16_t free_offset = 0;
+    uint32_t cluster_bytes = SD_BLOCK_SIZE << volume->cluster_shift;
+    char name[11];
+    FAT32_Result res;
+
+    memset(file, 0, sizeof(*file));
+    file->volume = volume;
+    file->mode = mode;
+
+    if (*path == '/')
+        path++;
+
+    for (;;)
+    {
+        const uint8_t *entry;
+
+        path = FAT32_ParseName(path, name);
+        if (path == NULL)
+            return FAT32_INVALID;
+
+        res = FAT32_FindEntry(file, dir, name, &free_sector, &free_offset, &last);
+        if (*path == '\0')
+            break;
+
+        /* intermediate component: must be a directory */
+        if (res != FAT32_OK)
+            return res;
+
+        entry = &file->buffer[file->entry_offset];
+        if ((entry[11] & FAT32_ATTR_DIRECTORY) == 0)
+            return FAT32_INVALID;
+
+        dir = ((uint32_t) FAT32_Load16(&entry[20]) << 16) | FAT32_Load16(&entry[26]);
+        if (dir == 0)
+            dir = volume->root_cluster;
+    }
+
+    if (res == FAT32_NOT_FOUND && (mode & FAT32_CREATE))
+        res = FAT32_CreateEntry(file, name, free_sector, free_offset, last);
+    else if (res == FAT32_OK)
+    {
+        const uint8_t *entry = &file->buffer[file->entry_offset];
+
+        if (entry[11] & (FAT32_ATTR_DIRECTORY | FAT32_ATTR_VOLUME))
+            return FAT32_INVALID;
+
+        file->first_cluster = ((uint32_t) FAT32_Load16(&entry[20]) << 16) | FAT32_Load16(&entry[26]);
+        file->size = FAT32_Load32(&entry[28]);
+        file->clusters = (file->size + cluster_bytes - 1) / cluster_bytes;
+    }
+
+    if (res != FAT32_OK)
+        return res;
+
+    if ((mode & FAT32_TRUNCATE) && file->first_cluster != 0)
+    {
+        uint32_t first = file->first_cluster;
+
+        if ((mode & FAT32_WRITE) == 0)
+            return FAT32_INVALID;
+
+        file->first_cluster = 0;
+        file->size = 0;
+        file->clusters = 0;
+
+        /* the entry lets go of the chain on the card before the chain is freed:
+         * a power loss in between loses clusters instead of cross-linking them */
+        res = FAT32_WriteEntry(file);
+        if (res == FAT32_OK)
+            res = FAT32_FreeChain(volume, first);
+        if (res != FAT32_OK)
+            return res;
+    }
+
+    if (mode & FAT32_APPEND)
+        file->position = file->size;
+
+    return FAT32_OK;
+}
+
+FAT32_Result FAT32_Read(FAT32_File *file, void *data, uint32_t len, uint32_t *done)
+{
+    uint8_t *dst = data;
+    uint32_t total = 0;
+    FAT32_Result res = FAT32_OK;
+
+    if ((file->mode & FAT32_READ) == 0)
+        res = FAT32_INVALID;
+    else if (len > file->size - file->position)
+        len = file->size - file->position;
+
+    while (res == FAT32_OK && len > 0)
+    {
+        uint32_t offset = file->position & (SD_BLOCK_SIZE - 1);
+        uint32_t sector, run, n;
+
+        res = FAT32_Locate(file, file->position, &sector, &run);
+        if (res != FAT32_OK)
+            break;
+
+        if (offset == 0 && len >= SD_BLOCK_SIZE)
+        { /* whole sectors of the run go straight to the caller, one CMD18 */
+            uint32_t count = len / SD_BLOCK_SIZE;
+            if (count > run)
+                count = run;
+
+            /* the buffered sector may be newer than the card */
+            if (file->buffer_dirty && file->buffer_sector >= sector && file->buffer_sector < sector + count)
+            {
+                res = FAT32_BufferFlush(file);
+                if (res != FAT32_OK)
+                    break;
+            }
+
+            if (SD_SectorsRead(file->volume->sd, sector, count, dst) != SD_RESPONSE_NO_ERROR)
+            {
+                res = FAT32_DISK_ERROR;
+                break;
+            }
+            n = count * SD_BLOCK_SIZE;
+        }
+        else
+        {
+            res = FAT32_BufferLoad(file, sector, 1);
+            if (res != FAT32_OK)
+                break;
+
+            n = SD_BLOCK_SIZE - offset;
+            if (n > len)
+                n = len;
+            memcpy(dst, &file->buffer[offset], n);
+        }
+
+        dst += n;
+        file->position += n;
+        total += n;
+        len -= n;
+    }
+
+    if (done)
+        *done = total;
+    return res;
+}
+
+FAT32_Result FAT32_Write(FAT32_File *file, const void *data, uint32_t len, uint32_t *done)
+{
+    const uint8_t *src = data;
+    uint32_t total = 0;
+    FAT32_Result res = FAT32_OK;
+
+    if ((file->mode & FAT32_WRITE) == 0)
+        res = FAT32_INVALID;
+
+    while (res == FAT32_OK && len > 0)
+    {
+        uint32_t offset = file->position & (SD_BLOCK_SIZE - 1);
+        uint32_t sector, run, n;
+
+        if ((file->position >> (9 + file->volume->cluster_shift)) >= file->clusters)
+        {
+            res = FAT32_Extend(file);
+            if (res != FAT32_OK)
+                break;
+        }
+
+        res = FAT32_Locate(file, file->position, &sector, &run);
+        if (res != FAT32_OK)
+            break;
+
+        if (offset == 0 && len >= SD_BLOCK_SIZE)
+        { /* whole sectors of the run go straight to the card, one CMD25 */
+            uint32_t count = len / SD_BLOCK_SIZE;
+            if (count > run)
+                count = run;
+
+            /* the buffered sector is overwritten */
+            if (file->buffer_valid && file->buffer_sector >= sector && file->buffer_sector < sector + count)
+            {
+                file->buffer_valid = 0;
+                file->buffer_dirty = 0;
+            }
+
+            if (SD_SectorsWrite(file->volume->sd, sector, count, src) != SD_RESPONSE_NO_ERROR)
+            {
+                res = FAT32_DISK_ERROR;
+                break;
+            }
+            n = count * SD_BLOCK_SIZE;
+        }
+        else
+        {
+            /* a sector past the end of the file has nothing worth reading */
+            res = FAT32_BufferLoad(file, sector, file->position - offset < file->size);
+            if (res != FAT32_OK)
+                break;
+
+            n = SD_BLOCK_SIZE - offset;
+            if (n > len)
+                n = len;
+            memcpy(&file->buffer[offset], src, n);
+            file->buffer_dirty = 1;
+        }
+
+        src += n;
+        file->position += n;
+        total += n;
+        len -= n;
+
+        if (file->position > file->size)
+        {
+            file->size = file->position;
+            file->entry_dirty = 1;
+        }
+    }
+
+    if (done)
+        *done = total;
+    return res;
+}
+
+FAT32_Result FAT32_Seek(FAT32_File *file, uint32_t position)
+{
+    file->position = (position < file->size) ? position : file->size;
+    return FAT32_OK;
+}
+
+FAT32_Result FAT32_Close(FAT32_File *file)
+{
+    FAT32_Volume *volume = file->volume;
+    uint32_t cluster_bytes = SD_BLOCK_SIZE << volume->cluster_shift;
+    uint32_t needed = (file->size + cluster_bytes - 1) / cluster_bytes;
+    FAT32_Result res = FAT32_BufferFlush(file);
+
+    if (res != FAT32_OK || (file->mode & FAT32_WRITE) == 0)
+        return res;
+
+    /* give the clusters past the size back, preallocated or left by a power loss */
+    if (needed == 0 && file->first_cluster != 0)
+    {
+        uint32_t first = file->first_cluster;
+
+        /* the entry lets go of the chain on the card before the chain is freed */
+        file->first_cluster = 0;
+        res = FAT32_WriteEntry(file);
+        if (res == FAT32_OK)
+            res = FAT32_FreeChain(volume, first);
+    }
+    else if (needed > 0)
+    {
+        uint32_t last, next;
+
+        res = FAT32_FindCluster(file, needed - 1, &last);
+        if (res == FAT32_OK)
+            res = FAT32_GetEntry(volume, last, &next);
+        if (res == FAT32_OK && FAT32_ValidCluster(volume, next))
+        { /* the chain ends on the card before its tail is freed */
+            res = FAT32_SetEntry(volume, last, FAT32_EOC);
+            if (res == FAT32_OK)
+                res = FAT32_WindowFlush(volume);
+            if (res == FAT32_OK)
+                res = FAT32_FreeChain(volume, next);
+        }
+    }
+
+    if (res != FAT32_OK)
+        return res;
+
+    file->clusters = needed;
+    file->run_length = 0;
+
+    /* the FAT copies and FSInfo reach the card before the entry that points
+     * into them: a power loss in between loses clusters instead of handing
+     * clusters of this file to another one */
+    res = FAT32_Sync(volume);
+    if (res == FAT32_OK && file->entry_dirty)
+        res = FAT32_WriteEntry(file);
+
+    return res;
+}
@@ -6,47 +6,156 @@
  */
 
 #include <ili9341_driver.h>
-#include <stdlib.h>
+#include <string.h>
 
 #define LCD_CMD   0
 #define LCD_DATA  1
 
-static void ili9341_delay(unsigned int time)
+/* Transfers shorter than this are sent in blocking mode, DMA setup costs more */
+#define ILI9341_DMA_MIN_BYTES 32
+/* Maximum DMA transfer length (NDTR is 16 bits) */
+#define ILI9341_DMA_MAX_BYTES 0xFFFE
+/* Size of the buffer used to stream solid color fills */
+#define ILI9341_FILL_PIXELS 240
+
+static uint16_t fill_buffer[ILI9341_FILL_PIXELS];
+static uint16_t fill_buffer_color;
+static uint8_t fill_buffer_valid = 0;
+
+// Wait until the pending DMA transfer (if any) is finished
+static void ili9341_wait(LCD_Handle *LcdHandle)
+{
+    while (LcdHandle->dma_busy)
+        ;
+}
+
+// Pull CS low if it is not already, the bus stays selected until ili9341_release
+static void ili9341_select(LCD_Handle *LcdHandle)
 {
-    for (unsigned int i = 0; i < time; i++)
+    ili9341_wait(LcdHandle);
+
+    if (!LcdHandle->cs_active)
     {
-        for (volatile unsigned int j = 0; j < 2000; j++)
-            ;
+        HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_RESET);
+        LcdHandle->cs_active = 1;
+        LcdHandle->stats.cs_asserts++;
     }
 }
 
-// SPI write data or command to LCD (bit-banging)
-void ili9341_send(LCD_Handle *LcdHandle, int dc, uint8_t value)
+// DC (Command = 0, Data = 1), only touch the pin when it changes
+static void ili9341_set_dc(LCD_Handle *LcdHandle, int dc)
 {
+    if (LcdHandle->dc_state == dc)
+        return;
+
+    HAL_GPIO_WritePin(LcdHandle->Init.DC_Port, LcdHandle->Init.DC_Pin, dc ? GPIO_PIN_SET : GPIO_PIN_RESET);
+    LcdHandle->dc_state = dc;
+}
 
-    // DC (Command = 0, Data = 1)
-    if (dc == 0)
+// End of a drawing operation, CS is raised now or by the DMA interrupt when the transfer ends
+static void ili9341_release(LCD_Handle *LcdHandle)
+{
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    if (LcdHandle->dma_busy)
     {
-        HAL_GPIO_WritePin(LcdHandle->Init.DC_Port, LcdHandle->Init.DC_Pin,
-                GPIO_PIN_RESET); // Cmd
+        LcdHandle->release_pending = 1;
     }
-    else
+    else if (LcdHandle->cs_active)
     {
-        HAL_GPIO_WritePin(LcdHandle->Init.DC_Port, LcdHandle->Init.DC_Pin,
-                GPIO_PIN_SET);   // Data
+        HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_SET);
+        LcdHandle->cs_active = 0;
     }
 
-    // CS Low
-    HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin,
-            GPIO_PIN_RESET);
+    __set_PRIMASK(primask);
+}
+
+// Send a buffer in the current DC mode, large buffers go through DMA and return immediately
+static void ili9341_transmit(LCD_Handle *LcdHandle, const uint8_t *data, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t chunk = (len > ILI9341_DMA_MAX_BYTES) ? ILI9341_DMA_MAX_BYTES : len;
+
+        ili9341_wait(LcdHandle);
 
-    // Send 1 byte via SPI hardware
-    HAL_SPI_Transmit(LcdHandle->Init.hspi, &value, 1, HAL_MAX_DELAY);
+        LcdHandle->stats.bytes += chunk;
+        LcdHandle->stats.transfers++;
 
-    // CS High
-    HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin,
-            GPIO_PIN_SET);
+        if (chunk >= ILI9341_DMA_MIN_BYTES && LcdHandle->Init.hspi->hdmatx != NULL)
+        {
+            LcdHandle->dma_busy = 1;
+            if (HAL_SPI_Transmit_DMA(LcdHandle->Init.hspi, data, chunk) != HAL_OK)
+            {
+                LcdHandle->dma_busy = 0;
+                HAL_SPI_Transmit(LcdHandle->Init.hspi, data, chunk, HAL_MAX_DELAY);
+            }
+        }
+        else
+        {
+            HAL_SPI_Transmit(LcdHandle->Init.hspi, data, chunk, HAL_MAX_DELAY);
+        }
 
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+// Stream count pixels of the same color
+static void ili9341_fill(LCD_Handle *LcdHandle, uint16_t color, uint32_t count)
+{
+    uint16_t bus_color = LCD_TO_BUS(color);
+
+    ili9341_select(LcdHandle);
+    ili9341_set_dc(LcdHandle, LCD_DATA);
+
+    if (!fill_buffer_valid || fill_buffer_color != bus_color)
+    {
+        for (int i = 0; i < ILI9341_FILL_PIXELS; i++)
+            fill_buffer[i] = bus_color;
+        fill_buffer_color = bus_color;
+        fill_buffer_valid = 1;
+    }
+
+    while (count > 0)
+    {
+        uint32_t n = (count > ILI9341_FILL_PIXELS) ? ILI9341_FILL_PIXELS : count;
+        ili9341_transmit(LcdHandle, (const uint8_t*) fill_buffer, n * 2);
+        count -= n;
+    }
+}
+
+// Send a command followed by its parameters as a single transfer
+static void ili9341_command(LCD_Handle *LcdHandle, uint8_t cmd, const uint8_t *args, uint32_t nargs)
+{
+    ili9341_select(LcdHandle);
+    ili9341_set_dc(LcdHandle, LCD_CMD);
+    ili9341_transmit(LcdHandle, &cmd, 1);
+
+    if (nargs > 0)
+    {
+        ili9341_set_dc(LcdHandle, LCD_DATA);
+        ili9341_transmit(LcdHandle, args, nargs);
+    }
+}
+
+void ili9341_tx_complete(LCD_Handle *LcdHandle, SPI_HandleTypeDef *hspi)
+{
+    if (hspi != LcdHandle->Init.hspi || !LcdHandle->dma_busy)
+        return;
+
+    if (LcdHandle->release_pending)
+    {
+        HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_SET);
+        LcdHandle->cs_active = 0;
+        LcdHandle->release_pending = 0;
+    }
+
+    LcdHandle->dma_busy = 0;
+
+    if (LcdHandle->TransferComplete != NULL)
+        LcdHandle->TransferComplete(LcdHandle);
 }
 
 void ili9341_reset(LCD_Handle *LcdHandle)
@@ -58,6 +167,39 @@ void ili9341_reset(LCD_Handle *LcdHandle)
     HAL_Delay(5);
 }
 
+typedef struct
+{
+    uint8_t cmd;
+    uint8_t nargs;
+    uint8_t args[15];
+    uint8_t delay_ms; // Wait after the command
+} ILI9341_InitCommand;
+
+static const ILI9341_InitCommand ili9341_init_commands[] =
+{
+{ 0xCB, 5, { 0x39, 0x2C, 0x00, 0x34, 0x02 }, 0 },
+{ 0xCF, 3, { 0x00, 0xC1, 0x30 }, 0 },
+{ 0xE8, 3, { 0x85, 0x00, 0x78 }, 0 },
+{ 0xEA, 2, { 0x00, 0x00 }, 0 },
+{ 0xED, 4, { 0x64, 0x03, 0x12, 0x81 }, 0 },
+{ 0xF7, 1, { 0x20 }, 0 },
+{ 0xC0, 1, { 0x23 }, 0 }, // Power control, VRH[5:0]
+{ 0xC1, 1, { 0x10 }, 0 }, // Power control, SAP[2:0];BT[3:0]
+{ 0xC5, 2, { 0x3e, 0x28 }, 0 }, // VCM control
+{ 0xC7, 1, { 0x86 }, 0 }, // VCM control2
+{ 0x36, 1, { 0x88 }, 0 }, // Memory Access Control
+{ 0x3A, 1, { 0x55 }, 0 },
+{ 0xB1, 2, { 0x00, 0x18 }, 0 },
+{ 0xB6, 3, { 0x08, 0x82, 0x27 }, 0 }, // Display Function Control
+{ 0xF2, 1, { 0x00 }, 0 }, // 3Gamma Function Disable
+{ 0x26, 1, { 0x01 }, 0 }, // Gamma curve selected
+{ 0xE0, 15, { 0x0F, 0x31, 0x2B, 0x0C, 0x0E, 0x08, 0x4E, 0xF1, 0x37, 0x07, 0x10, 0x03, 0x0E, 0x09, 0x00 }, 0 }, // Set Gamma
+{ 0xE1, 15, { 0x00, 0x0E, 0x14, 0x03, 0x11, 0x07, 0x31, 0xC1, 0x48, 0x08, 0x0F, 0x0C, 0x31, 0x36, 0x0F }, 0 }, // Set Gamma
+{ 0x11, 0, { 0 }, 5 }, // Sleep out, 5 ms before the next command (datasheet)
+{ 0x2C, 0, { 0 }, 0 },
+{ 0x29, 0, { 0 }, 0 }, // Display on
+{ 0x2C, 0, { 0 }, 0 }, };
+
 void ili9341_init(LCD_Handle *LcdHandle)
 {
 
@@ -68,144 +210,164 @@ void ili9341_init(LCD_Handle *LcdHandle)
     LcdHandle->PrintChar = ili9341_putchar;
     LcdHandle->PrintString = ili9341_putstring;
     LcdHandle->PrintNumber = ili9341_putnumber;
+    LcdHandle->PrintNumberPadded = ili9341_putnumber_padded;
     LcdHandle->DrawPixel = ili9341_draw_pixel;
     LcdHandle->SetDrawPos = ili9341_set_xy;
+    LcdHandle->SetWindow = ili9341_set_window;
+    LcdHandle->FillRect = ili9341_fill_rect;
+    LcdHandle->BlitRect = ili9341_blit_rect;
+    LcdHandle->WritePixels = ili9341_write_pixels;
+    LcdHandle->Sync = ili9341_sync;
+
+    LcdHandle->dma_busy = 0;
+    LcdHandle->release_pending = 0;
+    LcdHandle->cs_active = 0;
+    LcdHandle->dc_state = 0xFF; // Unknown, forces the first write
+    LcdHandle->window_valid = 0;
+    HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_SET);
 
     ili9341_reset(LcdHandle);
 
-    ili9341_send(LcdHandle, LCD_CMD, 0xCB);
-    ili9341_send(LcdHandle, LCD_DATA, 0x39);
-    ili9341_send(LcdHandle, LCD_DATA, 0x2C);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0x34);
-    ili9341_send(LcdHandle, LCD_DATA, 0x02);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xCF);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0XC1);
-    ili9341_send(LcdHandle, LCD_DATA, 0X30);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xE8);
-    ili9341_send(LcdHandle, LCD_DATA, 0x85);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0x78);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xEA);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xED);
-    ili9341_send(LcdHandle, LCD_DATA, 0x64);
-    ili9341_send(LcdHandle, LCD_DATA, 0x03);
-    ili9341_send(LcdHandle, LCD_DATA, 0X12);
-    ili9341_send(LcdHandle, LCD_DATA, 0X81);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xF7);
-    ili9341_send(LcdHandle, LCD_DATA, 0x20);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xC0); // Power control
-    ili9341_send(LcdHandle, LCD_DATA, 0x23); // VRH[5:0]
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xC1); // Power control
-    ili9341_send(LcdHandle, LCD_DATA, 0x10); // SAP[2:0];BT[3:0]
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xC5); // VCM control
-    ili9341_send(LcdHandle, LCD_DATA, 0x3e);
-    ili9341_send(LcdHandle, LCD_DATA, 0x28);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xC7); // VCM control2
-    ili9341_send(LcdHandle, LCD_DATA, 0x86);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0x36); // Memory Access Control
-    ili9341_send(LcdHandle, LCD_DATA, 0x88); // C8
-
-    ili9341_send(LcdHandle, LCD_CMD, 0x3A);
-    ili9341_send(LcdHandle, LCD_DATA, 0x55);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xB1);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0x18);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xB6); // Display Function Control
-    ili9341_send(LcdHandle, LCD_DATA, 0x08);
-    ili9341_send(LcdHandle, LCD_DATA, 0x82);
-    ili9341_send(LcdHandle, LCD_DATA, 0x27);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xF2); // 3Gamma Function Disable
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0x26); // Gamma curve selected
-    ili9341_send(LcdHandle, LCD_DATA, 0x01);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xE0); // Set Gamma
-    ili9341_send(LcdHandle, LCD_DATA, 0x0F);
-    ili9341_send(LcdHandle, LCD_DATA, 0x31);
-    ili9341_send(LcdHandle, LCD_DATA, 0x2B);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0C);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0E);
-    ili9341_send(LcdHandle, LCD_DATA, 0x08);
-    ili9341_send(LcdHandle, LCD_DATA, 0x4E);
-    ili9341_send(LcdHandle, LCD_DATA, 0xF1);
-    ili9341_send(LcdHandle, LCD_DATA, 0x37);
-    ili9341_send(LcdHandle, LCD_DATA, 0x07);
-    ili9341_send(LcdHandle, LCD_DATA, 0x10);
-    ili9341_send(LcdHandle, LCD_DATA, 0x03);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0E);
-    ili9341_send(LcdHandle, LCD_DATA, 0x09);
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0xE1); // Set Gamma
-    ili9341_send(LcdHandle, LCD_DATA, 0x00);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0E);
-    ili9341_send(LcdHandle, LCD_DATA, 0x14);
-    ili9341_send(LcdHandle, LCD_DATA, 0x03);
-    ili9341_send(LcdHandle, LCD_DATA, 0x11);
-    ili9341_send(LcdHandle, LCD_DATA, 0x07);
-    ili9341_send(LcdHandle, LCD_DATA, 0x31);
-    ili9341_send(LcdHandle, LCD_DATA, 0xC1);
-    ili9341_send(LcdHandle, LCD_DATA, 0x48);
-    ili9341_send(LcdHandle, LCD_DATA, 0x08);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0F);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0C);
-    ili9341_send(LcdHandle, LCD_DATA, 0x31);
-    ili9341_send(LcdHandle, LCD_DATA, 0x36);
-    ili9341_send(LcdHandle, LCD_DATA, 0x0F);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0x11); // Sleep out
-    ili9341_delay(120);
-    ili9341_send(LcdHandle, LCD_CMD, 0x2c);
-
-    ili9341_send(LcdHandle, LCD_CMD, 0x29); // Display on
-    ili9341_send(LcdHandle, LCD_CMD, 0x2c);
+    // CS stays low for the whole sequence, each command and its parameters is one transfer
+    for (unsigned int i = 0; i < sizeof(ili9341_init_commands) / sizeof(ili9341_init_commands[0]); i++)
+    {
+        const ILI9341_InitCommand *command = &ili9341_init_commands[i];
+
+        ili9341_command(LcdHandle, command->cmd, command->args, command->nargs);
+        if (command->delay_ms)
+            HAL_Delay(command->delay_ms);
+    }
+
+    ili9341_release(LcdHandle);
 }
 
-void ili9341_set_xy(LCD_Handle *LcdHandle, int x, int y)
+// Send a column (0x2A) or page (0x2B) range unless the panel already has it
+static void ili9341_range(LCD_Handle *LcdHandle, uint8_t cmd, uint16_t *cache, int start, int end)
+{
+    if (LcdHandle->window_valid && cache[0] == start && cache[1] == end)
+        return;
+
+    uint8_t args[4] = { start >> 8, start & 0xFF, end >> 8, end & 0xFF };
+    ili9341_command(LcdHandle, cmd, args, 4);
+
+    cache[0] = start;
+    cache[1] = end;
+}
+
+// Set the address window (inclusive bounds) and start a memory write, the caller releases the bus
+static void ili9341_window(LCD_Handle *LcdHandle, int x0, int y0, int x1, int y1)
 {
-    //X
-    ili9341_send(LcdHandle, LCD_CMD, 0x2B);
-    ili9341_send(LcdHandle, LCD_DATA, x >> 8);
-    ili9341_send(LcdHandle, LCD_DATA, x & 0xFF);
-    ili9341_send(LcdHandle, LCD_CMD, 0x2c);
+    ili9341_range(LcdHandle, 0x2B, LcdHandle->window_x, x0, x1); // Pages
+    ili9341_range(LcdHandle, 0x2A, LcdHandle->window_y, y0, y1); // Columns
+    LcdHandle->window_valid = 1;
+
+    ili9341_command(LcdHandle, 0x2C, NULL, 0);
+    ili9341_set_dc(LcdHandle, LCD_DATA);
+}
 
-    //Y
-    ili9341_send(LcdHandle, LCD_CMD, 0x2A);
-    ili9341_send(LcdHandle, LCD_DATA, y >> 8);
-    ili9341_send(LcdHandle, LCD_DATA, y & 0xFF);
-    ili9341_send(LcdHandle, LCD_CMD, 0x2c);
+// Set the draw position, pixels then run to the end of the screen
+static void ili9341_address(LCD_Handle *LcdHandle, int x, int y)
+{
+    ili9341_window(LcdHandle, x, y, LcdHandle->width - 1, LcdHandle->height - 1);
+}
+
+void ili9341_set_window(LCD_Handle *LcdHandle, int x0, int y0, int x1, int y1)
+{
+    ili9341_window(LcdHandle, x0, y0, x1, y1);
+    ili9341_release(LcdHandle);
+}
+
+void ili9341_set_xy(LCD_Handle *LcdHandle, int x, int y)
+{
+    ili9341_address(LcdHandle, x, y);
+    ili9341_release(LcdHandle);
 }
 
 void ili9341_draw_pixel(LCD_Handle *LcdHandle, uint16_t color)
 {
-    ili9341_send(LcdHandle, LCD_DATA, color >> 8);
-    ili9341_send(LcdHandle, LCD_DATA, color & 0xFF);
+    uint16_t bus_color = LCD_TO_BUS(color);
+
+    ili9341_select(LcdHandle);
+    ili9341_set_dc(LcdHandle, LCD_DATA);
+    ili9341_transmit(LcdHandle, (const uint8_t*) &bus_color, 2);
+    ili9341_release(LcdHandle);
+}
+
+void ili9341_draw_pixel_at(LCD_Handle *LcdHandle, int x, int y, uint16_t color)
+{
+    uint16_t bus_color = LCD_TO_BUS(color);
+
+    ili9341_address(LcdHandle, x, y);
+    ili9341_transmit(LcdHandle, (const uint8_t*) &bus_color, 2);
+    ili9341_release(LcdHandle);
 }
 
-void ili9341_draw_pixel_at(LCD_Handle *LcdHandle,int x, int y , uint16_t color)
+void ili9341_write_pixels(LCD_Handle *LcdHandle, const uint16_t *pixels, uint32_t count)
 {
-    ili9341_set_xy(LcdHandle, x, y);
-    ili9341_draw_pixel(LcdHandle, color);
+    ili9341_select(LcdHandle);
+    ili9341_set_dc(LcdHandle, LCD_DATA);
+    ili9341_transmit(LcdHandle, (const uint8_t*) pixels, count * 2);
+    ili9341_release(LcdHandle);
 }
 
+void ili9341_sync(LCD_Handle *LcdHandle)
+{
+    ili9341_wait(LcdHandle);
+}
+
+void ili9341_fill_rect(LCD_Handle *LcdHandle, int x, int y, int w, int h, uint16_t color)
+{
+    // Clip to the screen
+    if (x < 0)
+    {
+        w += x;
+        x = 0;
+    }
+    if (y < 0)
+    {
+        h += y;
+        y = 0;
+    }
+    if (x + w > LcdHandle->width)
+        w = LcdHandle->width - x;
+    if (y + h > LcdHandle->height)
+        h = LcdHandle->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    ili9341_window(LcdHandle, x, y, x + w - 1, y + h - 1);
+    ili9341_fill(LcdHandle, color, (uint32_t) w * h);
+    ili9341_release(LcdHandle);
+}
+
+void ili9341_blit_rect(LCD_Handle *LcdHandle, int x, int y, int w, int h, const uint16_t *pixels)
+{
+    if (w <= 0 || h <= 0)
+        return;
+
+    if (x >= 0 && y >= 0 && x + w <= LcdHandle->width && y + h <= LcdHandle->height)
+    {
+        ili9341_window(LcdHandle, x, y, x + w - 1, y + h - 1);
+        ili9341_transmit(LcdHandle, (const uint8_t*) pixels, (uint32_t) w * h * 2);
+    }
+    else
+    {
+        // Partly off screen, send the visible part of each column
+        int y0 = (y < 0) ? 0 : y;
+        int y1 = (y + h > LcdHandle->height) ? LcdHandle->height : y + h;
+
+        for (int i = 0; i < w && y0 < y1; i++)
+        {
+            if (x + i < 0 || x + i >= LcdHandle->width)
+                continue;
+
+            ili9341_window(LcdHandle, x + i, y0, x + i, y1 - 1);
+            ili9341_transmit(LcdHandle, (const uint8_t*) (pixels + i * h + (y0 - y)), (uint32_t) (y1 - y0) * 2);
+        }
+    }
+
+    ili9341_release(LcdHandle);
+}
 
 void ili9341_clear(LCD_Handle *LcdHandle)
 {
@@ -214,67 +376,218 @@ void ili9341_clear(LCD_Handle *LcdHandle)
 
 void ili9341_fill_screen(LCD_Handle *LcdHandle, uint16_t color)
 {
+    ili9341_address(LcdHandle, 0, 0);
+    ili9341_fill(LcdHandle, color, (uint32_t) LcdHandle->width * LcdHandle->height);
+    ili9341_release(LcdHandle);
+}
 
-    ili9341_set_xy(LcdHandle, 0, 0);
+// Glyph expanded to RGB565 for one fg/bg pair, column by column in bus order
+typedef struct
+{
+    uint16_t pixels[FONTWIDTH * FONTHEIGHT];
+    uint16_t fg;
+    uint16_t bg;
+    uint32_t last_use;
+    uint8_t c;
+    uint8_t valid;
+} ILI9341_Glyph;
+
+static ILI9341_Glyph glyph_cache[ILI9341_GLYPH_CACHE_SIZE];
+static uint32_t glyph_clock = 0;
+
+// Expand one font column (MSB first) into FONTHEIGHT pixels
+static void ili9341_expand_column(uint16_t *dst, int u, uint16_t fg, uint16_t bg)
+{
+    for (int t2 = FONTHEIGHT - 1; t2 >= 0; t2--)
+        *dst++ = (u & (1 << t2)) ? fg : bg;
+}
 
-    HAL_GPIO_WritePin(LcdHandle->Init.DC_Port, LcdHandle->Init.DC_Pin, GPIO_PIN_SET); // Write data
+static int ili9341_font_column(int c, int col)
+{
+    return xchar[c][2 * col + 1] + (xchar[c][2 * col] << 8);
+}
+
+/*
+ * Return the expanded glyph, from the cache when possible.
+ * Only the most recently used glyph can still be on the bus and it is never the LRU victim.
+ */
+static const uint16_t* ili9341_get_glyph(int c, uint16_t fg, uint16_t bg)
+{
+    ILI9341_Glyph *victim = &glyph_cache[0];
+
+    glyph_clock++;
 
-    // CS Low
-    HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_RESET);
+    for (int i = 0; i < ILI9341_GLYPH_CACHE_SIZE; i++)
+    {
+        ILI9341_Glyph *glyph = &glyph_cache[i];
+        if (glyph->valid && glyph->c == c && glyph->fg == fg && glyph->bg == bg)
+        {
+            glyph->last_use = glyph_clock;
+            return glyph->pixels;
+        }
 
-    uint16_t lineBuffer[240]; // Une ligne de pixels (240 pour ILI9341)
-    for (int i = 0; i < 240; i++)
-        lineBuffer[i] = (color >> 8) | (color << 8); // Convertir en Big Endian pour SPI
+        if (!glyph->valid)
+            victim = glyph;
+        else if (victim->valid && glyph->last_use < victim->last_use)
+            victim = glyph;
+    }
 
-    for (int y = 0; y < 320; y++)
-        HAL_SPI_Transmit(LcdHandle->Init.hspi, (uint8_t*) lineBuffer, sizeof(lineBuffer),
-                HAL_MAX_DELAY);
+    for (int col = 0; col < FONTWIDTH; col++)
+        ili9341_expand_column(&victim->pixels[col * FONTHEIGHT], ili9341_font_column(c, col), fg, bg);
 
-    // CS High
-    HAL_GPIO_WritePin(LcdHandle->Init.CS_Port, LcdHandle->Init.CS_Pin, GPIO_PIN_SET);
+    victim->c = c;
+    victim->fg = fg;
+    victim->bg = bg;
+    victim->valid = 1;
+    victim->last_use = glyph_clock;
+
+    return victim->pixels;
+}
+
+// Expand a font column scaled by a constant size, inlined once per size so the inner loop is unrolled
+static inline __attribute__((always_inline)) void ili9341_expand_scaled(uint16_t *dst, int u, uint16_t fg,
+        uint16_t bg, const int size)
+{
+    for (int t2 = FONTHEIGHT - 1; t2 >= 0; t2--)
+    {
+        uint16_t px = (u & (1 << t2)) ? fg : bg;
+        for (int t3 = 0; t3 < size; t3++)
+            *dst++ = px;
+    }
+}
+
+// Column buffers for scaled glyphs, one is filled while the other is on the bus
+typedef struct
+{
+    uint16_t column[2][FONTHEIGHT * ILI9341_MAX_CHAR_SIZE * ILI9341_MAX_CHAR_SIZE];
+    int buf;
+} ILI9341_ScaleBuffer;
+
+/*
+ * Build a scaled font column: the column is expanded once then repeated size times,
+ * so it covers the size output columns of one font column
+ */
+static const uint16_t* ili9341_scaled_column(ILI9341_ScaleBuffer *scale, int u, int size, uint16_t fg, uint16_t bg)
+{
+    uint16_t *dst = scale->column[scale->buf];
+    int n = FONTHEIGHT * size;
+
+    scale->buf ^= 1;
+
+    switch (size)
+    {
+    case 2:
+        ili9341_expand_scaled(dst, u, fg, bg, 2);
+        break;
+    case 3:
+        ili9341_expand_scaled(dst, u, fg, bg, 3);
+        break;
+    default:
+        ili9341_expand_scaled(dst, u, fg, bg, 4);
+        break;
+    }
+
+    for (int t1 = 1; t1 < size; t1++)
+        memcpy(dst + t1 * n, dst, n * sizeof(uint16_t));
+
+    return dst;
+}
+
+// Stream one glyph into the open window
+static void ili9341_stream_glyph(LCD_Handle *LcdHandle, ILI9341_ScaleBuffer *scale, int c, int size, uint16_t fg,
+        uint16_t bg)
+{
+    if (size == 1)
+    {
+        ili9341_transmit(LcdHandle, (const uint8_t*) ili9341_get_glyph(c, fg, bg), sizeof(glyph_cache[0].pixels));
+        return;
+    }
+
+    for (int t0 = 0; t0 < FONTWIDTH; t0++)
+    {
+        const uint16_t *column = ili9341_scaled_column(scale, ili9341_font_column(c, t0), size, fg, bg);
+        ili9341_transmit(LcdHandle, (const uint8_t*) column, FONTHEIGHT * size * size * 2);
+    }
+}
+
+static int ili9341_clamp_size(int size)
+{
+    if (size < 1)
+        return 1;
+    if (size > ILI9341_MAX_CHAR_SIZE)
+        return ILI9341_MAX_CHAR_SIZE;
+    return size;
 }
 
 // Write character from font set to destination on screen
 void ili9341_putchar(LCD_Handle *LcdHandle, int x, int y, int c, int size, int fcolor, int bcolor)
 {
-    int x0;
-    int t0, t1, t2, t3, u;
+    ILI9341_ScaleBuffer scale;
+    uint16_t fg = LCD_TO_BUS(fcolor);
+    uint16_t bg = LCD_TO_BUS(bcolor);
 
-    y = LcdHandle->height - y - FONTHEIGHT;
+    if (c < 0 || c >= FONTCHARS)
+        c = ' ';
+    size = ili9341_clamp_size(size);
+    scale.buf = 0;
 
-    x0 = x;
-    for (t0 = 0; t0 < FONTWIDTH * 2; t0 += 2)
+    y = LcdHandle->height - y - FONTHEIGHT * size;
+
+    // The whole glyph is one burst when it fits on screen, else each column is clipped
+    if (x >= 0 && y >= 0 && x + FONTWIDTH * size <= LcdHandle->width && y + FONTHEIGHT * size <= LcdHandle->height)
     {
-        for (t1 = 0; t1 < size; t1++)
+        ili9341_window(LcdHandle, x, y, x + FONTWIDTH * size - 1, y + FONTHEIGHT * size - 1);
+        ili9341_stream_glyph(LcdHandle, &scale, c, size, fg, bg);
+        ili9341_release(LcdHandle);
+    }
+    else if (size == 1)
+    {
+        ili9341_blit_rect(LcdHandle, x, y, FONTWIDTH, FONTHEIGHT, ili9341_get_glyph(c, fg, bg));
+    }
+    else
+    {
+        for (int t0 = 0; t0 < FONTWIDTH; t0++)
         {
-            u = xchar[c][t0 + 1] + (xchar[c][t0] << 8);
-            ili9341_set_xy(LcdHandle, x0, y);
-            for (t2 = 16; t2 >= 0; t2--)
-            {
-                if (u & (1 << t2))
-                {
-                    for (t3 = 0; t3 < size; t3++)
-                    {
-                        ili9341_draw_pixel(LcdHandle, fcolor);
-                    }
-                }
-                else
-                {
-                    for (t3 = 0; t3 < size; t3++)
-                    {
-                        ili9341_draw_pixel(LcdHandle, bcolor);
-                    }
-                }
-            }
-            x0++;
+            const uint16_t *column = ili9341_scaled_column(&scale, ili9341_font_column(c, t0), size, fg, bg);
+            ili9341_blit_rect(LcdHandle, x + t0 * size, y, size, FONTHEIGHT * size, column);
         }
     }
+
+    ili9341_wait(LcdHandle); // The column buffers live on the stack
 }
 
 //Print String to LCD
 void ili9341_putstring(LCD_Handle *LcdHandle, int x, int y, char *text, int size, int fc, int bc)
 {
     int t1 = 0, x0;
+    int len = strlen(text);
+    int y0;
+
+    size = ili9341_clamp_size(size);
+    y0 = LcdHandle->height - y - FONTHEIGHT * size;
+
+    // Strings that fit on the line are sent as one window, glyph after glyph
+    if (len > 0 && x >= 0 && y0 >= 0 && x + len * FONTWIDTH * size <= LcdHandle->width
+            && y0 + FONTHEIGHT * size <= LcdHandle->height)
+    {
+        ILI9341_ScaleBuffer scale;
+        uint16_t fg = LCD_TO_BUS(fc);
+        uint16_t bg = LCD_TO_BUS(bc);
+
+        scale.buf = 0;
+
+        ili9341_window(LcdHandle, x, y0, x + len * FONTWIDTH * size - 1, y0 + FONTHEIGHT * size - 1);
+        for (t1 = 0; t1 < len; t1++)
+        {
+            int c = (uint8_t) text[t1];
+            if (c >= FONTCHARS)
+                c = ' ';
+            ili9341_stream_glyph(LcdHandle, &scale, c, size, fg, bg);
+        }
+        ili9341_release(LcdHandle);
+        ili9341_wait(LcdHandle); // The column buffers live on the stack
+        return;
+    }
 
     x0 = x;
     while (text[t1])
@@ -288,15 +601,204 @@ void ili9341_putstring(LCD_Handle *LcdHandle, int x, int y, char *text, int size
 
 void ili9341_putnumber(LCD_Handle *LcdHandle, int x, int y, long num, int dec, int lsize, int fc, int bc)
 {
-    char *s = (char*) malloc(16);
-    if (s != NULL)
+    ili9341_putnumber_padded(LcdHandle, x, y, num, dec, 0, lsize, fc, bc);
+}
+
+void ili9341_putnumber_padded(LCD_Handle *LcdHandle, int x, int y, long num, int dec, int width, int lsize, int fc,
+        int bc)
+{
+    char s[ILI9341_NUMBER_BUFLEN];
+
+    if (int2asc_padded(num, dec, width, s, sizeof(s)) < 0)
+        int2asc_padded(num, dec, 0, s, sizeof(s)); // Too wide, print it unpadded
+
+    ili9341_putstring(LcdHandle, x, y, s, lsize, fc, bc);
+}
+
+/////////////
+// CONSOLE //
+/////////////
+
+/*
+ * MADCTL MY is set: logical x 0 is the last frame memory line, the scan (and the scroll)
+ * goes toward decreasing x. Console positions are in frame memory lines.
+ */
+#define ILI9341_LINE_TO_X(line) (ILI9341_SCROLL_LINES - 1 - (line))
+
+static uint16_t ili9341_console_top_lines(ILI9341_Console *console)
+{
+    return console->status_at_bottom ? 0 : console->status_rows * FONTHEIGHT;
+}
+
+// First frame memory line of a scrolling row
+static uint16_t ili9341_console_row_line(ILI9341_Console *console, uint8_t mem_row)
+{
+    return ili9341_console_top_lines(console) + mem_row * FONTHEIGHT;
+}
+
+// Top fixed, scrolling and bottom fixed areas, in frame memory lines (VSCRDEF)
+static void ili9341_console_define(ILI9341_Console *console, uint16_t tfa, uint16_t vsa, uint16_t bfa)
+{
+    uint8_t args[6] = { tfa >> 8, tfa, vsa >> 8, vsa, bfa >> 8, bfa };
+
+    ili9341_command(console->lcd, 0x33, args, sizeof(args));
+    ili9341_release(console->lcd);
+}
+
+// Frame memory line shown at the top of the scrolling area (VSCRSADD)
+static void ili9341_console_start(ILI9341_Console *console, uint16_t line)
+{
+    uint8_t args[2] = { line >> 8, line };
+
+    ili9341_command(console->lcd, 0x37, args, sizeof(args));
+    ili9341_release(console->lcd);
+}
+
+/*
+ * Draw a character with its top at frame memory line, rotated for the portrait layout:
+ * glyph rows go toward the end of the scan, glyph columns toward decreasing y
+ */
+static void ili9341_console_glyph(ILI9341_Console *console, uint16_t line, uint8_t col, int c)
+{
+    uint16_t *pixels = console->glyph[console->glyph_buf];
+    uint16_t fg = LCD_TO_BUS(console->fg);
+    uint16_t bg = LCD_TO_BUS(console->bg);
+    int x = ILI9341_LINE_TO_X(line + FONTHEIGHT - 1);
+    int y = console->lcd->height - FONTWIDTH * (col + 1);
+
+    if (c < 0 || c >= FONTCHARS)
+        c = ' ';
+
+    // Window column i is glyph row FONTHEIGHT - 1 - i, pixel j is glyph column FONTWIDTH - 1 - j
+    for (int j = 0; j < FONTWIDTH; j++)
     {
-        int2asc(num, dec, s, 16);
-        ili9341_putstring(LcdHandle, x, y, s, lsize, fc, bc);
-        free(s);
+        int u = ili9341_font_column(c, FONTWIDTH - 1 - j);
+        for (int i = 0; i < FONTHEIGHT; i++)
+            pixels[i * FONTWIDTH + j] = (u & (1 << (FONTHEIGHT - 1 - i))) ? fg : bg;
     }
-    else
+
+    // The other buffer may still be on the bus
+    ili9341_blit_rect(console->lcd, x, y, FONTHEIGHT, FONTWIDTH, pixels);
+    console->glyph_buf ^= 1;
+}
+
+static void ili9341_console_clear_row(ILI9341_Console *console, uint8_t mem_row)
+{
+    uint16_t line = ili9341_console_row_line(console, mem_row);
+
+    ili9341_fill_rect(console->lcd, ILI9341_LINE_TO_X(line + FONTHEIGHT - 1), 0, FONTHEIGHT, console->lcd->height,
+            console->bg);
+}
+
+static void ili9341_console_newline(ILI9341_Console *console)
+{
+    console->col = 0;
+
+    if (console->row + 1 < console->rows)
+    {
+        console->row++;
+        return;
+    }
+
+    // The top row becomes the new bottom row: clear it, then move the scroll start past it
+    ili9341_console_clear_row(console, console->first_row);
+    console->first_row = (console->first_row + 1) % console->rows;
+    ili9341_console_start(console, ili9341_console_row_line(console, console->first_row));
+}
+
+void ili9341_console_init(ILI9341_Console *console, LCD_Handle *LcdHandle, uint8_t status_rows,
+        uint8_t status_at_bottom, uint16_t fc, uint16_t bc)
+{
+    console->lcd = LcdHandle;
+    console->fg = fc;
+    console->bg = bc;
+    console->status_rows = status_rows;
+    console->status_at_bottom = status_at_bottom;
+    console->rows = ILI9341_SCROLL_LINES / FONTHEIGHT - status_rows;
+    console->cols = LcdHandle->height / FONTWIDTH;
+    console->row = 0;
+    console->col = 0;
+    console->first_row = 0;
+    console->glyph_buf = 0;
+
+    ili9341_fill_screen(LcdHandle, bc);
+
+    uint16_t fixed = status_rows * FONTHEIGHT;
+    ili9341_console_define(console, status_at_bottom ? 0 : fixed, ILI9341_SCROLL_LINES - fixed,
+            status_at_bottom ? fixed : 0);
+    ili9341_console_start(console, ili9341_console_top_lines(console));
+}
+
+void ili9341_console_end(ILI9341_Console *console)
+{
+    ili9341_console_define(console, 0, ILI9341_SCROLL_LINES, 0);
+    ili9341_console_start(console, 0);
+}
+
+void ili9341_console_putc(ILI9341_Console *console, char c)
+{
+    switch (c)
+    {
+    case '\n':
+        ili9341_console_newline(console);
+        break;
+
+    case '\r':
+        console->col = 0;
+        break;
+
+    case '\b':
+        if (console->col > 0)
+        {
+            console->col--;
+            ili9341_console_glyph(console,
+                    ili9341_console_row_line(console, (console->first_row + console->row) % console->rows),
+                    console->col, ' ');
+        }
+        break;
+
+    default:
+        // Wrap only when a character follows, so a full line does not leave a blank one
+        if (console->col >= console->cols)
+            ili9341_console_newline(console);
+
+        ili9341_console_glyph(console,
+                ili9341_console_row_line(console, (console->first_row + console->row) % console->rows),
+                console->col, (unsigned char) c);
+        console->col++;
+        break;
+    }
+}
+
+void ili9341_console_write(ILI9341_Console *console, const char *text, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+        ili9341_console_putc(console, text[i]);
+}
+
+void ili9341_console_clear(ILI9341_Console *console)
+{
+    for (int i = 0; i < console->rows; i++)
+        ili9341_console_clear_row(console, i);
+
+    console->row = 0;
+    console->col = 0;
+    console->first_row = 0;
+    ili9341_console_start(console, ili9341_console_top_lines(console));
+}
+
+void ili9341_console_status(ILI9341_Console *console, uint8_t row, const char *text)
+{
+    uint16_t line;
+
+    if (row >= console->status_rows)
+        return;
+
+    line = (console->status_at_bottom ? ILI9341_SCROLL_LINES - console->status_rows * FONTHEIGHT : 0) + row * FONTHEIGHT;
+
+    for (int col = 0; col < console->cols; col++)
     {
-        ili9341_putstring(LcdHandle, x, y, (char*) "Error", lsize, fc, bc);
+        int c = *text ? (unsigned char) *text++ : ' ';
+        ili9341_console_glyph(console, line, col, c);
     }
 }
@@ -270,6 +270,172 @@ const char xchar[][24] =
                 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	// 0x80 °-sign
         };
 
+///////////////////
+// DIRTY REGIONS //
+///////////////////
+
+static uint16_t dirty_chunks[2][LCD_DIRTY_CHUNK_PIXELS];
+
+static int32_t rect_area(const LCD_Rect *r)
+{
+    return (int32_t) r->w * r->h;
+}
+
+static LCD_Rect rect_union(const LCD_Rect *a, const LCD_Rect *b)
+{
+    LCD_Rect u;
+    int x1 = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int y1 = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+
+    u.x = (a->x < b->x) ? a->x : b->x;
+    u.y = (a->y < b->y) ? a->y : b->y;
+    u.w = x1 - u.x;
+    u.h = y1 - u.y;
+    return u;
+}
+
+static int32_t rect_overlap(const LCD_Rect *a, const LCD_Rect *b)
+{
+    int x0 = (a->x > b->x) ? a->x : b->x;
+    int y0 = (a->y > b->y) ? a->y : b->y;
+    int x1 = (a->x + a->w < b->x + b->w) ? a->x + a->w : b->x + b->w;
+    int y1 = (a->y + a->h < b->y + b->h) ? a->y + a->h : b->y + b->h;
+
+    if (x1 <= x0 || y1 <= y0)
+        return 0;
+    return (int32_t) (x1 - x0) * (y1 - y0);
+}
+
+// Pixels sent for nothing if a and b are replaced by their union
+static int32_t rect_merge_cost(const LCD_Rect *a, const LCD_Rect *b)
+{
+    LCD_Rect u = rect_union(a, b);
+    return rect_area(&u) - rect_area(a) - rect_area(b) + rect_overlap(a, b);
+}
+
+static void dirty_remove(LCD_DirtyRegions *dirty, int i)
+{
+    dirty->rects[i] = dirty->rects[--dirty->count];
+}
+
+void LCD_Dirty_Init(LCD_DirtyRegions *dirty, LCD_Handle *lcd, LCD_PaintFunc paint, void *context)
+{
+    dirty->lcd = lcd;
+    dirty->Paint = paint;
+    dirty->context = context;
+    dirty->count = 0;
+}
+
+void LCD_Dirty_Add(LCD_DirtyRegions *dirty, int x, int y, int w, int h)
+{
+    LCD_Rect r;
+
+    // Clip to the screen
+    if (x < 0)
+    {
+        w += x;
+        x = 0;
+    }
+    if (y < 0)
+    {
+        h += y;
+        y = 0;
+    }
+    if (x + w > dirty->lcd->width)
+        w = dirty->lcd->width - x;
+    if (y + h > dirty->lcd->height)
+        h = dirty->lcd->height - y;
+    if (w <= 0 || h <= 0)
+        return;
+
+    r.x = x;
+    r.y = y;
+    r.w = w;
+    r.h = h;
+
+    // Merge with any rectangle where the union is cheaper than two windows, the union may merge again
+    for (int i = 0; i < dirty->count; i++)
+    {
+        if (rect_merge_cost(&dirty->rects[i], &r) <= LCD_DIRTY_MERGE_SLACK)
+        {
+            r = rect_union(&dirty->rects[i], &r);
+            dirty_remove(dirty, i);
+            i = -1;
+        }
+    }
+
+    // Full: merge the cheapest pair to make room
+    if (dirty->count == LCD_DIRTY_MAX_RECTS)
+    {
+        int32_t best_cost = rect_merge_cost(&dirty->rects[0], &r);
+        int best_a = 0, best_b = -1;
+
+        for (int i = 0; i < dirty->count; i++)
+        {
+            int32_t cost = rect_merge_cost(&dirty->rects[i], &r);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_a = i;
+                best_b = -1;
+            }
+
+            for (int j = i + 1; j < dirty->count; j++)
+            {
+                cost = rect_merge_cost(&dirty->rects[i], &dirty->rects[j]);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_a = i;
+                    best_b = j;
+                }
+            }
+        }
+
+        if (best_b < 0)
+        {
+            r = rect_union(&dirty->rects[best_a], &r);
+            dirty_remove(dirty, best_a);
+        }
+        else
+        {
+            dirty->rects[best_a] = rect_union(&dirty->rects[best_a], &dirty->rects[best_b]);
+            dirty_remove(dirty, best_b);
+        }
+    }
+
+    dirty->rects[dirty->count++] = r;
+}
+
+void LCD_Dirty_Flush(LCD_DirtyRegions *dirty)
+{
+    LCD_Handle *lcd = dirty->lcd;
+    int buf = 0;
+
+    for (int i = 0; i < dirty->count; i++)
+    {
+        LCD_Rect *r = &dirty->rects[i];
+
+        // One window per rectangle, painted in chunks of whole columns
+        int columns = LCD_DIRTY_CHUNK_PIXELS / r->h;
+
+        lcd->SetWindow(lcd, r->x, r->y, r->x + r->w - 1, r->y + r->h - 1);
+
+        for (int x = 0; x < r->w; x += columns)
+        {
+            int w = (r->w - x < columns) ? r->w - x : columns;
+
+            // Painting one chunk while the other one is on the bus
+            dirty->Paint(dirty->context, r->x + x, r->y, w, r->h, dirty_chunks[buf]);
+            lcd->WritePixels(lcd, dirty_chunks[buf], (uint32_t) w * r->h);
+            buf ^= 1;
+        }
+    }
+
+    lcd->Sync(lcd);
+    dirty->count = 0;
+}
+
 //////////////////////
 // STRING FUNCTIONS //
 //////////////////////
@@ -341,3 +507,111 @@ int int2asc(long num, int dec, char *buf, int buflen)
     return c;
 }
 
+static const char digit_pairs[201] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+int int2asc_padded(long num, int dec, int width, char *buf, int buflen)
+{
+    char digits[20]; // Enough for a 64 bit long
+    char *p = digits + sizeof(digits);
+    unsigned long n;
+    int neg = 0, ndigits, len, pad, i;
+    char *out;
+
+    if (num < 0)
+    {
+        neg = 1;
+        n = 0UL - (unsigned long) num;
+    }
+    else
+    {
+        n = num;
+    }
+
+    // Two digits per division, right to left
+    while (n >= 100)
+    {
+        unsigned long q = n / 100;
+        unsigned long r = n - q * 100;
+        p -= 2;
+        p[0] = digit_pairs[2 * r];
+        p[1] = digit_pairs[2 * r + 1];
+        n = q;
+    }
+    if (n >= 10)
+    {
+        p -= 2;
+        p[0] = digit_pairs[2 * n];
+        p[1] = digit_pairs[2 * n + 1];
+    }
+    else
+    {
+        *--p = '0' + n;
+    }
+    ndigits = digits + sizeof(digits) - p;
+
+    // Same rules as int2asc: 0 has no separator, no leading 0 before the separator
+    if (num == 0 || dec <= 0 || dec > 9)
+        dec = 0;
+
+    len = neg + ndigits;
+    if (dec)
+        len += (ndigits > dec) ? 1 : 1 + dec - ndigits;
+
+    pad = ((width < 0) ? -width : width) - len;
+    if (pad < 0)
+        pad = 0;
+    if (len + pad >= buflen)
+    {
+        if (buflen > 0)
+            *buf = 0;
+        return -1;
+    }
+
+    out = buf;
+    if (width > 0)
+        for (i = 0; i < pad; i++)
+            *out++ = ' ';
+
+    if (neg)
+        *out++ = '-';
+
+    if (!dec)
+    {
+        for (i = 0; i < ndigits; i++)
+            *out++ = p[i];
+    }
+    else if (ndigits > dec)
+    {
+        for (i = 0; i < ndigits - dec; i++)
+            *out++ = p[i];
+        *out++ = '.';
+        for (; i < ndigits; i++)
+            *out++ = p[i];
+    }
+    else
+    {
+        *out++ = '.';
+        for (i = ndigits; i < dec; i++)
+            *out++ = '0';
+        for (i = 0; i < ndigits; i++)
+            *out++ = p[i];
+    }
+
+    if (width < 0)
+        for (i = 0; i < pad; i++)
+            *out++ = ' ';
+
+    *out = 0;
+
+    return len + pad;
+}
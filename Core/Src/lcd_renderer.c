@@ -0,0 +1,215 @@
+/*
+ * lcd_renderer.c
+ */
+
+#include "lcd_renderer.h"
+#include <string.h>
+
+#define LCD_RENDER_BAND_PIXELS (LCD_RENDER_MAX_WIDTH * LCD_RENDER_BAND_HEIGHT)
+
+static uint16_t band_buffers[2][LCD_RENDER_BAND_PIXELS];
+
+/*
+ * Band being rasterised, pixel (x, y) is at pixels[x * height + y - band.y]
+ */
+typedef struct
+{
+    uint16_t *pixels;
+    int y;
+    int width;
+    int height;
+} LCD_Band;
+
+static LCD_RenderCommand* render_push(LCD_Renderer *renderer, LCD_RenderCommandType type, int x, int y, int w, int h)
+{
+    LCD_RenderCommand *cmd;
+
+    if (renderer->count >= LCD_RENDER_MAX_COMMANDS)
+        return NULL;
+
+    cmd = &renderer->commands[renderer->count++];
+    cmd->type = type;
+    cmd->rect.x = x;
+    cmd->rect.y = y;
+    cmd->rect.w = w;
+    cmd->rect.h = h;
+    return cmd;
+}
+
+// Intersect a command with the band, return 0 if nothing is visible
+static int render_clip(const LCD_Band *band, const LCD_Rect *rect, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = (rect->x > 0) ? rect->x : 0;
+    *y0 = (rect->y > band->y) ? rect->y : band->y;
+    *x1 = (rect->x + rect->w < band->width) ? rect->x + rect->w : band->width;
+    *y1 = (rect->y + rect->h < band->y + band->height) ? rect->y + rect->h : band->y + band->height;
+
+    return *x0 < *x1 && *y0 < *y1;
+}
+
+static void render_text(const LCD_Band *band, const LCD_RenderCommand *cmd, int x0, int y0, int x1, int y1)
+{
+    int size = cmd->text.size;
+
+    for (int x = x0; x < x1; x++)
+    {
+        int col = (x - cmd->rect.x) / size;
+        int c = (unsigned char) cmd->text.text[col / FONTWIDTH];
+        uint16_t *dst = &band->pixels[x * band->height + y0 - band->y];
+        int u;
+
+        if (c >= FONTCHARS)
+            c = ' ';
+
+        // Font columns are MSB first from the top of the window, like ili9341_putchar
+        col %= FONTWIDTH;
+        u = xchar[c][2 * col + 1] + (xchar[c][2 * col] << 8);
+
+        for (int y = y0; y < y1; y++)
+            *dst++ = (u & (1 << (FONTHEIGHT - 1 - (y - cmd->rect.y) / size))) ? cmd->text.fg : cmd->text.bg;
+    }
+}
+
+static void render_command(const LCD_Band *band, const LCD_RenderCommand *cmd)
+{
+    int x0, y0, x1, y1;
+
+    if (!render_clip(band, &cmd->rect, &x0, &y0, &x1, &y1))
+        return;
+
+    switch (cmd->type)
+    {
+    case LCD_RENDER_FILL:
+        for (int x = x0; x < x1; x++)
+        {
+            uint16_t *dst = &band->pixels[x * band->height + y0 - band->y];
+            for (int y = y0; y < y1; y++)
+                *dst++ = cmd->color;
+        }
+        break;
+
+    case LCD_RENDER_BLIT:
+        for (int x = x0; x < x1; x++)
+            memcpy(&band->pixels[x * band->height + y0 - band->y],
+                    &cmd->pixels[(x - cmd->rect.x) * cmd->rect.h + y0 - cmd->rect.y], (y1 - y0) * sizeof(uint16_t));
+        break;
+
+    case LCD_RENDER_TEXT:
+        render_text(band, cmd, x0, y0, x1, y1);
+        break;
+
+    case LCD_RENDER_PAINT:
+        // A band column is contiguous, paint it in place
+        for (int x = x0; x < x1; x++)
+            cmd->paint.Paint(cmd->paint.context, x, y0, 1, y1 - y0,
+                    &band->pixels[x * band->height + y0 - band->y]);
+        break;
+    }
+}
+
+void LCD_Render_Init(LCD_Renderer *renderer, LCD_Handle *lcd)
+{
+    renderer->lcd = lcd;
+    renderer->Sink = NULL;
+    renderer->sink_context = NULL;
+    renderer->width = lcd ? lcd->width : 0;
+    renderer->height = lcd ? lcd->height : 0;
+    renderer->bg_color = lcd ? LCD_TO_BUS(lcd->Init.bg_color) : 0;
+    renderer->count = 0;
+}
+
+void LCD_Render_Begin(LCD_Renderer *renderer)
+{
+    renderer->count = 0;
+}
+
+int LCD_Render_FillRect(LCD_Renderer *renderer, int x, int y, int w, int h, uint16_t color)
+{
+    LCD_RenderCommand *cmd = render_push(renderer, LCD_RENDER_FILL, x, y, w, h);
+    if (cmd == NULL)
+        return -1;
+
+    cmd->color = LCD_TO_BUS(color);
+    return 0;
+}
+
+int LCD_Render_BlitRect(LCD_Renderer *renderer, int x, int y, int w, int h, const uint16_t *pixels)
+{
+    LCD_RenderCommand *cmd = render_push(renderer, LCD_RENDER_BLIT, x, y, w, h);
+    if (cmd == NULL)
+        return -1;
+
+    cmd->pixels = pixels;
+    return 0;
+}
+
+int LCD_Render_String(LCD_Renderer *renderer, int x, int y, const char *text, int size, int fc, int bc)
+{
+    LCD_RenderCommand *cmd;
+
+    if (size < 1)
+        size = 1;
+
+    // Same coordinates as PrintString, y is flipped
+    cmd = render_push(renderer, LCD_RENDER_TEXT, x, renderer->height - y - FONTHEIGHT * size,
+            strlen(text) * FONTWIDTH * size, FONTHEIGHT * size);
+    if (cmd == NULL)
+        return -1;
+
+    cmd->text.text = text;
+    cmd->text.fg = LCD_TO_BUS(fc);
+    cmd->text.bg = LCD_TO_BUS(bc);
+    cmd->text.size = size;
+    return 0;
+}
+
+int LCD_Render_Paint(LCD_Renderer *renderer, int x, int y, int w, int h, LCD_PaintFunc paint, void *context)
+{
+    LCD_RenderCommand *cmd = render_push(renderer, LCD_RENDER_PAINT, x, y, w, h);
+    if (cmd == NULL)
+        return -1;
+
+    cmd->paint.Paint = paint;
+    cmd->paint.context = context;
+    return 0;
+}
+
+void LCD_Render_End(LCD_Renderer *renderer)
+{
+    LCD_Band band;
+    int buf = 0;
+
+    band.width = (renderer->width < LCD_RENDER_MAX_WIDTH) ? renderer->width : LCD_RENDER_MAX_WIDTH;
+
+    for (band.y = 0; band.y < renderer->height; band.y += LCD_RENDER_BAND_HEIGHT)
+    {
+        uint32_t count;
+
+        band.height = renderer->height - band.y;
+        if (band.height > LCD_RENDER_BAND_HEIGHT)
+            band.height = LCD_RENDER_BAND_HEIGHT;
+        band.pixels = band_buffers[buf];
+        count = (uint32_t) band.width * band.height;
+
+        // The other buffer may still be on the bus, this one was released by the previous WritePixels
+        for (uint32_t i = 0; i < count; i++)
+            band.pixels[i] = renderer->bg_color;
+
+        for (int i = 0; i < renderer->count; i++)
+            render_command(&band, &renderer->commands[i]);
+
+        if (renderer->Sink)
+            renderer->Sink(renderer->sink_context, band.y, band.width, band.height, band.pixels);
+
+        if (renderer->lcd)
+        {
+            renderer->lcd->SetWindow(renderer->lcd, 0, band.y, band.width - 1, band.y + band.height - 1);
+            renderer->lcd->WritePixels(renderer->lcd, band.pixels, count);
+        }
+
+        buf ^= 1;
+    }
+
+    if (renderer->lcd)
+        renderer->lcd->Sync(renderer->lcd);
+}
@@ -19,6 +19,9 @@
 /* Driver includes */
 #include "ili9341_driver.h"
 #include "sd_spi_driver.h"
+#include "sd_async.h"
+#include "sd_trace.h"
+#include "fat32.h"
 #include "num_keyboard_driver.h"
 
 /* Other */
@@ -26,6 +29,9 @@
 
 LCD_Handle hlcd;
 SD_SPI_Handle hsd;
+SD_Async hsda;
+FAT32_Volume hfat;
+FAT32_File hlog;
 NKB_Handle hnkb;
 
 SnakeGameState snakeGS;
@@ -33,13 +39,19 @@ SnakeGameState snakeGS;
 uint8_t MAX_LINE_CHAR;
 uint8_t MAX_ROW_CHAR;
 
+#define CONSOLE_MAX_LINE_CHAR 26 // 320 / FONTWIDTH
+#define CONSOLE_MAX_ROW_CHAR 15 // 240 / FONTHEIGHT
+
+char console[CONSOLE_MAX_ROW_CHAR][CONSOLE_MAX_LINE_CHAR];
+LCD_DirtyRegions console_dirty;
+
+void PaintConsole(void *context, int x, int y, int w, int h, uint16_t *pixels);
+
 uint32_t mem_counter = 0x4000;
 
 void Init(void)
 {
 
-    uint16_t row = 0;
-
     /* Lcd screen init */
     {
         hlcd.Init.hspi = &hspi1;
@@ -57,33 +69,19 @@ void Init(void)
 
         MAX_LINE_CHAR = hlcd.width / FONTWIDTH;
         MAX_ROW_CHAR = hlcd.height / FONTHEIGHT;
+
+        memset(console, ' ', sizeof(console));
+        LCD_Dirty_Init(&console_dirty, &hlcd, PaintConsole, NULL);
     }
 
-    /* Sd card init */
+    /* Sd card init: the bring-up is stepped from Loop, the card shows up when ready */
     {
         hsd.init.hspi = &hspi2;
         hsd.init.CS_Pin = SD_CS_Pin;
         hsd.init.CS_Port = SD_CS_GPIO_Port;
 
-        SD_Error res = SD_Init(&hsd);
-        if (res != SD_RESPONSE_NO_ERROR)
-        {
-            char str[32];
-            sprintf(str, "Failed to init SD : 0x%x", res);
-
-            hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
-        }
-
-        /*SD_CSD sd_test_csd;
-         SD_Bus_Hold(&hsd);
-         SD_GetCSDRegister(&hsd, &sd_test_csd);
-         SD_Bus_Release(&hsd);
-
-         if (sd_test_csd.PermWrProtect)
-         hlcd.PrintString(&hlcd, 0, 20 * row++, "SD is write perm protected", 1, WHITE, hlcd.Init.bg_color);
-
-         if (sd_test_csd.TempWrProtect)
-         hlcd.PrintString(&hlcd, 0, 20 * row++, "SD is write temp protected", 1, WHITE, hlcd.Init.bg_color);*/
+        SD_Init_Start(&hsd);
+        SD_Async_Init(&hsda, &hsd);
     }
 
     /* Num keyboard init */
@@ -109,47 +107,6 @@ void Init(void)
         NKB_Init(&hnkb);
     }
 
-    /* Sd card check */
-    {
-        HAL_Delay(250);
-        uint8_t res;
-
-        /* Write */
-        for (int i = 0; i < 2; ++i)
-        {
-            uint8_t tx_buffer[512];
-            memset(tx_buffer, '\0', 512);
-            if (i == 0)
-                sprintf((char*) tx_buffer, "Hello world (Write 1) !");
-            else
-                sprintf((char*) tx_buffer, "Hello world (Write 2) !");
-
-            res = SD_SectorWrite(&hsd, 0x50, tx_buffer);
-            if (res != SD_RESPONSE_NO_ERROR)
-            {
-                char str[22];
-                sprintf(str, "Failed to write SD : 0x%x", res);
-                hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
-            }
-
-            /* Read */
-            uint8_t rx_buffer[512];
-            memset(rx_buffer, '0', 512);
-            res = SD_SectorRead(&hsd, 0x50, rx_buffer);
-            if (res != SD_RESPONSE_NO_ERROR)
-            {
-                char str[22];
-                sprintf(str, "Failed to read SD : 0x%x", res);
-                hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
-            }
-            else
-            {
-                rx_buffer[26] = '\0';
-                hlcd.PrintString(&hlcd, 0, 20 * row++, (char*) rx_buffer, 1, YELLOW, hlcd.Init.bg_color);
-            }
-        }
-    }
-
     //hlcd.Clear(&hlcd);
     hlcd.PrintString(&hlcd, 0, ROW12, "Init finished", 1, WHITE, hlcd.Init.bg_color);
     //MemTest(0x400);
@@ -159,6 +116,75 @@ void Init(void)
     InitSnake(&snakeGS);
 }
 
+#define SD_MESSAGE_MS 3000 // time the SD report stays over the snake board
+
+static uint16_t sd_message_rows = 0;
+static uint32_t sd_message_tick;
+
+// The SD report is drawn over the snake board, Loop has the board repaint it later
+static void HoldSdMessage(uint16_t rows)
+{
+    sd_message_rows = rows;
+    sd_message_tick = HAL_GetTick();
+}
+
+// Called once the SD bring-up is over: report it and append a line to LOG.TXT
+void SdCardReady(SD_InitResult init)
+{
+    uint16_t row = 0;
+    FAT32_Result res;
+    char str[32];
+
+    if (init != SD_INIT_SUCESS)
+    {
+        sprintf(str, "Failed to init SD : 0x%x", init);
+        hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
+        HoldSdMessage(row);
+        return;
+    }
+
+    sprintf(str, "SD clock : %lu kHz", (unsigned long) (hsd.clock / 1000));
+    hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
+
+    /*SD_CSD sd_test_csd;
+     SD_Bus_Hold(&hsd);
+     SD_GetCSDRegister(&hsd, &sd_test_csd);
+     SD_Bus_Release(&hsd);
+
+     if (sd_test_csd.PermWrProtect)
+     hlcd.PrintString(&hlcd, 0, 20 * row++, "SD is write perm protected", 1, WHITE, hlcd.Init.bg_color);
+
+     if (sd_test_csd.TempWrProtect)
+     hlcd.PrintString(&hlcd, 0, 20 * row++, "SD is write temp protected", 1, WHITE, hlcd.Init.bg_color);*/
+
+    res = FAT32_Mount(&hfat, &hsd);
+    if (res == FAT32_OK)
+        res = FAT32_Open(&hfat, &hlog, "LOG.TXT", FAT32_READ | FAT32_WRITE | FAT32_CREATE | FAT32_APPEND);
+
+    if (res == FAT32_OK)
+    {
+        char line[32];
+        int len = sprintf(line, "Boot at %lu ms\r\n", (unsigned long) HAL_GetTick());
+
+        res = FAT32_Write(&hlog, line, len, NULL);
+        if (res == FAT32_OK)
+            res = FAT32_Close(&hlog);
+    }
+
+    if (res != FAT32_OK)
+    {
+        sprintf(str, "Failed to log SD : %d", res);
+        hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, WHITE, hlcd.Init.bg_color);
+    }
+    else
+    {
+        sprintf(str, "LOG.TXT : %lu bytes", (unsigned long) hlog.size);
+        hlcd.PrintString(&hlcd, 0, 20 * row++, str, 1, YELLOW, hlcd.Init.bg_color);
+    }
+
+    HoldSdMessage(row);
+}
+
 static uint16_t FPS;
 uint8_t bDoOnce = 1;
 
@@ -174,21 +200,82 @@ struct KeyChar keyChars[NKB_NUM_KEYS] = { { NKB_KEY_1, '1' }, { NKB_KEY_2, '2' }
 
 uint16_t seek = 0;
 
+#define CONSOLE_X(col) (2 + FONTWIDTH * (col))
+#define CONSOLE_Y(row) (2 + (FONTHEIGHT + 1) * (row))
+
+// Dirty region paint callback, renders the console grid (text y is flipped like PrintChar)
+void PaintConsole(void *context, int x, int y, int w, int h, uint16_t *pixels)
+{
+    uint16_t fg = LCD_TO_BUS(WHITE);
+    uint16_t bg = LCD_TO_BUS(hlcd.Init.bg_color);
+
+    for (int i = 0; i < w; ++i)
+    {
+        int col = (x + i - 2) / FONTWIDTH;
+        int glyph_col = (x + i - 2) % FONTWIDTH;
+        uint8_t in_col = (x + i >= 2 && col < MAX_LINE_CHAR && col < CONSOLE_MAX_LINE_CHAR);
+
+        for (int j = 0; j < h; ++j)
+        {
+            int text_y = hlcd.height - 1 - (y + j) - 2;
+            int row = text_y / (FONTHEIGHT + 1);
+            int bit = text_y % (FONTHEIGHT + 1);
+            uint16_t color = bg;
+
+            if (in_col && text_y >= 0 && bit < FONTHEIGHT && row < MAX_ROW_CHAR && row < CONSOLE_MAX_ROW_CHAR)
+            {
+                unsigned char c = console[row][col];
+                if (c >= FONTCHARS)
+                    c = ' ';
+
+                uint16_t u = xchar[c][2 * glyph_col + 1] + (xchar[c][2 * glyph_col] << 8);
+                if (u & (1 << bit))
+                    color = fg;
+            }
+
+            *pixels++ = color;
+        }
+    }
+}
+
+void ClearConsole(void)
+{
+    seek = 0;
+    memset(console, ' ', sizeof(console));
+    LCD_Dirty_Add(&console_dirty, 0, 0, hlcd.width, hlcd.height);
+}
+
 void PrintAtSeek(char c)
 {
-    uint16_t x = 2 + FONTWIDTH * (seek % MAX_LINE_CHAR);
-    uint16_t y = 2 + (FONTHEIGHT + 1) * (seek / MAX_LINE_CHAR);
-    hlcd.PrintChar(&hlcd, x, y, c, 1, WHITE, hlcd.Init.bg_color);
+    uint8_t col = seek % MAX_LINE_CHAR;
+    uint8_t row = seek / MAX_LINE_CHAR;
+
+    console[row][col] = c;
+    LCD_Dirty_Add(&console_dirty, CONSOLE_X(col), hlcd.height - CONSOLE_Y(row) - FONTHEIGHT, FONTWIDTH, FONTHEIGHT);
 
     seek += 1;
 
     if (seek >= MAX_LINE_CHAR * MAX_ROW_CHAR)
-    {
-        seek = 0;
-        hlcd.Clear(&hlcd);
-    }
+        ClearConsole();
+}
+
+#if SD_TRACE
+#define SD_TRACE_DRAIN_PER_FRAME 4
+
+// Print a few SD trace events per frame, formatting stays out of the SD driver
+void DrainSdTrace(void)
+{
+    SD_TraceEvent event;
+    uint32_t dropped = SD_Trace_Dropped();
 
+    if (dropped > 0)
+        printf("[sd %lu] %lu events dropped\r\n", (unsigned long) HAL_GetTick(), (unsigned long) dropped);
+
+    for (int i = 0; i < SD_TRACE_DRAIN_PER_FRAME && SD_Trace_Pop(&event); ++i)
+        printf("[sd %lu] %s %lu\r\n", (unsigned long) event.tick, SD_Trace_Name(event.id),
+                (unsigned long) event.value);
 }
+#endif
 
 static volatile uint32_t tick_flag = 0;
 
@@ -200,6 +287,27 @@ void Loop(uint32_t ticks)
 
     NKB_Update(&hnkb);
 
+    /* SD card bring-up, then SD requests advance a little every frame */
+    if (hsd.init_phase != SD_INIT_PHASE_DONE)
+    {
+        SD_InitResult init = SD_Init_Step(&hsd);
+        if (init != SD_INIT_PENDING)
+            SdCardReady(init);
+    }
+    else
+        SD_Async_Poll(&hsda);
+
+    /* PrintString rows count from the bottom of the screen, the next snake update repaints them */
+    if (sd_message_rows > 0 && HAL_GetTick() - sd_message_tick >= SD_MESSAGE_MS)
+    {
+        LCD_Dirty_Add(&snakeGS.dirty, 0, hlcd.height - 20 * sd_message_rows, hlcd.width, 20 * sd_message_rows);
+        sd_message_rows = 0;
+    }
+
+#if SD_TRACE
+    DrainSdTrace();
+#endif
+
     if (NKB_IsKeyPressed(snakeGS.Init.nkb_handle, NKB_KEY_7))
         snakeGS.dir = 1;
     else if (NKB_IsKeyPressed(snakeGS.Init.nkb_handle, NKB_KEY_8))
@@ -234,17 +342,26 @@ void Loop(uint32_t ticks)
      }
      }
      else if (i == 11)
-     {
-     seek = 0;
-     hlcd.Clear(&hlcd);
-     }
+     ClearConsole();
      else
      PrintAtSeek(keyChars[i].c);
      }
-     }*/
+     }
+     LCD_Dirty_Flush(&console_dirty);*/
 }
 
 void TimerInterupt(void)
 {
     tick_flag++;
 }
+
+void SpiTxComplete(SPI_HandleTypeDef *hspi)
+{
+    ili9341_tx_complete(&hlcd, hspi);
+    SD_Async_TransferComplete(&hsda, hspi);
+}
+
+void SpiTxRxComplete(SPI_HandleTypeDef *hspi)
+{
+    SD_Async_TransferComplete(&hsda, hspi);
+}
@@ -0,0 +1,366 @@
+/*
+ * sd_async.c
+ */
+
+#include "sd_async.h"
+#include "sd_crc.h"
+
+#include <string.h>
+
+/* MOSI must stay high while a block is clocked in, DMA sends this */
+static uint8_t sd_async_ones[SD_BLOCK_SIZE];
+
+/**
+ * @brief  Start a wait on the card, timeout_us rounded up to whole ticks
+ */
+static void SD_Async_Wait(SD_Async *engine, uint32_t timeout_us)
+{
+    engine->deadline = HAL_GetTick() + timeout_us / 1000 + 1;
+}
+
+static uint8_t SD_Async_Expired(SD_Async *engine)
+{
+    return (int32_t) (HAL_GetTick() - engine->deadline) >= 0;
+}
+
+/**
+ * @brief  Sample up to SD_ASYNC_POLL_BYTES bytes
+ * @retval The first byte that is not 0xFF, 0xFF if the card is still silent
+ */
+static uint8_t SD_Async_WaitToken(SD_Async *engine)
+{
+    uint8_t b = 0xFF;
+
+    for (int i = 0; i < SD_ASYNC_POLL_BYTES && b == 0xFF; i++)
+        b = SD_ReadByte(engine->sd);
+
+    return b;
+}
+
+/**
+ * @brief  Sample up to SD_ASYNC_POLL_BYTES bytes
+ * @retval 1 once the card released MISO (0xFF), 0 while it is busy
+ */
+static uint8_t SD_Async_WaitNotBusy(SD_Async *engine)
+{
+    for (int i = 0; i < SD_ASYNC_POLL_BYTES; i++)
+    {
+        if (SD_ReadByte(engine->sd) == 0xFF)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief  End the current request and report it
+ * @param  stop: a multiple block command was accepted and must be terminated
+ */
+static void SD_Async_Finish(SD_Async *engine, SD_Error error, uint8_t stop)
+{
+    SD_Request *request = engine->current;
+
+    if (stop)
+    {
+        if (request->type == SD_REQUEST_READ)
+            SD_SendCmd(engine->sd, SD_CMD_STOP_TRANSMISSION, 0x00000000);
+        else
+            SD_WriteByte(engine->sd, SD_DATA_MULTIPLE_BLOCK_WRITE_STOP);
+    }
+
+    /* CRC error or no token: send the sectors not transferred yet again */
+    if (error == SD_RESPONSE_DATA_ERROR && engine->retries < SD_CRC_RETRIES)
+    {
+        engine->retries++;
+        engine->state = SD_ASYNC_RETRY;
+        SD_Async_Wait(engine, engine->sd->write_timeout_us);
+        return;
+    }
+
+    SD_Bus_Release(engine->sd);
+
+    engine->current = NULL;
+    engine->state = SD_ASYNC_IDLE;
+
+    request->error = error;
+    request->status = (error == SD_RESPONSE_NO_ERROR) ? SD_REQUEST_DONE : SD_REQUEST_FAILED;
+
+    if (request->Complete)
+        request->Complete(request);
+}
+
+/**
+ * @brief  Send the command for the sectors of the current request not done yet
+ */
+static void SD_Async_Issue(SD_Async *engine)
+{
+    SD_SPI_Handle *sd = engine->sd;
+    SD_Request *request = engine->current;
+    uint32_t addr = request->sector + engine->done;
+    uint8_t multi = request->count > 1;
+    SD_Error state;
+
+    /* non High Capacity cards use byte-oriented addresses */
+    if (sd->card_type != SD_Card_SDHC)
+        addr <<= 9;
+
+    if (request->type == SD_REQUEST_READ)
+    {
+        state = SD_SendCmd(sd, multi ? SD_CMD_READ_MULT_BLOCK : SD_CMD_READ_SINGLE_BLOCK, addr);
+        engine->state = SD_ASYNC_READ_TOKEN;
+        SD_Async_Wait(engine, engine->sd->read_timeout_us);
+    }
+    else
+    {
+        /* ACMD23 pre-erase hint, like SD_WriteStreamStart */
+        if (multi && sd->card_type != SD_Card_MMC)
+        {
+            if ((SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00) & ~SD_IN_IDLE_STATE) == SD_RESPONSE_NO_ERROR)
+                SD_SendCmd(sd, SD_ACMD_SET_WR_BLK_ERASE_COUNT, (request->count - engine->done) & 0x007FFFFF);
+        }
+
+        state = SD_SendCmd(sd, multi ? SD_CMD_WRITE_MULT_BLOCK : SD_CMD_WRITE_SINGLE_BLOCK, addr);
+        engine->state = SD_ASYNC_WRITE_READY;
+        SD_Async_Wait(engine, engine->sd->write_timeout_us);
+    }
+
+    if (state != SD_RESPONSE_NO_ERROR)
+        SD_Async_Finish(engine, state, 0);
+}
+
+/**
+ * @brief  Pop the next request and send its command
+ */
+static void SD_Async_Start(SD_Async *engine)
+{
+    SD_Request *request = engine->queue[engine->tail];
+
+    engine->tail = (engine->tail + 1) % SD_ASYNC_QUEUE_SIZE;
+    engine->count--;
+
+    engine->current = request;
+    engine->done = 0;
+    engine->retries = 0;
+    request->status = SD_REQUEST_ACTIVE;
+
+    if (request->count == 0)
+    {
+        request->error = SD_RESPONSE_NO_ERROR;
+        request->status = SD_REQUEST_DONE;
+        engine->current = NULL;
+        if (request->Complete)
+            request->Complete(request);
+        return;
+    }
+
+    SD_Bus_Hold(engine->sd);
+    SD_Async_Issue(engine);
+}
+
+static void SD_Async_StartDMA(SD_Async *engine, HAL_StatusTypeDef status)
+{
+    if (status != HAL_OK)
+    {
+        engine->dma_busy = 0;
+        SD_Async_Finish(engine, SD_RESPONSE_FAILURE, engine->current->count > 1);
+        return;
+    }
+
+    /* 12.5 ms at 328 kHz: the slowest clocks are the ones a bad bus ends on */
+    SD_Async_Wait(engine, (uint32_t) ((uint64_t) SD_BLOCK_SIZE * 8 * 1000000 / engine->sd->clock)
+            + SD_ASYNC_DMA_MARGIN_US);
+}
+
+static void SD_Async_Step(SD_Async *engine)
+{
+    SD_SPI_Handle *sd = engine->sd;
+    SD_Request *request = engine->current;
+    uint8_t *block = request->buffer + engine->done * SD_BLOCK_SIZE;
+    uint8_t multi = request->count > 1;
+    uint16_t crc;
+    uint8_t b;
+
+    switch (engine->state)
+    {
+    case SD_ASYNC_IDLE:
+        break;
+
+    case SD_ASYNC_READ_TOKEN:
+        b = SD_Async_WaitToken(engine);
+        if (b == SD_DATA_BLOCK_READ_START)
+        {
+            engine->dma_busy = 1;
+            engine->state = SD_ASYNC_READ_DATA;
+            SD_Async_StartDMA(engine,
+                    HAL_SPI_TransmitReceive_DMA(sd->init.hspi, sd_async_ones, block, SD_BLOCK_SIZE));
+        }
+        else if (b != 0xFF)
+            SD_Async_Finish(engine, SD_RESPONSE_DATA_ERROR, multi);
+        else if (SD_Async_Expired(engine))
+            SD_Async_Finish(engine, SD_RESPONSE_FAILURE, multi);
+        break;
+
+    case SD_ASYNC_READ_DATA:
+        if (engine->dma_busy)
+        {
+            if (SD_Async_Expired(engine))
+            {
+                HAL_SPI_Abort(sd->init.hspi);
+                engine->dma_busy = 0;
+                SD_Async_Finish(engine, SD_RESPONSE_FAILURE, multi);
+            }
+            break;
+        }
+
+        crc = SD_ReadByte(sd) << 8;
+        crc |= SD_ReadByte(sd);
+        if (sd->crc_on && crc != SD_CRC16(0, block, SD_BLOCK_SIZE))
+        {
+            sd->crc_errors++;
+            SD_Async_Finish(engine, SD_RESPONSE_DATA_ERROR, multi);
+            break;
+        }
+
+        if (++engine->done < request->count)
+        {
+            engine->state = SD_ASYNC_READ_TOKEN;
+            SD_Async_Wait(engine, engine->sd->read_timeout_us);
+            break;
+        }
+
+        if (multi)
+            SD_SendCmd(sd, SD_CMD_STOP_TRANSMISSION, 0x00000000);
+        engine->state = SD_ASYNC_STOP_BUSY;
+        SD_Async_Wait(engine, engine->sd->read_timeout_us);
+        break;
+
+    case SD_ASYNC_WRITE_READY:
+        /* before the first block this is the >= 1 byte gap after R1 */
+        if (!SD_Async_WaitNotBusy(engine))
+        {
+            if (SD_Async_Expired(engine))
+                SD_Async_Finish(engine, SD_RESPONSE_FAILURE, multi);
+            break;
+        }
+
+        if (engine->done == request->count)
+        { /* multiple block write: every block is programmed, send the stop token */
+            SD_WriteByte(sd, SD_DATA_MULTIPLE_BLOCK_WRITE_STOP);
+            SD_ReadByte(sd); /* one byte before the card signals busy */
+            engine->state = SD_ASYNC_STOP_BUSY;
+            SD_Async_Wait(engine, engine->sd->write_timeout_us);
+            break;
+        }
+
+        SD_WriteByte(sd, multi ? SD_DATA_MULTIPLE_BLOCK_WRITE_START : SD_DATA_SINGLE_BLOCK_WRITE_START);
+        engine->dma_busy = 1;
+        engine->state = SD_ASYNC_WRITE_DATA;
+        SD_Async_StartDMA(engine, HAL_SPI_Transmit_DMA(sd->init.hspi, block, SD_BLOCK_SIZE));
+        break;
+
+    case SD_ASYNC_WRITE_DATA:
+        if (engine->dma_busy)
+        {
+            if (SD_Async_Expired(engine))
+            {
+                HAL_SPI_Abort(sd->init.hspi);
+                engine->dma_busy = 0;
+                SD_Async_Finish(engine, SD_RESPONSE_FAILURE, multi);
+            }
+            break;
+        }
+
+        crc = SD_CRC16(0, block, SD_BLOCK_SIZE);
+        SD_WriteByte(sd, crc >> 8);
+        SD_WriteByte(sd, crc);
+
+        b = SD_ReadByte(sd) & SD_RESPONSE_MASK;
+        if (b != SD_RESPONSE_ACCEPTED)
+        {
+            if (b == SD_RESPONSE_REJECTED_CRC)
+                sd->crc_errors++;
+            SD_Async_Finish(engine, (b == SD_RESPONSE_REJECTED_CRC) ? SD_RESPONSE_DATA_ERROR : SD_RESPONSE_FAILURE,
+                    multi);
+            break;
+        }
+
+        /* the card is now busy programming the block */
+        engine->done++;
+        engine->state = multi ? SD_ASYNC_WRITE_READY : SD_ASYNC_STOP_BUSY;
+        SD_Async_Wait(engine, engine->sd->write_timeout_us);
+        break;
+
+    case SD_ASYNC_RETRY:
+        if (SD_Async_WaitNotBusy(engine))
+            SD_Async_Issue(engine);
+        else if (SD_Async_Expired(engine))
+            SD_Async_Finish(engine, SD_RESPONSE_FAILURE, 0);
+        break;
+
+    case SD_ASYNC_STOP_BUSY:
+        if (SD_Async_WaitNotBusy(engine))
+            SD_Async_Finish(engine, SD_RESPONSE_NO_ERROR, 0);
+        else if (SD_Async_Expired(engine))
+            SD_Async_Finish(engine, SD_RESPONSE_FAILURE, 0);
+        break;
+    }
+}
+
+static SD_Error SD_Async_Queue(SD_Async *engine, SD_Request *request, SD_RequestType type, uint32_t sector,
+        uint32_t count, uint8_t *buffer)
+{
+    if (engine->count >= SD_ASYNC_QUEUE_SIZE)
+        return SD_RESPONSE_FAILURE;
+
+    request->type = type;
+    request->sector = sector;
+    request->count = count;
+    request->buffer = buffer;
+    request->error = SD_RESPONSE_NO_ERROR;
+    request->status = SD_REQUEST_QUEUED;
+
+    engine->queue[engine->head] = request;
+    engine->head = (engine->head + 1) % SD_ASYNC_QUEUE_SIZE;
+    engine->count++;
+
+    return SD_RESPONSE_NO_ERROR;
+}
+
+void SD_Async_Init(SD_Async *engine, SD_SPI_Handle *sd)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->sd = sd;
+    engine->state = SD_ASYNC_IDLE;
+
+    memset(sd_async_ones, SD_DUMMY_BYTE, sizeof(sd_async_ones));
+}
+
+SD_Error SD_Async_Read(SD_Async *engine, SD_Request *request, uint32_t sector, uint32_t count, uint8_t *buffer)
+{
+    return SD_Async_Queue(engine, request, SD_REQUEST_READ, sector, count, buffer);
+}
+
+SD_Error SD_Async_Write(SD_Async *engine, SD_Request *request, uint32_t sector, uint32_t count, const uint8_t *buffer)
+{
+    return SD_Async_Queue(engine, request, SD_REQUEST_WRITE, sector, count, (uint8_t*) buffer);
+}
+
+void SD_Async_Poll(SD_Async *engine)
+{
+    if (engine->current == NULL && engine->count > 0)
+        SD_Async_Start(engine);
+
+    if (engine->current != NULL)
+        SD_Async_Step(engine);
+}
+
+uint8_t SD_Async_IsIdle(SD_Async *engine)
+{
+    return engine->current == NULL && engine->count == 0;
+}
+
+void SD_Async_TransferComplete(SD_Async *engine, SPI_HandleTypeDef *hspi)
+{
+    if (engine->sd != NULL && hspi == engine->sd->init.hspi)
+        engine->dma_busy = 0;
+}
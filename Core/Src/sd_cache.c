@@ -0,0 +1,222 @@
+/*
+ * sd_cache.c
+ */
+
+#include "sd_cache.h"
+
+#include <string.h>
+
+static void SD_Cache_Touch(SD_Cache *cache, SD_CacheLine *line)
+{
+    line->used = ++cache->stamp;
+}
+
+static SD_Error SD_Cache_WriteBack(SD_Cache *cache, int index)
+{
+    SD_CacheLine *line = &cache->lines[index];
+    SD_Error state = SD_SectorWrite(cache->sd, line->sector, cache->data[index]);
+
+    if (state == SD_RESPONSE_NO_ERROR)
+    {
+        line->dirty = 0;
+        cache->stats.writebacks++;
+        cache->stats.write_runs++;
+    }
+
+    return state;
+}
+
+/**
+ * @brief  Find the line holding sector, or make room for it in its set
+ * @param  load: read the sector from the card on a miss
+ * @param  index: line index
+ */
+static SD_Error SD_Cache_Lookup(SD_Cache *cache, uint32_t sector, uint8_t load, int *index)
+{
+    int first = (sector % SD_CACHE_SETS) * SD_CACHE_WAYS;
+    int victim = first;
+    SD_CacheLine *line;
+    SD_Error state;
+
+    for (int i = first; i < first + SD_CACHE_WAYS; i++)
+    {
+        line = &cache->lines[i];
+        if (line->valid && line->sector == sector)
+        {
+            cache->stats.hits++;
+            SD_Cache_Touch(cache, line);
+            *index = i;
+            return SD_RESPONSE_NO_ERROR;
+        }
+
+        /* an empty way first, then the least recently used one */
+        if (cache->lines[victim].valid && (!line->valid || line->used < cache->lines[victim].used))
+            victim = i;
+    }
+
+    cache->stats.misses++;
+    line = &cache->lines[victim];
+
+    if (line->valid)
+    {
+        if (line->dirty)
+        {
+            state = SD_Cache_WriteBack(cache, victim);
+            if (state != SD_RESPONSE_NO_ERROR)
+                return state;
+        }
+        cache->stats.evictions++;
+        line->valid = 0;
+    }
+
+    if (load)
+    {
+        state = SD_SectorRead(cache->sd, sector, cache->data[victim]);
+        if (state != SD_RESPONSE_NO_ERROR)
+            return state;
+    }
+
+    line->sector = sector;
+    line->valid = 1;
+    line->dirty = 0;
+    SD_Cache_Touch(cache, line);
+    *index = victim;
+    return SD_RESPONSE_NO_ERROR;
+}
+
+void SD_Cache_Init(SD_Cache *cache, SD_SPI_Handle *sd)
+{
+    memset(cache->lines, 0, sizeof(cache->lines));
+    memset(&cache->stats, 0, sizeof(cache->stats));
+    cache->stamp = 0;
+    cache->sd = sd;
+}
+
+SD_Error SD_Cache_Read(SD_Cache *cache, uint32_t sector, uint8_t *pBuffer)
+{
+    int index;
+    SD_Error state = SD_Cache_Lookup(cache, sector, 1, &index);
+
+    if (state == SD_RESPONSE_NO_ERROR)
+        memcpy(pBuffer, cache->data[index], SD_BLOCK_SIZE);
+
+    return state;
+}
+
+SD_Error SD_Cache_Write(SD_Cache *cache, uint32_t sector, const uint8_t *pBuffer)
+{
+    int index;
+    /* the whole sector is replaced, no need to read it on a miss */
+    SD_Error state = SD_Cache_Lookup(cache, sector, 0, &index);
+
+    if (state == SD_RESPONSE_NO_ERROR)
+    {
+        memcpy(cache->data[index], pBuffer, SD_BLOCK_SIZE);
+        cache->lines[index].dirty = 1;
+    }
+
+    return state;
+}
+
+SD_Error SD_Cache_Get(SD_Cache *cache, uint32_t sector, uint8_t **data)
+{
+    int index;
+    SD_Error state = SD_Cache_Lookup(cache, sector, 1, &index);
+
+    *data = (state == SD_RESPONSE_NO_ERROR) ? cache->data[index] : NULL;
+    return state;
+}
+
+void SD_Cache_MarkDirty(SD_Cache *cache, uint32_t sector)
+{
+    int first = (sector % SD_CACHE_SETS) * SD_CACHE_WAYS;
+
+    for (int i = first; i < first + SD_CACHE_WAYS; i++)
+    {
+        if (cache->lines[i].valid && cache->lines[i].sector == sector)
+            cache->lines[i].dirty = 1;
+    }
+}
+
+SD_Error SD_Cache_Flush(SD_Cache *cache)
+{
+    uint16_t order[SD_CACHE_LINES];
+    int count = 0;
+    SD_Error result = SD_RESPONSE_NO_ERROR;
+
+    /* dirty lines sorted by sector (insertion sort, a handful of lines) */
+    for (int i = 0; i < SD_CACHE_LINES; i++)
+    {
+        int j;
+
+        if (!cache->lines[i].valid || !cache->lines[i].dirty)
+            continue;
+
+        for (j = count; j > 0 && cache->lines[order[j - 1]].sector > cache->lines[i].sector; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        count++;
+    }
+
+    for (int start = 0; start < count;)
+    {
+        int end = start + 1;
+        SD_Error state;
+
+        while (end < count && cache->lines[order[end]].sector == cache->lines[order[end - 1]].sector + 1)
+            end++;
+
+        if (end - start == 1)
+            state = SD_Cache_WriteBack(cache, order[start]);
+        else
+        {
+            int i;
+
+            state = SD_WriteStreamStart(cache->sd, cache->lines[order[start]].sector, end - start);
+            if (state == SD_RESPONSE_NO_ERROR)
+            {
+                SD_Error stop;
+
+                for (i = start; i < end && state == SD_RESPONSE_NO_ERROR; i++)
+                    state = SD_WriteStreamNext(cache->sd, cache->data[order[i]]);
+
+                stop = SD_WriteStreamStop(cache->sd);
+                if (state == SD_RESPONSE_NO_ERROR)
+                    state = stop;
+            }
+
+            if (state == SD_RESPONSE_NO_ERROR)
+            {
+                for (i = start; i < end; i++)
+                    cache->lines[order[i]].dirty = 0;
+                cache->stats.writebacks += end - start;
+                cache->stats.write_runs++;
+            }
+        }
+
+        /* keep going, the lines that failed stay dirty */
+        if (state != SD_RESPONSE_NO_ERROR)
+            result = state;
+
+        start = end;
+    }
+
+    return result;
+}
+
+void SD_Cache_Invalidate(SD_Cache *cache)
+{
+    for (int i = 0; i < SD_CACHE_LINES; i++)
+    {
+        cache->lines[i].valid = 0;
+        cache->lines[i].dirty = 0;
+    }
+}
+
+void SD_Cache_GetStats(SD_Cache *cache, SD_CacheStats *stats, uint8_t reset)
+{
+    *stats = cache->stats;
+
+    if (reset)
+        memset(&cache->stats, 0, sizeof(cache->stats));
+}
@@ -0,0 +1,333 @@
+/*
+ * sd_log.c
+ */
+
+#include "sd_log.h"
+#include "sd_crc.h"
+
+#include <string.h>
+
+#define SD_LOG_MAGIC     0x474F4C53 /* "SLOG" */
+#define SD_LOG_NO_SECTOR 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t seq;
+    uint16_t used;
+    uint16_t count;
+    uint16_t data_crc;
+} SD_LogHeader;
+
+static uint16_t SD_Log_Load16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t SD_Log_Load32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void SD_Log_Store16(uint8_t *p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void SD_Log_Store32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/* CRC16-CCITT with init 0xFFFF, unlike the SD data blocks */
+static uint16_t SD_Log_Crc16(const uint8_t *data, uint32_t len)
+{
+    return SD_CRC16(0xFFFF, data, len);
+}
+
+static uint32_t SD_Log_SlotSector(SD_Log *log, uint32_t seq)
+{
+    return log->start + (seq % log->segments) * SD_LOG_SEGMENT_SECTORS;
+}
+
+static uint8_t SD_Log_ParseHeader(const uint8_t *p, SD_LogHeader *header)
+{
+    if (SD_Log_Load32(&p[0]) != SD_LOG_MAGIC
+            || SD_Log_Load16(&p[14]) != SD_Log_Crc16(p, SD_LOG_HEADER_SIZE - 2))
+        return 0;
+
+    header->seq = SD_Log_Load32(&p[4]);
+    header->used = SD_Log_Load16(&p[8]);
+    header->count = SD_Log_Load16(&p[10]);
+    header->data_crc = SD_Log_Load16(&p[12]);
+
+    return header->used <= SD_LOG_SEGMENT_SIZE - SD_LOG_HEADER_SIZE;
+}
+
+/**
+ * @brief  Read the header of a slot (into the segment buffer)
+ * @retval 1 if it is a valid header written for this slot
+ */
+static uint8_t SD_Log_ReadSlot(SD_Log *log, uint32_t slot, SD_LogHeader *header, SD_LogResult *res)
+{
+    if (SD_SectorRead(log->sd, log->start + slot * SD_LOG_SEGMENT_SECTORS, log->segment) != SD_RESPONSE_NO_ERROR)
+    {
+        *res = SD_LOG_DISK_ERROR;
+        return 0;
+    }
+
+    return SD_Log_ParseHeader(log->segment, header) && header->seq % log->segments == slot;
+}
+
+static void SD_Log_Reset(SD_Log *log, SD_SPI_Handle *sd, uint32_t start, uint32_t segments)
+{
+    log->sd = sd;
+    log->start = start;
+    log->segments = segments;
+    log->next_seq = 0;
+    log->oldest_seq = 0;
+    log->used = 0;
+    log->count = 0;
+}
+
+/* The slot of next_seq is the one overwritten next, it is not counted */
+static void SD_Log_UpdateOldest(SD_Log *log)
+{
+    log->oldest_seq = (log->next_seq >= log->segments) ? log->next_seq - log->segments + 1 : 0;
+}
+
+SD_LogResult SD_Log_Format(SD_Log *log, SD_SPI_Handle *sd, uint32_t start, uint32_t segments)
+{
+    SD_Log_Reset(log, sd, start, segments);
+    memset(log->segment, 0, SD_BLOCK_SIZE);
+
+    for (uint32_t i = 0; i < segments; i++)
+    {
+        if (SD_SectorWrite(sd, start + i * SD_LOG_SEGMENT_SECTORS, log->segment) != SD_RESPONSE_NO_ERROR)
+            return SD_LOG_DISK_ERROR;
+    }
+
+    return SD_LOG_OK;
+}
+
+SD_LogResult SD_Log_Mount(SD_Log *log, SD_SPI_Handle *sd, uint32_t start, uint32_t segments)
+{
+    SD_LogResult res = SD_LOG_OK;
+    SD_LogHeader header;
+    uint32_t head, first;
+    uint32_t sectors;
+
+    SD_Log_Reset(log, sd, start, segments);
+
+    if (SD_Log_ReadSlot(log, 0, &header, &res))
+    { /* slots 0..head hold first, first + 1, ... find the last one (log2(segments) reads) */
+        uint32_t lo = 0, hi = segments;
+
+        first = header.seq;
+        while (hi - lo > 1)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+
+            if (SD_Log_ReadSlot(log, mid, &header, &res) && header.seq == first + mid)
+                lo = mid;
+            else if (res != SD_LOG_OK)
+                return res;
+            else
+                hi = mid;
+        }
+        head = first + lo;
+    }
+    else if (res != SD_LOG_OK)
+        return res;
+    else if (SD_Log_ReadSlot(log, segments - 1, &header, &res))
+        head = header.seq; /* slot 0 torn while starting a new lap */
+    else
+        return res; /* empty */
+
+    /* only the head can be torn, check its data */
+    if (!SD_Log_ReadSlot(log, head % segments, &header, &res))
+        return (res != SD_LOG_OK) ? res : SD_LOG_DISK_ERROR;
+
+    sectors = (SD_LOG_HEADER_SIZE + header.used + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    if (sectors > 1 && SD_SectorsRead(sd, SD_Log_SlotSector(log, head) + 1, sectors - 1,
+            &log->segment[SD_BLOCK_SIZE]) != SD_RESPONSE_NO_ERROR)
+        return SD_LOG_DISK_ERROR;
+
+    if (SD_Log_Crc16(&log->segment[SD_LOG_HEADER_SIZE], header.used) == header.data_crc)
+        log->next_seq = head + 1;
+    else
+        log->next_seq = head;
+
+    SD_Log_UpdateOldest(log);
+    return SD_LOG_OK;
+}
+
+SD_LogResult SD_Log_Append(SD_Log *log, const void *data, uint16_t len)
+{
+    uint8_t *record;
+    SD_LogResult res;
+
+    if (len > SD_LOG_MAX_RECORD)
+        return SD_LOG_TOO_LARGE;
+
+    if (SD_LOG_HEADER_SIZE + log->used + SD_LOG_RECORD_HEADER_SIZE + len > SD_LOG_SEGMENT_SIZE)
+    {
+        res = SD_Log_Commit(log);
+        if (res != SD_LOG_OK)
+            return res;
+    }
+
+    record = &log->segment[SD_LOG_HEADER_SIZE + log->used];
+    SD_Log_Store16(&record[0], len);
+    SD_Log_Store16(&record[2], SD_Log_Crc16(data, len));
+    memcpy(&record[SD_LOG_RECORD_HEADER_SIZE], data, len);
+
+    log->used += SD_LOG_RECORD_HEADER_SIZE + len;
+    log->count++;
+    return SD_LOG_OK;
+}
+
+SD_LogResult SD_Log_Commit(SD_Log *log)
+{
+    uint8_t *header = log->segment;
+    uint32_t sectors;
+
+    if (log->count == 0)
+        return SD_LOG_OK;
+
+    SD_Log_Store32(&header[0], SD_LOG_MAGIC);
+    SD_Log_Store32(&header[4], log->next_seq);
+    SD_Log_Store16(&header[8], log->used);
+    SD_Log_Store16(&header[10], log->count);
+    SD_Log_Store16(&header[12], SD_Log_Crc16(&header[SD_LOG_HEADER_SIZE], log->used));
+    SD_Log_Store16(&header[14], SD_Log_Crc16(header, SD_LOG_HEADER_SIZE - 2));
+
+    /* only the sectors holding records, in one CMD25 */
+    sectors = (SD_LOG_HEADER_SIZE + log->used + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+    if (SD_SectorsWrite(log->sd, SD_Log_SlotSector(log, log->next_seq), sectors, log->segment) != SD_RESPONSE_NO_ERROR)
+        return SD_LOG_DISK_ERROR;
+
+    log->next_seq++;
+    SD_Log_UpdateOldest(log);
+    log->used = 0;
+    log->count = 0;
+    return SD_LOG_OK;
+}
+
+void SD_Log_Rewind(SD_Log *log, SD_LogCursor *cursor)
+{
+    cursor->seq = log->oldest_seq;
+    cursor->offset = 0;
+    cursor->end = 0;
+    cursor->sector = SD_LOG_NO_SECTOR;
+}
+
+static SD_LogResult SD_Log_ReadBytes(SD_Log *log, SD_LogCursor *cursor, uint16_t offset, uint8_t *dst, uint16_t len)
+{
+    uint32_t base = SD_Log_SlotSector(log, cursor->seq);
+
+    while (len > 0)
+    {
+        uint32_t sector = base + offset / SD_BLOCK_SIZE;
+        uint16_t in_sector = offset % SD_BLOCK_SIZE;
+        uint16_t n = SD_BLOCK_SIZE - in_sector;
+
+        if (cursor->sector != sector)
+        {
+            if (SD_SectorRead(log->sd, sector, cursor->buffer) != SD_RESPONSE_NO_ERROR)
+            {
+                cursor->sector = SD_LOG_NO_SECTOR;
+                return SD_LOG_DISK_ERROR;
+            }
+            cursor->sector = sector;
+        }
+
+        if (n > len)
+            n = len;
+        memcpy(dst, &cursor->buffer[in_sector], n);
+
+        dst += n;
+        offset += n;
+        len -= n;
+    }
+
+    return SD_LOG_OK;
+}
+
+SD_LogResult SD_Log_Next(SD_Log *log, SD_LogCursor *cursor, void *data, uint16_t max, uint16_t *len)
+{
+    uint8_t bytes[SD_LOG_HEADER_SIZE];
+    SD_LogResult res;
+    uint16_t size;
+
+    for (;;)
+    {
+        /* records older than the ring are gone */
+        if (cursor->seq < log->oldest_seq)
+        {
+            cursor->seq = log->oldest_seq;
+            cursor->end = 0;
+        }
+
+        if (cursor->seq >= log->next_seq)
+            return SD_LOG_END;
+
+        if (cursor->end == 0)
+        {
+            SD_LogHeader header;
+
+            res = SD_Log_ReadBytes(log, cursor, 0, bytes, SD_LOG_HEADER_SIZE);
+            if (res != SD_LOG_OK)
+                return res;
+
+            if (!SD_Log_ParseHeader(bytes, &header) || header.seq != cursor->seq)
+            {
+                cursor->seq++;
+                continue;
+            }
+
+            cursor->offset = SD_LOG_HEADER_SIZE;
+            cursor->end = SD_LOG_HEADER_SIZE + header.used;
+        }
+
+        if (cursor->offset + SD_LOG_RECORD_HEADER_SIZE <= cursor->end)
+            break;
+
+        cursor->seq++;
+        cursor->end = 0;
+    }
+
+    res = SD_Log_ReadBytes(log, cursor, cursor->offset, bytes, SD_LOG_RECORD_HEADER_SIZE);
+    if (res != SD_LOG_OK)
+        return res;
+
+    size = SD_Log_Load16(&bytes[0]);
+    *len = size;
+
+    if (cursor->offset + SD_LOG_RECORD_HEADER_SIZE + size > cursor->end)
+    { /* the length is damaged, nothing else in this segment can be trusted */
+        cursor->seq++;
+        cursor->end = 0;
+        return SD_LOG_CORRUPT;
+    }
+
+    if (size > max)
+    {
+        cursor->offset += SD_LOG_RECORD_HEADER_SIZE + size;
+        return SD_LOG_TOO_LARGE;
+    }
+
+    res = SD_Log_ReadBytes(log, cursor, cursor->offset + SD_LOG_RECORD_HEADER_SIZE, data, size);
+    if (res != SD_LOG_OK)
+        return res;
+
+    cursor->offset += SD_LOG_RECORD_HEADER_SIZE + size;
+
+    if (SD_Log_Crc16(data, size) != SD_Log_Load16(&bytes[2]))
+        return SD_LOG_CORRUPT;
+
+    return SD_LOG_OK;
+}
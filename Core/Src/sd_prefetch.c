@@ -0,0 +1,160 @@
+/*
+ * sd_prefetch.c
+ */
+
+#include "sd_prefetch.h"
+
+#include <string.h>
+
+static uint8_t SD_Prefetch_Pending(SD_PrefetchBuffer *buffer)
+{
+    return buffer->request.status == SD_REQUEST_QUEUED || buffer->request.status == SD_REQUEST_ACTIVE;
+}
+
+static void SD_Prefetch_Wait(SD_Prefetch *prefetch, SD_PrefetchBuffer *buffer)
+{
+    while (SD_Prefetch_Pending(buffer))
+        SD_Async_Poll(prefetch->engine);
+}
+
+/**
+ * @brief  Release a buffer, halve the depth if part of it was never read
+ */
+static void SD_Prefetch_Drop(SD_Prefetch *prefetch, SD_PrefetchBuffer *buffer)
+{
+    if (!buffer->in_use)
+        return;
+
+    /* the engine owns the buffer until the request ends */
+    SD_Prefetch_Wait(prefetch, buffer);
+
+    if (buffer->request.status == SD_REQUEST_DONE && buffer->consumed < buffer->request.count)
+    {
+        prefetch->stats.wasted += buffer->request.count - buffer->consumed;
+        if (prefetch->depth > 1)
+            prefetch->depth >>= 1;
+    }
+
+    buffer->in_use = 0;
+}
+
+static void SD_Prefetch_Issue(SD_Prefetch *prefetch, uint32_t sector)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        SD_PrefetchBuffer *buffer = &prefetch->buffers[i];
+
+        if (buffer->in_use)
+            continue;
+
+        if (SD_Async_Read(prefetch->engine, &buffer->request, sector, prefetch->depth, buffer->data)
+                == SD_RESPONSE_NO_ERROR)
+        {
+            buffer->in_use = 1;
+            buffer->consumed = 0;
+        }
+        return;
+    }
+}
+
+/**
+ * @brief  Keep a free buffer busy with the sectors following the furthest one,
+ *         or following sector once both buffers are read
+ */
+static void SD_Prefetch_Ahead(SD_Prefetch *prefetch, uint32_t sector)
+{
+    uint32_t next = sector + 1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        SD_Request *request = &prefetch->buffers[i].request;
+
+        if (prefetch->buffers[i].in_use && request->sector + request->count > next)
+            next = request->sector + request->count;
+    }
+
+    SD_Prefetch_Issue(prefetch, next);
+}
+
+void SD_Prefetch_Init(SD_Prefetch *prefetch, SD_Async *engine)
+{
+    memset(prefetch, 0, sizeof(*prefetch));
+    prefetch->engine = engine;
+    prefetch->depth = 2;
+    prefetch->last_sector = 0xFFFFFFFF;
+}
+
+SD_Error SD_Prefetch_Read(SD_Prefetch *prefetch, uint32_t sector, uint8_t *pBuffer)
+{
+    SD_Error state;
+
+    for (int i = 0; i < 2; i++)
+    {
+        SD_PrefetchBuffer *buffer = &prefetch->buffers[i];
+        uint32_t index = sector - buffer->request.sector;
+
+        if (!buffer->in_use || sector < buffer->request.sector || index >= buffer->request.count)
+            continue;
+
+        if (SD_Prefetch_Pending(buffer))
+        { /* the consumer is faster than the read-ahead, look further next time */
+            prefetch->stats.stalls++;
+            if (prefetch->depth < SD_PREFETCH_MAX_DEPTH)
+                prefetch->depth <<= 1;
+            SD_Prefetch_Wait(prefetch, buffer);
+        }
+
+        if (buffer->request.status != SD_REQUEST_DONE)
+        {
+            buffer->in_use = 0;
+            break;
+        }
+
+        memcpy(pBuffer, &buffer->data[index * SD_BLOCK_SIZE], SD_BLOCK_SIZE);
+        prefetch->stats.hits++;
+
+        if (index + 1 > buffer->consumed)
+            buffer->consumed = index + 1;
+        if (buffer->consumed == buffer->request.count)
+            buffer->in_use = 0;
+
+        SD_Prefetch_Ahead(prefetch, sector);
+
+        prefetch->sequential = 1;
+        prefetch->last_sector = sector;
+        return SD_RESPONSE_NO_ERROR;
+    }
+
+    /* off the prefetched stream: read it directly */
+    prefetch->stats.misses++;
+    SD_Prefetch_Invalidate(prefetch);
+
+    /* the blocking read needs the card, let queued requests finish first */
+    while (!SD_Async_IsIdle(prefetch->engine))
+        SD_Async_Poll(prefetch->engine);
+
+    state = SD_SectorRead(prefetch->engine->sd, sector, pBuffer);
+
+    prefetch->sequential = (sector == prefetch->last_sector + 1);
+    prefetch->last_sector = sector;
+
+    /* second consecutive sector: start reading ahead */
+    if (state == SD_RESPONSE_NO_ERROR && prefetch->sequential)
+        SD_Prefetch_Issue(prefetch, sector + 1);
+
+    return state;
+}
+
+void SD_Prefetch_Invalidate(SD_Prefetch *prefetch)
+{
+    SD_Prefetch_Drop(prefetch, &prefetch->buffers[0]);
+    SD_Prefetch_Drop(prefetch, &prefetch->buffers[1]);
+}
+
+void SD_Prefetch_GetStats(SD_Prefetch *prefetch, SD_PrefetchStats *stats, uint8_t reset)
+{
+    *stats = prefetch->stats;
+
+    if (reset)
+        memset(&prefetch->stats, 0, sizeof(prefetch->stats));
+}
@@ -6,19 +6,10 @@
  */
 
 #include "sd_spi_driver.h"
+#include "sd_crc.h"
+#include "sd_trace.h"
 
-#include <stdio.h>
-
-/**
- * @brief  Data response sent for CMD24
- */
-typedef enum _SD_DataResponse
-{
-    SD_RESPONSE_MASK = 0x0E, /*!< any response value bits have to be masked by this */
-    SD_RESPONSE_ACCEPTED = 0x04, /*!< data accepted */
-    SD_RESPONSE_REJECTED_CRC = 0x0A, /*!< data rejected due to CRC error */
-    SD_RESPONSE_REJECTED_ERR = 0x0C /*!< data rejected due to write error */
-} SD_DataResponse;
+#include <string.h>
 
 /**
  * @brief  Data response error
@@ -34,69 +25,9 @@ typedef enum _SD_DataError
 } SD_DataError;
 
 /**
- * @brief  Commands: CMDxx = CMD-number | 0x40
+ * @brief  Bytes of 0xFF sent with CS high before CMD0: at least 74 clocks
  */
-/*
- class 0 (basic):
- CMD0        CMD2        CMD3        CMD4
- CMD7        CMD8        CMD9        CMD10
- CMD11       CMD12       CMD13       CMD15
- class 2 (block read):
- CMD16       CMD17       CMD18       CMD19       CMD20       CMD23
- class 4 (block write):
- CMD16       CMD20       CMD23       CMD24       CMD25       CMD27
- class 5 (erase):
- CMD32       CMD33       CMD38
- class 6 (write protection):
- CMD28       CMD29       CMD30
- class 7 (lock card):
- CMD16       CMD40       CMD42
- class 8 (application-specific):
- CMD55       CMD56
- ACMD6       ACMD13  ACMD22  ACMD23  ACMD41  ACMD42  ACMD51
- class 9 (I/O mode):
- CMD5        CMD52       CMD53
- class 10 (switch):
- CMD6        CMD34       CMD35       CMD36       CMD37       CMD50       CMD57
- all other classes are reserved
- */
-typedef enum _SD_CMD
-{
-    SD_CMD_GO_IDLE_STATE = 0,     // CMD0  = 0x40, ARG=0x00000000, CRC=0x95
-    SD_CMD_SEND_OP_COND = 1,          // CMD1  = 0x41
-    SD_CMD_SEND_IF_COND = 8,          // CMD8  = 0x48, ARG=0x000001AA, CRC=0x87
-    SD_CMD_SEND_CSD = 9,          // CMD9  = 0x49
-    SD_CMD_SEND_CID = 10,     // CMD10 = 0x4A
-    SD_CMD_STOP_TRANSMISSION = 12,     // CMD12 = 0x4C
-    SD_CMD_SET_BLOCKLEN = 16,     // CMD16 = 0x50
-    SD_CMD_READ_SINGLE_BLOCK = 17,     // CMD17 = 0x51
-    SD_CMD_READ_MULT_BLOCK = 18,     // CMD18 = 0x52
-    SD_CMD_SET_BLOCK_COUNT = 23,     // CMD23 = 0x57
-    SD_CMD_WRITE_SINGLE_BLOCK = 24,     // CMD24 = 0x58
-    SD_CMD_WRITE_MULT_BLOCK = 25,     // CMD25 = 0x59
-    SD_CMD_ERASE_BLOCK_START = 32,     // CMD32 = 0x60
-    SD_CMD_ERASE_BLOCK_END = 33,     // CMD33 = 0x61
-    SD_CMD_ERASE = 38,     // CMD38 = 0x66
-    SD_CMD_SEND_APP = 55,     // CMD55 = 0x77, ARG=0x00000000, CRC=0x65
-    SD_CMD_READ_OCR = 58,     // CMD58 = 0x7A, ARG=0x00000000, CRC=0xFF
-} SD_CMD;
-
-typedef enum _SD_ACMD
-{
-    SD_ACMD_STATUS = 13,     // ACMD13= 0x4D
-    SD_ACMD_ACTIVATE_INIT = 41,     // ACMD41= 0x69, ARG=0x40000000, CRC=0x77
-    SD_ACMD_SEND_SCR = 51,     // ACMD51= 0x73
-} SD_ACMD;
-
-/**
- * @brief  Dummy byte
- */
-#define SD_DUMMY_BYTE       0xFF
-
-/**
- * @brief  Number of 8-bit cycles for RUMP UP phase
- */
-#define SD_NUM_TRIES_RUMPUP ((uint32_t)2500)
+#define SD_NUM_BYTES_RAMPUP 10
 
 /**
  * @brief  Maximum number of tries to send a command
@@ -104,60 +35,59 @@ typedef enum _SD_ACMD
 #define SD_NUM_TRIES        ((uint16_t)300)
 
 /**
- * @brief  Maximum number of tries until ACMD41/CMD1 initializes SD card
- * It means a time until "In Idle State" flag is set during initialization
- * For information:
- * ~ 11000 for Kingston 4Gb
- * ~ 10000 for SanDisk  1Gb
- * ~  6000 for Samsung  8Gb
+ * @brief  SPI clock limit during card identification
+ */
+#define SD_INIT_SPI_CLOCK   ((uint32_t)400000)
+
+/**
+ * @brief  Bring-up timings in ms: supply ramp-up before the first clocks, then
+ *         the time allowed to each phase (CMD0, ACMD41 / CMD1)
+ */
+#define SD_INIT_POWER_UP_MS 1
+#define SD_INIT_TIMEOUT_MS  1000
+
+/**
+ * @brief  CMD0 answers out of idle state before the card is taken as already initialised
+ */
+#define SD_INIT_READY_CHECKS 16
+
+/**
+ * @brief  Time a bring-up step waits for the card to release MISO, in us
+ */
+#define SD_INIT_READY_TIMEOUT_US ((uint32_t)10000)
+
+/**
+ * @brief  Timeout limits in us (SD spec 4.6.2). SDSC cards get 100 times the
+ *         typical access time from their CSD, up to these values; SDHC cards and
+ *         cards with an unknown CSD get these values.
+ */
+#define SD_READ_TIMEOUT_US  ((uint32_t)100000)
+#define SD_WRITE_TIMEOUT_US ((uint32_t)250000)
+
+/**
+ * @brief  Bytes sampled by SD_PollBusy before it gives the bus back
  */
-#define SD_NUM_TRIES_INIT   ((uint16_t)20000)
+#define SD_BUSY_POLL_BYTES  2
 
 /**
- * @brief  Maximum number of tries to receive data transmission token
- * It means a time before data transmission starts
- * For information:
- * ~  300 for SanDisk  1Gb
- * ~  600 for Kingston 4Gb
- * ~  900 for SP       4Gb
- * ~  500 for Samsung  8Gb
- * ~  300 for Lexar    4Gb
+ * @brief  Erase time allowed per AU when the SD status gives no erase timeout
  */
-#define SD_NUM_TRIES_READ   ((uint16_t)2000)
+#define SD_ERASE_TIMEOUT_PER_AU_US ((uint32_t)250000)
 
 /**
- * @brief  Maximum number of tries until SD card writes data
- * It means a time while BUSY flag is set, i.e. card writes the data received
- * For information:
- * ~  6100 for Kingston 4Gb
- * ~  4600 for Lexar    4Gb
- * ~ 80000 for SP       4Gb (9000)
- * ~ 10000 for SanDisk  1Gb
- * ~119000 for Samsung  8Gb
+ * @brief  AU assumed by that timeout when neither the SD status nor the CSD give one (4 MB)
  */
-#define SD_NUM_TRIES_WRITE  ((uint32_t)1000000)
+#define SD_ERASE_DEFAULT_AU_SECTORS ((uint32_t)8192)
 
 /**
- * @brief  Maximum number of tries until SD card erases data
- * It means a time while BUSY flag is set, i.e. card erases sectors
- * For information:
- * ~  6100 for Kingston 4Gb
- * ~  5200 for Lexar    4Gb
- * ~ 10300 for SP       4Gb
- * ~   N/A for SanDisk  1Gb
- * ~120000 for Samsung  8Gb
+ * @brief  Fastest SPI clock allowed in default speed mode (all cards support it)
  */
-#define SD_NUM_TRIES_ERASE  ((uint32_t)1000000)
+#define SD_MAX_SPI_CLOCK    ((uint32_t)25000000)
 
 /**
- * @brief  Start Data tokens:
- *         Tokens (necessary because at nop/idle (and CS active) only 0xff is
- *         on the data/command line)
+ * @brief  SPI prescaler steps: clock = PCLK / (2 << step), step 7 is /256
  */
-#define SD_DATA_BLOCK_READ_START           0xFE  /*!< Data token start byte, Start Single/Multiple Block Read */
-#define SD_DATA_SINGLE_BLOCK_WRITE_START   0xFE  /*!< Data token start byte, Start Single Block Write */
-#define SD_DATA_MULTIPLE_BLOCK_WRITE_START 0xFC  /*!< Data token start byte, Start Multiple Block Write */
-#define SD_DATA_MULTIPLE_BLOCK_WRITE_STOP  0xFD  /*!< Data token stop byte, Stop Multiple Block Write */
+#define SD_CLOCK_STEP_MAX   7
 
 /**
  * @brief  Write a byte on the SD.
@@ -197,32 +127,46 @@ void SD_Bus_Release(SD_SPI_Handle *sd)
  * @brief  Send a command to SD card and receive R1 response
  * @param  Cmd: Command to send to SD card
  * @param  Arg: Command argument
- * @param  Crc: CRC
  * @retval R1 response byte
  */
-static SD_Error SD_SendCmd(SD_SPI_Handle *sd, uint8_t cmd, uint32_t arg, uint8_t crc)
+SD_Error SD_SendCmd(SD_SPI_Handle *sd, uint8_t cmd, uint32_t arg)
 {
+    uint8_t frame[6];
     uint8_t res;
-    uint16_t i = SD_NUM_TRIES;
-    /* send a command */
-    SD_WriteByte(sd, (cmd & 0x3F) | 0x40); /*!< byte 1 */
-    SD_WriteByte(sd, (uint8_t) (arg >> 24)); /*!< byte 2 */
-    SD_WriteByte(sd, (uint8_t) (arg >> 16)); /*!< byte 3 */
-    SD_WriteByte(sd, (uint8_t) (arg >> 8)); /*!< byte 4 */
-    SD_WriteByte(sd, (uint8_t) arg); /*!< byte 5 */
-    SD_WriteByte(sd, crc | 0x01); /*!< byte 6: CRC */
-
-    /* a byte received immediately after CMD12 should be discarded... */
-    if (cmd == SD_CMD_STOP_TRANSMISSION)
-        SD_ReadByte(sd);
-    /* SD Card responds within Ncr (response time),
-     which is 0-8 bytes for SDSC cards, 1-8 bytes for MMC cards */
-    do
+    uint8_t retries = SD_CRC_RETRIES;
+
+    frame[0] = (cmd & 0x3F) | 0x40; /*!< byte 1 */
+    frame[1] = (uint8_t) (arg >> 24); /*!< byte 2 */
+    frame[2] = (uint8_t) (arg >> 16); /*!< byte 3 */
+    frame[3] = (uint8_t) (arg >> 8); /*!< byte 4 */
+    frame[4] = (uint8_t) arg; /*!< byte 5 */
+    frame[5] = (SD_CRC7(frame, 5) << 1) | 0x01; /*!< byte 6: CRC */
+
+    for (;;)
     {
-        res = SD_ReadByte(sd);
-        /* R1 response always starts with 7th bit set to 0 */
-    } while ((res & SD_CHECK_BIT) != 0x00 && i-- > 0);
-    return (SD_Error) res;
+        uint16_t i = SD_NUM_TRIES;
+
+        /* send a command */
+        HAL_SPI_Transmit(sd->init.hspi, frame, sizeof(frame), HAL_MAX_DELAY);
+
+        /* a byte received immediately after CMD12 should be discarded... */
+        if (cmd == SD_CMD_STOP_TRANSMISSION)
+            SD_ReadByte(sd);
+        /* SD Card responds within Ncr (response time),
+         which is 0-8 bytes for SDSC cards, 1-8 bytes for MMC cards */
+        do
+        {
+            res = SD_ReadByte(sd);
+            /* R1 response always starts with 7th bit set to 0 */
+        } while ((res & SD_CHECK_BIT) != 0x00 && i-- > 0);
+
+        /* the command was corrupted on the way, the card ignored it */
+        if ((res & (SD_CHECK_BIT | SD_COMMAND_CRC_ERROR)) != SD_COMMAND_CRC_ERROR || retries-- == 0)
+            return (SD_Error) res;
+
+        sd->crc_errors++;
+        SD_TRACE_EVENT(SD_TRACE_CRC_ERROR, cmd);
+    }
 }
 
 /**
@@ -238,19 +182,66 @@ static void SD_GetResponse4b(SD_SPI_Handle *sd, uint8_t *pres)
     pres[0] = SD_ReadByte(sd);
 }
 
+/**
+ * @brief  Add a wait to the latency statistics of its operation
+ */
+static void SD_RecordLatency(SD_SPI_Handle *sd, SD_Op op, uint32_t us, uint8_t timeout)
+{
+    SD_Latency *latency = &sd->latency[op];
+
+    latency->count++;
+    latency->last_us = us;
+    latency->total_us += us;
+    if (us > latency->max_us)
+        latency->max_us = us;
+    if (timeout)
+        latency->timeouts++;
+}
+
+/**
+ * @brief  Clock bytes out of the card until it ends the wait of op or timeout_us
+ *         elapses (DWT cycle counter): a read ends on the data token, a write
+ *         or an erase when MISO goes back high
+ * @retval The last byte received
+ */
+static uint8_t SD_TimedWait(SD_SPI_Handle *sd, SD_Op op, uint32_t timeout_us)
+{
+    uint32_t cycles_per_us = SystemCoreClock / 1000000;
+    uint64_t limit = (uint64_t) timeout_us * cycles_per_us;
+    uint64_t elapsed = 0;
+    uint32_t last = DWT->CYCCNT;
+    uint32_t now;
+    uint8_t done;
+    uint8_t b;
+
+    do
+    {
+        b = SD_ReadByte(sd);
+        done = (op == SD_OP_READ) ? (b != 0xFF) : (b == 0xFF);
+
+        /* accumulated, so waits longer than a counter wrap are timed too */
+        now = DWT->CYCCNT;
+        elapsed += now - last;
+        last = now;
+    } while (!done && elapsed < limit);
+
+    SD_RecordLatency(sd, op, (uint32_t) (elapsed / cycles_per_us), !done);
+    return b;
+}
+
 /**
  * @brief  Some commands take longer time and respond with R1b response,
- *         so we have to wait until 0xFF recieved (MISO is set to HIGH)
+ *         so we have to wait until 0xFF recieved (MISO is set to HIGH).
+ *         The card may still be programming, so the write timeout applies;
+ *         a bring-up step only waits SD_INIT_READY_TIMEOUT_US.
  * @retval Nonzero if required state wasn't recieved
  */
 static SD_Error SD_WaitReady(SD_SPI_Handle *sd)
 {
-    uint16_t i = SD_NUM_TRIES;
-    while (i-- > 0)
-    {
-        if (SD_ReadByte(sd) == 0xFF)
-            return SD_RESPONSE_NO_ERROR;
-    }
+    uint32_t timeout_us = (sd->init_phase != SD_INIT_PHASE_DONE) ? SD_INIT_READY_TIMEOUT_US : sd->write_timeout_us;
+
+    if (SD_TimedWait(sd, SD_OP_READY, timeout_us) == 0xFF)
+        return SD_RESPONSE_NO_ERROR;
     return SD_RESPONSE_FAILURE;
 }
 
@@ -260,17 +251,12 @@ static SD_Error SD_WaitReady(SD_SPI_Handle *sd)
  */
 static uint8_t SD_WaitBytesRead(SD_SPI_Handle *sd)
 {
-    uint16_t i = SD_NUM_TRIES_READ;
-    uint8_t b;
-    do
-    {
-        b = SD_ReadByte(sd);
-    } while (b == 0xFF && i-- > 0);
+    uint8_t b = SD_TimedWait(sd, SD_OP_READ, sd->read_timeout_us);
 
     if (b != 0xFF)
-        printf(" [[ READ delay %d ]] ", SD_NUM_TRIES_READ - i);
+        SD_TRACE_EVENT(SD_TRACE_READ_DELAY, sd->latency[SD_OP_READ].last_us);
     else
-        printf(" [[ READ delay was not enough ]] ");
+        SD_TRACE_EVENT(SD_TRACE_READ_TIMEOUT, sd->read_timeout_us);
 
     return b;
 }
@@ -282,39 +268,129 @@ static uint8_t SD_WaitBytesRead(SD_SPI_Handle *sd)
  */
 static SD_Error SD_WaitBytesWritten(SD_SPI_Handle *sd)
 {
-    uint32_t i = SD_NUM_TRIES_WRITE;
-    while (i-- > 0)
+    if (SD_TimedWait(sd, SD_OP_WRITE, sd->write_timeout_us) == 0xFF)
     {
-        if (SD_ReadByte(sd) == 0xFF)
-        {
-            printf(" [[ WRITE delay %lu ]] ", SD_NUM_TRIES_WRITE - i);
-            return SD_RESPONSE_NO_ERROR;
-        }
+        SD_TRACE_EVENT(SD_TRACE_WRITE_DELAY, sd->latency[SD_OP_WRITE].last_us);
+        return SD_RESPONSE_NO_ERROR;
     }
-    printf(" [[ WRITE delay was not enough ]] ");
+    SD_TRACE_EVENT(SD_TRACE_WRITE_TIMEOUT, sd->write_timeout_us);
     return SD_RESPONSE_FAILURE;
 }
 
 /**
  * @brief  Erasing data into flash takes some time and it responds with R1b response,
  *         so we have to wait until 0xFF recieved (MISO is set to HIGH)
+ * @param  timeout_us: Erase time allowed, it depends on the erased range
  * @retval Nonzero if required state wasn't recieved
  */
-static SD_Error SD_WaitBytesErased(SD_SPI_Handle *sd)
+static SD_Error SD_WaitBytesErased(SD_SPI_Handle *sd, uint32_t timeout_us)
 {
-    uint32_t i = SD_NUM_TRIES_ERASE;
-    while (i-- > 0)
+    if (SD_TimedWait(sd, SD_OP_ERASE, timeout_us) == 0xFF)
     {
-        if (SD_ReadByte(sd) == 0xFF)
-        {
-            printf(" [[ ERASE delay %lu ]] ", SD_NUM_TRIES_ERASE - i);
-            return SD_RESPONSE_NO_ERROR;
-        }
+        SD_TRACE_EVENT(SD_TRACE_ERASE_DELAY, sd->latency[SD_OP_ERASE].last_us);
+        return SD_RESPONSE_NO_ERROR;
     }
-    printf(" [[ ERASE delay was not enough ]] ");
+    SD_TRACE_EVENT(SD_TRACE_ERASE_TIMEOUT, timeout_us);
     return SD_RESPONSE_FAILURE;
 }
 
+/**
+ * @brief  Clock len bytes out of the card (MOSI held high) straight into data.
+ *         Register level with 16-bit frames: one frame in flight, so an interrupt
+ *         can delay the loop without causing an overrun. The CRC of a word is
+ *         computed while the next one is on the wire.
+ * @param  data: Pre-allocated data buffer
+ * @param  len: Number of bytes to receive
+ * @retval CRC16 of the received bytes
+ */
+static uint16_t SD_ReceiveBlock(SD_SPI_Handle *sd, uint8_t *data, uint16_t len)
+{
+    SPI_HandleTypeDef *hspi = sd->init.hspi;
+    SPI_TypeDef *spi = hspi->Instance;
+    uint16_t words = len >> 1;
+    uint16_t crc = 0;
+    uint16_t w;
+
+    /* the frame format can only change while the SPI is disabled */
+    __HAL_SPI_DISABLE(hspi);
+    SET_BIT(spi->CR1, SPI_CR1_DFF);
+    __HAL_SPI_ENABLE(hspi);
+    __HAL_SPI_CLEAR_OVRFLAG(hspi);
+
+    if (words > 0)
+        spi->DR = 0xFFFF;
+
+    while (words-- > 0)
+    {
+        while ((spi->SR & SPI_SR_RXNE) == 0)
+            ;
+        w = spi->DR;
+        if (words > 0)
+            spi->DR = 0xFFFF;
+
+        *data++ = w >> 8; /* MSB first on the wire */
+        *data++ = w;
+        crc = SD_CRC16_Byte(crc, w >> 8);
+        crc = SD_CRC16_Byte(crc, w);
+    }
+
+    while ((spi->SR & SPI_SR_BSY) != 0)
+        ;
+    __HAL_SPI_DISABLE(hspi);
+    CLEAR_BIT(spi->CR1, SPI_CR1_DFF);
+    __HAL_SPI_ENABLE(hspi);
+
+    if (len & 1)
+    {
+        *data = SD_ReadByte(sd);
+        crc = SD_CRC16_Byte(crc, *data);
+    }
+
+    return crc;
+}
+
+/**
+ * @brief  Send a data block followed by its CRC16. Register level with 16-bit
+ *         frames: the CRC of a word is computed while it is on the wire.
+ * @param  data: SD_BLOCK_SIZE bytes
+ * @retval None
+ */
+static void SD_TransmitBlock(SD_SPI_Handle *sd, const uint8_t *data)
+{
+    SPI_HandleTypeDef *hspi = sd->init.hspi;
+    SPI_TypeDef *spi = hspi->Instance;
+    uint16_t crc = 0;
+
+    __HAL_SPI_DISABLE(hspi);
+    SET_BIT(spi->CR1, SPI_CR1_DFF);
+    __HAL_SPI_ENABLE(hspi);
+
+    for (uint16_t i = 0; i < SD_BLOCK_SIZE; i += 2)
+    {
+        while ((spi->SR & SPI_SR_TXE) == 0)
+            ;
+        spi->DR = (data[i] << 8) | data[i + 1]; /* MSB first on the wire */
+
+        crc = SD_CRC16_Byte(crc, data[i]);
+        crc = SD_CRC16_Byte(crc, data[i + 1]);
+    }
+
+    while ((spi->SR & SPI_SR_TXE) == 0)
+        ;
+    spi->DR = crc;
+
+    while ((spi->SR & SPI_SR_TXE) == 0)
+        ;
+    while ((spi->SR & SPI_SR_BSY) != 0)
+        ;
+    /* nothing was read back */
+    __HAL_SPI_CLEAR_OVRFLAG(hspi);
+
+    __HAL_SPI_DISABLE(hspi);
+    CLEAR_BIT(spi->CR1, SPI_CR1_DFF);
+    __HAL_SPI_ENABLE(hspi);
+}
+
 /**
  * @brief  Recieve data from SD Card
  * @param  data: Pre-allocated data buffer
@@ -325,21 +401,37 @@ static SD_Error SD_WaitBytesErased(SD_SPI_Handle *sd)
  */
 static SD_Error SD_ReceiveData(SD_SPI_Handle *sd, uint8_t *data, uint16_t len)
 {
-    uint16_t i = 0;
+    uint8_t crc[2];
+    uint16_t sum;
     uint8_t b;
 
     /* some cards need time before transmitting the data... */
     b = SD_WaitBytesRead(sd);
 
     if (b != SD_DATA_BLOCK_READ_START)
-        return SD_RESPONSE_FAILURE;
+        return SD_RESPONSE_DATA_ERROR;
+
+#if SD_SPI_BENCHMARK
+    uint32_t start = DWT->CYCCNT;
+#endif
 
-    for (i = 0; i < len; ++i)
-        data[i] = SD_ReadByte(sd);
+    sum = SD_ReceiveBlock(sd, data, len);
+
+#if SD_SPI_BENCHMARK
+    sd->benchmark.last_cycles = DWT->CYCCNT - start;
+    sd->benchmark.data_cycles += sd->benchmark.last_cycles;
+    sd->benchmark.data_bytes += len;
+#endif
 
     /* CRC Reading */
-    SD_ReadByte(sd);
-    SD_ReadByte(sd);
+    SD_ReceiveBlock(sd, crc, sizeof(crc));
+
+    if (sd->crc_on && sum != ((crc[0] << 8) | crc[1]))
+    {
+        sd->crc_errors++;
+        SD_TRACE_EVENT(SD_TRACE_CRC_ERROR, SD_DATA_BLOCK_READ_START);
+        return SD_RESPONSE_DATA_ERROR;
+    }
 
     return SD_RESPONSE_NO_ERROR;
 
@@ -355,7 +447,7 @@ SD_Error SD_GetCSDRegister(SD_SPI_Handle *sd, SD_CSD *SD_csd)
         return SD_RESPONSE_FAILURE;
 
     /* request CSD register (send CMD9)... */
-    state = SD_SendCmd(sd, SD_CMD_SEND_CSD, 0x00000000, 0xFF);
+    state = SD_SendCmd(sd, SD_CMD_SEND_CSD, 0x00000000);
     if (state != SD_RESPONSE_NO_ERROR)
         return SD_RESPONSE_FAILURE;
     state = SD_ReceiveData(sd, CSD_Tab, 16); /* receive CSD register data */
@@ -429,7 +521,7 @@ SD_Error SD_GetCIDRegister(SD_SPI_Handle *sd, SD_CID *SD_cid)
         return SD_RESPONSE_FAILURE;
 
     /* request CID register (send CMD10)... */
-    state = SD_SendCmd(sd, SD_CMD_SEND_CID, 0x00000000, 0xFF);
+    state = SD_SendCmd(sd, SD_CMD_SEND_CID, 0x00000000);
     if (state != SD_RESPONSE_NO_ERROR)
         return SD_RESPONSE_FAILURE;
     state = SD_ReceiveData(sd, CID_Tab, 16); /* receive CID register data */
@@ -463,7 +555,7 @@ SD_Error SD_GetSCRRegister(SD_SPI_Handle *sd, SD_SCR *SD_scr)
 
     if (sd->card_type == SD_Card_MMC)
     {
-        printf("SCR Register is not available for MMC cards\n");
+        SD_TRACE_EVENT(SD_TRACE_SCR_MMC, 0); /* SCR Register is not available for MMC cards */
         return SD_ILLEGAL_COMMAND;
     }
 
@@ -472,9 +564,9 @@ SD_Error SD_GetSCRRegister(SD_SPI_Handle *sd, SD_SCR *SD_scr)
         return SD_RESPONSE_FAILURE;
 
     /* request SCR register (send ACMD51)... */
-    state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00000000, 0x65);
+    state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00000000);
     if (state == SD_RESPONSE_NO_ERROR)
-        state = SD_SendCmd(sd, SD_ACMD_SEND_SCR, 0x00000000, 0xFF);
+        state = SD_SendCmd(sd, SD_ACMD_SEND_SCR, 0x00000000);
     if (state != SD_RESPONSE_NO_ERROR)
         return SD_RESPONSE_FAILURE;
     state = SD_ReceiveData(sd, SCR_Tab, 8); /* receive SCR register data */
@@ -499,231 +591,502 @@ SD_Error SD_GetSCRRegister(SD_SPI_Handle *sd, SD_SCR *SD_scr)
 }
 
 /**
- * @brief  Put SD in Idle state.
- * @param  None
- * @retval The SD init result
+ * @brief  Set SD Card sector size to SD_CMD_SET_BLOCKLEN (512 bytes)
+ * @param  New sector size
+ * @retval The SD Response:
+ *         - SD_RESPONSE_FAILURE: Sequence failed
+ *         - SD_RESPONSE_NO_ERROR: Sequence succeed
  */
-static SD_InitResult SD_GoIdleState(SD_SPI_Handle *sd)
+static SD_Error SD_FixSectorSize(SD_SPI_Handle *sd, uint16_t ssize)
 {
-    uint32_t res = 0;
-    uint8_t state;
-    uint32_t start_time;
-
-    SD_Bus_Hold(sd);
+    return SD_SendCmd(sd, SD_CMD_SET_BLOCKLEN, (uint32_t) ssize);
+}
 
-    state = SD_WaitReady(sd);
+/**
+ * @brief  Decode TRAN_SPEED (CSD byte 3) to Hz
+ */
+static uint32_t SD_TranSpeedToHz(uint8_t tran_speed)
+{
+    /* time value x10 (bits 6:3) and rate unit / 10 (bits 2:0: 100 kbit/s .. 100 Mbit/s) */
+    static const uint8_t values[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    static const uint32_t units[4] = { 10000, 100000, 1000000, 10000000 };
 
-    /* Software reset */
-    uint8_t ready_check_counter = 16;
-    start_time = HAL_GetTick();
-    do
-    {
-        state = SD_SendCmd(sd, SD_CMD_GO_IDLE_STATE, 0x00000000, 0x95);          // valid CRC is mandatory here
-        if (state == 0x00 && --ready_check_counter == 0)
-        {
-            /* Check OCR */
-            /* request OCR register (send CMD58)... */
-            state = SD_SendCmd(sd, SD_CMD_READ_OCR, 0x00000000, 0xFF);
-            if (state == SD_RESPONSE_NO_ERROR)
-            { /* get OCR register (R3 response) and check its CCS (bit 30) */
-                SD_GetResponse4b(sd, (uint8_t*) &res);
-                sd->card_type = (res & 0x40000000) ? SD_Card_SDHC : SD_Card_SDSC_v2;
-            }
-            else
-                sd->card_type = SD_Card_SDSC_v2;
+    if ((tran_speed & 0x07) > 3)
+        return 0;
 
-            return SD_INIT_SUCESS;
-        }
+    return values[(tran_speed >> 3) & 0x0F] * units[tran_speed & 0x07];
+}
 
-    } while (state != SD_IN_IDLE_STATE && (HAL_GetTick() - start_time) <= 1000);
+/**
+ * @brief  Decode TAAC (CSD byte 1) to ns
+ */
+static uint32_t SD_TaacToNs(uint8_t taac)
+{
+    /* time value x10 (bits 6:3) and time unit (bits 2:0: 1 ns .. 10 ms) */
+    static const uint8_t values[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    static const uint32_t units[8] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
 
-    if (state != SD_IN_IDLE_STATE)
-        return SD_INIT_NO_CARD;
+    return values[(taac >> 3) & 0x0F] * units[taac & 0x07] / 10;
+}
 
-    state = SD_WaitReady(sd);
+/**
+ * @brief  Read and write timeouts for the current clock: the NSAC part of the
+ *         access time is counted in SPI clocks
+ */
+static void SD_UpdateTimeouts(SD_SPI_Handle *sd)
+{
+    uint32_t access_us;
 
-    /* Voltage check*/
-    state = SD_SendCmd(sd, SD_CMD_SEND_IF_COND, 0x000001AA, 0x87);          // valid CRC is mandatory here
-    if (state == SD_IN_IDLE_STATE)          // SDv2
+    if (sd->card_type == SD_Card_SDHC || sd->taac_ns == 0 || sd->clock == 0)
     {
-        SD_GetResponse4b(sd, (uint8_t*) &res);
-        if ((res & 0xFFF) != 0x01AA)
-            return SD_INIT_VOLTAGE_ERROR;
-
-        SD_WaitReady(sd);
+        sd->read_timeout_us = SD_READ_TIMEOUT_US;
+        sd->write_timeout_us = SD_WRITE_TIMEOUT_US;
+        return;
+    }
 
-        start_time = HAL_GetTick();
-        do
-        {
-            state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00, 0xFF);
+    access_us = sd->taac_ns / 1000 + (uint32_t) ((uint64_t) sd->nsac_clocks * 1000000 / sd->clock) + 1;
 
-            if (state != SD_IN_IDLE_STATE)
-                continue;
+    sd->read_timeout_us = 100 * access_us;
+    if (sd->read_timeout_us > SD_READ_TIMEOUT_US)
+        sd->read_timeout_us = SD_READ_TIMEOUT_US;
 
-            state = SD_SendCmd(sd, SD_ACMD_ACTIVATE_INIT, 0x40000000, 0xFF);
-            SD_GetResponse4b(sd, (uint8_t*) &res);
+    sd->write_timeout_us = (100 * access_us) << sd->r2w_factor;
+    if (sd->write_timeout_us > SD_WRITE_TIMEOUT_US)
+        sd->write_timeout_us = SD_WRITE_TIMEOUT_US;
+}
 
-            SD_WaitReady(sd);
-        } while ((state & SD_IN_IDLE_STATE) != 0x00 && (HAL_GetTick() - start_time) <= 1000);
+/**
+ * @brief  Clock of the SPI peripheral bus
+ */
+static uint32_t SD_SPIBusClock(SD_SPI_Handle *sd)
+{
+#if defined(SPI4)
+    if (sd->init.hspi->Instance == SPI1 || sd->init.hspi->Instance == SPI4)
+#else
+    if (sd->init.hspi->Instance == SPI1)
+#endif
+        return HAL_RCC_GetPCLK2Freq();
+
+    return HAL_RCC_GetPCLK1Freq();
+}
 
-        if ((state & SD_IN_IDLE_STATE) != 0x00)
-            return SD_INIT_APP_INIT_FAILED;
+/**
+ * @brief  Apply a prescaler step and record the resulting clock
+ * @retval HAL status of the SPI re-init, the step in use is kept on failure
+ */
+static HAL_StatusTypeDef SD_SetClockStep(SD_SPI_Handle *sd, uint8_t step)
+{
+    SPI_HandleTypeDef *hspi = sd->init.hspi;
+    uint32_t prescaler = hspi->Init.BaudRatePrescaler;
 
-        /* Check OCR */
-        /* request OCR register (send CMD58)... */
-        state = SD_SendCmd(sd, SD_CMD_READ_OCR, 0x00000000, 0xFF);
-        if (state == SD_RESPONSE_NO_ERROR)
-        { /* get OCR register (R3 response) and check its CCS (bit 30) */
-            SD_GetResponse4b(sd, (uint8_t*) &res);
-            sd->card_type = (res & 0x40000000) ? SD_Card_SDHC : SD_Card_SDSC_v2;
-        }
-        else
-            sd->card_type = SD_Card_SDSC_v2;
+    hspi->Init.BaudRatePrescaler = (uint32_t) step << SPI_CR1_BR_Pos;
+    if (HAL_SPI_Init(hspi) != HAL_OK)
+    { /* clock_step, clock and the timeouts still describe the previous prescaler */
+        hspi->Init.BaudRatePrescaler = prescaler;
+        HAL_SPI_Init(hspi);
+        return HAL_ERROR;
     }
-    else          // SDv1
-    {
-        sd->card_type = SD_Card_SDSC_v1;
 
-        start_time = HAL_GetTick();
-        do
-        {
-            state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00, 0xFF);
+    sd->clock_step = step;
+    sd->clock = SD_SPIBusClock(sd) / (2U << step);
 
-            if (state != SD_IN_IDLE_STATE)
-                continue;
+    SD_UpdateTimeouts(sd);
+    return HAL_OK;
+}
 
-            state = SD_SendCmd(sd, SD_ACMD_ACTIVATE_INIT, 0x00000000, 0xFF);
+/**
+ * @brief  Fastest prescaler step giving at most limit Hz
+ */
+static uint8_t SD_ClockStepFor(SD_SPI_Handle *sd, uint32_t limit)
+{
+    uint32_t pclk = SD_SPIBusClock(sd);
+    uint8_t step = 0;
 
-            SD_GetResponse4b(sd, (uint8_t*) &res);
+    while (step < SD_CLOCK_STEP_MAX && pclk / (2U << step) > limit)
+        step++;
 
-        } while ((state & SD_IN_IDLE_STATE) != 0x00 && (HAL_GetTick() - start_time) <= 1000);
+    return step;
+}
 
-        if ((state & SD_IN_IDLE_STATE) != 0x00)
-        {
-            do
-            {
-                state = SD_SendCmd(sd, SD_CMD_SEND_OP_COND, 0x00, 0xFF);
-                sd->card_type = SD_Card_MMC;
+/**
+ * @brief  Fastest prescaler step within the card and SPI mode limits
+ */
+static uint8_t SD_FastestClockStep(SD_SPI_Handle *sd)
+{
+    return SD_ClockStepFor(sd, sd->max_clock < SD_MAX_SPI_CLOCK ? sd->max_clock : SD_MAX_SPI_CLOCK);
+}
 
-            } while ((state & SD_IN_IDLE_STATE) != 0x00 && (HAL_GetTick() - start_time) <= 1000);
-        }
+/**
+ * @brief  Slow the SPI clock down by one step after a data error
+ * @retval 1 if the clock was lowered, 0 if it already is the slowest or the
+ *         SPI could not be set up for the next one
+ */
+static uint8_t SD_ClockStepDown(SD_SPI_Handle *sd)
+{
+    if (sd->clock_step >= SD_CLOCK_STEP_MAX)
+        return 0;
 
-        if ((state & SD_IN_IDLE_STATE) != 0x00)
-            return SD_INIT_UNKNOW_CARD;
+    return SD_SetClockStep(sd, sd->clock_step + 1) == HAL_OK;
+}
 
+/**
+ * @brief  Decide whether a transfer that ended with a data error is tried again:
+ *         first SD_CRC_RETRIES times at the same clock (a glitch), then one clock
+ *         step lower each time (a marginal bus)
+ * @param  retries: attempts left at the current clock, start with SD_CRC_RETRIES
+ * @retval 1 to try again
+ */
+static uint8_t SD_RetryDataError(SD_SPI_Handle *sd, uint8_t *retries)
+{
+    if (*retries > 0)
+    {
+        (*retries)--;
+        return 1;
     }
 
-    state = SD_WaitReady(sd);
-
-    return SD_INIT_SUCESS;
+    *retries = SD_CRC_RETRIES;
+    return SD_ClockStepDown(sd);
 }
 
 /**
- * @brief  Set SD Card sector size to SD_CMD_SET_BLOCKLEN (512 bytes)
- * @param  New sector size
- * @retval The SD Response:
- *         - SD_RESPONSE_FAILURE: Sequence failed
- *         - SD_RESPONSE_NO_ERROR: Sequence succeed
+ * @brief  Move to the next bring-up phase, its timeout starts now
  */
-static SD_Error SD_FixSectorSize(SD_SPI_Handle *sd, uint16_t ssize)
+static void SD_Init_Enter(SD_SPI_Handle *sd, SD_InitPhase phase)
 {
-    return SD_SendCmd(sd, SD_CMD_SET_BLOCKLEN, (uint32_t) ssize, 0xFF);
+    sd->init_phase = phase;
+    sd->init_tick = HAL_GetTick();
+    sd->init_tries = 0;
 }
 
-SD_InitResult SD_Init(SD_SPI_Handle *sd)
+/**
+ * @brief  End the bring-up: release the bus and switch to the data clock
+ */
+static SD_InitResult SD_Init_Finish(SD_SPI_Handle *sd, SD_InitResult result)
 {
-    SD_InitResult state;
-    uint32_t i = 0;
-
-    /* step 0:
-     * Check if SD card is present... */
-
-    /* step 1 :
-     * reduce spi baudrate.
-     */
-
-    SPI_HandleTypeDef *hspi = sd->init.hspi;
+    SD_Bus_Release(sd);
 
-    SPI_InitTypeDef spi_init_backup = hspi->Init;
+    /* fastest SPI clock the card allows, the old 64 prescaler if the CSD is unknown
+     * (the identification clock stays if the SPI cannot be set up for it) */
+    if (sd->max_clock != 0)
+        SD_SetClockStep(sd, SD_FastestClockStep(sd));
+    else
+        SD_SetClockStep(sd, SPI_BAUDRATEPRESCALER_64 >> SPI_CR1_BR_Pos);
 
-    hspi->Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
-    if (HAL_SPI_Init(hspi) != HAL_OK)
-    {
-        // TODO: Handle error
-    }
+    sd->init_phase = SD_INIT_PHASE_DONE;
+    sd->init_result = result;
+    return result;
+}
 
-    /* step 2:
-     * Card is now powered up (i.e. 1ms at least elapsed at 0.5V),
-     * Supply rump up time (set MOSI HIGH) to let voltage reach stable 2.2V at least.
-     * According to the specs it must be 74 SPI clock cycles minimum at 100-400Khz
-     * At 25Mhz it'll be 250 times more cycles => send 2500 times 0xFF byte.
-     * Chip Select pin should be set HIGH too. */
+void SD_Init_Start(SD_SPI_Handle *sd)
+{
+    /* start the cycle counter timing the card waits (and the data phase) */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    sd->max_clock = 0;
+    sd->taac_ns = 0; /* the default timeouts until the CSD is read */
+    sd->crc_on = 0;
+    sd->init_result = SD_INIT_PENDING;
+    sd->busy_poll_us = SD_BUSY_POLL_US;
+    sd->erase_sectors = 1;
+    sd->au_sectors = 0; /* SD status read again on the next erase */
+    sd->erase_size = 0;
 
     /* set SD chip select pin high */
     HAL_GPIO_WritePin(sd->init.CS_Port, sd->init.CS_Pin, GPIO_PIN_SET);
-    /* send dummy byte 0xFF (rise MOSI high for 2500*8 SPI bus clock cycles) */
-    while (i++ < SD_NUM_TRIES_RUMPUP)
-        SD_WriteByte(sd, SD_DUMMY_BYTE);
 
-    /* step 3:
-     * Put SD in SPI mode & perform soft reset */
-    state = SD_GoIdleState(sd);
-
-    /* step 4:
-     * Force sector size to SD_BLOCK_SIZE (i.e. 512 bytes) */
-    if (state == SD_INIT_SUCESS && sd->card_type != SD_Card_SDHC)
-        SD_FixSectorSize(sd, (uint16_t) SD_BLOCK_SIZE);
+    SD_Init_Enter(sd, SD_INIT_PHASE_POWER_UP);
+}
 
-    /* step 5:
-     * Release SPI bus for other devices */
-    SD_Bus_Release(sd);
+SD_InitResult SD_Init_Step(SD_SPI_Handle *sd)
+{
+    uint8_t ones[SD_NUM_BYTES_RAMPUP];
+    uint32_t elapsed = HAL_GetTick() - sd->init_tick;
+    uint32_t res = 0;
+    SD_Error state;
 
-    hspi->Init = spi_init_backup;
-    hspi->Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_64;
-    if (HAL_SPI_Init(hspi) != HAL_OK)
+    switch (sd->init_phase)
     {
-        // TODO: Handle error
-    }
+    case SD_INIT_PHASE_DONE:
+        return sd->init_result;
 
-    return state;
-}
+    case SD_INIT_PHASE_POWER_UP:
+        /* Card is powered up (i.e. 1ms at least elapsed at 0.5V), then the supply
+         * ramp up time (MOSI HIGH) lets the voltage reach 2.2V at least:
+         * 74 SPI clock cycles minimum at 100-400Khz, with CS high.
+         * Whole ms only: one more tick than the minimum. */
+        if (elapsed <= SD_INIT_POWER_UP_MS)
+            break;
 
-SD_Error SD_SectorRead(SD_SPI_Handle *sd, uint32_t readAddr, uint8_t *pBuffer)
-{
+        SD_SetClockStep(sd, SD_ClockStepFor(sd, SD_INIT_SPI_CLOCK));
 
-    SD_Error state;
+        memset(ones, SD_DUMMY_BYTE, sizeof(ones));
+        HAL_SPI_Transmit(sd->init.hspi, ones, sizeof(ones), HAL_MAX_DELAY);
 
-    /* non High Capacity cards use byte-oriented addresses */
-    if (sd->card_type != SD_Card_SDHC)
-        readAddr <<= 9;
+        /* the bus stays held until the end of the bring-up */
+        SD_Bus_Hold(sd);
+        SD_WaitReady(sd);
+        SD_Init_Enter(sd, SD_INIT_PHASE_GO_IDLE);
+        break;
 
-    SD_Bus_Hold(sd); /* hold SPI bus... */
+    case SD_INIT_PHASE_GO_IDLE:
+        /* Put SD in SPI mode & perform soft reset */
+        state = SD_SendCmd(sd, SD_CMD_GO_IDLE_STATE, 0x00000000);
+        if (state == SD_IN_IDLE_STATE)
+        {
+            SD_WaitReady(sd);
+            SD_Init_Enter(sd, SD_INIT_PHASE_IF_COND);
+        }
+        else if (state == SD_RESPONSE_NO_ERROR && ++sd->init_tries == SD_INIT_READY_CHECKS)
+        { /* the card stays out of idle state: it already is initialised */
+            sd->card_type = SD_Card_SDSC_v2;
+            SD_Init_Enter(sd, SD_INIT_PHASE_READ_OCR);
+        }
+        else if (elapsed > SD_INIT_TIMEOUT_MS)
+            return SD_Init_Finish(sd, SD_INIT_NO_CARD);
+        break;
+
+    case SD_INIT_PHASE_IF_COND:
+        /* Voltage check */
+        state = SD_SendCmd(sd, SD_CMD_SEND_IF_COND, 0x000001AA);
+        if (state == SD_IN_IDLE_STATE) // SDv2
+        {
+            SD_GetResponse4b(sd, (uint8_t*) &res);
+            if ((res & 0xFFF) != 0x01AA)
+                return SD_Init_Finish(sd, SD_INIT_VOLTAGE_ERROR);
 
-    state = SD_WaitReady(sd); /* make sure card is ready before we go further... */
+            sd->card_type = SD_Card_SDSC_v2;
+        }
+        else // SDv1
+            sd->card_type = SD_Card_SDSC_v1;
 
-    /* send CMD17 (SD_CMD_READ_SINGLE_BLOCK) to read one block */
-    state = SD_SendCmd(sd, SD_CMD_READ_SINGLE_BLOCK, readAddr, 0x00);
+        SD_WaitReady(sd);
+        SD_Init_Enter(sd, SD_INIT_PHASE_APP_INIT);
+        break;
 
-    /* receive data if command acknowledged... */
-    if (state == SD_RESPONSE_NO_ERROR)
-    {
-        /* read the block */
-        state = SD_ReceiveData(sd, pBuffer, SD_BLOCK_SIZE);
-    }
+    case SD_INIT_PHASE_APP_INIT:
+        /* ACMD41 until the card leaves idle state, HCS set for SDv2 */
+        state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00000000);
+        if (state == SD_IN_IDLE_STATE)
+            state = SD_SendCmd(sd, SD_ACMD_ACTIVATE_INIT,
+                    (sd->card_type == SD_Card_SDSC_v1) ? 0x00000000 : 0x40000000);
 
-    state = SD_WaitReady(sd);
+        if (state == SD_RESPONSE_NO_ERROR)
+            SD_Init_Enter(sd, (sd->card_type == SD_Card_SDSC_v1) ? SD_INIT_PHASE_CONFIGURE : SD_INIT_PHASE_READ_OCR);
+        else if (sd->card_type == SD_Card_SDSC_v1 && ((state & SD_ILLEGAL_COMMAND) || elapsed > SD_INIT_TIMEOUT_MS))
+            SD_Init_Enter(sd, SD_INIT_PHASE_MMC_INIT); /* no ACMD41: MMC */
+        else if (elapsed > SD_INIT_TIMEOUT_MS)
+            return SD_Init_Finish(sd, SD_INIT_APP_INIT_FAILED);
+        break;
+
+    case SD_INIT_PHASE_MMC_INIT:
+        state = SD_SendCmd(sd, SD_CMD_SEND_OP_COND, 0x00000000);
+        if (state == SD_RESPONSE_NO_ERROR)
+        {
+            sd->card_type = SD_Card_MMC;
+            SD_Init_Enter(sd, SD_INIT_PHASE_CONFIGURE);
+        }
+        else if (elapsed > SD_INIT_TIMEOUT_MS)
+            return SD_Init_Finish(sd, SD_INIT_UNKNOW_CARD);
+        break;
 
-    SD_Bus_Release(sd); /* release SPI bus... */
+    case SD_INIT_PHASE_READ_OCR:
+        /* request OCR register (send CMD58)... */
+        state = SD_SendCmd(sd, SD_CMD_READ_OCR, 0x00000000);
+        if (state == SD_RESPONSE_NO_ERROR)
+        { /* get OCR register (R3 response) and check its CCS (bit 30) */
+            SD_GetResponse4b(sd, (uint8_t*) &res);
+            sd->card_type = (res & 0x40000000) ? SD_Card_SDHC : SD_Card_SDSC_v2;
+        }
+        SD_Init_Enter(sd, SD_INIT_PHASE_CONFIGURE);
+        break;
 
-    return state;
-}
+    case SD_INIT_PHASE_CONFIGURE:
+        SD_WaitReady(sd);
 
-SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer)
-{
-    SD_Error state;
-    SD_DataResponse res;
+        /* Turn CRC checks on (CMD59), the card then rejects corrupted commands and blocks */
+#if SD_SPI_CRC
+        sd->crc_on = (SD_SendCmd(sd, SD_CMD_CRC_ON_OFF, 0x00000001) == SD_RESPONSE_NO_ERROR);
+#endif
 
-    /* non High Capacity cards use byte-oriented addresses */
+        /* Force sector size to SD_BLOCK_SIZE (i.e. 512 bytes) */
+        if (sd->card_type != SD_Card_SDHC)
+            SD_FixSectorSize(sd, (uint16_t) SD_BLOCK_SIZE);
+
+        /* Read the maximum transfer rate (TRAN_SPEED) from the CSD */
+        {
+            SD_CSD csd;
+            if (SD_GetCSDRegister(sd, &csd) == SD_RESPONSE_NO_ERROR)
+            {
+                sd->max_clock = SD_TranSpeedToHz(csd.MaxBusClkFrec);
+                sd->taac_ns = SD_TaacToNs(csd.TAAC);
+                sd->nsac_clocks = csd.NSAC * 100;
+                sd->r2w_factor = csd.WrSpeedFact;
+                if (!csd.EraseBlockEnable)
+                    sd->erase_sectors = csd.EraseSectorSize + 1;
+            }
+        }
+
+        return SD_Init_Finish(sd, SD_INIT_SUCESS);
+    }
+
+    return SD_INIT_PENDING;
+}
+
+void SD_GetLatency(SD_SPI_Handle *sd, SD_Op op, SD_Latency *stats, uint8_t reset)
+{
+    *stats = sd->latency[op];
+    stats->avg_us = (stats->count > 0) ? (uint32_t) (stats->total_us / stats->count) : 0;
+
+    if (reset)
+        memset(&sd->latency[op], 0, sizeof(sd->latency[op]));
+}
+
+SD_InitResult SD_Init(SD_SPI_Handle *sd)
+{
+    SD_InitResult state;
+
+    SD_Init_Start(sd);
+    do
+        state = SD_Init_Step(sd);
+    while (state == SD_INIT_PENDING);
+
+    return state;
+}
+
+static SD_Error SD_SectorReadOnce(SD_SPI_Handle *sd, uint32_t readAddr, uint8_t *pBuffer)
+{
+
+    SD_Error state;
+
+    /* non High Capacity cards use byte-oriented addresses */
+    if (sd->card_type != SD_Card_SDHC)
+        readAddr <<= 9;
+
+    SD_Bus_Hold(sd); /* hold SPI bus... */
+
+    state = SD_WaitReady(sd); /* make sure card is ready before we go further... */
+
+    /* send CMD17 (SD_CMD_READ_SINGLE_BLOCK) to read one block */
+    state = SD_SendCmd(sd, SD_CMD_READ_SINGLE_BLOCK, readAddr);
+
+    /* receive data if command acknowledged... */
+    if (state == SD_RESPONSE_NO_ERROR)
+    {
+        /* read the block */
+        state = SD_ReceiveData(sd, pBuffer, SD_BLOCK_SIZE);
+    }
+
+    if (SD_WaitReady(sd) != SD_RESPONSE_NO_ERROR && state == SD_RESPONSE_NO_ERROR)
+        state = SD_RESPONSE_FAILURE;
+
+    SD_Bus_Release(sd); /* release SPI bus... */
+
+    return state;
+}
+
+SD_Error SD_SectorRead(SD_SPI_Handle *sd, uint32_t readAddr, uint8_t *pBuffer)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+        state = SD_SectorReadOnce(sd, readAddr, pBuffer);
+    while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    return state;
+}
+
+SD_Error SD_ReadStreamStart(SD_SPI_Handle *sd, uint32_t readAddr)
+{
+    SD_Error state;
+
+    /* non High Capacity cards use byte-oriented addresses */
+    if (sd->card_type != SD_Card_SDHC)
+        readAddr <<= 9;
+
+    SD_Bus_Hold(sd); /* the bus stays held until SD_ReadStreamStop */
+
+    SD_WaitReady(sd);
+
+    /* send CMD18 (SD_CMD_READ_MULT_BLOCK), the card then sends blocks until CMD12 */
+    state = SD_SendCmd(sd, SD_CMD_READ_MULT_BLOCK, readAddr);
+    if (state != SD_RESPONSE_NO_ERROR)
+        SD_Bus_Release(sd);
+
+    return state;
+}
+
+SD_Error SD_ReadStreamNext(SD_SPI_Handle *sd, uint8_t *pBuffer)
+{
+    return SD_ReceiveData(sd, pBuffer, SD_BLOCK_SIZE);
+}
+
+SD_Error SD_ReadStreamStop(SD_SPI_Handle *sd)
+{
+    SD_Error state;
+
+    /* send CMD12 (SD_CMD_STOP_TRANSMISSION), R1b: wait until the card is not busy */
+    state = SD_SendCmd(sd, SD_CMD_STOP_TRANSMISSION, 0x00000000);
+    if (SD_WaitReady(sd) != SD_RESPONSE_NO_ERROR)
+        state = SD_RESPONSE_FAILURE;
+
+    SD_Bus_Release(sd);
+
+    return state;
+}
+
+static SD_Error SD_SectorsReadOnce(SD_SPI_Handle *sd, uint32_t readAddr, uint32_t count, uint8_t *pBuffer)
+{
+    SD_Error state;
+    SD_Error stop;
+
+    if (count == 0)
+        return SD_RESPONSE_NO_ERROR;
+
+    /* one sector: CMD17 costs less than CMD18 + CMD12 */
+    if (count == 1)
+        return SD_SectorReadOnce(sd, readAddr, pBuffer);
+
+    state = SD_ReadStreamStart(sd, readAddr);
+    if (state != SD_RESPONSE_NO_ERROR)
+        return state;
+
+    while (count-- > 0 && state == SD_RESPONSE_NO_ERROR)
+    {
+        state = SD_ReadStreamNext(sd, pBuffer);
+        pBuffer += SD_BLOCK_SIZE;
+    }
+
+    stop = SD_ReadStreamStop(sd);
+
+    return (state != SD_RESPONSE_NO_ERROR) ? state : stop;
+}
+
+SD_Error SD_SectorsRead(SD_SPI_Handle *sd, uint32_t readAddr, uint32_t count, uint8_t *pBuffer)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+        state = SD_SectorsReadOnce(sd, readAddr, count, pBuffer);
+    while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    return state;
+}
+
+/**
+ * @brief  Hold the bus and send one block with CMD24, the bus stays held
+ * @retval SD_RESPONSE_NO_ERROR once the card accepted the block and went busy
+ */
+static SD_Error SD_SectorWriteSend(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer)
+{
+    SD_Error state;
+    SD_DataResponse res;
+
+    /* non High Capacity cards use byte-oriented addresses */
     if (sd->card_type != SD_Card_SDHC)
         writeAddr <<= 9;
 
@@ -732,7 +1095,7 @@ SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pB
     state = SD_WaitReady(sd);
 
     /* send CMD24 (SD_CMD_WRITE_SINGLE_BLOCK) to write single block */
-    state = SD_SendCmd(sd, SD_CMD_WRITE_SINGLE_BLOCK, writeAddr, 0xFF);
+    state = SD_SendCmd(sd, SD_CMD_WRITE_SINGLE_BLOCK, writeAddr);
     if (state == SD_RESPONSE_NO_ERROR)
     { /* wait at least 8 clock cycles (send >=1 0xFF bytes) before transmission starts */
         SD_ReadByte(sd);
@@ -740,25 +1103,463 @@ SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pB
         SD_ReadByte(sd);
         /* send data token to signify the start of data transmission... */
         SD_WriteByte(sd, SD_DATA_SINGLE_BLOCK_WRITE_START); /* 0xFE */
-        /* send data... */
-
-        HAL_SPI_Transmit(sd->init.hspi, pBuffer, SD_BLOCK_SIZE, HAL_MAX_DELAY);
-
-        /* put 2 CRC bytes (not really needed by us, but required by SD) */
-        SD_WriteByte(sd, 0xFF);
-        SD_WriteByte(sd, 0xFF);
+        /* send data and its CRC... */
+        SD_TransmitBlock(sd, pBuffer);
 
         /* check data response... */
         res = (SD_DataResponse) (SD_ReadByte(sd) & SD_RESPONSE_MASK); /* mask unused bits */
-        if ((res & SD_RESPONSE_ACCEPTED) != 0)
-        { /* card is now processing data and goes to BUSY mode, wait until it finishes... */
-            state = SD_WaitBytesWritten(sd); /* make sure card is ready before we go further... */
+        if (res == SD_RESPONSE_REJECTED_CRC)
+        {
+            sd->crc_errors++;
+            SD_TRACE_EVENT(SD_TRACE_CRC_ERROR, SD_DATA_SINGLE_BLOCK_WRITE_START);
+            state = SD_RESPONSE_DATA_ERROR;
         }
-        else
+        else if (res != SD_RESPONSE_ACCEPTED)
             state = SD_RESPONSE_FAILURE;
     }
 
+    return state;
+}
+
+static SD_Error SD_SectorWriteOnce(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer)
+{
+    SD_Error state = SD_SectorWriteSend(sd, writeAddr, pBuffer);
+
+    if (state == SD_RESPONSE_NO_ERROR)
+    { /* card is now processing data and goes to BUSY mode, wait until it finishes... */
+        state = SD_WaitBytesWritten(sd); /* make sure card is ready before we go further... */
+    }
+
     SD_Bus_Release(sd); /* release SPI bus... */
 
     return state;
 }
+
+SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+        state = SD_SectorWriteOnce(sd, writeAddr, pBuffer);
+    while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    return state;
+}
+
+/**
+ * @brief  Arm a busy token, the card just went busy with op
+ */
+static void SD_BusyStart(SD_SPI_Handle *sd, SD_BusyToken *token, SD_Op op, uint32_t timeout_us)
+{
+    token->op = op;
+    token->timeout_us = timeout_us;
+    token->last = DWT->CYCCNT;
+    token->elapsed = 0;
+    token->next_poll = (uint64_t) sd->busy_poll_us * (SystemCoreClock / 1000000);
+}
+
+SD_Error SD_PollBusy(SD_SPI_Handle *sd, SD_BusyToken *token)
+{
+    uint32_t cycles_per_us = SystemCoreClock / 1000000;
+    uint32_t now = DWT->CYCCNT;
+    uint32_t elapsed_us;
+    uint8_t done = 0;
+
+    token->elapsed += now - token->last;
+    token->last = now;
+
+    if (token->elapsed < token->next_poll)
+        return SD_RESPONSE_BUSY;
+    token->next_poll = token->elapsed + (uint64_t) sd->busy_poll_us * cycles_per_us;
+
+    /* the card shows its busy state again as soon as it is selected */
+    SD_Bus_Hold(sd);
+    for (int i = 0; i < SD_BUSY_POLL_BYTES && !done; i++)
+        done = (SD_ReadByte(sd) == 0xFF);
+    SD_Bus_Release(sd);
+
+    elapsed_us = (uint32_t) (token->elapsed / cycles_per_us);
+
+    if (done)
+    {
+        SD_RecordLatency(sd, token->op, elapsed_us, 0);
+        return SD_RESPONSE_NO_ERROR;
+    }
+
+    if (elapsed_us >= token->timeout_us)
+    {
+        SD_RecordLatency(sd, token->op, elapsed_us, 1);
+        return SD_RESPONSE_FAILURE;
+    }
+
+    return SD_RESPONSE_BUSY;
+}
+
+SD_Error SD_SectorWriteBegin(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer, SD_BusyToken *token)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+    {
+        state = SD_SectorWriteSend(sd, writeAddr, pBuffer);
+        if (state != SD_RESPONSE_NO_ERROR)
+            SD_Bus_Release(sd);
+    } while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    if (state != SD_RESPONSE_NO_ERROR)
+        return state;
+
+    /* the card programs the block on its own, the bus is free meanwhile */
+    SD_BusyStart(sd, token, SD_OP_WRITE, sd->write_timeout_us);
+    SD_Bus_Release(sd);
+
+    return SD_RESPONSE_BUSY;
+}
+
+SD_Error SD_WriteStreamStart(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t preErase)
+{
+    SD_Error state;
+
+    /* non High Capacity cards use byte-oriented addresses */
+    if (sd->card_type != SD_Card_SDHC)
+        writeAddr <<= 9;
+
+    SD_Bus_Hold(sd); /* the bus stays held until SD_WriteStreamStop */
+
+    SD_WaitReady(sd);
+
+    /* ACMD23 (SD cards only): let the card pre-erase the blocks about to be written.
+     * It is only a hint, a failure does not prevent the write. */
+    if (preErase > 0 && sd->card_type != SD_Card_MMC)
+    {
+        if ((SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00) & ~SD_IN_IDLE_STATE) == SD_RESPONSE_NO_ERROR)
+            SD_SendCmd(sd, SD_ACMD_SET_WR_BLK_ERASE_COUNT, preErase & 0x007FFFFF);
+    }
+
+    /* send CMD25 (SD_CMD_WRITE_MULT_BLOCK), blocks then follow with the 0xFC token */
+    state = SD_SendCmd(sd, SD_CMD_WRITE_MULT_BLOCK, writeAddr);
+    if (state != SD_RESPONSE_NO_ERROR)
+        SD_Bus_Release(sd);
+
+    return state;
+}
+
+SD_Error SD_WriteStreamNext(SD_SPI_Handle *sd, const uint8_t *pBuffer)
+{
+    SD_DataResponse res;
+
+    /* the card is busy while it programs the previous block (at least 1 byte gap after the response) */
+    if (SD_WaitBytesWritten(sd) != SD_RESPONSE_NO_ERROR)
+        return SD_RESPONSE_FAILURE;
+
+    SD_WriteByte(sd, SD_DATA_MULTIPLE_BLOCK_WRITE_START); /* 0xFC */
+
+    SD_TransmitBlock(sd, pBuffer);
+
+    /* check data response, the card is now busy until the block is programmed */
+    res = (SD_DataResponse) (SD_ReadByte(sd) & SD_RESPONSE_MASK);
+    if (res == SD_RESPONSE_REJECTED_CRC)
+    {
+        sd->crc_errors++;
+        SD_TRACE_EVENT(SD_TRACE_CRC_ERROR, SD_DATA_MULTIPLE_BLOCK_WRITE_START);
+        return SD_RESPONSE_DATA_ERROR;
+    }
+    if (res != SD_RESPONSE_ACCEPTED)
+        return SD_RESPONSE_FAILURE;
+
+    return SD_RESPONSE_NO_ERROR;
+}
+
+SD_Error SD_WriteStreamStop(SD_SPI_Handle *sd)
+{
+    SD_Error state = SD_WaitBytesWritten(sd);
+
+    SD_WriteByte(sd, SD_DATA_MULTIPLE_BLOCK_WRITE_STOP); /* 0xFD */
+    SD_ReadByte(sd); /* one byte before the card signals busy */
+
+    /* programming of the last blocks */
+    if (SD_WaitBytesWritten(sd) != SD_RESPONSE_NO_ERROR)
+        state = SD_RESPONSE_FAILURE;
+
+    SD_Bus_Release(sd);
+
+    return state;
+}
+
+static SD_Error SD_SectorsWriteOnce(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t count, const uint8_t *pBuffer)
+{
+    SD_Error state;
+    SD_Error stop;
+
+    if (count == 0)
+        return SD_RESPONSE_NO_ERROR;
+
+    /* one sector: CMD24 has no stop token to wait for */
+    if (count == 1)
+        return SD_SectorWriteOnce(sd, writeAddr, pBuffer);
+
+    state = SD_WriteStreamStart(sd, writeAddr, count);
+    if (state != SD_RESPONSE_NO_ERROR)
+        return state;
+
+    while (count-- > 0 && state == SD_RESPONSE_NO_ERROR)
+    {
+        state = SD_WriteStreamNext(sd, pBuffer);
+        pBuffer += SD_BLOCK_SIZE;
+    }
+
+    stop = SD_WriteStreamStop(sd);
+
+    return (state != SD_RESPONSE_NO_ERROR) ? state : stop;
+}
+
+SD_Error SD_SectorsWrite(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t count, const uint8_t *pBuffer)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+        state = SD_SectorsWriteOnce(sd, writeAddr, count, pBuffer);
+    while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    return state;
+}
+
+static SD_Error SD_GetStatusOnce(SD_SPI_Handle *sd, uint8_t *Status_Tab)
+{
+    SD_Error state;
+
+    SD_Bus_Hold(sd);
+
+    SD_WaitReady(sd); /* make sure card is ready before we go further... */
+
+    /* request SD status (send ACMD13), R2 response: R1 then a second status byte */
+    state = SD_SendCmd(sd, SD_CMD_SEND_APP, 0x00000000);
+    if (state == SD_RESPONSE_NO_ERROR)
+        state = SD_SendCmd(sd, SD_ACMD_STATUS, 0x00000000);
+    if (state == SD_RESPONSE_NO_ERROR)
+    {
+        SD_ReadByte(sd);
+        state = SD_ReceiveData(sd, Status_Tab, 64); /* receive SD status data */
+    }
+
+    SD_Bus_Release(sd);
+
+    return state;
+}
+
+SD_Error SD_GetStatus(SD_SPI_Handle *sd, SD_Status *SD_status)
+{
+    SD_Error state;
+    uint8_t retries = SD_CRC_RETRIES;
+    uint8_t Status_Tab[64];
+
+    if (sd->card_type == SD_Card_MMC)
+        return SD_ILLEGAL_COMMAND; /* SD status is not available for MMC cards */
+
+    /* on a data error, retry then slow the clock down until the slowest one */
+    do
+        state = SD_GetStatusOnce(sd, Status_Tab);
+    while (state == SD_RESPONSE_DATA_ERROR && SD_RetryDataError(sd, &retries));
+
+    if (state != SD_RESPONSE_NO_ERROR)
+        return state;
+
+    SD_status->BusWidth = (Status_Tab[0] & 0xC0) >> 6; /* Byte 0 */
+    SD_status->InSecuredMode = (Status_Tab[0] & 0x20) >> 5;
+    SD_status->Reserved1 = (Status_Tab[0] & 0x1F) << 8;
+    SD_status->Reserved1 |= Status_Tab[1]; /* Byte 1 */
+    SD_status->CardType = (Status_Tab[2] << 8) | Status_Tab[3]; /* Byte 2, 3 */
+    SD_status->SizeProtectedArea = (uint32_t) Status_Tab[4] << 24; /* Byte 4 */
+    SD_status->SizeProtectedArea |= Status_Tab[5] << 16; /* Byte 5 */
+    SD_status->SizeProtectedArea |= Status_Tab[6] << 8; /* Byte 6 */
+    SD_status->SizeProtectedArea |= Status_Tab[7]; /* Byte 7 */
+    SD_status->SpeedClass = Status_Tab[8]; /* Byte 8 */
+    SD_status->PerformanceMove = Status_Tab[9]; /* Byte 9 */
+    SD_status->AU_Size = (Status_Tab[10] & 0xF0) >> 4; /* Byte 10 */
+    SD_status->Reserved2 = Status_Tab[10] & 0x0F;
+    SD_status->EraseSize = (Status_Tab[11] << 8) | Status_Tab[12]; /* Byte 11, 12 */
+    SD_status->EraseTimeout = (Status_Tab[13] & 0xFC) >> 2; /* Byte 13 */
+    SD_status->EraseOffset = Status_Tab[13] & 0x03;
+    SD_status->UHS_SpeedGrade = (Status_Tab[14] & 0xF0) >> 4; /* Byte 14 */
+    SD_status->UHS_AU_Size = Status_Tab[14] & 0x0F;
+
+    return state;
+}
+
+/**
+ * @brief  Read the erase geometry and timing from the SD status once
+ */
+static void SD_LoadEraseInfo(SD_SPI_Handle *sd)
+{
+    /* AU_Size 1h (16 KB) .. Fh (64 MB) in sectors */
+    static const uint32_t au_sectors[16] = { 0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384,
+            24576, 32768, 49152, 65536, 131072 };
+    SD_Status status;
+
+    if (sd->au_sectors != 0 || SD_GetStatus(sd, &status) != SD_RESPONSE_NO_ERROR)
+        return;
+
+    /* no AU defined: the erase unit of the CSD */
+    sd->au_sectors = (status.AU_Size != 0) ? au_sectors[status.AU_Size] : sd->erase_sectors;
+    sd->erase_size = status.EraseSize;
+    sd->erase_timeout_s = status.EraseTimeout;
+    sd->erase_offset_s = status.EraseOffset;
+}
+
+/**
+ * @brief  Erase time allowed for count sectors (SD spec 4.14)
+ */
+static uint32_t SD_EraseTimeout(SD_SPI_Handle *sd, uint32_t count)
+{
+    uint32_t unit = (sd->au_sectors > sd->erase_sectors) ? sd->au_sectors : sd->erase_sectors;
+    uint32_t aus;
+    uint64_t us;
+
+    if (unit <= 1)
+        unit = SD_ERASE_DEFAULT_AU_SECTORS;
+
+    /* AUs touched by the range */
+    aus = (uint32_t) (((uint64_t) count + 2 * (unit - 1)) / unit);
+
+    if (sd->erase_size != 0 && sd->erase_timeout_s != 0 && sd->au_sectors != 0)
+    { /* in us before dividing, ERASE_TIMEOUT * aus is often below ERASE_SIZE */
+        us = (uint64_t) sd->erase_timeout_s * 1000000 * aus / sd->erase_size
+                + (uint64_t) sd->erase_offset_s * 1000000;
+    }
+    else
+        us = (uint64_t) SD_ERASE_TIMEOUT_PER_AU_US * aus;
+
+    return (us > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) us;
+}
+
+/**
+ * @brief  Hold the bus and send the CMD32 / CMD33 / CMD38 sequence, the bus stays held
+ * @retval SD_RESPONSE_NO_ERROR once the card started erasing
+ */
+static SD_Error SD_EraseSend(SD_SPI_Handle *sd, uint32_t startAddr, uint32_t endAddr)
+{
+    SD_Error state;
+
+    /* non High Capacity cards use byte-oriented addresses */
+    if (sd->card_type != SD_Card_SDHC)
+    {
+        startAddr <<= 9;
+        endAddr <<= 9;
+    }
+
+    SD_Bus_Hold(sd);
+
+    SD_WaitReady(sd);
+
+    state = SD_SendCmd(sd, SD_CMD_ERASE_BLOCK_START, startAddr);
+    if (state == SD_RESPONSE_NO_ERROR)
+        state = SD_SendCmd(sd, SD_CMD_ERASE_BLOCK_END, endAddr);
+    if (state == SD_RESPONSE_NO_ERROR)
+        state = SD_SendCmd(sd, SD_CMD_ERASE, 0x00000000); /* R1b: busy until erased */
+
+    return state;
+}
+
+SD_Error SD_Erase(SD_SPI_Handle *sd, uint32_t start, uint32_t end)
+{
+    SD_Error state;
+
+    if (sd->card_type == SD_Card_MMC)
+        return SD_ILLEGAL_COMMAND; /* MMC cards erase groups with CMD35 / CMD36 */
+    if (end < start)
+        return SD_PARAMETER_ERROR;
+
+    SD_LoadEraseInfo(sd);
+
+    state = SD_EraseSend(sd, start, end);
+    if (state == SD_RESPONSE_NO_ERROR)
+        state = SD_WaitBytesErased(sd, SD_EraseTimeout(sd, end - start + 1));
+
+    SD_Bus_Release(sd);
+
+    return state;
+}
+
+SD_Error SD_EraseBegin(SD_SPI_Handle *sd, uint32_t start, uint32_t end, SD_BusyToken *token)
+{
+    SD_Error state;
+
+    if (sd->card_type == SD_Card_MMC)
+        return SD_ILLEGAL_COMMAND;
+    if (end < start)
+        return SD_PARAMETER_ERROR;
+
+    SD_LoadEraseInfo(sd);
+
+    state = SD_EraseSend(sd, start, end);
+    if (state != SD_RESPONSE_NO_ERROR)
+    {
+        SD_Bus_Release(sd);
+        return state;
+    }
+
+    /* the card erases on its own, the bus is free meanwhile */
+    SD_BusyStart(sd, token, SD_OP_ERASE, SD_EraseTimeout(sd, end - start + 1));
+    SD_Bus_Release(sd);
+
+    return SD_RESPONSE_BUSY;
+}
+
+uint32_t SD_ErasePlan_Init(SD_SPI_Handle *sd, SD_ErasePlan *plan, uint32_t start, uint32_t count)
+{
+    uint32_t unit;
+    uint64_t first;
+
+    SD_LoadEraseInfo(sd);
+
+    /* whole AUs, and whole erase units on cards without single block erase */
+    unit = (sd->au_sectors > sd->erase_sectors) ? sd->au_sectors : sd->erase_sectors;
+
+    first = ((uint64_t) start + unit - 1) / unit * unit;
+    plan->end = (uint32_t) (((uint64_t) start + count) / unit * unit);
+    plan->next = (first < plan->end) ? (uint32_t) first : plan->end;
+
+    /* ERASE_SIZE AUs is the unit the card gives its erase timeout for */
+    plan->chunk = unit * (sd->erase_size != 0 ? sd->erase_size : 1);
+
+    return plan->end - plan->next;
+}
+
+uint8_t SD_ErasePlan_Next(SD_ErasePlan *plan, uint32_t *start, uint32_t *end)
+{
+    uint32_t count = plan->end - plan->next;
+
+    if (count == 0)
+        return 0;
+
+    if (count > plan->chunk)
+        count = plan->chunk;
+
+    *start = plan->next;
+    *end = plan->next + count - 1;
+    plan->next += count;
+
+    return 1;
+}
+
+SD_Error SD_Discard(SD_SPI_Handle *sd, uint32_t start, uint32_t count)
+{
+    SD_ErasePlan plan;
+    SD_Error state = SD_RESPONSE_NO_ERROR;
+    uint32_t first, last;
+
+    if (sd->card_type == SD_Card_MMC)
+        return SD_ILLEGAL_COMMAND;
+
+    SD_ErasePlan_Init(sd, &plan, start, count);
+    while (state == SD_RESPONSE_NO_ERROR && SD_ErasePlan_Next(&plan, &first, &last))
+        state = SD_Erase(sd, first, last);
+
+    return state;
+}
@@ -0,0 +1,57 @@
+/*
+ * sd_trace.c
+ */
+
+#include "sd_trace.h"
+
+#if SD_TRACE
+
+/* One producer (SD driver) and one consumer (drain), indices only grow */
+static SD_TraceEvent trace_ring[SD_TRACE_SIZE];
+static volatile uint32_t trace_head;
+static volatile uint32_t trace_tail;
+static uint32_t trace_dropped;
+
+static const char *const trace_names[SD_TRACE_ID_COUNT] = { "read delay", "read timeout", "write delay",
+        "write timeout", "erase delay", "erase timeout", "scr on mmc", "crc error" };
+
+void SD_Trace_Record(SD_TraceId id, uint32_t value)
+{
+    SD_TraceEvent *event;
+
+    if (trace_head - trace_tail >= SD_TRACE_SIZE)
+    {
+        trace_dropped++;
+        return;
+    }
+
+    event = &trace_ring[trace_head & (SD_TRACE_SIZE - 1)];
+    event->tick = HAL_GetTick();
+    event->value = value;
+    event->id = id;
+    trace_head++;
+}
+
+uint8_t SD_Trace_Pop(SD_TraceEvent *event)
+{
+    if (trace_tail == trace_head)
+        return 0;
+
+    *event = trace_ring[trace_tail & (SD_TRACE_SIZE - 1)];
+    trace_tail++;
+    return 1;
+}
+
+uint32_t SD_Trace_Dropped(void)
+{
+    uint32_t dropped = trace_dropped;
+    trace_dropped = 0;
+    return dropped;
+}
+
+const char* SD_Trace_Name(uint8_t id)
+{
+    return (id < SD_TRACE_ID_COUNT) ? trace_names[id] : "?";
+}
+
+#endif // SD_TRACE
@@ -17,62 +17,59 @@ SnakeTile* GetSnakeTile(SnakeGameState *gameState, uint8_t x, uint8_t y)
     return &(gameState->tiles[y * SNAKE_TILE_X_COUNT + x]);
 }
 
-void DrawSnakeTile(SnakeGameState *gameState, uint16_t tile)
+uint16_t GetSnakeTileColor(SnakeGameState *gameState, uint8_t x, uint8_t y)
 {
-    uint8_t x = tile % SNAKE_TILE_X_COUNT;
-    uint8_t y = tile / SNAKE_TILE_X_COUNT;
+    uint16_t tile = SNAKE_TILE(x, y);
+    SnakeTile *snake_tile = &gameState->tiles[tile];
 
-    SnakeTile *snake_tile;
-    snake_tile = GetSnakeTile(gameState, x, y);
+    if (snake_tile->type == SNAKE_TILE_TYPE_SNAKE)
+        return (gameState->snake_head == tile) ? BLUE : LIGHTBLUE;
+    else if (snake_tile->type == SNAKE_TILE_TYPE_FOOD)
+        return RED;
 
+    return ((x & 0x1) == (y & 0x1)) ? LIGHTGREEN : GREEN;     // Faster than tile % 2 == 0
+}
 
-    if (snake_tile->dirty == 0)
-        return;
+// Dirty region paint callback, the board covers the whole screen
+void PaintSnake(void *context, int x, int y, int w, int h, uint16_t *pixels)
+{
+    SnakeGameState *gameState = context;
 
-    for (int i = 0; i < TILE_SIZE; ++i)
+    for (int i = 0; i < w; ++i)
     {
-        for (int j = 0; j < TILE_SIZE; ++j)
-        {
-
-            gameState->Init.lcd_handle->SetDrawPos(gameState->Init.lcd_handle, x * TILE_SIZE + j, y * TILE_SIZE + i);
+        uint8_t tile_x = (x + i) / TILE_SIZE;
+        int j = 0;
 
-            uint16_t color = ((x & 0x1) == (y & 0x1)) ? LIGHTGREEN : GREEN;     // Faster than tile % 2 == 0
+        while (j < h)
+        {
+            uint8_t tile_y = (y + j) / TILE_SIZE;
+            int end = (tile_y + 1) * TILE_SIZE - y;
+            uint16_t color = 0;
 
-            if (snake_tile->type == SNAKE_TILE_TYPE_SNAKE)
-            {
-                if (gameState->snake_head == tile)
-                    color = BLUE;
-                else
-                    color = LIGHTBLUE;
-            }
-            else if (snake_tile->type == SNAKE_TILE_TYPE_FOOD)
-                color = RED;
+            if (tile_x < SNAKE_TILE_X_COUNT && tile_y < SNAKE_TILE_Y_COUNT)
+                color = LCD_TO_BUS(GetSnakeTileColor(gameState, tile_x, tile_y));
 
-            gameState->Init.lcd_handle->DrawPixel(gameState->Init.lcd_handle, color);
+            if (end > h)
+                end = h;
+            for (; j < end; ++j)
+                *pixels++ = color;
         }
     }
-
-    snake_tile->dirty = 0;
 }
 
-void DrawSnakeToScreen(SnakeGameState *gameState)
+void InvalidateSnakeTile(SnakeGameState *gameState, uint16_t tile)
 {
-    for (int i = 0; i < SNAKE_TILE_COUNT; ++i)
-    {
-        if (!gameState->tiles[i].dirty)
-            continue;
-
-        DrawSnakeTile(gameState, i);
-    }
+    LCD_Dirty_Add(&gameState->dirty, (tile % SNAKE_TILE_X_COUNT) * TILE_SIZE, (tile / SNAKE_TILE_X_COUNT) * TILE_SIZE,
+            TILE_SIZE, TILE_SIZE);
 }
 
 void InitSnake(SnakeGameState *gameState)
 {
     for (int i = 0; i < SNAKE_TILE_COUNT; ++i)
-    {
-        gameState->tiles[i].dirty = 1;
         gameState->tiles[i].type = SNAKE_TILE_TYPE_EMPTY;
-    }
+
+    LCD_Dirty_Init(&gameState->dirty, gameState->Init.lcd_handle, PaintSnake, gameState);
+    LCD_Dirty_Add(&gameState->dirty, 0, 0, SNAKE_TILE_X_COUNT * TILE_SIZE, SNAKE_TILE_Y_COUNT * TILE_SIZE);
 
     GetSnakeTile(gameState, SNAKE_TILE_X_COUNT * 0.5, SNAKE_TILE_Y_COUNT * 0.5)->type = SNAKE_TILE_TYPE_SNAKE;
     GetSnakeTile(gameState, SNAKE_TILE_X_COUNT * 0.5 + 1, SNAKE_TILE_Y_COUNT * 0.5)->type = SNAKE_TILE_TYPE_SNAKE;
@@ -89,7 +86,7 @@ void InitSnake(SnakeGameState *gameState)
     GetSnakeTile(gameState, 12, 6)->type = SNAKE_TILE_TYPE_FOOD;
     GetSnakeTile(gameState, 21, 15)->type = SNAKE_TILE_TYPE_FOOD;
 
-    DrawSnakeToScreen(gameState);
+    LCD_Dirty_Flush(&gameState->dirty);
 
     gameState->dir = 0;
     gameState->is_running = 1;
@@ -139,21 +136,21 @@ uint8_t UpdateSnake(SnakeGameState *gameState)
     else
     {
         // Update tail if snake size didn't change
-        gameState->tiles[gameState->snake_tail].dirty = 1;
+        InvalidateSnakeTile(gameState, gameState->snake_tail);
         gameState->tiles[gameState->snake_tail].type = SNAKE_TILE_TYPE_EMPTY;
 
         gameState->snake_tail = gameState->tiles[gameState->snake_tail].next_snake_tile;
     }
 
     // Update head
-    gameState->tiles[gameState->snake_head].dirty = 1;
+    InvalidateSnakeTile(gameState, gameState->snake_head);
     gameState->tiles[gameState->snake_head].next_snake_tile = newHeadIdx;
 
     gameState->snake_head = newHeadIdx;
-    gameState->tiles[gameState->snake_head].dirty = 1;
+    InvalidateSnakeTile(gameState, gameState->snake_head);
     gameState->tiles[gameState->snake_head].type = SNAKE_TILE_TYPE_SNAKE;
 
-    DrawSnakeToScreen(gameState);
+    LCD_Dirty_Flush(&gameState->dirty);
 
     return 0;
 }
@@ -0,0 +1,184 @@
+/*
+ * lcd_bus_model.c
+ */
+
+#include "lcd_bus_model.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define LCD_MODEL_CASET 0x2A
+#define LCD_MODEL_PASET 0x2B
+#define LCD_MODEL_RAMWR 0x2C
+#define LCD_MODEL_RAMWRC 0x3C
+
+/* The GPIO hook is global, one model is attached at a time */
+static LCD_BusModel *attached_model;
+
+static void LCD_Model_Pin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    LCD_BusModel *model = attached_model;
+
+    if (model == NULL || GPIOx != model->cs_port || (GPIO_Pin & model->cs_pin) == 0)
+        return;
+
+    if (PinState == GPIO_PIN_RESET && !model->cs_low)
+        model->cs_asserts++;
+    model->cs_low = (PinState == GPIO_PIN_RESET);
+    model->pixel_half = 0; // A transfer never continues across CS
+}
+
+static void LCD_Model_Pixel(LCD_BusModel *model, uint16_t color)
+{
+    if (model->x < LCD_MODEL_WIDTH && model->y < LCD_MODEL_HEIGHT)
+        model->frame[model->x][model->y] = color;
+    model->pixels++;
+
+    // Columns (0x2A, y) run first, then pages (0x2B, x), wrapping inside the window
+    if (++model->y > model->col[1])
+    {
+        model->y = model->col[0];
+        if (++model->x > model->page[1])
+            model->x = model->page[0];
+    }
+}
+
+static void LCD_Model_Data(LCD_BusModel *model, uint8_t data)
+{
+    LCD_ModelCommand *entry = (model->log_count > 0 && model->log_count <= LCD_MODEL_LOG_SIZE) ?
+            &model->log[model->log_count - 1] : NULL;
+    uint16_t n;
+
+    if (model->cmd == LCD_MODEL_RAMWR || model->cmd == LCD_MODEL_RAMWRC)
+    {
+        if (!model->pixel_half)
+        {
+            model->pixel_hi = data;
+            model->pixel_half = 1;
+        }
+        else
+        {
+            LCD_Model_Pixel(model, (model->pixel_hi << 8) | data);
+            model->pixel_half = 0;
+        }
+        return;
+    }
+
+    // Decoded apart from the log, which only keeps the first commands
+    n = model->nargs++;
+    if (n < 4)
+        model->args[n] = data;
+    if (entry != NULL && n < LCD_MODEL_LOG_ARGS)
+        entry->args[n] = data;
+    if (entry != NULL)
+        entry->nargs++;
+
+    if (n == 3 && (model->cmd == LCD_MODEL_CASET || model->cmd == LCD_MODEL_PASET))
+    {
+        uint16_t *range = (model->cmd == LCD_MODEL_CASET) ? model->col : model->page;
+        range[0] = (model->args[0] << 8) | model->args[1];
+        range[1] = (model->args[2] << 8) | model->args[3];
+    }
+}
+
+static uint8_t LCD_Model_Exchange(SPI_HandleTypeDef *hspi, uint8_t mosi)
+{
+    LCD_BusModel *model = hspi->Device;
+
+    model->bytes++;
+    if (!model->cs_low)
+    {
+        model->stray_bytes++;
+        return 0xFF;
+    }
+
+    if ((model->dc_port->ODR & model->dc_pin) == 0)
+    {
+        model->cmd = mosi;
+        model->commands++;
+        model->pixel_half = 0;
+        model->nargs = 0;
+        if (model->log_count < LCD_MODEL_LOG_SIZE)
+        {
+            memset(&model->log[model->log_count], 0, sizeof(model->log[0]));
+            model->log[model->log_count].cmd = mosi;
+            model->log[model->log_count].us = Host_Micros();
+        }
+        model->log_count++;
+
+        if (mosi == LCD_MODEL_RAMWR)
+        {
+            model->x = model->page[0];
+            model->y = model->col[0];
+        }
+    }
+    else
+    {
+        LCD_Model_Data(model, mosi);
+    }
+
+    return 0xFF;
+}
+
+void LCD_Model_Attach(LCD_BusModel *model, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin,
+        GPIO_TypeDef *dc_port, uint16_t dc_pin)
+{
+    memset(model, 0, sizeof(*model));
+    model->cs_port = cs_port;
+    model->cs_pin = cs_pin;
+    model->dc_port = dc_port;
+    model->dc_pin = dc_pin;
+    model->col[1] = LCD_MODEL_HEIGHT - 1;
+    model->page[1] = LCD_MODEL_WIDTH - 1;
+
+    hspi->Exchange = LCD_Model_Exchange;
+    hspi->Device = model;
+
+    attached_model = model;
+    Host_GPIO_Hook = LCD_Model_Pin;
+}
+
+void LCD_Model_ResetCounters(LCD_BusModel *model)
+{
+    model->bytes = 0;
+    model->cs_asserts = 0;
+    model->commands = 0;
+    model->pixels = 0;
+    model->stray_bytes = 0;
+    model->log_count = 0;
+}
+
+uint32_t LCD_Model_CountCommand(const LCD_BusModel *model, uint8_t cmd)
+{
+    uint32_t n = 0;
+    uint32_t count = (model->log_count < LCD_MODEL_LOG_SIZE) ? model->log_count : LCD_MODEL_LOG_SIZE;
+
+    for (uint32_t i = 0; i < count; i++)
+        if (model->log[i].cmd == cmd)
+            n++;
+    return n;
+}
+
+int LCD_Model_WritePPM(const uint16_t frame[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT], const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    int ok;
+
+    if (file == NULL)
+        return -1;
+
+    fprintf(file, "P6\n%d %d\n255\n", LCD_MODEL_WIDTH, LCD_MODEL_HEIGHT);
+    for (int y = 0; y < LCD_MODEL_HEIGHT; y++)
+    {
+        for (int x = 0; x < LCD_MODEL_WIDTH; x++)
+        {
+            uint16_t c = frame[x][y];
+            fputc(((c >> 11) & 0x1F) * 255 / 31, file);
+            fputc(((c >> 5) & 0x3F) * 255 / 63, file);
+            fputc((c & 0x1F) * 255 / 31, file);
+        }
+    }
+
+    ok = !ferror(file);
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
@@ -0,0 +1,84 @@
+#ifndef __LCD_BUS_MODEL_H__
+#define __LCD_BUS_MODEL_H__
+
+#include "stm32f4xx_hal.h"
+
+/*
+ * Host model of an ILI9341 on SPI: counts what reaches the bus, keeps a log of
+ * the commands and decodes the column / page / memory write commands into a
+ * frame memory. Coordinates follow the driver: 0x2B sets the x range, 0x2A the
+ * y range, and pixels fill the window column by column.
+ */
+
+#define LCD_MODEL_WIDTH 320
+#define LCD_MODEL_HEIGHT 240
+
+/* Commands kept in the log, later ones are only counted */
+#define LCD_MODEL_LOG_SIZE 256
+/* Parameter bytes kept per logged command */
+#define LCD_MODEL_LOG_ARGS 16
+
+typedef struct __LCD_ModelCommand
+{
+    uint8_t cmd;
+    uint16_t nargs; // Parameter bytes received, pixels excluded
+    uint64_t us; // Simulated time of the command byte
+    uint8_t args[LCD_MODEL_LOG_ARGS];
+} LCD_ModelCommand;
+
+typedef struct __LCD_BusModel
+{
+    /* Wiring */
+    GPIO_TypeDef *cs_port;
+    uint16_t cs_pin;
+    GPIO_TypeDef *dc_port;
+    uint16_t dc_pin;
+
+    /* Counters, cleared by LCD_Model_ResetCounters */
+    uint32_t bytes;
+    uint32_t cs_asserts;
+    uint32_t commands;
+    uint32_t pixels;
+    uint32_t stray_bytes; // Bytes clocked while CS is high
+
+    LCD_ModelCommand log[LCD_MODEL_LOG_SIZE];
+    uint32_t log_count;
+
+    /* Decoder state */
+    uint8_t cs_low;
+    uint8_t cmd;
+    uint8_t args[4]; // Parameters of the current command
+    uint16_t nargs;
+    uint8_t pixel_hi;
+    uint8_t pixel_half;
+    uint16_t col[2]; // 0x2A range
+    uint16_t page[2]; // 0x2B range
+    uint16_t x, y; // Next memory write position
+
+    uint16_t frame[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT]; // RGB565, [x][y]
+} LCD_BusModel;
+
+/**
+ * @brief  Put the model on the bus of hspi, CS and DC are read from the pin writes
+ */
+void LCD_Model_Attach(LCD_BusModel *model, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin,
+        GPIO_TypeDef *dc_port, uint16_t dc_pin);
+
+/**
+ * @brief  Clear the counters and the command log, the frame memory is kept
+ */
+void LCD_Model_ResetCounters(LCD_BusModel *model);
+
+/**
+ * @brief  Number of logged commands equal to cmd
+ */
+uint32_t LCD_Model_CountCommand(const LCD_BusModel *model, uint8_t cmd);
+
+/**
+ * @brief  Write a frame (RGB565, [x][y] like LCD_BusModel.frame) as a binary PPM.
+ *         Rows are frame memory rows, the MADCTL orientation of the panel is not applied.
+ * @retval 0 on success
+ */
+int LCD_Model_WritePPM(const uint16_t frame[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT], const char *path);
+
+#endif // __LCD_BUS_MODEL_H__
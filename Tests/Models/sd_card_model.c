@@ -0,0 +1,551 @@
+/*
+ * sd_card_model.c
+ */
+
+#include "sd_card_model.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SD_MODEL_TOKEN_START 0xFE
+#define SD_MODEL_TOKEN_MULTI 0xFC
+#define SD_MODEL_TOKEN_STOP  0xFD
+
+#define SD_MODEL_R1_IDLE      0x01
+#define SD_MODEL_R1_ILLEGAL   0x04
+#define SD_MODEL_R1_CRC       0x08
+#define SD_MODEL_R1_ADDRESS   0x20
+
+#define SD_MODEL_DATA_ACCEPTED  0x05
+#define SD_MODEL_DATA_CRC_ERROR 0x0B
+
+/* ACMD41 calls before the card leaves the idle state */
+#define SD_MODEL_ACMD41_CALLS 3
+
+enum
+{
+    SD_MODEL_COMMAND, SD_MODEL_READING, SD_MODEL_WAIT_TOKEN, SD_MODEL_RECEIVING
+};
+
+/* 25 MHz TRAN_SPEED, writes 4 times the read access time, C_SIZE is filled in from the image size */
+static const uint8_t model_csd[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00, 0x00, 0x00, 0x7F, 0x80, 0x0A,
+        0x40, 0x00, 0x01 };
+/* CSD v1 of the byte addressed cards: 512-byte blocks, C_SIZE_MULT 7, ERASE_BLK_EN */
+static const uint8_t model_csd_v1[16] = { 0x00, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0x00, 0x36, 0xDB, 0xFF, 0x80,
+        0x0A, 0x40, 0x00, 0x01 };
+static const uint8_t model_cid[16] = { 0x03, 'S', 'D', 'H', 'O', 'S', 'T', '0', 0x10, 0x01, 0x02, 0x03, 0x04, 0x01,
+        0x23, 0x01 };
+static const uint8_t model_scr[8] = { 0x02, 0x35, 0x80, 0x03, 0x00, 0x00, 0x00, 0x00 };
+/* SD status: AU 4 MB, ERASE_SIZE 2 AU, ERASE_TIMEOUT 10 s, ERASE_OFFSET 0 */
+static const uint8_t model_status[64] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x90, 0x00,
+        0x02, 0x28 };
+
+static uint16_t SD_Model_CRC16(const uint8_t *data, uint32_t len)
+{
+    uint16_t crc = 0;
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc ^= data[i] << 8;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+static uint8_t SD_Model_CRC7(const uint8_t *data, uint32_t len)
+{
+    uint8_t crc = 0;
+
+    for (uint32_t i = 0; i < len; i++)
+        for (int k = 7; k >= 0; k--)
+        {
+            int bit = ((data[i] >> k) & 1) ^ ((crc >> 6) & 1);
+            crc = (crc << 1) & 0x7F;
+            if (bit)
+                crc ^= 0x09;
+        }
+    return crc;
+}
+
+static void SD_Model_Push(SD_CardModel *card, uint8_t byte)
+{
+    card->out[card->out_tail++ % sizeof(card->out)] = byte;
+}
+
+static void SD_Model_R1(SD_CardModel *card, uint8_t r1)
+{
+    SD_Model_Push(card, 0xFF); // NCR
+    SD_Model_Push(card, r1);
+}
+
+// Start token, data and CRC16 of a data block
+static void SD_Model_PushData(SD_CardModel *card, const uint8_t *data, uint32_t len)
+{
+    uint16_t crc = SD_Model_CRC16(data, len);
+
+    SD_Model_Push(card, SD_MODEL_TOKEN_START);
+    for (uint32_t i = 0; i < len; i++)
+        SD_Model_Push(card, data[i]);
+    SD_Model_Push(card, crc >> 8);
+    SD_Model_Push(card, crc);
+}
+
+static void SD_Model_PushSector(SD_CardModel *card, uint32_t s)
+{
+    uint8_t *sector = SD_Model_Sector(card, s);
+    uint16_t crc = SD_Model_CRC16(sector, SD_MODEL_BLOCK_SIZE);
+
+    for (int i = 0; i < SD_MODEL_ACCESS_BYTES; i++)
+        SD_Model_Push(card, 0xFF);
+
+    if (card->inject_read_error > 0)
+    {
+        card->inject_read_error--;
+        SD_Model_Push(card, 0x08); // Error token: out of range
+        return;
+    }
+
+    if (card->inject_read_crc > 0)
+    {
+        card->inject_read_crc--;
+        crc ^= 0x0001;
+    }
+
+    SD_Model_Push(card, SD_MODEL_TOKEN_START);
+    for (int i = 0; i < SD_MODEL_BLOCK_SIZE; i++)
+        SD_Model_Push(card, sector[i]);
+    SD_Model_Push(card, crc >> 8);
+    SD_Model_Push(card, crc);
+    card->sectors_read++;
+}
+
+static void SD_Model_Csd(SD_CardModel *card)
+{
+    uint8_t csd[16];
+    uint32_t c_size;
+
+    if (card->type == SD_MODEL_SDHC)
+    {
+        c_size = card->sectors / 1024 - 1; // (C_SIZE + 1) * 512 KB
+        memcpy(csd, model_csd, sizeof(csd));
+        csd[7] = (c_size >> 16) & 0x3F;
+        csd[8] = c_size >> 8;
+        csd[9] = c_size;
+    }
+    else
+    {
+        c_size = card->sectors / 512 - 1; // (C_SIZE + 1) << (C_SIZE_MULT + 2) blocks
+        memcpy(csd, model_csd_v1, sizeof(csd));
+        csd[6] |= (c_size >> 10) & 0x03;
+        csd[7] = c_size >> 2;
+        csd[8] |= c_size << 6;
+    }
+    csd[1] = card->taac;
+    csd[2] = card->nsac;
+    csd[15] = (SD_Model_CRC7(csd, 15) << 1) | 1;
+
+    SD_Model_R1(card, 0x00);
+    SD_Model_Push(card, 0xFF);
+    SD_Model_PushData(card, csd, sizeof(csd));
+}
+
+static void SD_Model_AppCommand(SD_CardModel *card, uint8_t cmd, uint32_t arg)
+{
+    card->acmd_count[cmd]++;
+
+    switch (cmd)
+    {
+    case 41:
+        if (++card->acmd41_calls >= SD_MODEL_ACMD41_CALLS)
+            card->idle = 0;
+        SD_Model_R1(card, card->idle);
+        break;
+    case 51:
+        SD_Model_R1(card, 0x00);
+        SD_Model_Push(card, 0xFF);
+        SD_Model_PushData(card, model_scr, sizeof(model_scr));
+        break;
+    case 13:
+        SD_Model_R1(card, 0x00);
+        SD_Model_Push(card, 0x00); // R2 second byte
+        SD_Model_Push(card, 0xFF);
+        SD_Model_PushData(card, card->status, sizeof(card->status));
+        break;
+    case 23:
+        card->pre_erase = arg;
+        SD_Model_R1(card, 0x00);
+        break;
+    default:
+        SD_Model_R1(card, SD_MODEL_R1_ILLEGAL | card->idle);
+        break;
+    }
+}
+
+static void SD_Model_Command(SD_CardModel *card)
+{
+    uint8_t cmd = card->frame[0] & 0x3F;
+    uint32_t arg = (card->frame[1] << 24) | (card->frame[2] << 16) | (card->frame[3] << 8) | card->frame[4];
+    uint8_t app = card->app;
+
+    card->app = 0;
+
+    // CMD0 and CMD8 are always checked, the others once CMD59 turned CRCs on
+    if (card->crc_on || cmd == 0 || cmd == 8)
+    {
+        if (((SD_Model_CRC7(card->frame, 5) << 1) | 1) != card->frame[5] || card->inject_cmd_crc > 0)
+        {
+            if (card->inject_cmd_crc > 0)
+                card->inject_cmd_crc--;
+            SD_Model_R1(card, SD_MODEL_R1_CRC | card->idle);
+            return;
+        }
+    }
+
+    if (app)
+    {
+        SD_Model_AppCommand(card, cmd, arg);
+        return;
+    }
+
+    card->cmd_count[cmd]++;
+
+    // Byte addresses on the cards below SDHC
+    if (card->type != SD_MODEL_SDHC
+            && (cmd == 17 || cmd == 18 || cmd == 24 || cmd == 25 || cmd == 32 || cmd == 33))
+        arg /= SD_MODEL_BLOCK_SIZE;
+
+    switch (cmd)
+    {
+    case 0:
+        card->idle = 1;
+        card->acmd41_calls = 0;
+        card->crc_on = 0;
+        card->state = SD_MODEL_COMMAND;
+        SD_Model_R1(card, SD_MODEL_R1_IDLE);
+        break;
+    case 1:
+        if (card->type != SD_MODEL_MMC)
+        {
+            SD_Model_R1(card, SD_MODEL_R1_ILLEGAL | card->idle);
+            break;
+        }
+        if (++card->acmd41_calls >= SD_MODEL_ACMD41_CALLS)
+            card->idle = 0;
+        SD_Model_R1(card, card->idle);
+        break;
+    case 8:
+        if (card->type == SD_MODEL_SDV1 || card->type == SD_MODEL_MMC)
+        {
+            SD_Model_R1(card, SD_MODEL_R1_ILLEGAL | card->idle);
+            break;
+        }
+        SD_Model_R1(card, card->idle);
+        SD_Model_Push(card, 0x00);
+        SD_Model_Push(card, 0x00);
+        SD_Model_Push(card, 0x01);
+        SD_Model_Push(card, arg & 0xFF);
+        break;
+    case 9:
+        SD_Model_Csd(card);
+        break;
+    case 10:
+        SD_Model_R1(card, 0x00);
+        SD_Model_Push(card, 0xFF);
+        SD_Model_PushData(card, model_cid, sizeof(model_cid));
+        break;
+    case 12:
+        // Drop the block in flight, stuff byte then R1
+        card->out_head = card->out_tail;
+        SD_Model_Push(card, 0xFF);
+        SD_Model_R1(card, 0x00);
+        card->state = SD_MODEL_COMMAND;
+        break;
+    case 16:
+        SD_Model_R1(card, (arg == SD_MODEL_BLOCK_SIZE) ? 0x00 : SD_MODEL_R1_ILLEGAL);
+        break;
+    case 17:
+    case 18:
+        if (arg >= card->sectors)
+        {
+            SD_Model_R1(card, SD_MODEL_R1_ADDRESS);
+            break;
+        }
+        SD_Model_R1(card, 0x00);
+        if (cmd == 17)
+        {
+            SD_Model_PushSector(card, arg);
+        }
+        else
+        {
+            card->address = arg;
+            card->state = SD_MODEL_READING;
+        }
+        break;
+    case 24:
+    case 25:
+        if (arg >= card->sectors)
+        {
+            SD_Model_R1(card, SD_MODEL_R1_ADDRESS);
+            break;
+        }
+        SD_Model_R1(card, 0x00);
+        card->address = arg;
+        card->multi = (cmd == 25);
+        card->state = SD_MODEL_WAIT_TOKEN;
+        break;
+    case 32:
+        card->erase_start = arg;
+        SD_Model_R1(card, 0x00);
+        break;
+    case 33:
+        card->erase_end = arg;
+        SD_Model_R1(card, 0x00);
+        break;
+    case 38:
+        SD_Model_R1(card, 0x00);
+        for (uint32_t s = card->erase_start; s <= card->erase_end && s < card->sectors; s++)
+            memset(SD_Model_Sector(card, s), 0x00, SD_MODEL_BLOCK_SIZE);
+        card->busy_pending_us = card->erase_us;
+        break;
+    case 55:
+        if (card->type == SD_MODEL_MMC)
+        {
+            SD_Model_R1(card, SD_MODEL_R1_ILLEGAL | card->idle);
+            break;
+        }
+        card->app = 1;
+        SD_Model_R1(card, card->idle);
+        break;
+    case 58:
+        SD_Model_R1(card, card->idle);
+        SD_Model_Push(card, (card->type == SD_MODEL_SDHC) ? 0xC0 : 0x80); // Powered up, CCS: block addressing
+        SD_Model_Push(card, 0xFF);
+        SD_Model_Push(card, 0x80);
+        SD_Model_Push(card, 0x00);
+        break;
+    case 59:
+        card->crc_on = arg & 1;
+        SD_Model_R1(card, card->idle);
+        break;
+    default:
+        SD_Model_R1(card, SD_MODEL_R1_ILLEGAL | card->idle);
+        break;
+    }
+}
+
+// A full data block (and its CRC) arrived
+static void SD_Model_Block(SD_CardModel *card)
+{
+    uint16_t crc = (card->block[SD_MODEL_BLOCK_SIZE] << 8) | card->block[SD_MODEL_BLOCK_SIZE + 1];
+
+    card->state = card->multi ? SD_MODEL_WAIT_TOKEN : SD_MODEL_COMMAND;
+
+    if ((card->crc_on && crc != SD_Model_CRC16(card->block, SD_MODEL_BLOCK_SIZE)) || card->inject_write_crc > 0)
+    {
+        if (card->inject_write_crc > 0)
+            card->inject_write_crc--;
+        SD_Model_Push(card, SD_MODEL_DATA_CRC_ERROR);
+        return;
+    }
+
+    if (card->address < card->sectors)
+    {
+        memcpy(SD_Model_Sector(card, card->address++), card->block, SD_MODEL_BLOCK_SIZE);
+        card->sectors_written++;
+    }
+    SD_Model_Push(card, SD_MODEL_DATA_ACCEPTED);
+    card->busy_pending_us = card->program_us;
+}
+
+static uint8_t SD_Model_Exchange(SPI_HandleTypeDef *hspi, uint8_t mosi)
+{
+    SD_CardModel *card = hspi->Device;
+    uint8_t miso;
+
+    card->bytes++;
+    if (!card->cs_low)
+        return 0xFF;
+
+    // What the card drives on MISO during this byte
+    if (card->out_head != card->out_tail)
+    {
+        miso = card->out[card->out_head++ % sizeof(card->out)];
+    }
+    else if (card->busy_pending_us > 0)
+    {
+        card->busy_until = Host_Cycles() + (uint64_t) card->busy_pending_us * (SystemCoreClock / 1000000);
+        card->busy_pending_us = 0;
+        miso = 0x00;
+    }
+    else if (Host_Cycles() < card->busy_until)
+    {
+        miso = 0x00;
+    }
+    else if (card->state == SD_MODEL_READING)
+    {
+        if (card->address < card->sectors)
+            SD_Model_PushSector(card, card->address++);
+        else
+            SD_Model_Push(card, 0x08); // Past the end: out of range error token
+        miso = card->out[card->out_head++ % sizeof(card->out)];
+    }
+    else
+    {
+        miso = 0xFF;
+    }
+
+    // What the host sends
+    switch (card->state)
+    {
+    case SD_MODEL_COMMAND:
+    case SD_MODEL_READING:
+        if (card->frame_len == 0 && (mosi & 0xC0) == 0x40)
+            card->frame[card->frame_len++] = mosi;
+        else if (card->frame_len > 0)
+        {
+            card->frame[card->frame_len++] = mosi;
+            if (card->frame_len == 6)
+            {
+                card->frame_len = 0;
+                SD_Model_Command(card);
+            }
+        }
+        break;
+
+    case SD_MODEL_WAIT_TOKEN:
+        if (mosi == SD_MODEL_TOKEN_START || (mosi == SD_MODEL_TOKEN_MULTI && card->multi))
+        {
+            card->state = SD_MODEL_RECEIVING;
+            card->block_len = 0;
+        }
+        else if (mosi == SD_MODEL_TOKEN_STOP && card->multi)
+        {
+            card->state = SD_MODEL_COMMAND;
+            SD_Model_Push(card, 0xFF);
+            card->busy_pending_us = card->program_us;
+        }
+        else if ((mosi & 0xC0) == 0x40)
+        {
+            // A command instead of a token ends the write (CMD12 after an error)
+            card->state = SD_MODEL_COMMAND;
+            card->frame[card->frame_len++] = mosi;
+        }
+        break;
+
+    case SD_MODEL_RECEIVING:
+        card->block[card->block_len++] = mosi;
+        if (card->block_len == SD_MODEL_BLOCK_SIZE + 2)
+            SD_Model_Block(card);
+        break;
+    }
+
+    return miso;
+}
+
+// The GPIO hook is global, one card is attached at a time
+static SD_CardModel *attached_card;
+
+static void SD_Model_Pin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    SD_CardModel *card = attached_card;
+
+    if (card == NULL || GPIOx != card->cs_port || (GPIO_Pin & card->cs_pin) == 0)
+        return;
+
+    if (PinState == GPIO_PIN_RESET && !card->cs_low)
+        card->cs_asserts++;
+    if (PinState != GPIO_PIN_RESET)
+        card->frame_len = 0;
+    card->cs_low = (PinState == GPIO_PIN_RESET);
+}
+
+int SD_Model_Init(SD_CardModel *card, uint32_t sectors)
+{
+    memset(card, 0, sizeof(*card));
+    card->image = malloc((size_t) sectors * SD_MODEL_BLOCK_SIZE);
+    if (card->image == NULL)
+        return -1;
+
+    memset(card->image, 0xFF, (size_t) sectors * SD_MODEL_BLOCK_SIZE);
+    card->sectors = sectors;
+    card->idle = 1;
+    card->program_us = 250;
+    card->erase_us = 2000;
+    card->taac = 0x0E;
+    memcpy(card->status, model_status, sizeof(model_status));
+    return 0;
+}
+
+int SD_Model_Load(SD_CardModel *card, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long size;
+    int ok;
+
+    if (file == NULL)
+        return -1;
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    ok = size >= SD_MODEL_BLOCK_SIZE && SD_Model_Init(card, size / SD_MODEL_BLOCK_SIZE) == 0
+            && fread(card->image, SD_MODEL_BLOCK_SIZE, card->sectors, file) == card->sectors;
+
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+int SD_Model_Save(const SD_CardModel *card, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    int ok;
+
+    if (file == NULL)
+        return -1;
+
+    ok = fwrite(card->image, SD_MODEL_BLOCK_SIZE, card->sectors, file) == card->sectors;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+void SD_Model_Free(SD_CardModel *card)
+{
+    free(card->image);
+    card->image = NULL;
+}
+
+void SD_Model_Attach(SD_CardModel *card, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin)
+{
+    card->cs_port = cs_port;
+    card->cs_pin = cs_pin;
+    card->cs_low = 0;
+
+    hspi->Exchange = SD_Model_Exchange;
+    hspi->Device = card;
+
+    attached_card = card;
+    Host_GPIO_Hook = SD_Model_Pin;
+}
+
+void SD_Model_AttachHandle(SD_CardModel *card, SPI_HandleTypeDef *hspi, SD_SPI_Handle *sd, SD_ModelType type)
+{
+    card->type = type;
+
+    hspi->Instance = SPI2;
+    hspi->Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+    Host_SPI_MapRegisters(hspi);
+    SD_Model_Attach(card, hspi, SD_CS_GPIO_Port, SD_CS_Pin);
+
+    memset(sd, 0, sizeof(*sd));
+    sd->init.hspi = hspi;
+    sd->init.CS_Port = SD_CS_GPIO_Port;
+    sd->init.CS_Pin = SD_CS_Pin;
+}
+
+uint8_t* SD_Model_Sector(SD_CardModel *card, uint32_t s)
+{
+    return &card->image[(size_t) s * SD_MODEL_BLOCK_SIZE];
+}
@@ -0,0 +1,125 @@
+#ifndef __SD_CARD_MODEL_H__
+#define __SD_CARD_MODEL_H__
+
+#include "stm32f4xx_hal.h"
+#include "sd_spi_driver.h"
+
+/*
+ * Host model of a SD card in SPI mode, byte by byte on the bus of a SPI handle:
+ * SDHC by default, or a byte addressed SDSC v2, SDv1 or MMC card (CSD v1).
+ * Sectors live in a RAM image, loaded from and saved to an image file.
+ * Commands and data blocks carry checked CRCs once CMD59 turns them on, the
+ * card is busy for a programmable time after writes and erases, and faults
+ * can be injected. Time is the simulated time of the host HAL.
+ */
+
+#define SD_MODEL_BLOCK_SIZE 512
+
+/* Bytes of 0xFF before the token of a read block */
+#ifndef SD_MODEL_ACCESS_BYTES
+#define SD_MODEL_ACCESS_BYTES 3
+#endif
+
+typedef enum _SD_ModelType
+{
+    SD_MODEL_SDHC, /*!< SDv2, block addressing */
+    SD_MODEL_SDSC, /*!< SDv2, byte addressing */
+    SD_MODEL_SDV1, /*!< no CMD8 */
+    SD_MODEL_MMC /*!< no CMD8 nor ACMD41, initialised with CMD1 */
+} SD_ModelType;
+
+typedef struct __SD_CardModel
+{
+    uint8_t *image;
+    uint32_t sectors;
+
+    /* Set after SD_Model_Init / SD_Model_Load, before the bring-up */
+    SD_ModelType type;
+    uint8_t taac; // CSD read access time, 1 ms by default
+    uint8_t nsac;
+    uint8_t status[64]; // ACMD13 SD status, AU 4 MB, ERASE_SIZE 2, ERASE_TIMEOUT 10 s by default
+
+    GPIO_TypeDef *cs_port;
+    uint16_t cs_pin;
+
+    /* Busy time after a programmed block and after an erase command */
+    uint32_t program_us;
+    uint32_t erase_us;
+
+    /* Fault injection, each count is spent by one fault */
+    uint32_t inject_cmd_crc; // Next commands answered with COM_CRC_ERROR
+    uint32_t inject_read_crc; // Next read blocks sent with a wrong CRC
+    uint32_t inject_write_crc; // Next written blocks rejected for their CRC
+    uint32_t inject_read_error; // Next read blocks replaced by an error token
+
+    /* Counters */
+    uint32_t bytes;
+    uint32_t cs_asserts;
+    uint32_t cmd_count[64];
+    uint32_t acmd_count[64];
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+
+    /* Card state */
+    uint8_t cs_low;
+    uint8_t idle;
+    uint8_t app;
+    uint8_t crc_on;
+    uint8_t acmd41_calls;
+    uint8_t state;
+    uint8_t multi;
+    uint8_t frame[6];
+    uint8_t frame_len;
+    uint8_t block[SD_MODEL_BLOCK_SIZE + 2];
+    uint16_t block_len;
+    uint32_t address;
+    uint32_t erase_start;
+    uint32_t erase_end;
+    uint32_t pre_erase; // Last ACMD23 count
+    uint32_t busy_pending_us; // Starts once the queued bytes are out
+    uint64_t busy_until; // Host cycles
+
+    /* Bytes queued toward the host */
+    uint8_t out[1024];
+    uint16_t out_head;
+    uint16_t out_tail;
+} SD_CardModel;
+
+/**
+ * @brief  Model a card of sectors blank (0xFF) sectors
+ * @retval 0 on success
+ */
+int SD_Model_Init(SD_CardModel *card, uint32_t sectors);
+
+/**
+ * @brief  Model a card holding the image file at path
+ * @retval 0 on success
+ */
+int SD_Model_Load(SD_CardModel *card, const char *path);
+
+/**
+ * @brief  Write the card content back to an image file
+ * @retval 0 on success
+ */
+int SD_Model_Save(const SD_CardModel *card, const char *path);
+
+void SD_Model_Free(SD_CardModel *card);
+
+/**
+ * @brief  Put the card on the bus of hspi, selected by the cs_pin of cs_port
+ */
+void SD_Model_Attach(SD_CardModel *card, SPI_HandleTypeDef *hspi, GPIO_TypeDef *cs_port, uint16_t cs_pin);
+
+/**
+ * @brief  Model a card of the given type on SPI2 at /2, as on the board, and
+ *         point a cleared sd at it. The card is set up with SD_Model_Init or
+ *         SD_Model_Load first, the bring-up is left to the caller.
+ */
+void SD_Model_AttachHandle(SD_CardModel *card, SPI_HandleTypeDef *hspi, SD_SPI_Handle *sd, SD_ModelType type);
+
+/**
+ * @brief  Sector s of the image
+ */
+uint8_t* SD_Model_Sector(SD_CardModel *card, uint32_t s);
+
+#endif // __SD_CARD_MODEL_H__
@@ -0,0 +1,166 @@
+/*
+ * hal_stub.c
+ *
+ * Host HAL: the SPI functions clock bytes through hspi->Exchange and advance
+ * the simulated time by what the bytes cost at the configured prescaler.
+ * DMA transfers complete before they return, their callback included.
+ */
+
+#include "stm32f4xx_hal.h"
+
+DWT_Type host_dwt;
+CoreDebug_Type host_core_debug;
+uint32_t SystemCoreClock = 168000000;
+
+GPIO_TypeDef host_gpioa, host_gpiob, host_gpioc;
+SPI_TypeDef host_spi1, host_spi2, host_spi4;
+
+void (*Host_GPIO_Hook)(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState) = NULL;
+
+static uint64_t host_cycles;
+static uint32_t host_delayed_ms;
+
+/* CPU cycles spent in a HAL call before the first byte moves */
+#define HOST_HAL_CALL_CYCLES 200
+/* CPU cycles of a HAL_GPIO_WritePin call */
+#define HOST_GPIO_CYCLES 20
+
+void Host_AdvanceCycles(uint32_t cycles)
+{
+    host_cycles += cycles;
+    host_dwt.CYCCNT += cycles;
+}
+
+uint64_t Host_Cycles(void)
+{
+    return host_cycles;
+}
+
+uint64_t Host_Micros(void)
+{
+    return host_cycles / (SystemCoreClock / 1000000);
+}
+
+uint32_t Host_DelayedMs(void)
+{
+    return host_delayed_ms;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+    return SystemCoreClock / 4;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+    return SystemCoreClock / 2;
+}
+
+uint32_t HAL_GetTick(void)
+{
+    /* A polling loop always moves time forward */
+    Host_AdvanceCycles(16);
+    return (uint32_t) (host_cycles / (SystemCoreClock / 1000));
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+    host_delayed_ms += Delay;
+    Host_AdvanceCycles(Delay * (SystemCoreClock / 1000));
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+    Host_AdvanceCycles(HOST_GPIO_CYCLES);
+    if (PinState != GPIO_PIN_RESET)
+        GPIOx->ODR |= GPIO_Pin;
+    else
+        GPIOx->ODR &= ~(uint32_t) GPIO_Pin;
+
+    if (Host_GPIO_Hook != NULL)
+        Host_GPIO_Hook(GPIOx, GPIO_Pin, PinState);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    return (GPIOx->ODR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+// CPU cycles per byte at the prescaler of the handle, SPI1 and SPI4 sit on APB2
+static uint32_t host_byte_cycles(SPI_HandleTypeDef *hspi)
+{
+    uint32_t pclk = (hspi->Instance == SPI1 || hspi->Instance == SPI4) ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+    uint32_t divider = 2U << (hspi->Init.BaudRatePrescaler >> SPI_CR1_BR_Pos);
+
+    return 8 * divider * (SystemCoreClock / pclk);
+}
+
+uint8_t Host_SPI_Exchange(SPI_HandleTypeDef *hspi, uint8_t mosi)
+{
+    Host_AdvanceCycles(host_byte_cycles(hspi));
+    return (hspi->Exchange != NULL) ? hspi->Exchange(hspi, mosi) : 0xFF;
+}
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi)
+{
+    return (hspi == NULL) ? HAL_ERROR : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    Host_AdvanceCycles(HOST_HAL_CALL_CYCLES);
+    for (uint16_t i = 0; i < Size; i++)
+        Host_SPI_Exchange(hspi, pData[i]);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    Host_AdvanceCycles(HOST_HAL_CALL_CYCLES);
+    for (uint16_t i = 0; i < Size; i++)
+        pData[i] = Host_SPI_Exchange(hspi, 0xFF);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+        uint16_t Size, uint32_t Timeout)
+{
+    (void) Timeout;
+    Host_AdvanceCycles(HOST_HAL_CALL_CYCLES);
+    for (uint16_t i = 0; i < Size; i++)
+        pRxData[i] = Host_SPI_Exchange(hspi, pTxData[i]);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size)
+{
+    HAL_SPI_Transmit(hspi, pData, Size, HAL_MAX_DELAY);
+    HAL_SPI_TxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+        uint16_t Size)
+{
+    HAL_SPI_TransmitReceive(hspi, pTxData, pRxData, Size, HAL_MAX_DELAY);
+    HAL_SPI_TxRxCpltCallback(hspi);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi)
+{
+    (void) hspi;
+    return HAL_OK;
+}
+
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void) hspi;
+}
+
+__attribute__((weak)) void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    (void) hspi;
+}
@@ -0,0 +1,121 @@
+/*
+ * sd_disk.c
+ */
+
+#include "sd_disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+SD_Disk host_disk = { .write_limit = -1 };
+
+int SD_Disk_Init(uint32_t sectors)
+{
+    SD_Disk_Free();
+    memset(&host_disk, 0, sizeof(host_disk));
+    host_disk.write_limit = -1;
+
+    host_disk.sectors = sectors;
+    host_disk.image = malloc((size_t) sectors * SD_BLOCK_SIZE);
+    if (host_disk.image == NULL)
+        return -1;
+
+    memset(host_disk.image, 0xFF, (size_t) sectors * SD_BLOCK_SIZE);
+    return 0;
+}
+
+int SD_Disk_Load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    long size;
+    int ok;
+
+    if (file == NULL)
+        return -1;
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    ok = SD_Disk_Init(size / SD_BLOCK_SIZE) == 0
+            && fread(host_disk.image, SD_BLOCK_SIZE, host_disk.sectors, file) == host_disk.sectors;
+
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+int SD_Disk_Save(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    int ok;
+
+    if (file == NULL)
+        return -1;
+
+    ok = fwrite(host_disk.image, SD_BLOCK_SIZE, host_disk.sectors, file) == host_disk.sectors;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+void SD_Disk_Free(void)
+{
+    free(host_disk.image);
+    host_disk.image = NULL;
+}
+
+static SD_Error SD_Disk_Read(uint32_t sector, uint32_t count, uint8_t *pBuffer)
+{
+    if (sector >= host_disk.sectors || count > host_disk.sectors - sector)
+        return SD_ADDRESS_ERROR;
+
+    memcpy(pBuffer, &host_disk.image[(size_t) sector * SD_BLOCK_SIZE], (size_t) count * SD_BLOCK_SIZE);
+    host_disk.reads += count;
+    host_disk.read_calls++;
+    return SD_RESPONSE_NO_ERROR;
+}
+
+static SD_Error SD_Disk_Write(uint32_t sector, uint32_t count, const uint8_t *pBuffer)
+{
+    if (sector >= host_disk.sectors || count > host_disk.sectors - sector)
+        return SD_ADDRESS_ERROR;
+
+    host_disk.write_calls++;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // The card lost power: the caller carries on, nothing reaches it any more
+        if (host_disk.write_limit >= 0 && host_disk.writes >= (uint32_t) host_disk.write_limit)
+        {
+            if (host_disk.dropped++ == 0)
+                memcpy(&host_disk.image[(size_t) (sector + i) * SD_BLOCK_SIZE], &pBuffer[i * SD_BLOCK_SIZE],
+                        host_disk.torn_bytes);
+            continue;
+        }
+        memcpy(&host_disk.image[(size_t) (sector + i) * SD_BLOCK_SIZE], &pBuffer[i * SD_BLOCK_SIZE], SD_BLOCK_SIZE);
+        host_disk.writes++;
+    }
+    return SD_RESPONSE_NO_ERROR;
+}
+
+SD_Error SD_SectorRead(SD_SPI_Handle *sd, uint32_t readAddr, uint8_t *pBuffer)
+{
+    (void) sd;
+    return SD_Disk_Read(readAddr, 1, pBuffer);
+}
+
+SD_Error SD_SectorsRead(SD_SPI_Handle *sd, uint32_t readAddr, uint32_t count, uint8_t *pBuffer)
+{
+    (void) sd;
+    return SD_Disk_Read(readAddr, count, pBuffer);
+}
+
+SD_Error SD_SectorWrite(SD_SPI_Handle *sd, uint32_t writeAddr, const uint8_t *pBuffer)
+{
+    (void) sd;
+    return SD_Disk_Write(writeAddr, 1, pBuffer);
+}
+
+SD_Error SD_SectorsWrite(SD_SPI_Handle *sd, uint32_t writeAddr, uint32_t count, const uint8_t *pBuffer)
+{
+    (void) sd;
+    return SD_Disk_Write(writeAddr, count, pBuffer);
+}
@@ -0,0 +1,54 @@
+/*
+ * sd_disk.h
+ *
+ * Host stand-in for the sector calls of the SD driver (SD_SectorRead,
+ * SD_SectorsRead, SD_SectorWrite, SD_SectorsWrite) over a RAM image, for the
+ * layers above the driver. Link it instead of sd_spi_driver.c.
+ */
+
+#ifndef __SD_DISK_H__
+#define __SD_DISK_H__
+
+#include "sd_spi_driver.h"
+
+typedef struct __SD_Disk
+{
+    uint8_t *image;
+    uint32_t sectors;
+
+    /* Sectors moved and calls made, in each direction */
+    uint32_t reads;
+    uint32_t read_calls;
+    uint32_t writes;
+    uint32_t write_calls;
+
+    /* Power loss: sector writes past write_limit are dropped, -1 for none.
+     * The first dropped sector keeps torn_bytes bytes of its new content. */
+    int32_t write_limit;
+    uint16_t torn_bytes;
+    uint32_t dropped;
+} SD_Disk;
+
+extern SD_Disk host_disk;
+
+/**
+ * @brief  Blank (0xFF) image of sectors sectors, counters reset and no write limit
+ * @retval 0 on success
+ */
+int SD_Disk_Init(uint32_t sectors);
+
+/**
+ * @brief  Load the image file at path, counters reset and no write limit
+ * @retval 0 on success
+ */
+int SD_Disk_Load(const char *path);
+
+/**
+ * @brief  Write the image back to a file
+ * @retval 0 on success
+ */
+int SD_Disk_Save(const char *path);
+
+void SD_Disk_Free(void);
+
+#endif // __SD_DISK_H__
@@ -0,0 +1,118 @@
+/*
+ * spi_registers.c
+ *
+ * Register level SPI on the host. The registers of a handle live on a page
+ * without access rights: every access faults, the handler opens the page
+ * and single steps the instruction, then the trap handler acts on what was
+ * accessed and closes the page again.
+ */
+
+#define _GNU_SOURCE
+
+#include "stm32f4xx_hal.h"
+
+#if !defined(__linux__) || !defined(__x86_64__)
+#error "SPI register emulation needs Linux on x86-64"
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define HOST_PAGE_SIZE 4096
+#define HOST_EFLAGS_TF 0x100
+#define HOST_PF_WRITE  0x2
+
+static SPI_HandleTypeDef *mapped_hspi;
+static SPI_TypeDef *mapped_regs;
+static uintptr_t access_offset;
+static int access_write;
+
+static void host_spi_fault(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    uintptr_t offset = (uintptr_t) info->si_addr - (uintptr_t) mapped_regs;
+
+    (void) sig;
+    if (mapped_regs == NULL || offset >= HOST_PAGE_SIZE)
+    {
+        // A real fault: crash on the instruction again
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    access_offset = offset;
+    access_write = (uc->uc_mcontext.gregs[REG_ERR] & HOST_PF_WRITE) != 0;
+    mprotect(mapped_regs, HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= HOST_EFLAGS_TF;
+}
+
+static void host_spi_step(int sig, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    SPI_TypeDef *spi = mapped_regs;
+
+    (void) sig;
+    (void) info;
+    uc->uc_mcontext.gregs[REG_EFL] &= ~HOST_EFLAGS_TF;
+
+    if (access_offset == offsetof(SPI_TypeDef, DR))
+    {
+        if (access_write)
+        {
+            uint32_t mosi = spi->DR;
+            uint32_t miso;
+
+            if (spi->CR1 & SPI_CR1_DFF)
+            {
+                miso = Host_SPI_Exchange(mapped_hspi, (mosi >> 8) & 0xFF) << 8;
+                miso |= Host_SPI_Exchange(mapped_hspi, mosi & 0xFF);
+            }
+            else
+            {
+                miso = Host_SPI_Exchange(mapped_hspi, mosi & 0xFF);
+            }
+            spi->DR = miso;
+            spi->SR |= SPI_SR_RXNE | SPI_SR_TXE;
+        }
+        else
+        {
+            spi->SR &= ~SPI_SR_RXNE;
+        }
+    }
+
+    mprotect(mapped_regs, HOST_PAGE_SIZE, PROT_NONE);
+}
+
+void Host_SPI_MapRegisters(SPI_HandleTypeDef *hspi)
+{
+    struct sigaction action;
+
+    if (mapped_regs == NULL)
+    {
+        mapped_regs = mmap(NULL, HOST_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped_regs == MAP_FAILED)
+            abort();
+
+        memset(&action, 0, sizeof(action));
+        action.sa_flags = SA_SIGINFO;
+        action.sa_sigaction = host_spi_fault;
+        sigaction(SIGSEGV, &action, NULL);
+        action.sa_sigaction = host_spi_step;
+        sigaction(SIGTRAP, &action, NULL);
+    }
+    else
+    {
+        mprotect(mapped_regs, HOST_PAGE_SIZE, PROT_READ | PROT_WRITE);
+    }
+
+    memset(mapped_regs, 0, HOST_PAGE_SIZE);
+    mapped_regs->CR1 = (hspi->Instance != NULL) ? hspi->Instance->CR1 : 0;
+    mapped_regs->SR = SPI_SR_TXE;
+    mapped_hspi = hspi;
+    hspi->Instance = mapped_regs;
+
+    mprotect(mapped_regs, HOST_PAGE_SIZE, PROT_NONE);
+}
@@ -0,0 +1,214 @@
+/*
+ * stm32f4xx_hal.h
+ *
+ * Host stand-in for the parts of the STM32F4 HAL used by the drivers.
+ * SPI transfers go byte by byte to the device attached to the handle,
+ * time is a simulated cycle counter advanced by the bus (see hal_stub.c).
+ */
+
+#ifndef __STM32F4xx_HAL_H
+#define __STM32F4xx_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum
+{
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+
+#define __IO volatile
+#define UNUSED(X) (void)X
+
+#define SET_BIT(REG, BIT) ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT) ((REG) &= ~(BIT))
+#define READ_BIT(REG, BIT) ((REG) & (BIT))
+
+/* Core */
+
+static inline uint32_t __get_PRIMASK(void)
+{
+    return 0;
+}
+static inline void __set_PRIMASK(uint32_t primask)
+{
+    (void) primask;
+}
+static inline void __disable_irq(void)
+{
+}
+static inline void __enable_irq(void)
+{
+}
+#define __NOP()
+
+typedef struct
+{
+    __IO uint32_t CTRL;
+    __IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+    __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type host_dwt;
+extern CoreDebug_Type host_core_debug;
+extern uint32_t SystemCoreClock;
+
+#define DWT (&host_dwt)
+#define CoreDebug (&host_core_debug)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+
+/* GPIO, the output data register keeps the pin levels */
+
+typedef struct
+{
+    __IO uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef enum
+{
+    GPIO_PIN_RESET = 0,
+    GPIO_PIN_SET
+} GPIO_PinState;
+
+#define GPIO_PIN_0  ((uint16_t)0x0001)
+#define GPIO_PIN_1  ((uint16_t)0x0002)
+#define GPIO_PIN_2  ((uint16_t)0x0004)
+#define GPIO_PIN_3  ((uint16_t)0x0008)
+#define GPIO_PIN_4  ((uint16_t)0x0010)
+#define GPIO_PIN_5  ((uint16_t)0x0020)
+#define GPIO_PIN_6  ((uint16_t)0x0040)
+#define GPIO_PIN_7  ((uint16_t)0x0080)
+#define GPIO_PIN_8  ((uint16_t)0x0100)
+#define GPIO_PIN_9  ((uint16_t)0x0200)
+#define GPIO_PIN_13 ((uint16_t)0x2000)
+#define GPIO_PIN_14 ((uint16_t)0x4000)
+
+extern GPIO_TypeDef host_gpioa, host_gpiob, host_gpioc;
+#define GPIOA (&host_gpioa)
+#define GPIOB (&host_gpiob)
+#define GPIOC (&host_gpioc)
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+/* SPI */
+
+typedef struct
+{
+    __IO uint32_t CR1;
+    __IO uint32_t CR2;
+    __IO uint32_t SR;
+    __IO uint32_t DR;
+} SPI_TypeDef;
+
+typedef struct
+{
+    uint32_t Mode;
+    uint32_t Direction;
+    uint32_t DataSize;
+    uint32_t CLKPolarity;
+    uint32_t CLKPhase;
+    uint32_t NSS;
+    uint32_t BaudRatePrescaler;
+    uint32_t FirstBit;
+    uint32_t TIMode;
+    uint32_t CRCCalculation;
+    uint32_t CRCPolynomial;
+} SPI_InitTypeDef;
+
+typedef struct
+{
+    uint32_t Instance;
+} DMA_HandleTypeDef;
+
+typedef struct __SPI_HandleTypeDef
+{
+    SPI_TypeDef *Instance;
+    SPI_InitTypeDef Init;
+    DMA_HandleTypeDef *hdmatx;
+    DMA_HandleTypeDef *hdmarx;
+
+    /* Host only: device on the bus, one byte out (MOSI) for one byte in (MISO) */
+    uint8_t (*Exchange)(struct __SPI_HandleTypeDef *hspi, uint8_t mosi);
+    void *Device;
+} SPI_HandleTypeDef;
+
+extern SPI_TypeDef host_spi1, host_spi2, host_spi4;
+#define SPI1 (&host_spi1)
+#define SPI2 (&host_spi2)
+#define SPI4 (&host_spi4)
+
+#define SPI_BAUDRATEPRESCALER_2   (0x00000000U)
+#define SPI_BAUDRATEPRESCALER_4   (0x00000008U)
+#define SPI_BAUDRATEPRESCALER_8   (0x00000010U)
+#define SPI_BAUDRATEPRESCALER_16  (0x00000018U)
+#define SPI_BAUDRATEPRESCALER_32  (0x00000020U)
+#define SPI_BAUDRATEPRESCALER_64  (0x00000028U)
+#define SPI_BAUDRATEPRESCALER_128 (0x00000030U)
+#define SPI_BAUDRATEPRESCALER_256 (0x00000038U)
+
+#define SPI_CR1_BR_Pos (3U)
+#define SPI_CR1_SPE (1UL << 6)
+#define SPI_CR1_DFF (1UL << 11)
+#define SPI_SR_RXNE (1UL << 0)
+#define SPI_SR_TXE (1UL << 1)
+#define SPI_SR_OVR (1UL << 6)
+#define SPI_SR_BSY (1UL << 7)
+
+#define __HAL_SPI_ENABLE(__HANDLE__) SET_BIT((__HANDLE__)->Instance->CR1, SPI_CR1_SPE)
+#define __HAL_SPI_DISABLE(__HANDLE__) CLEAR_BIT((__HANDLE__)->Instance->CR1, SPI_CR1_SPE)
+#define __HAL_SPI_CLEAR_OVRFLAG(__HANDLE__) \
+    do { __IO uint32_t tmpreg_ovr = (__HANDLE__)->Instance->DR; \
+         tmpreg_ovr = (__HANDLE__)->Instance->SR; UNUSED(tmpreg_ovr); } while (0)
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef *hspi);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+        uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi, const uint8_t *pTxData, uint8_t *pRxData,
+        uint16_t Size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi);
+
+/* RCC and tick */
+
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+/* Host only */
+
+/* Advance the simulated time */
+void Host_AdvanceCycles(uint32_t cycles);
+/* Simulated time since start, in CPU cycles and in us */
+uint64_t Host_Cycles(void);
+uint64_t Host_Micros(void);
+/* Time spent in HAL_Delay since start, in ms */
+uint32_t Host_DelayedMs(void);
+/* One byte through the device of hspi, at the bus cost of the handle */
+uint8_t Host_SPI_Exchange(SPI_HandleTypeDef *hspi, uint8_t mosi);
+/*
+ * Move the registers of hspi to a guarded page so that register level code
+ * reaches the device: a DR write clocks one frame (two bytes with DFF), a
+ * DR read clears RXNE. Linux x86-64 only (spi_registers.c). The moved
+ * registers count as an APB1 bus.
+ */
+void Host_SPI_MapRegisters(SPI_HandleTypeDef *hspi);
+/* Called on every pin write, NULL by default */
+extern void (*Host_GPIO_Hook)(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+
+#endif /* __STM32F4xx_HAL_H */
@@ -0,0 +1,440 @@
+#!/usr/bin/env python3
+#
+# fat_image.py
+#
+# FAT32 images for the host tests of Core/Src/fat32.c, and the checks run on
+# them afterwards. mkfs.fat and fsck.fat (dosfstools) are used when they are
+# installed and the layout allows it, the built-in formatter and checker
+# otherwise. The checker always runs, fsck.fat comes on top.
+#
+#   fat_image.py prep IMAGE SPC MBR    format, then add a fragmented HELLO.TXT,
+#                                      LOGS/ and LOGS/IN.BIN (IMAGE.HELLO.TXT and
+#                                      IMAGE.IN.BIN hold their content)
+#   fat_image.py chain IMAGE           LONG.TXT (600 bytes) on a 6 cluster chain
+#                                      and EMPTY.TXT (0 bytes) on a 3 cluster chain
+#   fat_image.py check IMAGE [--lenient] [PATH=REF[,REF...]...]
+#                                      structure, then each file against its
+#                                      reference: equal, or with --lenient a
+#                                      prefix of one of them
+#   fat_image.py suite TEST_FAT32 DIR  every case of the FAT32 test (make check)
+#
+
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+SECTOR = 512
+EOC = 0x0FFFFFFF
+ATTR_DIRECTORY = 0x10
+ATTR_VOLUME = 0x08
+ATTR_ARCHIVE = 0x20
+
+# 64 MB: enough clusters for FAT32 at 8 sectors per cluster
+IMAGE_SECTORS = 131072
+# Power loss images: just over the FAT32 cluster floor at 1 sector per cluster
+POWER_SECTORS = 70000
+# First partition sector with a MBR
+PARTITION_START = 2048
+# mkfs.fat refuses FAT32 below this cluster count
+FAT32_MIN_CLUSTERS = 65525
+
+
+class Image:
+    def __init__(self, path):
+        self.path = path
+        with open(path, 'rb') as f:
+            self.data = bytearray(f.read())
+        self.parse()
+
+    def save(self):
+        with open(self.path, 'wb') as f:
+            f.write(self.data)
+
+    def parse(self):
+        d = self.data
+        self.lba = 0
+        if d[0] not in (0xEB, 0xE9):
+            self.lba = struct.unpack_from('<I', d, 0x1C6)[0]
+        o = self.lba * SECTOR
+        self.spc = d[o + 13]
+        self.reserved = struct.unpack_from('<H', d, o + 14)[0]
+        self.num_fats = d[o + 16]
+        total = struct.unpack_from('<I', d, o + 32)[0]
+        self.fat_size = struct.unpack_from('<I', d, o + 36)[0]
+        self.root = struct.unpack_from('<I', d, o + 44)[0]
+        self.fsinfo = self.lba + struct.unpack_from('<H', d, o + 48)[0]
+        self.fat_start = self.lba + self.reserved
+        self.data_start = self.fat_start + self.num_fats * self.fat_size
+        self.clusters = (total - (self.data_start - self.lba)) // self.spc
+        self.fats = [memoryview(d)[(self.fat_start + k * self.fat_size) * SECTOR:
+                                   (self.fat_start + (k + 1) * self.fat_size) * SECTOR].cast('I')
+                     for k in range(self.num_fats)]
+
+    def entry(self, cluster, fat=0):
+        return self.fats[fat][cluster] & 0x0FFFFFFF
+
+    def set_entry(self, cluster, value):
+        for fat in self.fats:
+            fat[cluster] = value
+
+    def valid(self, cluster):
+        return 2 <= cluster < self.clusters + 2
+
+    def offset(self, cluster):
+        return (self.data_start + (cluster - 2) * self.spc) * SECTOR
+
+    def chain(self, cluster):
+        seen = []
+        while self.valid(cluster) and len(seen) <= self.clusters:
+            seen.append(cluster)
+            cluster = self.entry(cluster)
+        return seen
+
+    def entries(self, cluster):
+        """Offsets of the used short entries of a directory"""
+        for c in self.chain(cluster):
+            for o in range(self.offset(c), self.offset(c) + self.spc * SECTOR, 32):
+                if self.data[o] == 0:
+                    return
+                if self.data[o] == 0xE5 or self.data[o + 11] & ATTR_VOLUME:
+                    continue
+                yield o
+
+    def first_cluster(self, o):
+        return struct.unpack_from('<H', self.data, o + 20)[0] << 16 | struct.unpack_from('<H', self.data, o + 26)[0]
+
+    def size(self, o):
+        return struct.unpack_from('<I', self.data, o + 28)[0]
+
+    @staticmethod
+    def short_name(name):
+        base, _, ext = name.upper().partition('.')
+        return (base.ljust(8) + ext.ljust(3)).encode()
+
+    def find(self, path):
+        """Offset of the entry of path, None if missing"""
+        cluster = self.root
+        parts = path.strip('/').split('/')
+        for i, part in enumerate(parts):
+            for o in self.entries(cluster):
+                if self.data[o:o + 11] == self.short_name(part):
+                    break
+            else:
+                return None
+            if i < len(parts) - 1:
+                cluster = self.first_cluster(o)
+        return o
+
+    def read(self, path):
+        o = self.find(path)
+        if o is None:
+            return None
+        out = bytearray()
+        for c in self.chain(self.first_cluster(o)):
+            out += self.data[self.offset(c):self.offset(c) + self.spc * SECTOR]
+        return bytes(out[:self.size(o)])
+
+    def free_clusters(self):
+        return [c for c in range(2, self.clusters + 2) if self.entry(c) == 0]
+
+    def allocate(self, count, fragmented=False):
+        free = self.free_clusters()
+        if fragmented:
+            free = free[::3]
+        chain = free[:count]
+        for a, b in zip(chain, chain[1:] + [EOC]):
+            self.set_entry(a, b)
+        return chain
+
+    def add(self, directory, name, content, attr=ATTR_ARCHIVE, fragmented=False):
+        cluster_bytes = self.spc * SECTOR
+        count = max(1, -(-len(content) // cluster_bytes)) if content or attr & ATTR_DIRECTORY else 0
+        chain = self.allocate(count, fragmented) if count else []
+        for i, c in enumerate(chain):
+            part = content[i * cluster_bytes:(i + 1) * cluster_bytes]
+            self.data[self.offset(c):self.offset(c) + cluster_bytes] = part.ljust(cluster_bytes, b'\0')
+        o = self.offset(directory)
+        while self.data[o] != 0:
+            o += 32
+        first = chain[0] if chain else 0
+        self.data[o:o + 32] = self.dir_entry(self.short_name(name), attr, first, len(content))
+        if attr & ATTR_DIRECTORY:
+            o = self.offset(first)
+            parent = 0 if directory == self.root else directory
+            self.data[o:o + 32] = self.dir_entry(b'.          ', ATTR_DIRECTORY, first, 0)
+            self.data[o + 32:o + 64] = self.dir_entry(b'..         ', ATTR_DIRECTORY, parent, 0)
+        return first
+
+    @staticmethod
+    def dir_entry(name, attr, first, size):
+        e = bytearray(32)
+        e[0:11] = name
+        e[11] = attr
+        struct.pack_into('<H', e, 20, first >> 16)
+        struct.pack_into('<HI', e, 26, first & 0xFFFF, 0 if attr & ATTR_DIRECTORY else size)
+        return e
+
+    def set_first_cluster(self, path, cluster):
+        o = self.find(path)
+        struct.pack_into('<H', self.data, o + 20, cluster >> 16)
+        struct.pack_into('<H', self.data, o + 26, cluster & 0xFFFF)
+
+    def update_fsinfo(self):
+        struct.pack_into('<I', self.data, self.fsinfo * SECTOR + 488, len(self.free_clusters()))
+
+    def check(self, lenient=False):
+        """
+        Errors of the volume. Lenient is the state a power loss may leave: FAT
+        copies may differ, clusters may be lost, a chain may run past the size
+        and the FSInfo count is only a hint. Chains shorter than their size,
+        entries on free clusters and cross links are errors either way.
+        """
+        errors = []
+        cluster_bytes = self.spc * SECTOR
+        for fat in range(1, self.num_fats):
+            if not lenient and self.fats[fat] != self.fats[0]:
+                errors.append('FAT %d differs from FAT 0' % fat)
+
+        used = set()
+
+        def claim(path, chain):
+            for c in chain:
+                if c in used:
+                    errors.append('%s: cross-linked cluster %d' % (path, c))
+                used.add(c)
+
+        def walk(directory, prefix):
+            claim(prefix or '/', self.chain(directory))
+            for o in self.entries(directory):
+                name = self.data[o:o + 11]
+                if name[0] == ord('.'):
+                    continue
+                path = prefix + '/' + name.decode('ascii', 'replace').replace(' ', '')
+                first = self.first_cluster(o)
+                if first != 0 and (not self.valid(first) or self.entry(first) == 0):
+                    errors.append('%s: first cluster %d is free' % (path, first))
+                    continue
+                if self.data[o + 11] & ATTR_DIRECTORY:
+                    walk(first, path)
+                    continue
+                chain = self.chain(first) if first else []
+                needed = -(-self.size(o) // cluster_bytes)
+                if len(chain) < needed or (not lenient and len(chain) != needed):
+                    errors.append('%s: %d bytes on %d clusters' % (path, self.size(o), len(chain)))
+                claim(path, chain)
+
+        walk(self.root, '')
+
+        lost = [c for c in range(2, self.clusters + 2) if self.entry(c) != 0 and c not in used]
+        if lost and not lenient:
+            errors.append('%d lost clusters' % len(lost))
+
+        free = struct.unpack_from('<I', self.data, self.fsinfo * SECTOR + 488)[0]
+        if not lenient and free != 0xFFFFFFFF and free != len(self.free_clusters()):
+            errors.append('FSInfo free count %d, %d free' % (free, len(self.free_clusters())))
+        return errors
+
+
+def have(tool):
+    return shutil.which(tool) is not None
+
+
+def mkfs(path, spc, mbr, sectors=IMAGE_SECTORS):
+    """Format path, with mkfs.fat when it can make this layout"""
+    if not mbr and have('mkfs.fat') and (sectors - 32) // spc >= FAT32_MIN_CLUSTERS + 1024:
+        with open(path, 'wb') as f:
+            f.truncate(sectors * SECTOR)
+        subprocess.run(['mkfs.fat', '-F', '32', '-s', str(spc), '-S', str(SECTOR), '-R', '32', '-f', '2', path],
+                       check=True, stdout=subprocess.DEVNULL)
+        return 'mkfs.fat'
+
+    d = bytearray(sectors * SECTOR)
+    lba = PARTITION_START if mbr else 0
+    total = sectors - lba
+    reserved, num_fats, fat_size = 32, 2, 1
+    while True:
+        clusters = (total - reserved - num_fats * fat_size) // spc
+        need = -(-(clusters + 2) * 4 // SECTOR)
+        if need <= fat_size:
+            break
+        fat_size = need
+
+    o = lba * SECTOR
+    d[o:o + 3] = b'\xEB\x58\x90'
+    d[o + 3:o + 11] = b'MSWIN4.1'
+    struct.pack_into('<HBHBHHBHHHII', d, o + 11, SECTOR, spc, reserved, num_fats, 0, 0, 0xF8, 0, 63, 255, lba, total)
+    struct.pack_into('<IHHIHH', d, o + 36, fat_size, 0, 0, 2, 1, 6)
+    d[o + 66] = 0x29
+    d[o + 71:o + 82] = b'NO NAME    '
+    d[o + 82:o + 90] = b'FAT32   '
+    d[o + 510:o + 512] = b'\x55\xAA'
+
+    fsinfo = o + SECTOR
+    struct.pack_into('<I', d, fsinfo, 0x41615252)
+    struct.pack_into('<I', d, fsinfo + 484, 0x61417272)
+    struct.pack_into('<II', d, fsinfo + 488, clusters - 1, 3)
+    d[fsinfo + 510:fsinfo + 512] = b'\x55\xAA'
+    d[o + 6 * SECTOR:o + 7 * SECTOR] = d[o:o + SECTOR]
+
+    for k in range(num_fats):
+        struct.pack_into('<III', d, (lba + reserved + k * fat_size) * SECTOR, 0x0FFFFFF8, EOC, EOC)
+
+    if mbr:
+        d[0x1BE + 4] = 0x0C
+        struct.pack_into('<II', d, 0x1C6, lba, total)
+        d[510:512] = b'\x55\xAA'
+
+    with open(path, 'wb') as f:
+        f.write(d)
+    return 'built-in'
+
+
+def prep(path, spc, mbr, sectors=IMAGE_SECTORS):
+    how = mkfs(path, spc, mbr, sectors)
+    image = Image(path)
+    rng = random.Random(1)
+
+    hello = bytes(rng.getrandbits(8) for _ in range(100000))
+    image.add(image.root, 'HELLO.TXT', hello, fragmented=True)
+    logs = image.add(image.root, 'LOGS', b'', attr=ATTR_DIRECTORY)
+    inbin = bytes(rng.getrandbits(8) for _ in range(20000))
+    image.add(logs, 'IN.BIN', inbin)
+    image.update_fsinfo()
+    image.save()
+
+    for name, content in (('HELLO.TXT', hello), ('IN.BIN', inbin)):
+        with open(path + '.' + name, 'wb') as f:
+            f.write(content)
+    return how
+
+
+def chain(path):
+    mkfs(path, 1, False)
+    image = Image(path)
+
+    first = image.add(image.root, 'LONG.TXT', b'x' * 600)
+    tail = image.allocate(4)
+    image.set_entry(image.chain(first)[-1], tail[0])
+
+    image.add(image.root, 'EMPTY.TXT', b'')
+    image.set_first_cluster('EMPTY.TXT', image.allocate(3)[0])
+
+    image.update_fsinfo()
+    image.save()
+
+
+def check(path, lenient, specs):
+    image = Image(path)
+    errors = image.check(lenient)
+
+    for spec in specs:
+        name, refs = spec.split('=', 1)
+        content = image.read(name)
+        expected = []
+        for ref in refs.split(','):
+            with open(ref, 'rb') as f:
+                expected.append(f.read())
+        if content is None:
+            if not lenient:
+                errors.append('%s: missing' % name)
+        elif lenient and not any(e.startswith(content) for e in expected):
+            errors.append('%s: %d bytes, not a prefix of the expected content' % (name, len(content)))
+        elif not lenient and content not in expected:
+            errors.append('%s: content differs' % name)
+
+    if not lenient and have('fsck.fat'):
+        run = subprocess.run(['fsck.fat', '-n', path], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        if run.returncode != 0:
+            errors.append('fsck.fat: ' + run.stdout.strip().replace('\n', ' / '))
+    return errors
+
+
+def report(what, errors):
+    print('%s: %s' % (what, '; '.join(errors) if errors else 'clean'))
+    return not errors
+
+
+def run(args):
+    return subprocess.run(args).returncode == 0
+
+
+def suite(test, directory):
+    os.makedirs(directory, exist_ok=True)
+    ok = True
+
+    # Round trip on every layout
+    for spc in (1, 4, 8):
+        for mbr in (False, True):
+            path = os.path.join(directory, 'fat_spc%d%s.img' % (spc, '_mbr' if mbr else ''))
+            how = prep(path, spc, mbr)
+            print('%s (%s)' % (path, how))
+            ok &= run([test, 'roundtrip', path])
+            refs = ['%s=%s.%s' % (name, path, name.split('/')[-1])
+                    for name in ('HELLO.TXT', 'LOGS/IN.BIN', 'NEW.BIN', 'LOGS/F33.LOG', 'EMPTY')]
+            ok &= report(path, check(path, False, refs))
+
+    # Appends along chains longer than the size
+    path = os.path.join(directory, 'fat_chain.img')
+    chain(path)
+    ok &= run([test, 'chain', path])
+    ok &= report(path, check(path, False, ['LONG.TXT=%s.LONG.TXT' % path, 'EMPTY.TXT=%s.EMPTY.TXT' % path]))
+
+    # Power loss after every few sector writes of the logging workload. Each
+    # cut copies and saves a whole image, in RAM when /dev/shm is there
+    temp = tempfile.TemporaryDirectory(dir='/dev/shm' if os.path.isdir('/dev/shm') else None)
+    base = os.path.join(temp.name, 'fat_power_base.img')
+    prep(base, 1, False, POWER_SECTORS)
+    path = os.path.join(temp.name, 'fat_power.img')
+    shutil.copyfile(base, path)
+    out = subprocess.run([test, 'power', path, '-1'], stdout=subprocess.PIPE, text=True)
+    print(out.stdout, end='')
+    found = re.search(r'sector writes: (\d+)', out.stdout)
+    writes = int(found.group(1)) if found else 0
+    ok &= out.returncode == 0 and writes > 0
+    files = ['HELLO.TXT', 'LOGS/A.LOG', 'LOGS/B.LOG', 'DATA.BIN']
+    refs = ['%s=%s' % (name, ','.join('%s.%s%s' % (path, name.split('/')[-1], s) for s in ('', '.OLD')))
+            for name in files]
+    ok &= report('power loss, no cut', check(path, False, ['%s=%s.%s' % (n, path, n.split('/')[-1]) for n in files]))
+
+    cuts = sorted(set(list(range(0, 24)) + list(range(24, writes, max(1, writes // 40)))))
+    failed = 0
+    for cut in cuts:
+        shutil.copyfile(base, path)
+        if subprocess.run([test, 'power', path, str(cut)], stdout=subprocess.DEVNULL).returncode != 0:
+            failed += 1
+            continue
+        errors = check(path, True, refs)
+        if errors:
+            failed += 1
+            report('power loss after %d writes' % cut, errors)
+    print('power loss: %d cuts over %d writes, %d failed' % (len(cuts), writes, failed))
+    ok &= failed == 0
+    temp.cleanup()
+
+    return ok
+
+
+def main(argv):
+    if len(argv) >= 5 and argv[1] == 'prep':
+        print(prep(argv[2], int(argv[3]), argv[4] == '1'))
+    elif len(argv) == 3 and argv[1] == 'chain':
+        chain(argv[2])
+    elif len(argv) >= 3 and argv[1] == 'check':
+        lenient = '--lenient' in argv[3:]
+        specs = [a for a in argv[3:] if a != '--lenient']
+        return 0 if report(argv[2], check(argv[2], lenient, specs)) else 1
+    elif len(argv) == 4 and argv[1] == 'suite':
+        return 0 if suite(argv[2], argv[3]) else 1
+    else:
+        print('usage: see the head of %s' % argv[0])
+        return 2
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
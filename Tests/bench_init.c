@@ -0,0 +1,62 @@
+/*
+ * bench_init.c
+ *
+ * Panel bring-up time on the simulated SPI1 bus plus the waits. The current
+ * driver waits with HAL_Delay, counted by the host HAL. The baseline waited
+ * with a busy loop (ili9341_delay), which takes no simulated time on the host,
+ * so its length on the target is added from BENCH_DELAY_LOOP_CYCLES.
+ */
+
+#include "ili9341_driver.h"
+#include "lcd_bus_model.h"
+
+#include <stdio.h>
+
+#ifndef BENCH_LABEL
+#define BENCH_LABEL "current"
+#endif
+
+#ifdef BENCH_LEGACY
+/* ili9341_delay(120): 120 x 2000 turns of a loop on a volatile counter */
+#define BENCH_DELAY_LOOP_ITERATIONS (120ULL * 2000)
+/* Load, add, store, load, compare and taken branch at -Os, from the ART cache */
+#ifndef BENCH_DELAY_LOOP_CYCLES
+#define BENCH_DELAY_LOOP_CYCLES 8
+#endif
+#endif
+
+static SPI_HandleTypeDef hspi1;
+static DMA_HandleTypeDef hdma_tx;
+static LCD_Handle hlcd;
+static LCD_BusModel panel;
+
+int main(void)
+{
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+    hspi1.hdmatx = &hdma_tx;
+    hlcd.Init.hspi = &hspi1;
+    hlcd.Init.CS_Port = GPIOB;
+    hlcd.Init.CS_Pin = GPIO_PIN_6;
+    hlcd.Init.DC_Port = GPIOA;
+    hlcd.Init.DC_Pin = GPIO_PIN_9;
+    hlcd.Init.RESET_Port = GPIOC;
+    hlcd.Init.RESET_Pin = GPIO_PIN_7;
+
+    LCD_Model_Attach(&panel, &hspi1, GPIOB, GPIO_PIN_6, GPIOA, GPIO_PIN_9);
+
+    uint64_t start = Host_Micros();
+    ili9341_init(&hlcd);
+    uint64_t us = Host_Micros() - start;
+
+    uint64_t bus_us = us - Host_DelayedMs() * 1000ULL;
+    uint64_t wait_us = Host_DelayedMs() * 1000ULL;
+#ifdef BENCH_LEGACY
+    wait_us += BENCH_DELAY_LOOP_ITERATIONS * BENCH_DELAY_LOOP_CYCLES / (SystemCoreClock / 1000000);
+#endif
+
+    printf("%-8s init %4llu us on the bus + %5llu us waiting = %5llu us  %3u bytes  %3u CS assertions\n",
+            BENCH_LABEL, (unsigned long long) bus_us, (unsigned long long) wait_us,
+            (unsigned long long) (bus_us + wait_us), panel.bytes, panel.cs_asserts);
+    return 0;
+}
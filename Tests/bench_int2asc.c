@@ -0,0 +1,49 @@
+/*
+ * bench_int2asc.c
+ *
+ * Host CPU time of int2asc and int2asc_padded over the same values, only the
+ * ratio carries over to the target.
+ */
+
+#include "lcd_driver.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_CALLS 2000000
+
+static volatile char sink;
+
+static double Seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(void)
+{
+    char buf[16];
+    double start, old_s, new_s;
+
+    start = Seconds();
+    for (long i = 0; i < BENCH_CALLS; i++)
+    {
+        int2asc(i * 997 % 100000000, i & 3, buf, sizeof(buf));
+        sink = buf[0];
+    }
+    old_s = Seconds() - start;
+
+    start = Seconds();
+    for (long i = 0; i < BENCH_CALLS; i++)
+    {
+        int2asc_padded(i * 997 % 100000000, i & 3, 0, buf, sizeof(buf));
+        sink = buf[0];
+    }
+    new_s = Seconds() - start;
+
+    printf("int2asc         %6.1f ns/call\n", old_s * 1e9 / BENCH_CALLS);
+    printf("int2asc_padded  %6.1f ns/call  (%.1fx)\n", new_s * 1e9 / BENCH_CALLS, old_s / new_s);
+    return 0;
+}
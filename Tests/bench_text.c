@@ -0,0 +1,63 @@
+/*
+ * bench_text.c
+ *
+ * Text throughput on the simulated SPI1 bus (42 MHz, HAL call and pin write
+ * costs included). Built against the current driver and, for the "before"
+ * numbers, against the driver of the baseline revision (see the Makefile).
+ */
+
+#include "ili9341_driver.h"
+#include "lcd_bus_model.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef BENCH_LABEL
+#define BENCH_LABEL "current"
+#endif
+
+#define BENCH_LINES 100
+
+static SPI_HandleTypeDef hspi1;
+static DMA_HandleTypeDef hdma_tx;
+static LCD_Handle hlcd;
+static LCD_BusModel panel;
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+#ifndef BENCH_LEGACY
+    ili9341_tx_complete(&hlcd, hspi);
+#else
+    (void) hspi;
+#endif
+}
+
+int main(void)
+{
+    char line[] = "The quick brown fox jumps.";
+    uint32_t chars = BENCH_LINES * strlen(line);
+
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+    hspi1.hdmatx = &hdma_tx;
+    hlcd.Init.hspi = &hspi1;
+    hlcd.Init.CS_Port = GPIOB;
+    hlcd.Init.CS_Pin = GPIO_PIN_6;
+    hlcd.Init.DC_Port = GPIOA;
+    hlcd.Init.DC_Pin = GPIO_PIN_9;
+    hlcd.Init.RESET_Port = GPIOC;
+    hlcd.Init.RESET_Pin = GPIO_PIN_7;
+
+    LCD_Model_Attach(&panel, &hspi1, GPIOB, GPIO_PIN_6, GPIOA, GPIO_PIN_9);
+    ili9341_init(&hlcd);
+    LCD_Model_ResetCounters(&panel);
+
+    uint64_t start = Host_Cycles();
+    for (int i = 0; i < BENCH_LINES; i++)
+        hlcd.PrintString(&hlcd, 0, (i % 12) * 20, line, 1, WHITE, BLACK);
+    double seconds = (double) (Host_Cycles() - start) / SystemCoreClock;
+
+    printf("%-8s %8.0f chars/s  %6.1f bytes/char  %7.2f CS/char\n", BENCH_LABEL, chars / seconds,
+            (double) panel.bytes / chars, (double) panel.cs_asserts / chars);
+    return 0;
+}
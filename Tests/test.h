@@ -0,0 +1,29 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+/*
+ * Minimal assertions for the host tests: a failed check is reported and
+ * counted, TEST_EXIT() makes the test return non-zero if any failed.
+ */
+
+static int test_checks;
+static int test_failures;
+
+#define CHECK(cond) \
+    do { test_checks++; \
+        if (!(cond)) { test_failures++; printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { long long a_ = (long long) (a), b_ = (long long) (b); test_checks++; \
+        if (a_ != b_) { test_failures++; \
+            printf("%s:%d: %s == %s failed (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, a_, b_); } \
+    } while (0)
+
+#define TEST_EXIT() \
+    do { printf("%s: %d checks, %d failed\n", __FILE__, test_checks, test_failures); \
+        return test_failures != 0; } while (0)
+
+#endif // __TEST_H__
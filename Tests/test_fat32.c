@@ -0,0 +1,365 @@
+/*
+ * test_fat32.c
+ *
+ * FAT32 layer on an image file, through the sector stub of Stubs/sd_disk.c.
+ * Run by Tools/fat_image.py, which prepares the images and checks them (and
+ * the IMAGE.<NAME> files holding the content each file must end with) after:
+ *
+ *   test_fat32 roundtrip IMAGE   reads, writes, appends, overwrites, many files,
+ *                                truncation and bad names on a prepared image
+ *   test_fat32 chain IMAGE       appends to files whose chain runs past their size
+ *   test_fat32 power IMAGE CUT   logging workload, sector writes past CUT are
+ *                                lost (-1: none, the count is printed)
+ */
+
+#include "fat32.h"
+#include "sd_disk.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_FILE_MAX 400000
+
+static SD_SPI_Handle hsd;
+static FAT32_Volume volume;
+static FAT32_File file;
+
+static uint8_t expected[TEST_FILE_MAX];
+static uint8_t got[TEST_FILE_MAX];
+
+static const char *image;
+
+static long LoadReference(const char *name, uint8_t *data)
+{
+    char path[512];
+    FILE *ref;
+    long len;
+
+    snprintf(path, sizeof(path), "%s.%s", image, name);
+    ref = fopen(path, "rb");
+    if (ref == NULL)
+        return -1;
+    len = fread(data, 1, TEST_FILE_MAX, ref);
+    fclose(ref);
+    return len;
+}
+
+static void SaveReference(const char *name, const void *data, uint32_t len)
+{
+    char path[512];
+    FILE *ref;
+
+    snprintf(path, sizeof(path), "%s.%s", image, name);
+    ref = fopen(path, "wb");
+    CHECK(ref != NULL);
+    if (ref == NULL)
+        return;
+    CHECK_EQ(fwrite(data, 1, len, ref), len);
+    fclose(ref);
+}
+
+// Whole content of path through the FAT32 layer
+static long ReadAll(const char *path, uint8_t *data)
+{
+    uint32_t done;
+
+    if (FAT32_Open(&volume, &file, path, FAT32_READ) != FAT32_OK)
+        return -1;
+    if (FAT32_Read(&file, data, TEST_FILE_MAX, &done) != FAT32_OK)
+        done = -1;
+    FAT32_Close(&file);
+    return done;
+}
+
+static void Mount(void)
+{
+    CHECK_EQ(SD_Disk_Load(image), 0);
+    CHECK_EQ(FAT32_Mount(&volume, &hsd), FAT32_OK);
+}
+
+static void Unmount(void)
+{
+    CHECK_EQ(FAT32_Sync(&volume), FAT32_OK);
+    CHECK_EQ(SD_Disk_Save(image), 0);
+    SD_Disk_Free();
+}
+
+// Fragmented file in random chunks, contiguous file in one call
+static void TestRead(void)
+{
+    uint32_t position = 0, done;
+    long len = LoadReference("HELLO.TXT", expected);
+
+    CHECK(len > 0);
+    CHECK_EQ(FAT32_Open(&volume, &file, "hello.txt", FAT32_READ), FAT32_OK);
+    CHECK_EQ(file.size, len);
+    while (position < file.size)
+    {
+        CHECK_EQ(FAT32_Read(&file, got + position, rand() % 3000 + 1, &done), FAT32_OK);
+        if (done == 0)
+            break;
+        position += done;
+    }
+    CHECK_EQ(position, len);
+    CHECK(memcmp(got, expected, len) == 0);
+    CHECK_EQ(FAT32_Read(&file, got, 10, &done), FAT32_OK);
+    CHECK_EQ(done, 0);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+
+    len = LoadReference("IN.BIN", expected);
+    host_disk.reads = 0;
+    host_disk.read_calls = 0;
+    CHECK_EQ(ReadAll("/LOGS/IN.BIN", got), len);
+    CHECK(memcmp(got, expected, len) == 0);
+    // Contiguous clusters go in multiple block reads (the file sits in the holes HELLO.TXT left)
+    CHECK(host_disk.read_calls < host_disk.reads);
+    printf("IN.BIN: %u sectors in %u reads\n", host_disk.reads, host_disk.read_calls);
+}
+
+static void TestWrite(void)
+{
+    uint32_t position = 0, done;
+
+    for (int i = 0; i < 300000; i++)
+        expected[i] = rand();
+
+    // Mixed chunks, some whole sectors
+    CHECK_EQ(FAT32_Open(&volume, &file, "NEW.BIN", FAT32_WRITE | FAT32_CREATE), FAT32_OK);
+    host_disk.writes = 0;
+    host_disk.write_calls = 0;
+    while (position < 200000)
+    {
+        uint32_t len = (rand() % 2) ? rand() % 700 + 1 : (rand() % 8 + 1) * SD_BLOCK_SIZE;
+
+        if (position + len > 200000)
+            len = 200000 - position;
+        CHECK_EQ(FAT32_Write(&file, expected + position, len, &done), FAT32_OK);
+        CHECK_EQ(done, len);
+        position += done;
+    }
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    printf("NEW.BIN: %u sectors in %u writes\n", host_disk.writes, host_disk.write_calls);
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "NEW.BIN", FAT32_WRITE | FAT32_APPEND), FAT32_OK);
+    CHECK_EQ(file.position, 200000);
+    CHECK_EQ(FAT32_Write(&file, expected + 200000, 100000, &done), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+
+    // Overwrite in the middle, the size stays
+    memset(expected + 1000, 'Z', 5000);
+    CHECK_EQ(FAT32_Open(&volume, &file, "NEW.BIN", FAT32_READ | FAT32_WRITE), FAT32_OK);
+    CHECK_EQ(FAT32_Seek(&file, 1000), FAT32_OK);
+    CHECK_EQ(FAT32_Write(&file, expected + 1000, 5000, &done), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+
+    CHECK_EQ(ReadAll("NEW.BIN", got), 300000);
+    CHECK(memcmp(got, expected, 300000) == 0);
+    SaveReference("NEW.BIN", expected, 300000);
+}
+
+// Enough entries to grow the LOGS directory past its first cluster at 1 sector per cluster
+static void TestManyFiles(void)
+{
+    char path[32], line[40];
+    uint32_t done;
+    int len;
+
+    for (int i = 0; i < 40; i++)
+    {
+        snprintf(path, sizeof(path), "LOGS/F%d.LOG", i);
+        len = snprintf(line, sizeof(line), "file %d\r\n", i);
+        CHECK_EQ(FAT32_Open(&volume, &file, path, FAT32_WRITE | FAT32_CREATE | FAT32_APPEND), FAT32_OK);
+        CHECK_EQ(FAT32_Write(&file, line, len, &done), FAT32_OK);
+        CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    }
+
+    len = snprintf(line, sizeof(line), "file %d\r\n", 33);
+    CHECK_EQ(ReadAll("LOGS/F33.LOG", got), len);
+    CHECK(memcmp(got, line, len) == 0);
+    SaveReference("F33.LOG", line, len);
+}
+
+static void TestTruncate(void)
+{
+    uint32_t done;
+    uint32_t free_count = volume.free_count;
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "HELLO.TXT", FAT32_WRITE | FAT32_TRUNCATE), FAT32_OK);
+    CHECK_EQ(file.size, 0);
+    CHECK_EQ(FAT32_Write(&file, "short", 5, &done), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    // 100000 bytes of clusters back, one taken
+    CHECK(volume.free_count > free_count);
+
+    CHECK_EQ(ReadAll("HELLO.TXT", got), 5);
+    CHECK(memcmp(got, "short", 5) == 0);
+    SaveReference("HELLO.TXT", "short", 5);
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "HELLO.TXT", FAT32_READ | FAT32_TRUNCATE), FAT32_INVALID);
+}
+
+static void TestNames(void)
+{
+    CHECK_EQ(FAT32_Open(&volume, &file, "EMPTY", FAT32_WRITE | FAT32_CREATE), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    CHECK_EQ(ReadAll("EMPTY", got), 0);
+    SaveReference("EMPTY", "", 0);
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "NOPE.TXT", FAT32_READ), FAT32_NOT_FOUND);
+    CHECK_EQ(FAT32_Open(&volume, &file, "NOPE/A.TXT", FAT32_READ), FAT32_NOT_FOUND);
+    CHECK_EQ(FAT32_Open(&volume, &file, "A*B", FAT32_READ), FAT32_INVALID);
+    CHECK_EQ(FAT32_Open(&volume, &file, "TOOLONGNAME.TXT", FAT32_READ), FAT32_INVALID);
+    CHECK_EQ(FAT32_Open(&volume, &file, "LOGS", FAT32_READ), FAT32_INVALID);
+    CHECK_EQ(FAT32_Open(&volume, &file, "HELLO.TXT/X", FAT32_READ), FAT32_INVALID);
+}
+
+static void TestRoundTrip(void)
+{
+    Mount();
+    printf("%s: %u sectors per cluster, %u clusters, %u free\n", image, 1U << volume.cluster_shift,
+            volume.cluster_count, volume.free_count);
+    TestRead();
+    TestWrite();
+    TestManyFiles();
+    TestTruncate();
+    TestNames();
+    Unmount();
+
+    // Everything is on the image, not only in the volume and file buffers
+    Mount();
+    CHECK_EQ(ReadAll("NEW.BIN", got), 300000);
+    CHECK(memcmp(got, expected, 300000) == 0);
+    CHECK_EQ(ReadAll("HELLO.TXT", got), 5);
+    SD_Disk_Free();
+}
+
+// Appends reuse the chain found past the size instead of leaking it
+static void TestChain(void)
+{
+    static uint8_t content[2100];
+    uint32_t done;
+    uint32_t free_count;
+
+    Mount();
+    free_count = volume.free_count;
+    memset(content, 'x', 600);
+    memset(content + 600, 'y', 1500);
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "LONG.TXT", FAT32_WRITE | FAT32_APPEND), FAT32_OK);
+    CHECK_EQ(FAT32_Write(&file, content + 600, 1500, &done), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    SaveReference("LONG.TXT", content, 2100);
+
+    CHECK_EQ(FAT32_Open(&volume, &file, "EMPTY.TXT", FAT32_WRITE | FAT32_APPEND), FAT32_OK);
+    CHECK_EQ(FAT32_Write(&file, content + 600, 700, &done), FAT32_OK);
+    CHECK_EQ(FAT32_Close(&file), FAT32_OK);
+    SaveReference("EMPTY.TXT", content + 600, 700);
+
+    // 6 + 3 clusters on the chains, 5 + 2 needed: two come back, none taken
+    CHECK_EQ(volume.free_count, free_count + 2);
+
+    CHECK_EQ(ReadAll("LONG.TXT", got), 2100);
+    CHECK(memcmp(got, content, 2100) == 0);
+    Unmount();
+}
+
+static uint32_t AppendRandom(const char *path, uint8_t *content, uint32_t *size, uint32_t len, int check)
+{
+    uint32_t done = 0;
+    FAT32_Result res;
+
+    for (uint32_t i = 0; i < len; i++)
+        content[*size + i] = 'a' + rand() % 26;
+
+    res = FAT32_Open(&volume, &file, path, FAT32_WRITE | FAT32_CREATE | FAT32_APPEND);
+    if (res == FAT32_OK)
+        res = FAT32_Write(&file, content + *size, len, &done);
+    if (res == FAT32_OK)
+        res = FAT32_Close(&file);
+    if (check)
+        CHECK_EQ(res, FAT32_OK);
+
+    *size += len;
+    return done;
+}
+
+/*
+ * Logger workload: three files appended to and closed in turns, one file
+ * truncated and rewritten. Once the cut is reached nothing reaches the image
+ * any more, so the image is the card as it was when the power went. After a
+ * cut the layer reads stale sectors back and may fail, that is not checked.
+ */
+static void TestPower(int32_t cut)
+{
+    static uint8_t a[40000], b[40000], data[200000], hello[40000];
+    uint32_t a_size = 0, b_size = 0, data_size = 0, hello_size = 0;
+    int check = cut < 0;
+    long old_len;
+    uint32_t done;
+
+    Mount();
+    host_disk.write_limit = cut;
+
+    old_len = ReadAll("HELLO.TXT", got);
+    CHECK(old_len > 0);
+    SaveReference("HELLO.TXT.OLD", got, old_len);
+    SaveReference("A.LOG.OLD", "", 0);
+    SaveReference("B.LOG.OLD", "", 0);
+    SaveReference("DATA.BIN.OLD", "", 0);
+
+    for (int round = 0; round < 12; round++)
+    {
+        AppendRandom("LOGS/A.LOG", a, &a_size, 300 + rand() % 200, check);
+        AppendRandom("LOGS/B.LOG", b, &b_size, 1500 + rand() % 1000, check);
+        AppendRandom("DATA.BIN", data, &data_size, 6000 + rand() % 8000, check);
+
+        if (round == 5)
+        {
+            FAT32_Result res = FAT32_Open(&volume, &file, "HELLO.TXT", FAT32_WRITE | FAT32_TRUNCATE);
+
+            for (int i = 0; i < 3000; i++)
+                hello[i] = 'A' + i % 26;
+            hello_size = 3000;
+            if (res == FAT32_OK)
+                res = FAT32_Write(&file, hello, hello_size, &done);
+            if (res == FAT32_OK)
+                res = FAT32_Close(&file);
+            if (check)
+                CHECK_EQ(res, FAT32_OK);
+        }
+    }
+    FAT32_Sync(&volume);
+
+    SaveReference("A.LOG", a, a_size);
+    SaveReference("B.LOG", b, b_size);
+    SaveReference("DATA.BIN", data, data_size);
+    SaveReference("HELLO.TXT", hello, hello_size);
+
+    printf("sector writes: %u\n", host_disk.writes);
+    CHECK_EQ(SD_Disk_Save(image), 0);
+    SD_Disk_Free();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printf("usage: %s roundtrip|chain IMAGE, %s power IMAGE CUT\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    image = argv[2];
+    srand(19);
+
+    if (strcmp(argv[1], "roundtrip") == 0)
+        TestRoundTrip();
+    else if (strcmp(argv[1], "chain") == 0)
+        TestChain();
+    else if (strcmp(argv[1], "power") == 0 && argc > 3)
+        TestPower(atoi(argv[3]));
+    else
+        CHECK(0);
+
+    TEST_EXIT();
+}
@@ -0,0 +1,310 @@
+/*
+ * test_ili9341.c
+ *
+ * ILI9341 driver against the LCD bus model: what reaches the panel and what
+ * it costs on the bus.
+ */
+
+#include "ili9341_driver.h"
+#include "lcd_bus_model.h"
+#include "test.h"
+
+#include <string.h>
+
+static SPI_HandleTypeDef hspi1;
+static DMA_HandleTypeDef hdma_tx;
+static LCD_Handle hlcd;
+static LCD_BusModel panel;
+static uint32_t transfer_complete_calls;
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    ili9341_tx_complete(&hlcd, hspi);
+}
+
+static void TransferComplete(LCD_Handle *LcdHandle)
+{
+    (void) LcdHandle;
+    transfer_complete_calls++;
+}
+
+static void Setup(void)
+{
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+    hspi1.hdmatx = &hdma_tx;
+
+    memset(&hlcd, 0, sizeof(hlcd));
+    hlcd.Init.hspi = &hspi1;
+    hlcd.Init.CS_Port = GPIOB;
+    hlcd.Init.CS_Pin = GPIO_PIN_6;
+    hlcd.Init.DC_Port = GPIOA;
+    hlcd.Init.DC_Pin = GPIO_PIN_9;
+    hlcd.Init.RESET_Port = GPIOC;
+    hlcd.Init.RESET_Pin = GPIO_PIN_7;
+    hlcd.Init.bg_color = BLACK;
+
+    LCD_Model_Attach(&panel, &hspi1, GPIOB, GPIO_PIN_6, GPIOA, GPIO_PIN_9);
+    ili9341_init(&hlcd);
+    hlcd.TransferComplete = TransferComplete;
+}
+
+static void ResetCounters(void)
+{
+    LCD_Model_ResetCounters(&panel);
+    memset(&hlcd.stats, 0, sizeof(hlcd.stats));
+    transfer_complete_calls = 0;
+}
+
+// Pixels of an unscaled glyph printed at x, y (text coordinates, y from the bottom)
+static int GlyphMatches(int c, int x, int y, uint16_t fg, uint16_t bg)
+{
+    int y0 = hlcd.height - y - FONTHEIGHT;
+
+    for (int col = 0; col < FONTWIDTH; col++)
+    {
+        int u = xchar[c][2 * col + 1] + (xchar[c][2 * col] << 8);
+        for (int row = 0; row < FONTHEIGHT; row++)
+        {
+            uint16_t expected = (u & (1 << (FONTHEIGHT - 1 - row))) ? fg : bg;
+            if (panel.frame[x + col][y0 + row] != expected)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int RectIs(int x, int y, int w, int h, uint16_t color)
+{
+    for (int i = x; i < x + w; i++)
+        for (int j = y; j < y + h; j++)
+            if (panel.frame[i][j] != color)
+                return 0;
+    return 1;
+}
+
+static void TestFillScreen(void)
+{
+    ResetCounters();
+    ili9341_fill_screen(&hlcd, BLUE);
+
+    CHECK(RectIs(0, 0, 320, 240, BLUE));
+    CHECK_EQ(panel.pixels, 320 * 240);
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK_EQ(panel.stray_bytes, 0);
+    CHECK(!panel.cs_low);
+
+    // The driver counters match what the panel received
+    CHECK_EQ(hlcd.stats.bytes, panel.bytes);
+    CHECK_EQ(hlcd.stats.cs_asserts, panel.cs_asserts);
+    CHECK(transfer_complete_calls > 0);
+}
+
+static void TestString(void)
+{
+    char text[] = "Hello, world!";
+
+    ili9341_fill_screen(&hlcd, BLACK);
+    ResetCounters();
+    hlcd.PrintString(&hlcd, 20, 100, text, 1, WHITE, BLACK);
+
+    // One CS assertion for the 13 characters (6552 with one transaction per byte)
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK_EQ(panel.pixels, 13 * FONTWIDTH * FONTHEIGHT);
+    CHECK_EQ(hlcd.stats.bytes, panel.bytes);
+    CHECK(!panel.cs_low);
+
+    for (int i = 0; i < 13; i++)
+        CHECK(GlyphMatches(text[i], 20 + i * FONTWIDTH, 100, WHITE, BLACK));
+}
+
+static void TestPixel(void)
+{
+    ili9341_fill_screen(&hlcd, BLACK);
+    hlcd.DrawPixelAt(&hlcd, 5, 7, RED);
+    hlcd.DrawPixel(&hlcd, GREEN); // Next position, same column
+
+    CHECK_EQ(panel.frame[5][7], RED);
+    CHECK_EQ(panel.frame[5][8], GREEN);
+    CHECK(RectIs(6, 0, 10, 10, BLACK));
+}
+
+// Window commands logged at index i: 0x2B (x) range, 0x2A (y) range
+static int RangeIs(uint32_t i, uint8_t cmd, int start, int end)
+{
+    const LCD_ModelCommand *entry = &panel.log[i];
+
+    return i < panel.log_count && entry->cmd == cmd && entry->nargs == 4
+            && ((entry->args[0] << 8) | entry->args[1]) == start && ((entry->args[2] << 8) | entry->args[3]) == end;
+}
+
+static void TestFillRect(void)
+{
+    ili9341_fill_screen(&hlcd, BLACK);
+    ResetCounters();
+    hlcd.FillRect(&hlcd, 30, 40, 10, 10, RED);
+
+    // One window (11 bytes) and 200 bytes of pixels for a snake tile
+    CHECK_EQ(panel.log_count, 3);
+    CHECK(RangeIs(0, 0x2B, 30, 39));
+    CHECK(RangeIs(1, 0x2A, 40, 49));
+    CHECK_EQ(panel.log[2].cmd, 0x2C);
+    CHECK_EQ(panel.bytes, 211);
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK(RectIs(30, 40, 10, 10, RED));
+    CHECK(RectIs(30, 50, 10, 1, BLACK));
+    CHECK(RectIs(40, 40, 1, 10, BLACK));
+
+    // The tile below keeps the x range, only 0x2A and RAMWR go out
+    ResetCounters();
+    hlcd.FillRect(&hlcd, 30, 50, 10, 10, GREEN);
+    CHECK_EQ(panel.log_count, 2);
+    CHECK(RangeIs(0, 0x2A, 50, 59));
+    CHECK_EQ(panel.bytes, 206);
+    CHECK(RectIs(30, 50, 10, 10, GREEN));
+
+    // Clipped to the screen
+    ResetCounters();
+    hlcd.FillRect(&hlcd, 315, -5, 10, 10, YELLOW);
+    CHECK(RangeIs(0, 0x2B, 315, 319));
+    CHECK(RangeIs(1, 0x2A, 0, 4));
+    CHECK_EQ(panel.pixels, 25);
+    CHECK(RectIs(315, 0, 5, 5, YELLOW));
+
+    ResetCounters();
+    hlcd.FillRect(&hlcd, 400, 10, 10, 10, YELLOW);
+    CHECK_EQ(panel.bytes, 0);
+}
+
+static void TestBlitRect(void)
+{
+    static uint16_t sprite[8 * 6];
+
+    for (int i = 0; i < 8 * 6; i++)
+        sprite[i] = LCD_TO_BUS((uint16_t) (i * 1000));
+
+    ili9341_fill_screen(&hlcd, BLACK);
+    ResetCounters();
+    hlcd.BlitRect(&hlcd, 100, 50, 8, 6, sprite);
+
+    CHECK(RangeIs(0, 0x2B, 100, 107));
+    CHECK(RangeIs(1, 0x2A, 50, 55));
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK_EQ(panel.bytes, 11 + 8 * 6 * 2);
+
+    int same = 1;
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 6; j++)
+            same &= panel.frame[100 + i][50 + j] == (uint16_t) ((i * 6 + j) * 1000);
+    CHECK(same);
+
+    // Partly off screen, the visible part of each column
+    ili9341_fill_screen(&hlcd, BLACK);
+    hlcd.BlitRect(&hlcd, -2, 237, 8, 6, sprite);
+    CHECK_EQ(panel.frame[0][237], (uint16_t) ((2 * 6) * 1000));
+    CHECK_EQ(panel.frame[5][239], (uint16_t) ((7 * 6 + 2) * 1000));
+}
+
+// A window left bounded by a rectangle must not make DrawPixel wrap early
+static void TestWindowReset(void)
+{
+    hlcd.FillRect(&hlcd, 0, 0, 2, 2, RED);
+    hlcd.SetDrawPos(&hlcd, 10, 238);
+    hlcd.DrawPixel(&hlcd, BLUE);
+    hlcd.DrawPixel(&hlcd, BLUE);
+    hlcd.DrawPixel(&hlcd, GREEN);
+
+    CHECK_EQ(panel.frame[10][238], BLUE);
+    CHECK_EQ(panel.frame[10][239], BLUE);
+    CHECK_EQ(panel.frame[11][238], GREEN); // Window is y 238..239 up to the right edge
+}
+
+static void TestGlyphCache(void)
+{
+    char text[] = "0123456789ABCDEFGHIJ"; // More glyphs than ILI9341_GLYPH_CACHE_SIZE
+
+    ili9341_fill_screen(&hlcd, BLACK);
+    ResetCounters();
+    hlcd.PrintString(&hlcd, 0, 0, text, 1, YELLOW, NAVY1);
+
+    // One window for the line: 11 bytes of window and 384 bytes per glyph
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK_EQ(LCD_Model_CountCommand(&panel, 0x2C), 1);
+    CHECK_EQ(panel.bytes, 11 + 20 * FONTWIDTH * FONTHEIGHT * 2);
+
+    int same = 1;
+    for (int i = 0; i < 20; i++)
+        same &= GlyphMatches(text[i], i * FONTWIDTH, 0, YELLOW, NAVY1);
+    CHECK(same);
+
+    // Evicted and cached glyphs, the same glyphs in other colors
+    hlcd.PrintString(&hlcd, 0, 20, text, 1, WHITE, RED);
+    hlcd.PrintString(&hlcd, 0, 40, text, 1, YELLOW, NAVY1);
+    same = 1;
+    for (int i = 0; i < 20; i++)
+        same &= GlyphMatches(text[i], i * FONTWIDTH, 20, WHITE, RED)
+                && GlyphMatches(text[i], i * FONTWIDTH, 40, YELLOW, NAVY1);
+    CHECK(same);
+
+    // 16 rows: the row under the glyph is not touched (it used to get a 17th pixel)
+    ili9341_fill_screen(&hlcd, GREEN);
+    hlcd.PrintChar(&hlcd, 50, 100, 'A', 1, WHITE, BLACK);
+    CHECK(RectIs(50, 240 - 100, FONTWIDTH, 1, GREEN));
+    CHECK(RectIs(50, 240 - 100 - FONTHEIGHT - 1, FONTWIDTH, 1, GREEN));
+    CHECK(GlyphMatches('A', 50, 100, WHITE, BLACK));
+
+    // The bottom row of the screen stays in bounds
+    hlcd.PrintChar(&hlcd, 0, 0, 'W', 1, WHITE, BLACK);
+    CHECK(GlyphMatches('W', 0, 0, WHITE, BLACK));
+
+    // Characters outside the font draw as a space
+    hlcd.PrintChar(&hlcd, 80, 100, 200, 1, WHITE, BLACK);
+    CHECK(GlyphMatches(' ', 80, 100, WHITE, BLACK));
+}
+
+// Expected init stream: command, parameter count
+static const uint8_t init_commands[][2] =
+{
+{ 0xCB, 5 }, { 0xCF, 3 }, { 0xE8, 3 }, { 0xEA, 2 }, { 0xED, 4 }, { 0xF7, 1 }, { 0xC0, 1 }, { 0xC1, 1 }, { 0xC5, 2 },
+{ 0xC7, 1 }, { 0x36, 1 }, { 0x3A, 1 }, { 0xB1, 2 }, { 0xB6, 3 }, { 0xF2, 1 }, { 0x26, 1 }, { 0xE0, 15 },
+{ 0xE1, 15 }, { 0x11, 0 }, { 0x2C, 0 }, { 0x29, 0 }, { 0x2C, 0 } };
+
+// Checked right after Setup, the counters hold the init sequence
+static void TestInit(void)
+{
+    uint32_t n = sizeof(init_commands) / sizeof(init_commands[0]);
+    int same = (panel.log_count == n);
+
+    for (uint32_t i = 0; same && i < n; i++)
+        same = panel.log[i].cmd == init_commands[i][0] && panel.log[i].nargs == init_commands[i][1];
+    CHECK(same);
+
+    // 84 bytes under one CS assertion, each command and its parameters as one transfer
+    CHECK_EQ(panel.bytes, 84);
+    CHECK_EQ(panel.cs_asserts, 1);
+    CHECK_EQ(hlcd.stats.transfers, 40);
+    CHECK_EQ(panel.stray_bytes, 0);
+    CHECK(!panel.cs_low);
+    CHECK_EQ(panel.log[10].args[0], 0x88); // MADCTL
+    CHECK_EQ(panel.log[17].args[14], 0x0F); // Last gamma byte
+
+    // 5 ms between sleep out and the next command
+    CHECK(panel.log[19].us - panel.log[18].us >= 5000);
+    CHECK(panel.log[19].us - panel.log[18].us < 6000);
+}
+
+int main(void)
+{
+    Setup();
+    TestInit();
+
+    TestFillScreen();
+    TestString();
+    TestPixel();
+    TestFillRect();
+    TestBlitRect();
+    TestWindowReset();
+    TestGlyphCache();
+
+    TEST_EXIT();
+}
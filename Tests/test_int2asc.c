@@ -0,0 +1,114 @@
+/*
+ * test_int2asc.c
+ *
+ * int2asc_padded against int2asc, whose output it must reproduce, and the padding rules.
+ */
+
+#include "lcd_driver.h"
+#include "test.h"
+
+#include <string.h>
+
+static uint32_t rng = 2463534242U;
+
+static uint32_t Random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Same string as int2asc for num and dec
+static int SameAsInt2asc(long num, int dec)
+{
+    char expected[24], got[24];
+    int len;
+
+    memset(expected, 0, sizeof(expected));
+    int2asc(num, dec, expected, 16);
+    len = int2asc_padded(num, dec, 0, got, sizeof(got));
+
+    if (strcmp(expected, got) != 0 || len != (int) strlen(got))
+    {
+        printf("num %ld dec %d: int2asc \"%s\", int2asc_padded \"%s\" (%d)\n", num, dec, expected, got, len);
+        return 0;
+    }
+    return 1;
+}
+
+static void TestAgainstInt2asc(void)
+{
+    static const long edges[] = { 0, 1, -1, 5, -5, 9, 10, 99, 100, 101, 999, 1000, 12345, -12345, 99999999, 100000000,
+            999999999, -999999999, 1000000000, 2147483647 };
+    int mismatches = 0;
+
+    for (unsigned int i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+        for (int dec = 0; dec <= 10; dec++)
+            mismatches += !SameAsInt2asc(edges[i], dec);
+
+    // Every magnitude, int2asc writes before its buffer for negative ten digit values
+    for (int i = 0; i < 200000; i++)
+    {
+        long num = (long) (Random() >> (Random() % 32));
+        if (num > 2147483647L)
+            num = 2147483647L;
+        if (Random() & 1 && num < 1000000000L)
+            num = -num;
+        mismatches += !SameAsInt2asc(num, Random() % 11);
+    }
+
+    CHECK_EQ(mismatches, 0);
+}
+
+static void TestFormat(void)
+{
+    char buf[INT2ASC_MAX_LEN + 1];
+
+    // Negative ten digit values, out of reach of int2asc
+    CHECK_EQ(int2asc_padded(-2147483647L, 0, 0, buf, sizeof(buf)), 11);
+    CHECK(strcmp(buf, "-2147483647") == 0);
+    CHECK_EQ(int2asc_padded(-2147483647L, 3, 0, buf, sizeof(buf)), INT2ASC_MAX_LEN);
+    CHECK(strcmp(buf, "-2147483.647") == 0);
+
+    // dec rules: no leading 0 before the separator, 0 has no separator
+    int2asc_padded(5, 2, 0, buf, sizeof(buf));
+    CHECK(strcmp(buf, ".05") == 0);
+    int2asc_padded(-5, 2, 0, buf, sizeof(buf));
+    CHECK(strcmp(buf, "-.05") == 0);
+    int2asc_padded(0, 2, 0, buf, sizeof(buf));
+    CHECK(strcmp(buf, "0") == 0);
+    int2asc_padded(1234, 2, 0, buf, sizeof(buf));
+    CHECK(strcmp(buf, "12.34") == 0);
+}
+
+static void TestPadding(void)
+{
+    char buf[16];
+
+    CHECK_EQ(int2asc_padded(42, 0, 6, buf, sizeof(buf)), 6);
+    CHECK(strcmp(buf, "    42") == 0);
+    CHECK_EQ(int2asc_padded(42, 0, -6, buf, sizeof(buf)), 6);
+    CHECK(strcmp(buf, "42    ") == 0);
+    CHECK_EQ(int2asc_padded(-315, 1, 7, buf, sizeof(buf)), 7);
+    CHECK(strcmp(buf, "  -31.5") == 0);
+
+    // Narrower than the number: no padding, no truncation
+    CHECK_EQ(int2asc_padded(123456, 0, 3, buf, sizeof(buf)), 6);
+    CHECK(strcmp(buf, "123456") == 0);
+
+    // Does not fit: empty string
+    CHECK_EQ(int2asc_padded(42, 0, 16, buf, sizeof(buf)), -1);
+    CHECK_EQ(buf[0], 0);
+    CHECK_EQ(int2asc_padded(123456, 0, 0, buf, 6), -1);
+    CHECK_EQ(int2asc_padded(12345, 0, 0, buf, 6), 5);
+}
+
+int main(void)
+{
+    TestAgainstInt2asc();
+    TestFormat();
+    TestPadding();
+
+    TEST_EXIT();
+}
@@ -0,0 +1,179 @@
+/*
+ * test_lcd_renderer.c
+ *
+ * Band renderer against the same scene drawn directly with the ILI9341 driver.
+ * With a directory argument the frames are also written there as PPM files,
+ * for comparison with a previous run.
+ */
+
+#include "lcd_renderer.h"
+#include "ili9341_driver.h"
+#include "lcd_bus_model.h"
+#include "test.h"
+
+#include <string.h>
+
+static SPI_HandleTypeDef hspi1;
+static DMA_HandleTypeDef hdma_tx;
+static LCD_Handle hlcd;
+static LCD_BusModel panel;
+static LCD_Renderer renderer;
+
+static uint16_t reference[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT];
+static uint16_t sink_frame[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT];
+static uint32_t sink_bands;
+
+static uint16_t sprite[24 * 20];
+static char title[] = "Band renderer";
+static char overlap[] = "overlap";
+static char clipped[] = "CLIP";
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    ili9341_tx_complete(&hlcd, hspi);
+}
+
+static void Setup(void)
+{
+    hspi1.Instance = SPI1;
+    hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_2;
+    hspi1.hdmatx = &hdma_tx;
+
+    hlcd.Init.hspi = &hspi1;
+    hlcd.Init.CS_Port = GPIOB;
+    hlcd.Init.CS_Pin = GPIO_PIN_6;
+    hlcd.Init.DC_Port = GPIOA;
+    hlcd.Init.DC_Pin = GPIO_PIN_9;
+    hlcd.Init.RESET_Port = GPIOC;
+    hlcd.Init.RESET_Pin = GPIO_PIN_7;
+    hlcd.Init.bg_color = NAVY2;
+
+    LCD_Model_Attach(&panel, &hspi1, GPIOB, GPIO_PIN_6, GPIOA, GPIO_PIN_9);
+    ili9341_init(&hlcd);
+
+    for (int i = 0; i < 24 * 20; i++)
+        sprite[i] = LCD_TO_BUS((uint16_t) (i * 137));
+}
+
+// Gradient, bus order like every paint callback
+static void PaintGradient(void *context, int x, int y, int w, int h, uint16_t *pixels)
+{
+    (void) context;
+
+    for (int i = 0; i < w; i++)
+        for (int j = 0; j < h; j++)
+            *pixels++ = LCD_TO_BUS((uint16_t) (((x + i) & 0x1F) << 11 | ((y + j) & 0x3F) << 5));
+}
+
+static void Sink(void *context, int y, int width, int height, const uint16_t *pixels)
+{
+    (void) context;
+
+    for (int x = 0; x < width; x++)
+        for (int j = 0; j < height; j++)
+            sink_frame[x][y + j] = LCD_TO_BUS(pixels[x * height + j]);
+    sink_bands++;
+}
+
+// The scene drawn directly, widgets overlap and some are partly off screen
+static void DrawDirect(void)
+{
+    static uint16_t painted[60 * 50];
+
+    hlcd.Clear(&hlcd);
+    hlcd.FillRect(&hlcd, 20, 30, 200, 100, DARKCYAN);
+    hlcd.BlitRect(&hlcd, 150, 100, 24, 20, sprite);
+    hlcd.PrintString(&hlcd, 30, 180, title, 1, WHITE, DARKCYAN);
+    PaintGradient(NULL, 200, 110, 60, 50, painted);
+    hlcd.BlitRect(&hlcd, 200, 110, 60, 50, painted);
+    hlcd.PrintString(&hlcd, 180, 110, overlap, 2, YELLOW, BLACK);
+    hlcd.FillRect(&hlcd, -10, 200, 40, 60, ORANGE);
+    hlcd.PrintString(&hlcd, 280, 40, clipped, 2, BLACK, WHITE);
+    hlcd.Sync(&hlcd);
+}
+
+static void DrawRendered(void)
+{
+    LCD_Render_Begin(&renderer);
+    LCD_Render_FillRect(&renderer, 20, 30, 200, 100, DARKCYAN);
+    LCD_Render_BlitRect(&renderer, 150, 100, 24, 20, sprite);
+    LCD_Render_String(&renderer, 30, 180, title, 1, WHITE, DARKCYAN);
+    LCD_Render_Paint(&renderer, 200, 110, 60, 50, PaintGradient, NULL);
+    LCD_Render_String(&renderer, 180, 110, overlap, 2, YELLOW, BLACK);
+    LCD_Render_FillRect(&renderer, -10, 200, 40, 60, ORANGE);
+    LCD_Render_String(&renderer, 280, 40, clipped, 2, BLACK, WHITE);
+    LCD_Render_End(&renderer);
+}
+
+static int FramesEqual(uint16_t a[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT], uint16_t b[LCD_MODEL_WIDTH][LCD_MODEL_HEIGHT])
+{
+    return memcmp(a, b, sizeof(uint16_t) * LCD_MODEL_WIDTH * LCD_MODEL_HEIGHT) == 0;
+}
+
+static void TestScene(const char *dump_dir)
+{
+    char path[256];
+
+    DrawDirect();
+    memcpy(reference, panel.frame, sizeof(reference));
+
+    hlcd.FillRect(&hlcd, 0, 0, 320, 240, RED); // Anything left from the direct pass shows
+    LCD_Render_Init(&renderer, &hlcd);
+    renderer.Sink = Sink;
+    LCD_Model_ResetCounters(&panel);
+    DrawRendered();
+
+    CHECK(FramesEqual(panel.frame, reference));
+    CHECK(FramesEqual(sink_frame, reference));
+
+    // One window and one memory write per 320x16 band
+    CHECK_EQ(sink_bands, 240 / LCD_RENDER_BAND_HEIGHT);
+    CHECK_EQ(LCD_Model_CountCommand(&panel, 0x2C), 240 / LCD_RENDER_BAND_HEIGHT);
+    CHECK_EQ(panel.pixels, 320 * 240);
+    CHECK(!panel.cs_low);
+
+    if (dump_dir != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/renderer.ppm", dump_dir);
+        CHECK_EQ(LCD_Model_WritePPM(panel.frame, path), 0);
+        snprintf(path, sizeof(path), "%s/direct.ppm", dump_dir);
+        CHECK_EQ(LCD_Model_WritePPM(reference, path), 0);
+    }
+}
+
+// Without a LCD the frame only goes to the sink
+static void TestSinkOnly(void)
+{
+    LCD_Render_Init(&renderer, NULL);
+    renderer.width = 320;
+    renderer.height = 240;
+    renderer.bg_color = LCD_TO_BUS(hlcd.Init.bg_color);
+    renderer.Sink = Sink;
+    sink_bands = 0;
+    memset(sink_frame, 0, sizeof(sink_frame));
+    LCD_Model_ResetCounters(&panel);
+
+    DrawRendered();
+
+    CHECK(FramesEqual(sink_frame, reference));
+    CHECK_EQ(panel.bytes, 0);
+}
+
+static void TestListFull(void)
+{
+    LCD_Render_Init(&renderer, NULL);
+    LCD_Render_Begin(&renderer);
+    for (int i = 0; i < LCD_RENDER_MAX_COMMANDS; i++)
+        CHECK_EQ(LCD_Render_FillRect(&renderer, i, i, 1, 1, RED), 0);
+    CHECK_EQ(LCD_Render_FillRect(&renderer, 0, 0, 1, 1, RED), -1);
+}
+
+int main(int argc, char **argv)
+{
+    Setup();
+    TestScene((argc > 1) ? argv[1] : NULL);
+    TestSinkOnly();
+    TestListFull();
+
+    TEST_EXIT();
+}
@@ -0,0 +1,307 @@
+/*
+ * test_sd_async.c
+ *
+ * The SD_Async request engine on the SD card model, polled from a simulated
+ * 1 ms main loop. DMA completions can be held back to stand for the
+ * interrupt arriving later than the host stub's synchronous transfer.
+ */
+
+#include "sd_async.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SECTORS 1024
+#define TEST_RUN     8
+#define LOOP_CYCLES  (SystemCoreClock / 1000)
+
+static SPI_HandleTypeDef hspi1, hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+static SD_Async engine;
+
+static uint8_t buffer[SD_ASYNC_QUEUE_SIZE + 1][TEST_RUN * SD_BLOCK_SIZE];
+
+/* Completion order, request index taken from the context */
+static int completed[2 * SD_ASYNC_QUEUE_SIZE];
+static int completions;
+
+/* With hold_dma set the completion waits in pending_dma until Deliver */
+static uint8_t hold_dma;
+static SPI_HandleTypeDef *pending_dma;
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    if (hold_dma)
+        pending_dma = hspi;
+    else
+        SD_Async_TransferComplete(&engine, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    HAL_SPI_TxCpltCallback(hspi);
+}
+
+static void Deliver(void)
+{
+    SPI_HandleTypeDef *hspi = pending_dma;
+
+    pending_dma = NULL;
+    SD_Async_TransferComplete(&engine, hspi);
+}
+
+static void Complete(SD_Request *request)
+{
+    CHECK(request->status == SD_REQUEST_DONE || request->status == SD_REQUEST_FAILED);
+    completed[completions++] = (int) (intptr_t) request->context;
+}
+
+static void Setup(void)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+    for (uint32_t s = 0; s < card.sectors; s++)
+        for (int i = 0; i < SD_BLOCK_SIZE; i++)
+            SD_Model_Sector(&card, s)[i] = rand();
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, SD_MODEL_SDHC);
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+    CHECK(hsd.crc_on);
+    SD_Async_Init(&engine, &hsd);
+}
+
+// One main loop frame: a poll, then the rest of the frame elsewhere
+static void Frame(void)
+{
+    SD_Async_Poll(&engine);
+    Host_AdvanceCycles(LOOP_CYCLES);
+}
+
+// Frames until the engine is idle, at most max
+static uint32_t Run(uint32_t max)
+{
+    uint32_t frames = 0;
+
+    while (!SD_Async_IsIdle(&engine) && frames < max)
+    {
+        Frame();
+        frames++;
+    }
+    CHECK(SD_Async_IsIdle(&engine));
+    return frames;
+}
+
+static void Queue(SD_Request *request, SD_RequestType type, int index, uint32_t sector, uint32_t count)
+{
+    request->Complete = Complete;
+    request->context = (void*) (intptr_t) index;
+    if (type == SD_REQUEST_READ)
+        CHECK_EQ(SD_Async_Read(&engine, request, sector, count, buffer[index]), SD_RESPONSE_NO_ERROR);
+    else
+        CHECK_EQ(SD_Async_Write(&engine, request, sector, count, buffer[index]), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(request->status, SD_REQUEST_QUEUED);
+}
+
+// Requests complete in queue order, a full ring refuses more
+static void TestQueueOrder(void)
+{
+    SD_Request requests[SD_ASYNC_QUEUE_SIZE + 1];
+    SD_Request extra;
+
+    completions = 0;
+    for (int i = 0; i < SD_ASYNC_QUEUE_SIZE; i++)
+    {
+        uint32_t count = (i == 3) ? 0 : (uint32_t) (i % 3) * 3 + 1;
+
+        if (i % 2 == 0)
+            Queue(&requests[i], SD_REQUEST_READ, i, 100 + 10 * i, count);
+        else
+        {
+            for (int k = 0; k < TEST_RUN * SD_BLOCK_SIZE; k++)
+                buffer[i][k] = rand();
+            Queue(&requests[i], SD_REQUEST_WRITE, i, 100 + 10 * i, count);
+        }
+    }
+    CHECK_EQ(SD_Async_Read(&engine, &extra, 0, 1, buffer[0]), SD_RESPONSE_FAILURE);
+
+    // The first one leaves the ring
+    Frame();
+    CHECK_EQ(requests[0].status, SD_REQUEST_ACTIVE);
+    Queue(&requests[SD_ASYNC_QUEUE_SIZE], SD_REQUEST_READ, SD_ASYNC_QUEUE_SIZE, 900, TEST_RUN);
+    CHECK_EQ(SD_Async_Read(&engine, &extra, 0, 1, buffer[0]), SD_RESPONSE_FAILURE);
+
+    Run(10000);
+    CHECK_EQ(completions, SD_ASYNC_QUEUE_SIZE + 1);
+    for (int i = 0; i <= SD_ASYNC_QUEUE_SIZE; i++)
+    {
+        CHECK_EQ(completed[i], i);
+        CHECK_EQ(requests[i].status, SD_REQUEST_DONE);
+        CHECK_EQ(requests[i].error, SD_RESPONSE_NO_ERROR);
+        CHECK(memcmp(buffer[i], SD_Model_Sector(&card, requests[i].sector),
+                (size_t) requests[i].count * SD_BLOCK_SIZE) == 0);
+    }
+    CHECK(!card.cs_low);
+}
+
+// Nothing moves on the bus while a block DMA is in flight
+static void TestDmaCompletion(void)
+{
+    SD_Request request;
+    uint32_t bytes, cmd12;
+
+    hold_dma = 1;
+    Queue(&request, SD_REQUEST_READ, 0, 200, 2);
+    for (int i = 0; i < 10 && engine.state != SD_ASYNC_READ_DATA; i++)
+        Frame();
+    CHECK_EQ(engine.state, SD_ASYNC_READ_DATA);
+    CHECK(pending_dma != NULL);
+
+    bytes = card.bytes;
+    Frame();
+    Frame();
+    SD_Async_TransferComplete(&engine, &hspi1); // Another SPI's completion
+    Frame();
+    CHECK_EQ(engine.state, SD_ASYNC_READ_DATA);
+    CHECK_EQ(card.bytes, bytes);
+    CHECK_EQ(engine.done, 0);
+
+    // The completion lets the next poll take the CRC and wait for the next token
+    Deliver();
+    Frame();
+    CHECK_EQ(engine.done, 1);
+    CHECK_EQ(engine.state, SD_ASYNC_READ_TOKEN);
+
+    hold_dma = 0;
+    Run(100);
+    CHECK_EQ(request.status, SD_REQUEST_DONE);
+    CHECK(memcmp(buffer[0], SD_Model_Sector(&card, 200), 2 * SD_BLOCK_SIZE) == 0);
+
+    // A completion that never comes fails the request after the block time and the margin
+    hold_dma = 1;
+    cmd12 = card.cmd_count[12];
+    Queue(&request, SD_REQUEST_READ, 0, 300, 2);
+    CHECK(Run(100) <= SD_ASYNC_DMA_MARGIN_US / 1000 + 4);
+    CHECK_EQ(request.status, SD_REQUEST_FAILED);
+    CHECK_EQ(request.error, SD_RESPONSE_FAILURE);
+    CHECK_EQ(card.cmd_count[12], cmd12 + 1);
+    CHECK(!card.cs_low);
+    hold_dma = 0;
+    pending_dma = NULL;
+
+    // And the engine goes on with the next one
+    Queue(&request, SD_REQUEST_READ, 0, 300, 2);
+    Run(100);
+    CHECK_EQ(request.status, SD_REQUEST_DONE);
+    CHECK(memcmp(buffer[0], SD_Model_Sector(&card, 300), 2 * SD_BLOCK_SIZE) == 0);
+}
+
+// Poll until count sectors of request are transferred
+static void RunUntilDone(const SD_Request *request, uint32_t count)
+{
+    for (int i = 0; i < 1000 && (engine.current != request || engine.done < count); i++)
+        Frame();
+    CHECK_EQ(engine.done, count);
+}
+
+// A CRC error sends only the sectors not transferred yet again
+static void TestCrcRetry(void)
+{
+    SD_Request request;
+    uint32_t crc_errors = hsd.crc_errors;
+    uint32_t cmd18 = card.cmd_count[18];
+    uint32_t cmd25 = card.cmd_count[25];
+    uint32_t read = card.sectors_read;
+    uint32_t written = card.sectors_written;
+
+    Queue(&request, SD_REQUEST_READ, 0, 400, TEST_RUN);
+    RunUntilDone(&request, 3);
+    card.inject_read_crc = 1;
+    Run(1000);
+    CHECK_EQ(request.status, SD_REQUEST_DONE);
+    CHECK(memcmp(buffer[0], SD_Model_Sector(&card, 400), TEST_RUN * SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(hsd.crc_errors, crc_errors + 1);
+    CHECK_EQ(card.cmd_count[18], cmd18 + 2);
+    // 3 good, the bad one and 5 again, the card may push one more per command
+    CHECK(card.sectors_read - read <= TEST_RUN + 1 + 2);
+
+    for (int k = 0; k < TEST_RUN * SD_BLOCK_SIZE; k++)
+        buffer[1][k] = rand();
+    Queue(&request, SD_REQUEST_WRITE, 1, 500, 6);
+    RunUntilDone(&request, 2);
+    card.inject_write_crc = 1;
+    Run(1000);
+    CHECK_EQ(request.status, SD_REQUEST_DONE);
+    CHECK(memcmp(buffer[1], SD_Model_Sector(&card, 500), 6 * SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(hsd.crc_errors, crc_errors + 2);
+    CHECK_EQ(card.cmd_count[25], cmd25 + 2);
+    CHECK_EQ(card.pre_erase, 4); // ACMD23 of the retry counts the 4 left
+    CHECK_EQ(card.sectors_written - written, 6);
+
+    // Past SD_CRC_RETRIES the request fails. A single block, as the CMD12 after a
+    // bad block of a CMD18 also drops a faulty block the card already queued.
+    card.inject_read_crc = SD_CRC_RETRIES + 1;
+    Queue(&request, SD_REQUEST_READ, 0, 600, 1);
+    Run(1000);
+    CHECK_EQ(request.status, SD_REQUEST_FAILED);
+    CHECK_EQ(request.error, SD_RESPONSE_DATA_ERROR);
+    CHECK_EQ(hsd.crc_errors, crc_errors + 2 + SD_CRC_RETRIES + 1);
+    CHECK(!card.cs_low);
+}
+
+// While the card programs each poll samples SD_ASYNC_POLL_BYTES and returns
+static void TestBusyCadence(void)
+{
+    SD_Request request;
+    uint32_t busy_polls = 0, frames = 0;
+    uint64_t worst = 0;
+
+    card.program_us = 20000;
+    for (int k = 0; k < TEST_RUN * SD_BLOCK_SIZE; k++)
+        buffer[0][k] = rand();
+    Queue(&request, SD_REQUEST_WRITE, 0, 700, 4);
+
+    while (!SD_Async_IsIdle(&engine) && frames++ < 1000)
+    {
+        SD_AsyncState state = engine.state;
+        uint32_t bytes = card.bytes;
+        uint64_t start = Host_Cycles();
+
+        SD_Async_Poll(&engine);
+        if ((state == SD_ASYNC_WRITE_READY || state == SD_ASYNC_STOP_BUSY) && engine.state == state)
+        {
+            busy_polls++;
+            CHECK_EQ(card.bytes - bytes, SD_ASYNC_POLL_BYTES);
+            if (Host_Cycles() - start > worst)
+                worst = Host_Cycles() - start;
+        }
+        Host_AdvanceCycles(LOOP_CYCLES);
+    }
+
+    CHECK_EQ(request.status, SD_REQUEST_DONE);
+    CHECK(memcmp(buffer[0], SD_Model_Sector(&card, 700), 4 * SD_BLOCK_SIZE) == 0);
+    // The card programs 20 ms after each block and after the stop token, seen from a 1 ms loop
+    CHECK(busy_polls >= 5 * 19 && busy_polls <= 5 * 21);
+    // 16 bytes at 21 MHz, and the HAL call per byte of the host stub
+    CHECK(worst < 50 * (SystemCoreClock / 1000000));
+    card.program_us = 250;
+
+    printf("4 blocks of 20 ms programming: %u polls of %u bytes, %u us at most\n", busy_polls, SD_ASYNC_POLL_BYTES,
+            (unsigned) (worst / (SystemCoreClock / 1000000)));
+}
+
+int main(void)
+{
+    hspi1.Instance = SPI1;
+
+    Setup();
+    TestQueueOrder();
+    TestDmaCompletion();
+    TestCrcRetry();
+    TestBusyCadence();
+    SD_Model_Free(&card);
+
+    TEST_EXIT();
+}
@@ -0,0 +1,252 @@
+/*
+ * test_sd_cache.c
+ *
+ * Sector cache replaying access traces on the SD card model, against a
+ * reference copy of the image. Arguments ending in .trace are replayed after
+ * the built-in random trace (format in Traces/), any other argument is a card
+ * image file loaded in place of the random one.
+ */
+
+#include "sd_cache.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SECTORS 8192
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+static SD_Cache cache;
+
+static uint8_t *reference;
+static uint32_t accesses;
+static uint32_t mismatches;
+
+static uint8_t* Reference(uint32_t sector)
+{
+    return &reference[(size_t) sector * SD_BLOCK_SIZE];
+}
+
+static void Setup(const char *image)
+{
+    if (image != NULL)
+    {
+        CHECK_EQ(SD_Model_Load(&card, image), 0);
+    }
+    else
+    {
+        CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+        for (uint32_t s = 0; s < card.sectors; s++)
+            for (int i = 0; i < SD_BLOCK_SIZE; i++)
+                SD_Model_Sector(&card, s)[i] = rand();
+    }
+
+    reference = malloc((size_t) card.sectors * SD_BLOCK_SIZE);
+    memcpy(reference, card.image, (size_t) card.sectors * SD_BLOCK_SIZE);
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, SD_MODEL_SDHC);
+
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+    SD_Cache_Init(&cache, &hsd);
+}
+
+// One trace operation on the cache and on the reference
+static void Replay(char op, uint32_t sector)
+{
+    uint8_t buffer[SD_BLOCK_SIZE];
+    uint8_t *line;
+
+    switch (op)
+    {
+    case 'R':
+        accesses++;
+        if (SD_Cache_Read(&cache, sector, buffer) != SD_RESPONSE_NO_ERROR
+                || memcmp(buffer, Reference(sector), SD_BLOCK_SIZE) != 0)
+            mismatches++;
+        break;
+    case 'W':
+        accesses++;
+        for (int i = 0; i < SD_BLOCK_SIZE; i++)
+            buffer[i] = rand();
+        memcpy(Reference(sector), buffer, SD_BLOCK_SIZE);
+        if (SD_Cache_Write(&cache, sector, buffer) != SD_RESPONSE_NO_ERROR)
+            mismatches++;
+        break;
+    case 'M':
+        accesses++;
+        if (SD_Cache_Get(&cache, sector, &line) != SD_RESPONSE_NO_ERROR
+                || memcmp(line, Reference(sector), SD_BLOCK_SIZE) != 0)
+        {
+            mismatches++;
+            break;
+        }
+        line[sector % SD_BLOCK_SIZE] ^= 0x5A;
+        Reference(sector)[sector % SD_BLOCK_SIZE] ^= 0x5A;
+        SD_Cache_MarkDirty(&cache, sector);
+        break;
+    case 'F':
+        if (SD_Cache_Flush(&cache) != SD_RESPONSE_NO_ERROR)
+            mismatches++;
+        break;
+    }
+}
+
+static void ResetCounters(void)
+{
+    SD_CacheStats stats;
+
+    SD_Cache_GetStats(&cache, &stats, 1);
+    accesses = 0;
+    mismatches = 0;
+    card.sectors_read = 0;
+    card.sectors_written = 0;
+    memset(card.cmd_count, 0, sizeof(card.cmd_count));
+    memset(card.acmd_count, 0, sizeof(card.acmd_count));
+}
+
+// After a flush the card holds the reference, the counters match the bus
+static void CheckFlushed(const char *name)
+{
+    SD_CacheStats stats;
+    uint32_t differ = 0;
+
+    CHECK_EQ(SD_Cache_Flush(&cache), SD_RESPONSE_NO_ERROR);
+    for (uint32_t s = 0; s < card.sectors; s++)
+        differ += memcmp(SD_Model_Sector(&card, s), Reference(s), SD_BLOCK_SIZE) != 0;
+
+    SD_Cache_GetStats(&cache, &stats, 0);
+    CHECK_EQ(mismatches, 0);
+    CHECK_EQ(differ, 0);
+    CHECK_EQ(stats.hits + stats.misses, accesses);
+    CHECK_EQ(stats.writebacks, card.sectors_written);
+    CHECK_EQ(stats.write_runs, card.cmd_count[24] + card.cmd_count[25]);
+    CHECK(card.sectors_read <= stats.misses);
+    CHECK(!card.cs_low);
+
+    printf("%s: %u accesses, %u hits, %u misses, %u evictions, %u sectors in %u writes\n", name, accesses,
+            stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.write_runs);
+    ResetCounters();
+}
+
+// Mostly a small hot set (metadata), a quarter anywhere on the card
+static void TestRandomTrace(void)
+{
+    static const char ops[] = { 'R', 'W', 'M' };
+
+    for (int i = 0; i < 1200; i++)
+    {
+        uint32_t sector = (rand() % 4 == 0) ? rand() % 1024 : rand() % 40;
+
+        Replay(ops[rand() % 3], sector);
+        if (i % 200 == 0)
+            Replay('F', 0);
+    }
+    CheckFlushed("random");
+}
+
+static void TestTraceFile(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    char line[64];
+    char op;
+    unsigned long sector;
+
+    CHECK(file != NULL);
+    if (file == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, " %c %lu", &op, &sector) < 1 || (op != 'F' && sector >= card.sectors))
+        {
+            mismatches++;
+            continue;
+        }
+        Replay(op, sector);
+    }
+    fclose(file);
+
+    CheckFlushed(path);
+}
+
+// The least recently used line of a set is the one replaced
+static void TestLeastRecentlyUsed(void)
+{
+    SD_CacheStats stats;
+    uint8_t buffer[SD_BLOCK_SIZE];
+
+    SD_Cache_Invalidate(&cache);
+    ResetCounters();
+    for (uint32_t way = 0; way < SD_CACHE_WAYS; way++)
+        SD_Cache_Read(&cache, 2000 + way * SD_CACHE_SETS, buffer);
+    SD_Cache_Read(&cache, 2000, buffer); // 2000 becomes the most recent
+    SD_Cache_GetStats(&cache, &stats, 1);
+    CHECK_EQ(stats.misses, SD_CACHE_WAYS);
+    CHECK_EQ(stats.hits, 1);
+
+    SD_Cache_Read(&cache, 2000 + SD_CACHE_WAYS * SD_CACHE_SETS, buffer); // replaces 2000 + SD_CACHE_SETS
+    SD_Cache_Read(&cache, 2000, buffer);
+    SD_Cache_Read(&cache, 2000 + SD_CACHE_SETS, buffer);
+    SD_Cache_GetStats(&cache, &stats, 1);
+    CHECK_EQ(stats.evictions, 2);
+    CHECK_EQ(stats.hits, 1);
+    CHECK_EQ(stats.misses, 2);
+    ResetCounters();
+}
+
+// Consecutive dirty sectors leave in one CMD25, whatever order they were written in
+static void TestMergedFlush(void)
+{
+    SD_CacheStats stats;
+    static const uint8_t order[16] = { 3, 0, 7, 12, 1, 15, 4, 9, 2, 14, 5, 10, 6, 13, 8, 11 };
+
+    SD_Cache_Invalidate(&cache);
+    for (int i = 0; i < 16; i++)
+        Replay('W', 500 + order[i]);
+
+    CHECK_EQ(SD_Cache_Flush(&cache), SD_RESPONSE_NO_ERROR);
+    SD_Cache_GetStats(&cache, &stats, 0);
+    CHECK_EQ(card.cmd_count[25], 1);
+    CHECK_EQ(card.cmd_count[24], 0);
+    CHECK_EQ(card.acmd_count[23], 1); // Pre-erase count of the run
+    CHECK_EQ(card.pre_erase, 16);
+    CHECK_EQ(stats.writebacks, 16);
+    CHECK_EQ(stats.write_runs, 1);
+
+    CheckFlushed("merged");
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = NULL;
+    int i;
+
+    srand(17);
+    for (i = 1; i < argc; i++)
+    {
+        size_t len = strlen(argv[i]);
+        if (len < 6 || strcmp(argv[i] + len - 6, ".trace") != 0)
+            image = argv[i];
+    }
+
+    Setup(image);
+    TestRandomTrace();
+    for (i = 1; i < argc; i++)
+        if (argv[i] != image)
+            TestTraceFile(argv[i]);
+    TestLeastRecentlyUsed();
+    TestMergedFlush();
+
+    if (image != NULL)
+        CHECK_EQ(SD_Model_Save(&card, image), 0);
+    SD_Model_Free(&card);
+    free(reference);
+
+    TEST_EXIT();
+}
@@ -0,0 +1,179 @@
+/*
+ * test_sd_crc.c
+ *
+ * Table CRC kernels of sd_crc.c on known vectors and against bitwise
+ * references, then the driver retries on the SD card model with injected
+ * command, read and write CRC faults.
+ */
+
+#include "sd_spi_driver.h"
+#include "sd_crc.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SECTORS 1024
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+
+static uint8_t Crc7Bitwise(const uint8_t *data, uint32_t len)
+{
+    uint8_t crc = 0;
+
+    for (uint32_t i = 0; i < len; i++)
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            uint8_t in = ((data[i] >> bit) & 1) ^ ((crc >> 6) & 1);
+
+            crc = ((crc << 1) & 0x7F) ^ (in ? 0x09 : 0);
+        }
+    return crc;
+}
+
+static uint16_t Crc16Bitwise(uint16_t crc, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// Command CRC byte as sent on the wire
+static uint8_t CommandCrc(uint8_t cmd, uint32_t arg)
+{
+    uint8_t frame[5] = { 0x40 | cmd, arg >> 24, arg >> 16, arg >> 8, arg };
+
+    return (SD_CRC7(frame, 5) << 1) | 1;
+}
+
+static void TestVectors(void)
+{
+    static const uint8_t check[] = "123456789";
+    uint8_t ones[SD_BLOCK_SIZE];
+
+    CHECK_EQ(CommandCrc(0, 0), 0x95);
+    CHECK_EQ(CommandCrc(8, 0x1AA), 0x87);
+    CHECK_EQ(CommandCrc(55, 0), 0x65);
+    CHECK_EQ(CommandCrc(41, 0x40000000), 0x77);
+    CHECK_EQ(CommandCrc(17, 0), 0x55);
+
+    CHECK_EQ(SD_CRC16(0, check, 9), 0x31C3);
+    CHECK_EQ(SD_CRC16(0xFFFF, check, 9), 0x29B1);
+
+    memset(ones, 0xFF, sizeof(ones));
+    CHECK_EQ(SD_CRC16(0, ones, sizeof(ones)), 0x7FA1);
+
+    // Continuing over a split block gives the same CRC
+    CHECK_EQ(SD_CRC16(SD_CRC16(0, ones, 100), ones + 100, sizeof(ones) - 100), 0x7FA1);
+}
+
+// Random lengths and contents, every table entry and the inline byte step
+static void TestAgainstBitwise(void)
+{
+    uint8_t data[SD_BLOCK_SIZE];
+    uint32_t differ = 0;
+
+    srand(21);
+    for (int i = 0; i < 200; i++)
+    {
+        uint32_t len = rand() % (sizeof(data) + 1);
+        uint16_t crc = 0;
+
+        for (uint32_t j = 0; j < len; j++)
+            data[j] = rand();
+
+        differ += SD_CRC7(data, len) != Crc7Bitwise(data, len);
+        differ += SD_CRC16(0, data, len) != Crc16Bitwise(0, data, len);
+        for (uint32_t j = 0; j < len; j++)
+            crc = SD_CRC16_Byte(crc, data[j]);
+        differ += crc != Crc16Bitwise(0, data, len);
+    }
+    CHECK_EQ(differ, 0);
+
+    for (int value = 0; value < 256; value++)
+    {
+        uint8_t byte = value;
+
+        differ += sd_crc16_table[value] != Crc16Bitwise(0, &byte, 1);
+    }
+    CHECK_EQ(differ, 0);
+}
+
+static void Setup(void)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+    for (uint32_t s = 0; s < card.sectors; s++)
+        for (int i = 0; i < SD_BLOCK_SIZE; i++)
+            SD_Model_Sector(&card, s)[i] = rand();
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, SD_MODEL_SDHC);
+
+    // The model rejects every frame and block with a wrong CRC once CMD59 is on
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+    CHECK(hsd.crc_on);
+    CHECK(card.crc_on);
+    CHECK_EQ(hsd.crc_errors, 0);
+}
+
+// Each injected fault is counted once and retried to success
+static void TestInjectedFaults(void)
+{
+    uint8_t buffer[2 * SD_BLOCK_SIZE];
+    uint8_t data[2 * SD_BLOCK_SIZE];
+    uint32_t count;
+
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = rand();
+
+    count = card.cmd_count[17];
+    card.inject_cmd_crc = 1;
+    CHECK_EQ(SD_SectorRead(&hsd, 10, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 10), SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(card.cmd_count[17] - count, 1); // rejected frames are not executed
+    CHECK_EQ(hsd.crc_errors, 1);
+
+    card.inject_read_crc = 1;
+    CHECK_EQ(SD_SectorRead(&hsd, 11, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 11), SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(hsd.crc_errors, 2);
+
+    card.inject_read_crc = 1;
+    CHECK_EQ(SD_SectorsRead(&hsd, 20, 2, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 20), sizeof(buffer)) == 0);
+    CHECK_EQ(hsd.crc_errors, 3);
+
+    card.inject_write_crc = 1;
+    CHECK_EQ(SD_SectorWrite(&hsd, 30, data), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(data, SD_Model_Sector(&card, 30), SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(hsd.crc_errors, 4);
+
+    card.inject_write_crc = 1;
+    CHECK_EQ(SD_SectorsWrite(&hsd, 40, 2, data), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(data, SD_Model_Sector(&card, 40), sizeof(data)) == 0);
+    CHECK_EQ(hsd.crc_errors, 5);
+
+    // Every fault spent, the clock kept
+    CHECK_EQ(card.inject_cmd_crc + card.inject_read_crc + card.inject_write_crc, 0);
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_2);
+    CHECK(!card.cs_low);
+}
+
+int main(void)
+{
+    TestVectors();
+    TestAgainstBitwise();
+
+    Setup();
+    TestInjectedFaults();
+    SD_Model_Free(&card);
+
+    TEST_EXIT();
+}
@@ -0,0 +1,278 @@
+/*
+ * test_sd_erase.c
+ *
+ * SD status, erase and AU-aligned discard on the SD card model. The model
+ * reports 4 MB allocation units (8192 sectors), ERASE_SIZE 2 AUs and a 10 s
+ * ERASE_TIMEOUT, and reads erased sectors as 0x00.
+ */
+
+#include "sd_spi_driver.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <string.h>
+
+#define TEST_SECTORS 65536
+#define TEST_AU      8192
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+
+static void Setup(SD_ModelType type)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, type);
+
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+}
+
+static void Fill(uint32_t start, uint32_t count, uint8_t value)
+{
+    memset(SD_Model_Sector(&card, start), value, (size_t) count * SD_BLOCK_SIZE);
+}
+
+// Sectors of [start, start + count) that do not hold value
+static uint32_t Differ(uint32_t start, uint32_t count, uint8_t value)
+{
+    uint32_t differ = 0;
+
+    for (uint32_t s = start; s < start + count; s++)
+        for (int i = 0; i < SD_BLOCK_SIZE; i++)
+            if (SD_Model_Sector(&card, s)[i] != value)
+            {
+                differ++;
+                break;
+            }
+    return differ;
+}
+
+static void TestStatus(void)
+{
+    SD_Status status;
+
+    CHECK_EQ(SD_GetStatus(&hsd, &status), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.acmd_count[13], 1);
+    CHECK_EQ(status.SpeedClass, 4);
+    CHECK_EQ(status.AU_Size, 9);
+    CHECK_EQ(status.EraseSize, 2);
+    CHECK_EQ(status.EraseTimeout, 10);
+    CHECK_EQ(status.EraseOffset, 0);
+    CHECK(!card.cs_low);
+
+    // Not read yet by the driver, the first erase loads it once
+    CHECK_EQ(hsd.au_sectors, 0);
+}
+
+static void TestErase(void)
+{
+    SD_Latency stats;
+
+    Fill(100, 100, 0xAB);
+    CHECK_EQ(SD_Erase(&hsd, 100, 149), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(Differ(100, 50, 0x00), 0);
+    CHECK_EQ(Differ(150, 50, 0xAB), 0);
+    CHECK_EQ(card.cmd_count[32], 1);
+    CHECK_EQ(card.cmd_count[33], 1);
+    CHECK_EQ(card.cmd_count[38], 1);
+    CHECK(!card.cs_low);
+
+    CHECK_EQ(hsd.au_sectors, TEST_AU);
+    CHECK_EQ(hsd.erase_size, 2);
+    CHECK_EQ(hsd.erase_timeout_s, 10);
+
+    // The busy time of the erase is measured
+    SD_GetLatency(&hsd, SD_OP_ERASE, &stats, 1);
+    CHECK_EQ(stats.count, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.last_us >= card.erase_us && stats.last_us < card.erase_us + 100);
+
+    // The status is read once
+    CHECK_EQ(SD_Erase(&hsd, 150, 150), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.acmd_count[13], 2);
+    CHECK_EQ(Differ(150, 1, 0x00), 0);
+    CHECK_EQ(Differ(151, 49, 0xAB), 0);
+
+    CHECK_EQ(SD_Erase(&hsd, 10, 9), SD_PARAMETER_ERROR);
+    CHECK_EQ(card.cmd_count[32], 2);
+}
+
+static void TestPlan(void)
+{
+    SD_ErasePlan plan;
+    uint32_t first, last;
+
+    // Whole AUs only, in commands of ERASE_SIZE AUs
+    CHECK_EQ(SD_ErasePlan_Init(&hsd, &plan, 100, 5 * TEST_AU), 4 * TEST_AU);
+    CHECK(SD_ErasePlan_Next(&plan, &first, &last));
+    CHECK_EQ(first, TEST_AU);
+    CHECK_EQ(last, 3 * TEST_AU - 1);
+    CHECK(SD_ErasePlan_Next(&plan, &first, &last));
+    CHECK_EQ(first, 3 * TEST_AU);
+    CHECK_EQ(last, 5 * TEST_AU - 1);
+    CHECK(!SD_ErasePlan_Next(&plan, &first, &last));
+
+    // Aligned on both ends, an odd number of AUs: the last command is shorter
+    CHECK_EQ(SD_ErasePlan_Init(&hsd, &plan, 2 * TEST_AU, 3 * TEST_AU), 3 * TEST_AU);
+    CHECK(SD_ErasePlan_Next(&plan, &first, &last));
+    CHECK(SD_ErasePlan_Next(&plan, &first, &last));
+    CHECK_EQ(first, 4 * TEST_AU);
+    CHECK_EQ(last, 5 * TEST_AU - 1);
+    CHECK(!SD_ErasePlan_Next(&plan, &first, &last));
+
+    // Inside one AU, or across a boundary without a whole AU: nothing
+    CHECK_EQ(SD_ErasePlan_Init(&hsd, &plan, 10, TEST_AU - 20), 0);
+    CHECK(!SD_ErasePlan_Next(&plan, &first, &last));
+    CHECK_EQ(SD_ErasePlan_Init(&hsd, &plan, TEST_AU - 10, TEST_AU), 0);
+    CHECK(!SD_ErasePlan_Next(&plan, &first, &last));
+}
+
+// The partial AUs at both ends keep their content
+static void TestDiscard(void)
+{
+    uint32_t cmd38 = card.cmd_count[38];
+
+    Fill(0, 6 * TEST_AU, 0x11);
+    CHECK_EQ(SD_Discard(&hsd, 100, 5 * TEST_AU), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.cmd_count[38], cmd38 + 2);
+    CHECK_EQ(Differ(0, TEST_AU, 0x11), 0);
+    CHECK_EQ(Differ(TEST_AU, 4 * TEST_AU, 0x00), 0);
+    CHECK_EQ(Differ(5 * TEST_AU, TEST_AU, 0x11), 0);
+
+    // Nothing whole to erase: no command
+    CHECK_EQ(SD_Discard(&hsd, 100, 200), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.cmd_count[38], cmd38 + 2);
+}
+
+// SD_EraseBegin leaves the bus free while the card erases
+static void TestCooperativeErase(void)
+{
+    SD_BusyToken token;
+    SD_Latency stats;
+    SD_Error state;
+    uint32_t bytes;
+
+    card.erase_us = 30000;
+    Fill(300, 10, 0x22);
+    SD_GetLatency(&hsd, SD_OP_ERASE, &stats, 1);
+
+    CHECK_EQ(SD_EraseBegin(&hsd, 300, 304, &token), SD_RESPONSE_BUSY);
+    CHECK(!card.cs_low);
+    bytes = card.bytes;
+    do
+    {
+        Host_AdvanceCycles(SystemCoreClock / 10000);
+        state = SD_PollBusy(&hsd, &token);
+    } while (state == SD_RESPONSE_BUSY);
+    bytes = card.bytes - bytes;
+
+    CHECK_EQ(state, SD_RESPONSE_NO_ERROR);
+    CHECK(bytes < 150);
+    CHECK_EQ(Differ(300, 5, 0x00), 0);
+    CHECK_EQ(Differ(305, 5, 0x22), 0);
+
+    SD_GetLatency(&hsd, SD_OP_ERASE, &stats, 1);
+    CHECK_EQ(stats.count, 1);
+    // Seen done at the first poll after it, polls run from a 100 us loop
+    CHECK(stats.last_us >= 30000 && stats.last_us <= 30000 + 2 * SD_BUSY_POLL_US);
+
+    printf("30 ms erase: %u bytes while polling\n", bytes);
+    card.erase_us = 2000;
+    SD_Model_Free(&card);
+}
+
+// Erase of sectors 100..149 with card.erase_us of busy time, timed out after about timeout_us
+static void EraseWithin(uint32_t timeout_us, int times_out)
+{
+    SD_Latency stats;
+
+    SD_GetLatency(&hsd, SD_OP_ERASE, &stats, 1);
+    CHECK_EQ(SD_Erase(&hsd, 100, 149), times_out ? SD_RESPONSE_FAILURE : SD_RESPONSE_NO_ERROR);
+    SD_GetLatency(&hsd, SD_OP_ERASE, &stats, 1);
+    CHECK_EQ(stats.timeouts, times_out);
+    if (times_out)
+        CHECK(stats.last_us >= timeout_us && stats.last_us < timeout_us + 100);
+    else
+        CHECK(stats.last_us >= card.erase_us && stats.last_us < card.erase_us + 100);
+}
+
+// The range touches at most 2 AUs, which get their share of the status timeout
+static void TestEraseTimeout(void)
+{
+    // ERASE_SIZE 64 AUs in an ERASE_TIMEOUT of 1 s: ERASE_TIMEOUT * AUs < ERASE_SIZE
+    Setup(SD_MODEL_SDHC);
+    card.status[11] = 0;
+    card.status[12] = 64;
+    card.status[13] = 1 << 2;
+    card.erase_us = 25000;
+    EraseWithin(2 * 1000000 / 64, 0);
+    Host_AdvanceCycles((uint64_t) SystemCoreClock);
+    card.erase_us = 40000;
+    EraseWithin(2 * 1000000 / 64, 1);
+    SD_Model_Free(&card);
+
+    // ERASE_OFFSET is added once
+    Setup(SD_MODEL_SDHC);
+    card.status[13] = (1 << 2) | 1;
+    card.erase_us = 2500000;
+    EraseWithin(2 * 1000000 / 2 + 1000000, 1);
+    SD_Model_Free(&card);
+
+    // No ERASE_TIMEOUT: 250 ms per AU, not per sector
+    Setup(SD_MODEL_SDHC);
+    card.status[13] = 0;
+    card.erase_us = 600000;
+    EraseWithin(2 * 250000, 1);
+    SD_Model_Free(&card);
+}
+
+// SDSC cards take byte addresses
+static void TestSdscAddressing(void)
+{
+    Setup(SD_MODEL_SDSC);
+    CHECK_EQ(hsd.card_type, SD_Card_SDSC_v2);
+
+    Fill(1000, 20, 0x33);
+    CHECK_EQ(SD_Erase(&hsd, 1005, 1009), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.erase_start, 1005);
+    CHECK_EQ(card.erase_end, 1009);
+    CHECK_EQ(Differ(1000, 5, 0x33), 0);
+    CHECK_EQ(Differ(1005, 5, 0x00), 0);
+    CHECK_EQ(Differ(1010, 10, 0x33), 0);
+    SD_Model_Free(&card);
+}
+
+// MMC cards erase with other commands, and have no SD status
+static void TestMmc(void)
+{
+    SD_Status status;
+    SD_BusyToken token;
+
+    Setup(SD_MODEL_MMC);
+    CHECK_EQ(hsd.card_type, SD_Card_MMC);
+
+    CHECK_EQ(SD_GetStatus(&hsd, &status), SD_ILLEGAL_COMMAND);
+    CHECK_EQ(SD_Erase(&hsd, 0, 10), SD_ILLEGAL_COMMAND);
+    CHECK_EQ(SD_EraseBegin(&hsd, 0, 10, &token), SD_ILLEGAL_COMMAND);
+    CHECK_EQ(SD_Discard(&hsd, 0, 5 * TEST_AU), SD_ILLEGAL_COMMAND);
+    CHECK_EQ(card.cmd_count[32] + card.cmd_count[38], 0);
+    SD_Model_Free(&card);
+}
+
+int main(void)
+{
+    Setup(SD_MODEL_SDHC);
+    TestStatus();
+    TestErase();
+    TestPlan();
+    TestDiscard();
+    TestCooperativeErase();
+    TestEraseTimeout();
+
+    TestSdscAddressing();
+    TestMmc();
+
+    TEST_EXIT();
+}
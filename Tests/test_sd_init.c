@@ -0,0 +1,151 @@
+/*
+ * test_sd_init.c
+ *
+ * Non-blocking bring-up (SD_Init_Start / SD_Init_Step) on the SD card model:
+ * each card type comes up with a bounded amount of bus work per step, the
+ * ramp-up runs at the identification clock, and a missing card times out.
+ */
+
+#include "sd_spi_driver.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <string.h>
+
+#define TEST_SECTORS 4096
+
+/* Slowest step: CMD0 with its ready waits, at most a few commands */
+#define TEST_STEP_BYTES 64
+
+/* Without a card each CMD0 waits out the R1 polling (SD_NUM_TRIES, 300 bytes) */
+#define TEST_NO_CARD_STEP_BYTES 320
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+
+typedef struct
+{
+    uint32_t steps; // Steps that put bytes on the wire
+    uint32_t max_bytes; // On the wire in one step
+    uint32_t rampup_bytes; // Clocked by the power-up step
+    uint32_t rampup_clock;
+    SD_InitResult result;
+} BringUp;
+
+static void Setup(SD_ModelType type, uint16_t cs_pin)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, type);
+    if (cs_pin != SD_CS_Pin)
+        SD_Model_Attach(&card, &hspi2, SD_CS_GPIO_Port, cs_pin); // No card behind the CS of the driver
+}
+
+static void Run(BringUp *run)
+{
+    uint32_t loops = 0;
+
+    memset(run, 0, sizeof(*run));
+    SD_Init_Start(&hsd);
+    do
+    {
+        SD_InitPhase phase = hsd.init_phase;
+        uint32_t bytes = card.bytes;
+
+        run->result = SD_Init_Step(&hsd);
+        bytes = card.bytes - bytes;
+
+        if (phase == SD_INIT_PHASE_POWER_UP && hsd.init_phase != phase)
+        {
+            run->rampup_bytes = bytes;
+            run->rampup_clock = hsd.clock;
+        }
+        if (bytes > 0)
+            run->steps++;
+        if (bytes > run->max_bytes)
+            run->max_bytes = bytes;
+    } while (run->result == SD_INIT_PENDING && ++loops < 10000000);
+}
+
+static void TestCard(SD_ModelType type, SDCardType expected, const char *name)
+{
+    BringUp run;
+    uint8_t buffer[SD_BLOCK_SIZE];
+
+    Setup(type, SD_CS_Pin);
+    Run(&run);
+
+    CHECK_EQ(run.result, SD_INIT_SUCESS);
+    CHECK_EQ(hsd.card_type, expected);
+    CHECK(run.max_bytes <= TEST_STEP_BYTES);
+    CHECK(!card.cs_low);
+
+    // 74+ clocks with CS high at the fastest clock up to 400 kHz: /128 on APB1
+    CHECK(run.rampup_bytes >= 10);
+    CHECK_EQ(run.rampup_clock, HAL_RCC_GetPCLK1Freq() / 128);
+    CHECK_EQ(card.cs_asserts > 0, 1);
+
+    // Then TRAN_SPEED (25 MHz): /2 on APB1
+    CHECK_EQ(hsd.clock, HAL_RCC_GetPCLK1Freq() / 2);
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_2);
+
+    // The card is usable, with its own addressing
+    CHECK_EQ(SD_SectorRead(&hsd, 100, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 100), SD_BLOCK_SIZE) == 0);
+
+    printf("%s: %u steps on the wire, %u bytes at most, ramp-up %u bytes at %u Hz\n", name, run.steps,
+            run.max_bytes, run.rampup_bytes, run.rampup_clock);
+    SD_Model_Free(&card);
+}
+
+// A MMC card answers CMD55 as illegal: CMD1 right away, without the ACMD41 timeout
+static void TestMmcNoTimeout(void)
+{
+    BringUp run;
+    uint32_t start;
+
+    Setup(SD_MODEL_MMC, SD_CS_Pin);
+    start = HAL_GetTick();
+    Run(&run);
+
+    CHECK_EQ(run.result, SD_INIT_SUCESS);
+    CHECK_EQ(card.acmd_count[41], 0);
+    CHECK(card.cmd_count[1] > 0);
+    CHECK(HAL_GetTick() - start < 100);
+    SD_Model_Free(&card);
+}
+
+// Nothing answers on the CS line: CMD0 until the bring-up timeout
+static void TestNoCard(void)
+{
+    BringUp run;
+    uint32_t start;
+
+    Setup(SD_MODEL_SDHC, GPIO_PIN_0);
+    start = HAL_GetTick();
+    Run(&run);
+
+    CHECK_EQ(run.result, SD_INIT_NO_CARD);
+    CHECK(run.max_bytes <= TEST_NO_CARD_STEP_BYTES);
+    CHECK(HAL_GetTick() - start >= 1000);
+    CHECK(HAL_GetTick() - start < 1100);
+    CHECK(!card.cs_low);
+
+    printf("no card: %u steps, %u bytes at most, gave up after %u ms\n", run.steps, run.max_bytes,
+            HAL_GetTick() - start);
+    SD_Model_Free(&card);
+}
+
+int main(void)
+{
+    TestCard(SD_MODEL_SDHC, SD_Card_SDHC, "SDHC");
+    TestCard(SD_MODEL_SDSC, SD_Card_SDSC_v2, "SDSC v2");
+    TestCard(SD_MODEL_SDV1, SD_Card_SDSC_v1, "SDv1");
+    TestCard(SD_MODEL_MMC, SD_Card_MMC, "MMC");
+    TestMmcNoTimeout();
+    TestNoCard();
+
+    TEST_EXIT();
+}
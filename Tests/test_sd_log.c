@@ -0,0 +1,268 @@
+/*
+ * test_sd_log.c
+ *
+ * Log store on a blank RAM image through Stubs/sd_disk.c. Each power loss
+ * round appends records until a random sector write, the sectors after it are
+ * lost (the first one partly written), then remounts: the log must read back
+ * as the newest committed records in order, the torn group whole or not at all.
+ */
+
+#include "sd_log.h"
+#include "sd_disk.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_START 64
+#define TEST_ROUNDS 300
+#define TEST_IDS 65536
+
+static SD_SPI_Handle hsd;
+static SD_Log log_store;
+static SD_LogCursor cursor;
+
+static uint32_t seed;
+static uint8_t record[SD_LOG_MAX_RECORD];
+static uint8_t got[SD_LOG_MAX_RECORD];
+
+// Committed (durable) ids, and the ids appended since the last commit
+static uint32_t *committed;
+static uint32_t committed_count;
+static uint32_t pending[SD_LOG_SEGMENT_SIZE / SD_LOG_RECORD_HEADER_SIZE];
+static uint32_t pending_count;
+static uint32_t *found;
+
+static uint32_t Random(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Deterministic content of record id, the id in its first 4 bytes
+static uint16_t MakeRecord(uint32_t id, uint8_t *data)
+{
+    uint16_t len = 4 + (id * 2654435761u >> 7) % 300;
+
+    if (id % 251 == 0)
+        len = SD_LOG_MAX_RECORD;
+    else if (id % 97 == 0)
+        len = 1500;
+
+    memcpy(data, &id, 4);
+    for (uint16_t i = 4; i < len; i++)
+        data[i] = id * 31 + i * 7 + (i >> 8);
+    return len;
+}
+
+static uint32_t Log2Ceil(uint32_t n)
+{
+    uint32_t bits = 0;
+
+    while ((1u << bits) < n)
+        bits++;
+    return bits;
+}
+
+static uint32_t Mount(uint32_t segments)
+{
+    uint32_t reads = host_disk.reads;
+
+    CHECK_EQ(SD_Log_Mount(&log_store, &hsd, TEST_START, segments), SD_LOG_OK);
+    return host_disk.reads - reads;
+}
+
+// Read the whole log into found, returns the record count or -1 if a record is bad
+static int32_t ReadAll(void)
+{
+    uint32_t n = 0;
+    uint16_t len;
+    SD_LogResult res;
+
+    SD_Log_Rewind(&log_store, &cursor);
+    while ((res = SD_Log_Next(&log_store, &cursor, got, sizeof(got), &len)) == SD_LOG_OK)
+    {
+        uint32_t id;
+
+        if (len < 4 || n == TEST_IDS)
+            return -1;
+        memcpy(&id, got, 4);
+        if (MakeRecord(id, record) != len || memcmp(record, got, len) != 0)
+            return -1;
+        found[n++] = id;
+    }
+    return (res == SD_LOG_END) ? (int32_t) n : -1;
+}
+
+/**
+ * @brief  The pending group was written (next_seq moved): committed, or torn
+ *         if the power went during its write
+ * @retval Size of the torn group copied to torn, 0 if committed
+ */
+static uint32_t GroupWritten(uint32_t *torn)
+{
+    uint32_t count = pending_count;
+
+    pending_count = 0;
+    if (host_disk.dropped > 0)
+    {
+        memcpy(torn, pending, count * sizeof(uint32_t));
+        return count;
+    }
+
+    memcpy(&committed[committed_count], pending, count * sizeof(uint32_t));
+    committed_count += count;
+    return 0;
+}
+
+/**
+ * @brief  One power loss round: appends until a sector write is lost
+ * @retval 1 if the remounted log is the expected one
+ */
+static uint8_t PowerRound(uint32_t segments, uint32_t *next_id, uint32_t *max_mount_reads)
+{
+    uint32_t torn[SD_LOG_SEGMENT_SIZE / SD_LOG_RECORD_HEADER_SIZE];
+    uint32_t torn_count = 0;
+    uint32_t mount_reads;
+    int32_t n;
+
+    host_disk.dropped = 0;
+    host_disk.write_limit = host_disk.writes + Random() % (4 * SD_LOG_SEGMENT_SECTORS);
+    host_disk.torn_bytes = (Random() % 2) ? Random() % SD_BLOCK_SIZE : 0;
+
+    for (int i = 0; i < 200 && torn_count == 0; i++)
+    {
+        uint32_t seq = log_store.next_seq;
+        uint32_t id = (*next_id)++;
+
+        // a full buffer is committed before the record goes in
+        if (SD_Log_Append(&log_store, record, MakeRecord(id, record)) != SD_LOG_OK)
+            return 0;
+        if (log_store.next_seq != seq)
+            torn_count = GroupWritten(torn);
+        pending[pending_count++] = id;
+
+        if (torn_count == 0 && Random() % 8 == 0)
+        {
+            if (SD_Log_Commit(&log_store) != SD_LOG_OK)
+                return 0;
+            torn_count = GroupWritten(torn);
+        }
+    }
+
+    if (torn_count == 0)
+    { // the cut was never reached, power off after a last commit
+        if (SD_Log_Commit(&log_store) != SD_LOG_OK)
+            return 0;
+        torn_count = GroupWritten(torn);
+    }
+    pending_count = 0;
+    host_disk.write_limit = -1;
+
+    mount_reads = Mount(segments);
+    if (mount_reads > *max_mount_reads)
+        *max_mount_reads = mount_reads;
+
+    n = ReadAll();
+    if (n < 0)
+        return 0;
+
+    // the torn group is all there (then it is committed) or not at all
+    if (n > 0 && torn_count > 0 && found[n - 1] == torn[torn_count - 1])
+    {
+        memcpy(&committed[committed_count], torn, torn_count * sizeof(uint32_t));
+        committed_count += torn_count;
+    }
+
+    // the newest committed records, in order, nothing else
+    if ((uint32_t) n > committed_count || (committed_count > 0 && n == 0))
+        return 0;
+    return memcmp(found, &committed[committed_count - n], n * sizeof(uint32_t)) == 0;
+}
+
+static void TestPowerLoss(uint32_t segments)
+{
+    uint32_t next_id = 1;
+    uint32_t failed = 0;
+    uint32_t max_mount_reads = 0;
+    uint32_t cuts = 0;
+
+    CHECK_EQ(SD_Disk_Init(TEST_START + segments * SD_LOG_SEGMENT_SECTORS), 0);
+    CHECK_EQ(SD_Log_Format(&log_store, &hsd, TEST_START, segments), SD_LOG_OK);
+    Mount(segments);
+    committed_count = 0;
+    pending_count = 0;
+
+    for (int round = 0; round < TEST_ROUNDS && next_id < TEST_IDS - 400; round++)
+    {
+        if (!PowerRound(segments, &next_id, &max_mount_reads))
+        {
+            if (failed++ == 0)
+                printf("%u segments: round %d reads back wrong\n", segments, round);
+        }
+        cuts += host_disk.dropped > 0;
+    }
+
+    CHECK_EQ(failed, 0);
+    CHECK(cuts > TEST_ROUNDS / 2);
+    CHECK(committed_count > TEST_ROUNDS);
+    // binary search over the headers, then the head segment
+    CHECK(max_mount_reads <= 2 + Log2Ceil(segments) + SD_LOG_SEGMENT_SECTORS);
+
+    printf("%u segments: %u rounds, %u cuts, %u records committed, mount reads %u sectors at most\n", segments,
+            TEST_ROUNDS, cuts, committed_count, max_mount_reads);
+    SD_Disk_Free();
+}
+
+// Without power loss: empty log, round trip, oversized records
+static void TestBasic(void)
+{
+    uint16_t len;
+
+    CHECK_EQ(SD_Disk_Init(TEST_START + 4 * SD_LOG_SEGMENT_SECTORS), 0);
+    CHECK_EQ(SD_Log_Format(&log_store, &hsd, TEST_START, 4), SD_LOG_OK);
+    Mount(4);
+    CHECK_EQ(ReadAll(), 0);
+
+    CHECK_EQ(SD_Log_Append(&log_store, record, SD_LOG_MAX_RECORD + 1), SD_LOG_TOO_LARGE);
+    for (uint32_t id = 1; id <= 20; id++)
+        CHECK_EQ(SD_Log_Append(&log_store, record, MakeRecord(id, record)), SD_LOG_OK);
+    CHECK_EQ(SD_Log_Commit(&log_store), SD_LOG_OK);
+
+    // One CMD25 per segment after the 4 format writes, 20 records fill at most two
+    CHECK(host_disk.write_calls <= 4 + 3);
+    CHECK(log_store.next_seq >= 1);
+
+    Mount(4);
+    CHECK_EQ(ReadAll(), 20);
+    for (uint32_t i = 0; i < 20; i++)
+        CHECK_EQ(found[i], i + 1);
+
+    // A record larger than the read buffer is skipped
+    SD_Log_Rewind(&log_store, &cursor);
+    CHECK_EQ(SD_Log_Next(&log_store, &cursor, got, 3, &len), SD_LOG_TOO_LARGE);
+    CHECK_EQ(SD_Log_Next(&log_store, &cursor, got, sizeof(got), &len), SD_LOG_OK);
+    CHECK_EQ(len, MakeRecord(2, record));
+    SD_Disk_Free();
+}
+
+int main(void)
+{
+    static const uint32_t segments[] = { 3, 7, 64 };
+
+    committed = malloc(TEST_IDS * sizeof(uint32_t));
+    found = malloc(TEST_IDS * sizeof(uint32_t));
+
+    TestBasic();
+    for (unsigned i = 0; i < sizeof(segments) / sizeof(segments[0]); i++)
+    {
+        seed = 20 + i;
+        TestPowerLoss(segments[i]);
+    }
+
+    free(committed);
+    free(found);
+    TEST_EXIT();
+}
@@ -0,0 +1,221 @@
+/*
+ * test_sd_multiblock.c
+ *
+ * CMD18 reads (SD_SectorsRead and the read stream) against CMD17 reads, and
+ * CMD25 writes, on the SD card model. With an image file argument the card
+ * holds that image and is saved back to it at the end (the written sectors get
+ * their content back); otherwise it holds random sectors.
+ */
+
+#include "sd_spi_driver.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SECTORS 8192
+#define TEST_RUN     64
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+
+static uint8_t buffer[TEST_RUN * SD_BLOCK_SIZE];
+static uint8_t saved[TEST_RUN * SD_BLOCK_SIZE];
+
+static void Setup(const char *image)
+{
+    if (image != NULL)
+    {
+        CHECK_EQ(SD_Model_Load(&card, image), 0);
+    }
+    else
+    {
+        CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+        srand(11);
+        for (uint32_t s = 0; s < card.sectors; s++)
+            for (int i = 0; i < SD_BLOCK_SIZE; i++)
+                SD_Model_Sector(&card, s)[i] = rand();
+    }
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, SD_MODEL_SDHC);
+}
+
+static void TestInit(void)
+{
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+    CHECK_EQ(hsd.card_type, SD_Card_SDHC);
+    CHECK(hsd.crc_on);
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_2); // TRAN_SPEED 25 MHz
+    CHECK(!card.cs_low);
+}
+
+// Wire bytes per sector, CMD17 per sector then one CMD18 for the run
+static void TestBytesPerSector(void)
+{
+    uint32_t start = card.sectors / 2;
+    uint32_t bytes;
+    uint32_t single;
+
+    bytes = card.bytes;
+    for (int i = 0; i < TEST_RUN; i++)
+        CHECK_EQ(SD_SectorRead(&hsd, start + i, buffer + i * SD_BLOCK_SIZE), SD_RESPONSE_NO_ERROR);
+    single = (card.bytes - bytes) / TEST_RUN;
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, start), sizeof(buffer)) == 0);
+
+    memset(buffer, 0, sizeof(buffer));
+    bytes = card.bytes;
+    uint32_t cmd18 = card.cmd_count[18];
+    CHECK_EQ(SD_SectorsRead(&hsd, start, TEST_RUN, buffer), SD_RESPONSE_NO_ERROR);
+    uint32_t multi = (card.bytes - bytes) / TEST_RUN;
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, start), sizeof(buffer)) == 0);
+    CHECK_EQ(card.cmd_count[18], cmd18 + 1);
+
+    // 512 data bytes, token and CRC are the floor
+    CHECK(multi < single);
+    CHECK(multi >= SD_BLOCK_SIZE + 3);
+    printf("bytes per sector: CMD17 %u, CMD18 %u\n", single, multi);
+
+    // The card takes commands again after CMD12
+    CHECK_EQ(SD_SectorRead(&hsd, 5, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 5), SD_BLOCK_SIZE) == 0);
+    CHECK(!card.cs_low);
+}
+
+static void TestSingleSectorRun(void)
+{
+    uint32_t cmd17 = card.cmd_count[17];
+
+    CHECK_EQ(SD_SectorsRead(&hsd, 7, 1, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 7), SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(card.cmd_count[17], cmd17 + 1);
+}
+
+// The last sectors of the card, a run may end on the last one
+static void TestRunAtEnd(void)
+{
+    uint32_t start = card.sectors - 8;
+
+    CHECK_EQ(SD_SectorsRead(&hsd, start, 8, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, start), 8 * SD_BLOCK_SIZE) == 0);
+}
+
+static void TestStream(void)
+{
+    uint32_t start = 1000;
+
+    CHECK_EQ(SD_ReadStreamStart(&hsd, start), SD_RESPONSE_NO_ERROR);
+    for (int i = 0; i < 10; i++)
+    {
+        CHECK_EQ(SD_ReadStreamNext(&hsd, buffer), SD_RESPONSE_NO_ERROR);
+        CHECK(memcmp(buffer, SD_Model_Sector(&card, start + i), SD_BLOCK_SIZE) == 0);
+    }
+    CHECK_EQ(SD_ReadStreamStop(&hsd), SD_RESPONSE_NO_ERROR);
+    CHECK(!card.cs_low);
+
+    CHECK_EQ(SD_SectorRead(&hsd, 3, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 3), SD_BLOCK_SIZE) == 0);
+}
+
+// One ACMD23 and one CMD25 for the run, the content reads back
+static void TestMultiWrite(void)
+{
+    uint32_t start = card.sectors / 4;
+    uint32_t cmd24 = card.cmd_count[24];
+    uint32_t cmd25 = card.cmd_count[25];
+    uint32_t acmd23 = card.acmd_count[23];
+    uint32_t written = card.sectors_written;
+
+    memcpy(saved, SD_Model_Sector(&card, start), sizeof(saved));
+    for (uint32_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = ~saved[i];
+
+    CHECK_EQ(SD_SectorsWrite(&hsd, start, TEST_RUN, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, start), sizeof(buffer)) == 0);
+    CHECK_EQ(card.cmd_count[25], cmd25 + 1);
+    CHECK_EQ(card.cmd_count[24], cmd24);
+    CHECK_EQ(card.acmd_count[23], acmd23 + 1);
+    CHECK_EQ(card.pre_erase, TEST_RUN);
+    CHECK_EQ(card.sectors_written, written + TEST_RUN);
+    CHECK(!card.cs_low);
+
+    // Read back through the driver once the last block is programmed
+    memset(buffer, 0, sizeof(buffer));
+    CHECK_EQ(SD_SectorsRead(&hsd, start, TEST_RUN, buffer), SD_RESPONSE_NO_ERROR);
+    for (uint32_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = ~buffer[i];
+    CHECK(memcmp(buffer, saved, sizeof(buffer)) == 0);
+
+    // A single sector goes out as CMD24
+    CHECK_EQ(SD_SectorsWrite(&hsd, start, 1, saved), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(card.cmd_count[24], cmd24 + 1);
+    CHECK_EQ(card.cmd_count[25], cmd25 + 1);
+
+    CHECK_EQ(SD_SectorsWrite(&hsd, start, TEST_RUN, saved), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(saved, SD_Model_Sector(&card, start), sizeof(saved)) == 0);
+}
+
+// Stream writes, without pre-erase hint, up to the last sector of the card
+static void TestWriteStream(void)
+{
+    uint32_t start = card.sectors - 10;
+    uint32_t acmd23 = card.acmd_count[23];
+
+    memcpy(saved, SD_Model_Sector(&card, start), 10 * SD_BLOCK_SIZE);
+    memset(buffer, 0xA5, 10 * SD_BLOCK_SIZE);
+
+    CHECK_EQ(SD_WriteStreamStart(&hsd, start, 0), SD_RESPONSE_NO_ERROR);
+    for (int i = 0; i < 10; i++)
+        CHECK_EQ(SD_WriteStreamNext(&hsd, buffer + i * SD_BLOCK_SIZE), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(SD_WriteStreamStop(&hsd), SD_RESPONSE_NO_ERROR);
+    CHECK(!card.cs_low);
+    CHECK_EQ(card.acmd_count[23], acmd23);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, start), 10 * SD_BLOCK_SIZE) == 0);
+
+    CHECK_EQ(SD_SectorsWrite(&hsd, start, 10, saved), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(saved, SD_Model_Sector(&card, start), 10 * SD_BLOCK_SIZE) == 0);
+}
+
+// A block replaced by an error token is retried at the same clock first
+static void TestErrorToken(void)
+{
+    uint32_t cmd18 = card.cmd_count[18];
+
+    card.inject_read_error = 1;
+    memset(buffer, 0, sizeof(buffer));
+    CHECK_EQ(SD_SectorsRead(&hsd, 300, 4, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 300), 4 * SD_BLOCK_SIZE) == 0);
+    CHECK_EQ(card.cmd_count[18], cmd18 + 2);
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_2);
+    CHECK(!card.cs_low);
+
+    // A card that keeps failing slows the clock to its last step, then the error reaches the caller
+    card.inject_read_error = 1000;
+    CHECK_EQ(SD_SectorsRead(&hsd, 300, 4, buffer), SD_RESPONSE_DATA_ERROR);
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_256);
+    CHECK(!card.cs_low);
+    card.inject_read_error = 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = (argc > 1) ? argv[1] : NULL;
+
+    Setup(image);
+    TestInit();
+    TestBytesPerSector();
+    TestSingleSectorRun();
+    TestRunAtEnd();
+    TestStream();
+    TestMultiWrite();
+    TestWriteStream();
+    TestErrorToken();
+
+    if (image != NULL)
+        CHECK_EQ(SD_Model_Save(&card, image), 0);
+    SD_Model_Free(&card);
+
+    TEST_EXIT();
+}
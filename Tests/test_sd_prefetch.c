@@ -0,0 +1,194 @@
+/*
+ * test_sd_prefetch.c
+ *
+ * The read-ahead of sd_prefetch.c over SD_Async on the SD card model: when it
+ * starts, how its depth follows the consumer, the blocking fallback and the
+ * invalidation a writer must do first.
+ */
+
+#include "sd_prefetch.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SECTORS 1024
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+static SD_Async engine;
+static SD_Prefetch prefetch;
+
+static uint8_t buffer[SD_BLOCK_SIZE];
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    SD_Async_TransferComplete(&engine, hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    SD_Async_TransferComplete(&engine, hspi);
+}
+
+static void Setup(void)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+    for (uint32_t s = 0; s < card.sectors; s++)
+        for (int i = 0; i < SD_BLOCK_SIZE; i++)
+            SD_Model_Sector(&card, s)[i] = rand();
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, SD_MODEL_SDHC);
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+    SD_Async_Init(&engine, &hsd);
+}
+
+// The main loop, until the background reads are done
+static void PollAll(void)
+{
+    for (int i = 0; i < 1000 && !SD_Async_IsIdle(&engine); i++)
+        SD_Async_Poll(&engine);
+    CHECK(SD_Async_IsIdle(&engine));
+}
+
+static void Read(uint32_t sector)
+{
+    CHECK_EQ(SD_Prefetch_Read(&prefetch, sector, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, sector), SD_BLOCK_SIZE) == 0);
+}
+
+static uint8_t InUse(void)
+{
+    return prefetch.buffers[0].in_use + prefetch.buffers[1].in_use;
+}
+
+// The second consecutive read starts the read-ahead, the stream then stays in RAM
+static void TestSequentialTrigger(void)
+{
+    uint32_t cmd17 = card.cmd_count[17];
+    uint32_t cmd18 = card.cmd_count[18];
+
+    SD_Prefetch_Init(&prefetch, &engine);
+    Read(10);
+    CHECK(SD_Async_IsIdle(&engine));
+    CHECK_EQ(InUse(), 0);
+
+    Read(11);
+    CHECK(!SD_Async_IsIdle(&engine));
+    CHECK_EQ(prefetch.buffers[0].request.sector, 12);
+    CHECK_EQ(prefetch.buffers[0].request.count, 2);
+    PollAll();
+
+    // Each hit keeps the free buffer reading past the furthest one
+    for (uint32_t s = 12; s < 20; s++)
+    {
+        Read(s);
+        PollAll();
+    }
+    CHECK_EQ(prefetch.stats.misses, 2);
+    CHECK_EQ(prefetch.stats.hits, 8);
+    CHECK_EQ(prefetch.stats.stalls, 0);
+    CHECK_EQ(prefetch.depth, 2);
+    CHECK_EQ(card.cmd_count[17] - cmd17, 2);
+    CHECK(card.cmd_count[18] - cmd18 >= 4);
+    CHECK(!card.cs_low);
+}
+
+// A consumer faster than the card doubles the depth up to the maximum, a stream
+// left mid-buffer halves it for each buffer thrown away with unread sectors
+static void TestDepth(void)
+{
+    SD_Prefetch_Init(&prefetch, &engine);
+    Read(100);
+    Read(101);
+
+    // No main loop in between: every buffer is still in flight when it is needed
+    Read(102);
+    CHECK_EQ(prefetch.stats.stalls, 1);
+    CHECK_EQ(prefetch.depth, 4);
+    for (uint32_t s = 103; s < 112; s++)
+        Read(s);
+    CHECK(prefetch.stats.stalls >= 2);
+    CHECK_EQ(prefetch.depth, SD_PREFETCH_MAX_DEPTH);
+    CHECK(prefetch.buffers[0].request.count == 4 && prefetch.buffers[1].request.count == 4);
+    CHECK_EQ(prefetch.stats.wasted, 0);
+
+    // 112..115 and 116..119 are read ahead, 112 only is read
+    PollAll();
+    Read(112);
+    PollAll();
+    Read(500);
+    CHECK_EQ(prefetch.stats.wasted, 3 + 4);
+    CHECK_EQ(prefetch.depth, 1);
+}
+
+// A read off the stream goes to the card with CMD17 and drops the buffers
+static void TestFallback(void)
+{
+    uint32_t cmd17, cmd18;
+
+    SD_Prefetch_Init(&prefetch, &engine);
+    Read(200);
+    Read(201);
+    PollAll();
+    CHECK_EQ(InUse(), 1);
+
+    cmd17 = card.cmd_count[17];
+    cmd18 = card.cmd_count[18];
+    Read(700);
+    CHECK_EQ(card.cmd_count[17] - cmd17, 1);
+    CHECK_EQ(card.cmd_count[18] - cmd18, 0);
+    CHECK_EQ(prefetch.stats.misses, 3);
+    CHECK_EQ(InUse(), 0);
+    CHECK(SD_Async_IsIdle(&engine));
+
+    // Backwards is not sequential either
+    Read(699);
+    CHECK_EQ(InUse(), 0);
+    CHECK(!card.cs_low);
+}
+
+// A writer invalidates first: the read in flight ends, the next read sees the new data
+static void TestWriteInvalidates(void)
+{
+    uint8_t data[SD_BLOCK_SIZE];
+
+    for (int i = 0; i < SD_BLOCK_SIZE; i++)
+        data[i] = rand();
+
+    SD_Prefetch_Init(&prefetch, &engine);
+    Read(300);
+    Read(301);
+    CHECK(!SD_Async_IsIdle(&engine)); // 302..303 queued
+
+    SD_Prefetch_Invalidate(&prefetch);
+    CHECK(SD_Async_IsIdle(&engine));
+    CHECK_EQ(InUse(), 0);
+    CHECK_EQ(prefetch.stats.wasted, 2);
+
+    CHECK_EQ(SD_SectorWrite(&hsd, 302, data), SD_RESPONSE_NO_ERROR);
+    Read(302);
+    CHECK(memcmp(buffer, data, SD_BLOCK_SIZE) == 0);
+
+    // The stream picks up again after the write
+    Read(303);
+    CHECK(InUse() > 0);
+    PollAll();
+    Read(304);
+    CHECK(prefetch.stats.hits > 0);
+}
+
+int main(void)
+{
+    Setup();
+    TestSequentialTrigger();
+    TestDepth();
+    TestFallback();
+    TestWriteInvalidates();
+    SD_Model_Free(&card);
+
+    TEST_EXIT();
+}
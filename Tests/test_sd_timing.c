@@ -0,0 +1,287 @@
+/*
+ * test_sd_timing.c
+ *
+ * Card waits timed in microseconds on the SD card model, whose busy times are
+ * simulated time: timeouts from the CSD and the SPI clock, the latency
+ * statistics, waits across a DWT counter wrap, and the cooperative busy wait
+ * (SD_SectorWriteBegin / SD_PollBusy).
+ */
+
+#include "sd_spi_driver.h"
+#include "sd_card_model.h"
+#include "main.h"
+#include "test.h"
+
+#include <string.h>
+
+#define TEST_SECTORS 4096
+
+/* Caps of the read and write timeouts */
+#define TEST_READ_TIMEOUT_US  100000
+#define TEST_WRITE_TIMEOUT_US 250000
+
+static SPI_HandleTypeDef hspi2;
+static SD_SPI_Handle hsd;
+static SD_CardModel card;
+
+static uint8_t buffer[SD_BLOCK_SIZE];
+
+static void Setup(SD_ModelType type, uint8_t taac, uint8_t nsac)
+{
+    CHECK_EQ(SD_Model_Init(&card, TEST_SECTORS), 0);
+    card.taac = taac;
+    card.nsac = nsac;
+
+    SD_Model_AttachHandle(&card, &hspi2, &hsd, type);
+
+    CHECK_EQ(SD_Init(&hsd), SD_INIT_SUCESS);
+}
+
+// SD spec: 100 times the access time (TAAC + NSAC * 100 clocks), << R2W_FACTOR for writes
+static uint32_t ExpectedTimeout(uint32_t taac_ns, uint32_t nsac, uint8_t r2w, uint32_t cap)
+{
+    uint32_t access_us = taac_ns / 1000 + (uint32_t) ((uint64_t) nsac * 100 * 1000000 / hsd.clock) + 1;
+    uint32_t timeout = (100 * access_us) << r2w;
+
+    return (timeout > cap) ? cap : timeout;
+}
+
+// SDHC cards get the caps, whatever their CSD says
+static void TestSdhcTimeouts(void)
+{
+    Setup(SD_MODEL_SDHC, 0x0E, 0);
+    CHECK_EQ(hsd.read_timeout_us, TEST_READ_TIMEOUT_US);
+    CHECK_EQ(hsd.write_timeout_us, TEST_WRITE_TIMEOUT_US);
+}
+
+// A long programming time completes, a too long one is a timeout at the cap
+static void TestProgrammingWait(void)
+{
+    SD_Latency stats;
+
+    memset(buffer, 0x3C, sizeof(buffer));
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+
+    card.program_us = 152000;
+    CHECK_EQ(SD_SectorWrite(&hsd, 10, buffer), SD_RESPONSE_NO_ERROR);
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 0);
+    CHECK_EQ(stats.count, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.last_us >= 152000 && stats.last_us < 153000);
+
+    card.program_us = 380000;
+    CHECK_EQ(SD_SectorWrite(&hsd, 11, buffer), SD_RESPONSE_FAILURE);
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+    CHECK_EQ(stats.count, 2);
+    CHECK_EQ(stats.timeouts, 1);
+    CHECK(stats.last_us >= TEST_WRITE_TIMEOUT_US && stats.last_us < TEST_WRITE_TIMEOUT_US + 1000);
+    CHECK_EQ(stats.max_us, stats.last_us);
+    CHECK_EQ(stats.avg_us, stats.total_us / 2);
+
+    // The reset cleared them
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 0);
+    CHECK_EQ(stats.count, 0);
+
+    // Let the card finish before the next command
+    HAL_Delay(200);
+    card.program_us = 250;
+    printf("programming: 152 ms completes, 380 ms times out after %u us\n", TEST_WRITE_TIMEOUT_US);
+}
+
+// The counter wraps during the wait: the elapsed cycles are accumulated
+static void TestCounterWrap(void)
+{
+    SD_Latency stats;
+
+    card.program_us = 50000;
+    DWT->CYCCNT = 0xFFFFFFFF - 1000;
+    CHECK_EQ(SD_SectorWrite(&hsd, 12, buffer), SD_RESPONSE_NO_ERROR);
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.last_us >= 50000 && stats.last_us < 51000);
+    card.program_us = 250;
+}
+
+// A command issued while the card is still busy waits for it to be ready
+static void TestReadyWhileBusy(void)
+{
+    SD_Latency stats;
+
+    SD_GetLatency(&hsd, SD_OP_READY, &stats, 1);
+    card.busy_until = Host_Cycles() + 7600ULL * (SystemCoreClock / 1000000);
+    CHECK_EQ(SD_SectorRead(&hsd, 20, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 20), SD_BLOCK_SIZE) == 0);
+
+    SD_GetLatency(&hsd, SD_OP_READY, &stats, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.max_us >= 7000 && stats.max_us < 7700);
+    printf("read on a busy card: waited %u us for it\n", stats.max_us);
+}
+
+// A command issued while the card still programs waits for it to be ready
+static void TestReadyAfterWrite(void)
+{
+    SD_BusyToken token;
+    SD_Latency stats;
+
+    card.program_us = 7600;
+    memset(buffer, 0xC3, sizeof(buffer));
+    SD_GetLatency(&hsd, SD_OP_READY, &stats, 1);
+
+    CHECK_EQ(SD_SectorWriteBegin(&hsd, 20, buffer, &token), SD_RESPONSE_BUSY);
+    memset(buffer, 0, sizeof(buffer));
+    CHECK_EQ(SD_SectorRead(&hsd, 20, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(buffer[0], 0xC3);
+
+    SD_GetLatency(&hsd, SD_OP_READY, &stats, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.max_us >= 7000 && stats.max_us < 7700);
+    printf("read after a write: waited %u us for the card\n", stats.max_us);
+    card.program_us = 250;
+}
+
+/**
+ * @brief  Main loop doing 100 us of other work between SD_PollBusy calls
+ * @retval Result of the last poll
+ */
+static SD_Error PollUntilDone(SD_BusyToken *token, uint32_t *polls, uint8_t *cs_held)
+{
+    SD_Error state;
+
+    *polls = 0;
+    *cs_held = 0;
+    do
+    {
+        Host_AdvanceCycles(SystemCoreClock / 10000);
+        state = SD_PollBusy(&hsd, token);
+        (*polls)++;
+        *cs_held |= card.cs_low;
+    } while (state == SD_RESPONSE_BUSY);
+
+    return state;
+}
+
+// The bus is free while the card programs, only a couple of bytes per busy_poll_us
+static void TestCooperativeWrite(void)
+{
+    SD_BusyToken token;
+    SD_Latency stats;
+    uint32_t polls, bytes, blocking;
+    uint8_t cs_held;
+
+    card.program_us = 20000;
+    memset(buffer, 0x5A, sizeof(buffer));
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+
+    // The blocking write clocks the whole busy phase
+    bytes = card.bytes;
+    CHECK_EQ(SD_SectorWrite(&hsd, 40, buffer), SD_RESPONSE_NO_ERROR);
+    blocking = card.bytes - bytes;
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+
+    CHECK_EQ(SD_SectorWriteBegin(&hsd, 41, buffer, &token), SD_RESPONSE_BUSY);
+    CHECK(!card.cs_low);
+    bytes = card.bytes;
+    CHECK_EQ(PollUntilDone(&token, &polls, &cs_held), SD_RESPONSE_NO_ERROR);
+    bytes = card.bytes - bytes;
+
+    CHECK(!cs_held);
+    CHECK(polls > 150); // most calls return at once
+    CHECK(bytes <= (20000 / SD_BUSY_POLL_US + 2) * 3); // 2 samples and the release byte per poll
+    CHECK(memcmp(buffer, SD_Model_Sector(&card, 41), SD_BLOCK_SIZE) == 0);
+
+    // Same latency statistics as the blocking path, to the poll interval
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+    CHECK_EQ(stats.count, 1);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.last_us >= 20000 && stats.last_us <= 20000 + SD_BUSY_POLL_US + 100);
+
+    printf("20 ms programming: %u bytes blocking, %u bytes in %u polls\n", blocking, bytes, polls);
+    card.program_us = 250;
+}
+
+// A card that stays busy past the write timeout fails the poll
+static void TestCooperativeTimeout(void)
+{
+    SD_BusyToken token;
+    SD_Latency stats;
+    uint32_t polls;
+    uint8_t cs_held;
+
+    card.program_us = 400000;
+    CHECK_EQ(SD_SectorWriteBegin(&hsd, 42, buffer, &token), SD_RESPONSE_BUSY);
+    CHECK_EQ(PollUntilDone(&token, &polls, &cs_held), SD_RESPONSE_FAILURE);
+
+    SD_GetLatency(&hsd, SD_OP_WRITE, &stats, 1);
+    CHECK_EQ(stats.timeouts, 1);
+    CHECK(stats.last_us >= TEST_WRITE_TIMEOUT_US && stats.last_us <= TEST_WRITE_TIMEOUT_US + SD_BUSY_POLL_US + 100);
+    CHECK(!cs_held);
+
+    HAL_Delay(200);
+    card.program_us = 250;
+}
+
+// Read latency: one wait per data token
+static void TestReadLatency(void)
+{
+    SD_Latency stats;
+    uint8_t run[4 * SD_BLOCK_SIZE];
+
+    SD_GetLatency(&hsd, SD_OP_READ, &stats, 1);
+    CHECK_EQ(SD_SectorRead(&hsd, 30, buffer), SD_RESPONSE_NO_ERROR);
+    CHECK_EQ(SD_SectorsRead(&hsd, 30, 4, run), SD_RESPONSE_NO_ERROR);
+    SD_GetLatency(&hsd, SD_OP_READ, &stats, 0);
+    CHECK_EQ(stats.count, 5);
+    CHECK_EQ(stats.timeouts, 0);
+    CHECK(stats.max_us < 10);
+    SD_Model_Free(&card);
+}
+
+// SDSC: timeouts from TAAC and NSAC at the data clock, recomputed on a clock step down
+static void TestSdscTimeouts(void)
+{
+    // TAAC 100 us, NSAC 10 (1000 clocks)
+    Setup(SD_MODEL_SDSC, 0x0D, 10);
+    CHECK_EQ(hsd.taac_ns, 100000);
+    CHECK_EQ(hsd.nsac_clocks, 1000);
+    CHECK_EQ(hsd.r2w_factor, 2);
+    CHECK_EQ(hsd.read_timeout_us, ExpectedTimeout(100000, 10, 0, TEST_READ_TIMEOUT_US));
+    CHECK_EQ(hsd.write_timeout_us, ExpectedTimeout(100000, 10, 2, TEST_WRITE_TIMEOUT_US));
+    CHECK(hsd.write_timeout_us < TEST_WRITE_TIMEOUT_US);
+    printf("SDSC: timeouts read %u us, write %u us at %u Hz\n", hsd.read_timeout_us, hsd.write_timeout_us,
+            hsd.clock);
+
+    // A programming time past it is a timeout
+    card.program_us = hsd.write_timeout_us + 5000;
+    CHECK_EQ(SD_SectorWrite(&hsd, 10, buffer), SD_RESPONSE_FAILURE);
+    CHECK_EQ(hsd.latency[SD_OP_WRITE].timeouts, 1);
+    HAL_Delay(100);
+    card.program_us = 250;
+
+    // At the slowest clock the NSAC part dominates, up to the caps
+    card.inject_read_crc = 1000;
+    CHECK_EQ(SD_SectorRead(&hsd, 10, buffer), SD_RESPONSE_DATA_ERROR);
+    card.inject_read_crc = 0;
+    CHECK_EQ(hspi2.Init.BaudRatePrescaler, SPI_BAUDRATEPRESCALER_256);
+    CHECK_EQ(hsd.read_timeout_us, ExpectedTimeout(100000, 10, 0, TEST_READ_TIMEOUT_US));
+    CHECK_EQ(hsd.write_timeout_us, TEST_WRITE_TIMEOUT_US);
+
+    printf("SDSC: timeouts read %u us, write %u us at %u Hz\n", hsd.read_timeout_us, hsd.write_timeout_us,
+            hsd.clock);
+    SD_Model_Free(&card);
+}
+
+int main(void)
+{
+    TestSdhcTimeouts();
+    TestProgrammingWait();
+    TestCounterWrap();
+    TestReadyWhileBusy();
+    TestReadyAfterWrite();
+    TestCooperativeWrite();
+    TestCooperativeTimeout();
+    TestReadLatency();
+    TestSdscTimeouts();
+
+    TEST_EXIT();
+}